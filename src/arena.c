@@ -0,0 +1,227 @@
+/**
+ * @file arena.c
+ * @brief Bump pointer arena for the memory needed during one update round.
+ *
+ * The scratch memory needed while updating (arrays for sorting the
+ * connections and groups, collected rows for views etc.) is allocated from
+ * the arena and released at once when the arena is reset at the end of the
+ * update round. When one round needed more than one chunk, the chunks are
+ * replaced with one chunk big enough for the whole round on reset, after a
+ * few rounds the arena does not need to allocate anything.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "debug.h"
+#include "arena.h"
+
+/**
+ * @defgroup arena Arena for the memory needed during update round
+ */
+
+/**
+ * Round the size up to the alignment.
+ */
+#define ARENA_ROUND(s) ( ( (s) + ARENA_ALIGN - 1 ) & ~( (size_t)ARENA_ALIGN - 1 ))
+
+/**
+ * @brief Allocate new chunk.
+ *
+ * @param size Minimum number of bytes on the chunk.
+ * @param prev The previous chunk, NULL if none.
+ * @return Pointer to the new chunk.
+ */
+static struct arena_chunk *new_chunk( size_t size, struct arena_chunk *prev )
+{
+        struct arena_chunk *chunk;
+
+        /* Room to align the first allocation */
+        chunk = mem_alloc( sizeof( *chunk ) + size + ARENA_ALIGN );
+        chunk->prev = prev;
+        chunk->size = size + ARENA_ALIGN;
+        chunk->used = ARENA_ROUND( (uintptr_t)chunk->data ) - (uintptr_t)chunk->data;
+        return chunk;
+}
+
+/**
+ * @brief Free chunk and all the chunks before it.
+ *
+ * @param chunk The chunk.
+ */
+static void free_chunks( struct arena_chunk *chunk )
+{
+        struct arena_chunk *prev;
+
+        while ( chunk != NULL ) {
+                prev = chunk->prev;
+                mem_free( chunk );
+                chunk = prev;
+        }
+}
+
+/** 
+ * @brief Initialize the arena.
+ * 
+ * @ingroup arena
+ * @param chunk_size Size for the chunks.
+ * 
+ * @return Pointer to the new arena.
+ */
+struct arena *arena_init( size_t chunk_size )
+{
+        struct arena *arena;
+
+        arena = mem_zalloc( sizeof( *arena ));
+        arena->chunk_size = ARENA_ROUND( chunk_size );
+        arena->chunk = new_chunk( arena->chunk_size, NULL );
+        arena->capacity = arena->chunk->size;
+        return arena;
+}
+
+/** 
+ * @brief Free the arena and all memory allocated from it.
+ * 
+ * @ingroup arena
+ * @param arena Pointer to the arena.
+ */
+void arena_deinit( struct arena *arena )
+{
+        free_chunks( arena->chunk );
+        mem_free( arena );
+}
+
+/** 
+ * @brief Allocate memory from the arena.
+ *
+ * The memory is valid until the arena is reset.
+ * 
+ * @ingroup arena
+ * @param arena Pointer to the arena.
+ * @param size Number of bytes to allocate.
+ * 
+ * @return Pointer to the allocated memory, aligned to ARENA_ALIGN bytes.
+ */
+void *arena_alloc( struct arena *arena, size_t size )
+{
+        struct arena_chunk *chunk = arena->chunk;
+        void *ptr;
+
+        size = ARENA_ROUND( size );
+        if ( chunk->size - chunk->used < size ) {
+                chunk = new_chunk( size > arena->chunk_size ? size : 
+                                arena->chunk_size, chunk );
+                arena->chunk = chunk;
+                arena->capacity += chunk->size;
+                TRACE( "New chunk of %zu bytes\n", chunk->size );
+        }
+        ptr = chunk->data + chunk->used;
+        chunk->used += size;
+        arena->used += size;
+        arena->top = ptr;
+        return ptr;
+}
+
+/** 
+ * @brief Grow memory allocated from the arena.
+ *
+ * If @a ptr is the latest allocation and there is room on the chunk, it is
+ * grown in place. Otherwise new memory is allocated and the contents are
+ * copied, the old memory is left unused until reset.
+ * 
+ * @ingroup arena
+ * @param arena Pointer to the arena.
+ * @param ptr Memory allocated from the arena, NULL to allocate new.
+ * @param old_size Size @a ptr was allocated with.
+ * @param new_size New size.
+ * 
+ * @return Pointer to the memory (may differ from @a ptr).
+ */
+void *arena_grow( struct arena *arena, void *ptr, size_t old_size, size_t new_size )
+{
+        struct arena_chunk *chunk = arena->chunk;
+        size_t grow;
+        void *nptr;
+
+        if ( ptr == NULL ) 
+                return arena_alloc( arena, new_size );
+
+        old_size = ARENA_ROUND( old_size );
+        new_size = ARENA_ROUND( new_size );
+        if ( new_size <= old_size ) 
+                return ptr;
+
+        grow = new_size - old_size;
+        if ( ptr == arena->top && chunk->size - chunk->used >= grow ) {
+                chunk->used += grow;
+                arena->used += grow;
+                return ptr;
+        }
+        nptr = arena_alloc( arena, new_size );
+        memcpy( nptr, ptr, old_size );
+        return nptr;
+}
+
+/** 
+ * @brief Release all memory allocated from the arena.
+ *
+ * If more than one chunk was needed, the chunks are replaced with one chunk
+ * which can hold everything allocated since the last reset.
+ * 
+ * @ingroup arena
+ * @param arena Pointer to the arena.
+ */
+void arena_reset( struct arena *arena )
+{
+        struct arena_chunk *chunk = arena->chunk;
+
+        if ( arena->used > arena->high_water ) {
+                DBG( "New high water mark %zu bytes\n", arena->used );
+                arena->high_water = arena->used;
+        }
+        if ( chunk->prev != NULL ) {
+                free_chunks( chunk );
+                if ( arena->high_water > arena->chunk_size ) 
+                        arena->chunk_size = ARENA_ROUND( arena->high_water );
+                chunk = new_chunk( arena->chunk_size, NULL );
+                arena->chunk = chunk;
+                arena->capacity = chunk->size;
+        }
+        chunk->used = ARENA_ROUND( (uintptr_t)chunk->data ) - (uintptr_t)chunk->data;
+        arena->last_used = arena->used;
+        arena->used = 0;
+        arena->top = NULL;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file arena.h
+ * @brief Bump pointer arena for the memory needed during one update round.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+/**
+ * Default size for the chunks on arena.
+ */
+#define ARENA_DEFAULT_SIZE ( 64 * 1024 )
+
+/**
+ * Alignment for the allocations from arena.
+ */
+#define ARENA_ALIGN 16
+
+/**
+ * Chunk of memory the allocations are made from.
+ * @ingroup arena
+ */
+struct arena_chunk {
+        struct arena_chunk *prev; /**< Chunk which was full when this was allocated */
+        size_t size; /**< Number of bytes on data */
+        size_t used; /**< Number of bytes allocated from data */
+        uint8_t data[]; /**< The memory */
+};
+
+/**
+ * Arena for the memory which is only needed until the end of the update
+ * round. Allocations are made by bumping the offset on the current chunk, new
+ * chunks are allocated if the current one is full. All the memory is released
+ * at once by resetting the arena.
+ * @ingroup arena
+ */
+struct arena {
+        struct arena_chunk *chunk; /**< Current chunk */
+        size_t chunk_size; /**< Minimum size for new chunks */
+        size_t used; /**< Bytes allocated since the last reset */
+        size_t last_used; /**< Bytes allocated between the last two resets */
+        size_t high_water; /**< Most bytes allocated between resets */
+        size_t capacity; /**< Bytes on all chunks */
+        void *top; /**< Latest allocation, it can be grown in place */
+};
+
+struct arena *arena_init( size_t chunk_size );
+void arena_deinit( struct arena *arena );
+void *arena_alloc( struct arena *arena, size_t size );
+void *arena_grow( struct arena *arena, void *ptr, size_t old_size, size_t new_size );
+void arena_reset( struct arena *arena );
+
+#endif /* _ARENA_H_ */
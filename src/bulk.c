@@ -0,0 +1,479 @@
+/**
+ * @file bulk.c
+ * @brief Loading of the initial snapshot of connections in bulk.
+ *
+ * On the first round every existing connection is new. Matching them one by
+ * one against the listen groups and the outgoing groups is quadratic on the
+ * number of groups, and looking up the interface and route for each of them
+ * walks the interface and route lists. With enough connections the first
+ * screen would take tens of seconds.
+ *
+ * While the initial snapshot is read, the interface and route lookups are
+ * deferred and done for the whole new queue at once, remembering the results
+ * for the addresses already seen. The connections are then grouped in bulk:
+ * the listen groups are indexed by port, and the outgoing connections are
+ * partitioned by the hash of their grouping selectors (radix partition on the
+ * hash bits) so that connections of one group end up next to each other and
+ * are only compared against the groups created on their partition. If there
+ * are more groups than allowed, the excess is folded once all groups are
+ * built.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_STAT
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "hash.h"
+#include "stat.h"
+#include "scouts.h"
+#include "portmon.h"
+#include "lbstat.h"
+#include "overflow.h"
+#include "bulk.h"
+
+/**
+ * @defgroup bulk Bulk loading of connections
+ */
+
+/**
+ * Entry on table memoizing interface or route for an address.
+ */
+struct memo_entry {
+        const void *tag; /**< Interface name for routes, NULL for interfaces */
+        int family; /**< Address family, 0 if the entry is not used */
+        uint8_t addr[16]; /**< The address */
+        const void *value; /**< The interface name or route */
+};
+
+/**
+ * Slot on the listen group index.
+ */
+struct listen_slot {
+        struct group *grp; /**< The listen group, NULL if slot is not used */
+        int family; /**< Address family of the listening socket */
+        in_port_t port; /**< Listening port (network byte order) */
+};
+
+/**
+ * @brief Get the slot for address on memo table.
+ *
+ * The table is direct mapped, the entry on slot is replaced if it is for
+ * some other address.
+ *
+ * @param table The memo table.
+ * @param tag Interface name for routes, NULL for interfaces.
+ * @param ss The address.
+ * @return Pointer to the slot.
+ */
+static struct memo_entry *memo_slot( struct memo_entry *table, const void *tag,
+                struct sockaddr_storage *ss )
+{
+        const uint8_t *p;
+        uint32_t h;
+        int len;
+
+        if ( ss->ss_family == AF_INET6 ) {
+                p = (const uint8_t *)ss_get_addr6( ss );
+                len = 16;
+        } else {
+                p = (const uint8_t *)ss_get_addr( ss );
+                len = 4;
+        }
+        h = hash_fnv( HASH_FNV_INIT ^ (uint32_t)(uintptr_t)tag, p, len );
+
+        return &table[ ( h ^ ( h >> 16 )) & ( BULK_MEMO_SIZE - 1 ) ];
+}
+
+/**
+ * @brief Check if memo entry holds the value for the address.
+ */
+static int memo_match( struct memo_entry *e, const void *tag, 
+                struct sockaddr_storage *ss )
+{
+        if ( e->family != ss->ss_family || e->tag != tag ) 
+                return 0;
+        if ( ss->ss_family == AF_INET6 ) 
+                return memcmp( e->addr, ss_get_addr6( ss ), 16 ) == 0;
+        return memcmp( e->addr, ss_get_addr( ss ), 4 ) == 0;
+}
+
+/**
+ * @brief Store value for the address to memo entry.
+ */
+static void memo_store( struct memo_entry *e, const void *tag, 
+                struct sockaddr_storage *ss, const void *value )
+{
+        e->tag = tag;
+        e->family = ss->ss_family;
+        if ( ss->ss_family == AF_INET6 ) 
+                memcpy( e->addr, ss_get_addr6( ss ), 16 );
+        else 
+                memcpy( e->addr, ss_get_addr( ss ), 4 );
+        e->value = value;
+}
+
+/** 
+ * @brief Set interface and route for all connections on the new queue.
+ *
+ * The lookups are done once for every local address (interface) and remote
+ * address on interface (route), connections with the same addresses get the
+ * remembered results.
+ * 
+ * @ingroup bulk
+ * @param ctx Pointer to the global context.
+ */
+void bulk_attribute( struct stat_context *ctx )
+{
+        struct memo_entry *ifs, *e;
+#ifdef ENABLE_ROUTES
+        struct memo_entry *rts;
+#endif /* ENABLE_ROUTES */
+        struct tcp_connection *conn_p;
+        int count = 0, hits = 0;
+
+        ifs = mem_zalloc( BULK_MEMO_SIZE * sizeof( *ifs ));
+#ifdef ENABLE_ROUTES
+        rts = mem_zalloc( BULK_MEMO_SIZE * sizeof( *rts ));
+#endif /* ENABLE_ROUTES */
+
+        for ( conn_p = cqueue_get_head( ctx->newq ); conn_p != NULL; 
+                        conn_p = conn_p->next ) {
+                count++;
+                e = memo_slot( ifs, NULL, &conn_p->laddr );
+                if ( memo_match( e, NULL, &conn_p->laddr )) {
+                        conn_p->metadata.ifname = e->value;
+                        hits++;
+                } else {
+                        conn_p->metadata.ifname = ifname_for_addr( ctx->iftab, 
+                                        &conn_p->laddr );
+                        memo_store( e, NULL, &conn_p->laddr, conn_p->metadata.ifname );
+                }
+#ifdef ENABLE_ROUTES
+                if ( conn_p->state == TCP_LISTEN || conn_p->metadata.ifname == NULL ) 
+                        continue;
+                e = memo_slot( rts, conn_p->metadata.ifname, &conn_p->raddr );
+                if ( memo_match( e, conn_p->metadata.ifname, &conn_p->raddr )) {
+                        conn_p->metadata.route = (struct rtinfo *)e->value;
+                } else {
+                        resolve_route_for_connection( ctx, conn_p );
+                        memo_store( e, conn_p->metadata.ifname, &conn_p->raddr,
+                                        conn_p->metadata.route );
+                }
+#endif /* ENABLE_ROUTES */
+        }
+        DBG( "Attributed %d connections, %d interfaces remembered\n", count, hits );
+
+        mem_free( ifs );
+#ifdef ENABLE_ROUTES
+        mem_free( rts );
+#endif /* ENABLE_ROUTES */
+}
+
+/**
+ * @brief Index the listen groups by address family and port.
+ *
+ * If there are listen groups for the same port, the first one on the list is
+ * indexed as it is the one iterating the list would match.
+ *
+ * @param list The listen groups.
+ * @param size_p Pointer to variable receiving the size of the index.
+ * @return The index, NULL if some listen group is not matched by port.
+ */
+static struct listen_slot *index_listen_groups( struct glist *list, int *size_p )
+{
+        struct listen_slot *index, *slot;
+        struct group *grp;
+        struct filter *filt;
+        int size = 16, i;
+        in_port_t port;
+
+        while ( size < glist_get_size( list ) * 2 ) 
+                size = size * 2;
+        index = mem_zalloc( size * sizeof( *index ));
+
+        glist_foreach_group( list, grp ) {
+                filt = grp->grp_filter;
+                if ( filt == NULL || filt->policy != ( POLICY_LOCAL | POLICY_PORT | POLICY_AF )) {
+                        mem_free( index );
+                        return NULL;
+                }
+                port = ss_get_port( &filt->laddr );
+                i = ( ntohs( port ) ^ filt->af ) & ( size - 1 );
+                for ( slot = &index[i]; slot->grp != NULL; slot = &index[i] ) {
+                        if ( slot->family == filt->af && slot->port == port ) 
+                                break;
+                        i = ( i + 1 ) & ( size - 1 );
+                }
+                if ( slot->grp == NULL ) {
+                        slot->grp = grp;
+                        slot->family = filt->af;
+                        slot->port = port;
+                }
+        }
+        *size_p = size;
+        return index;
+}
+
+/**
+ * @brief Find the listen group for connection.
+ *
+ * @param index The listen group index.
+ * @param size Size of the index.
+ * @param conn_p The connection.
+ * @return The group the connection was added to, NULL if it is not incoming.
+ */
+static struct group *find_listen_group( struct listen_slot *index, int size,
+                struct tcp_connection *conn_p )
+{
+        in_port_t port = ss_get_port( &conn_p->laddr );
+        int family = conn_p->laddr.ss_family;
+        int i = ( ntohs( port ) ^ family ) & ( size - 1 );
+
+        for ( ; index[i].grp != NULL; i = ( i + 1 ) & ( size - 1 )) {
+                if ( index[i].family == family && index[i].port == port ) {
+                        if ( group_match_and_add( index[i].grp, conn_p ) == 1 ) 
+                                return index[i].grp;
+                        break;
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Get the partition for selector hash.
+ */
+#define PARTITION( h, bits ) ( ( (h) * 2654435761u ) >> ( 32 - (bits) ))
+
+/**
+ * @brief Compare groups by size, larger first.
+ */
+static int compare_size( const void *a, const void *b )
+{
+        int s1 = group_get_size( *(struct group **)a );
+        int s2 = group_get_size( *(struct group **)b );
+
+        return ( s1 < s2 ) - ( s1 > s2 );
+}
+
+/** 
+ * @brief Add the new groups to the outgoing groups.
+ *
+ * If there are more groups than allowed, the groups are folded at once like
+ * overflow_make_room() would do, instead of folding and promoting while the
+ * groups are created. All groups were active on the same round, the smallest
+ * groups are folded.
+ * 
+ * @param ctx Pointer to the global context.
+ * @param grps The new groups.
+ * @param count Number of groups.
+ */
+static void add_out_groups( struct stat_context *ctx, struct group **grps, int count )
+{
+        int keep = count, i;
+
+        if ( ctx->max_groups > 0 && count > ctx->max_groups ) {
+                keep = ctx->max_groups - 1 - ctx->max_groups / OVERFLOW_FOLD_FRACTION;
+                if ( keep < 0 ) 
+                        keep = 0;
+                qsort( grps, count, sizeof( *grps ), compare_size );
+        }
+        for ( i = keep - 1; i >= 0; i-- ) 
+                glist_add( ctx->out_groups, grps[i] );
+        if ( keep == count ) 
+                return;
+
+        if ( ctx->ovf == NULL ) 
+                ctx->ovf = overflow_init( ctx->max_groups, ctx->common_policy, 
+                                ctx->gkey );
+        for ( i = keep; i < count; i++ ) 
+                overflow_fold( ctx->ovf, ctx->out_groups, grps[i] );
+        DBG( "Folded %d groups of %d\n", count - keep, count );
+}
+
+/** 
+ * @brief Group the outgoing connections partitioned by selector hash.
+ *
+ * The connections are scattered to partitions by the high bits of the
+ * (mixed) hash of their grouping selectors. Connections on the same group
+ * have the same hash, hence they are on the same partition and need to be
+ * compared only against the groups created on that partition.
+ * 
+ * @param ctx Pointer to the global context.
+ * @param conns The outgoing connections.
+ * @param hash The selector hashes of the connections.
+ * @param count Number of connections.
+ */
+static void group_partitioned( struct stat_context *ctx, 
+                struct tcp_connection **conns, uint32_t *hash, int count )
+{
+        struct tcp_connection **sorted;
+        uint32_t *sorted_hash, *grp_hash;
+        struct group **grps, *grp;
+        int *next, bits = 4, parts, p, i, j, start, first, ngrp = 0, grp_size = 64;
+
+        while ( bits < BULK_MAX_PARTITION_BITS && ( 1 << bits ) < count / 4 ) 
+                bits++;
+        parts = 1 << bits;
+
+        /* Count, prefix sum and scatter */
+        next = mem_zalloc( parts * sizeof( *next ));
+        for ( i = 0; i < count; i++ ) 
+                next[ PARTITION( hash[i], bits ) ]++;
+        for ( p = 0, start = 0; p < parts; p++ ) {
+                j = next[p];
+                next[p] = start;
+                start += j;
+        }
+        sorted = mem_alloc( count * sizeof( *sorted ));
+        sorted_hash = mem_alloc( count * sizeof( *sorted_hash ));
+        for ( i = 0; i < count; i++ ) {
+                j = next[ PARTITION( hash[i], bits ) ]++;
+                sorted[j] = conns[i];
+                sorted_hash[j] = hash[i];
+        }
+
+        grps = mem_alloc( grp_size * sizeof( *grps ));
+        grp_hash = mem_alloc( grp_size * sizeof( *grp_hash ));
+        /* After the scatter next[p] is the start of partition p + 1 */
+        for ( p = 0, start = 0; p < parts; start = next[p], p++ ) {
+                first = ngrp;
+                for ( i = start; i < next[p]; i++ ) {
+                        grp = NULL;
+                        for ( j = first; j < ngrp; j++ ) {
+                                if ( grp_hash[j] == sorted_hash[i] && 
+                                                group_match_and_add( grps[j], sorted[i] ) == 1 ) {
+                                        grp = grps[j];
+                                        break;
+                                }
+                        }
+                        if ( grp != NULL ) 
+                                continue;
+
+                        grp = group_init();
+                        group_set_filter( grp, filter_from_connection( sorted[i], 
+                                                ctx->common_policy, FILTERACT_GROUP ));
+                        group_add_connection( grp, sorted[i] );
+                        if ( ngrp == grp_size ) {
+                                grp_size = grp_size * 2;
+                                grps = mem_realloc( grps, grp_size * sizeof( *grps ));
+                                grp_hash = mem_realloc( grp_hash, grp_size * sizeof( *grp_hash ));
+                        }
+                        grps[ngrp] = grp;
+                        grp_hash[ngrp] = sorted_hash[i];
+                        ngrp++;
+                }
+        }
+        DBG( "Grouped %d connections on %d partitions to %d groups\n", 
+                        count, parts, ngrp );
+        add_out_groups( ctx, grps, ngrp );
+
+        mem_free( grps );
+        mem_free( grp_hash );
+        mem_free( sorted );
+        mem_free( sorted_hash );
+        mem_free( next );
+}
+
+/** 
+ * @brief Rotate the new queue in bulk.
+ *
+ * On the initial snapshot the interfaces and routes are first set for the
+ * connections with bulk_attribute(). If there are enough connections on the
+ * new queue and no outgoing groups yet (initial snapshot or regrouping), the
+ * connections are grouped in bulk. This is not done when grouping by related
+ * connections (they have to be grouped in order) or by key, which has its own
+ * index.
+ *
+ * The arrays are sized by the snapshot, hence they are not taken from the
+ * scratch arena which is kept at the size needed on normal rounds.
+ * 
+ * @ingroup bulk
+ * @param ctx Pointer to the global context.
+ * @return 1 if the new queue was rotated, 0 if it should be rotated one by one.
+ */
+int bulk_rotate( struct stat_context *ctx )
+{
+        struct tcp_connection **conns, *conn_p;
+        struct listen_slot *index;
+        uint32_t *hash;
+        int count, size, out = 0;
+
+        if ( ctx->bulk ) 
+                bulk_attribute( ctx );
+
+        count = cqueue_get_size( ctx->newq );
+        if ( count < BULK_MIN_CONNECTIONS || glist_get_size( ctx->out_groups ) != 0 ||
+                        ( ctx->common_policy & ( POLICY_CLOUD | POLICY_KEY )))
+                return 0;
+
+        index = index_listen_groups( ctx->listen_groups, &size );
+        if ( index == NULL ) 
+                return 0;
+
+        conns = mem_alloc( count * sizeof( *conns ));
+        hash = mem_alloc( count * sizeof( *hash ));
+        while ( ( conn_p = cqueue_pop( ctx->newq )) != NULL ) {
+                if ( find_listen_group( index, size, conn_p ) != NULL ) {
+                        conn_p->metadata.dir = DIR_INBOUND;
+#ifdef ENABLE_PORT_MONITOR
+                        /* Local port is the listening port, not ephemeral */
+                        if ( ctx->ports != NULL )
+                                portmon_remove( ctx->ports, conn_p );
+#endif /* ENABLE_PORT_MONITOR */
+                        continue;
+                }
+                conn_p->metadata.dir = DIR_OUTBOUND;
+                if ( ctx->lb != NULL )
+                        lb_add( ctx->lb, conn_p );
+                conns[out] = conn_p;
+                hash[out] = filter_policy_hash( ctx->common_policy, conn_p );
+                out++;
+        }
+        DBG( "Bulk rotating %d connections, %d incoming\n", count, count - out );
+
+        if ( out > 0 ) 
+                group_partitioned( ctx, conns, hash, out );
+
+        mem_free( index );
+        mem_free( conns );
+        mem_free( hash );
+        return 1;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file bulk.h
+ * @brief Loading of the initial snapshot of connections in bulk.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _BULK_H_
+#define _BULK_H_
+
+/**
+ * Minimum number of connections on the new queue for grouping them in bulk.
+ */
+#define BULK_MIN_CONNECTIONS 256
+
+/**
+ * Number of entries on the tables memoizing the interfaces and routes for
+ * addresses (power of 2).
+ */
+#define BULK_MEMO_SIZE 4096
+
+/**
+ * Maximum number of hash bits used for partitioning the connections.
+ */
+#define BULK_MAX_PARTITION_BITS 16
+
+struct stat_context;
+
+void bulk_attribute( struct stat_context *ctx );
+int bulk_rotate( struct stat_context *ctx );
+
+#endif /* _BULK_H_ */
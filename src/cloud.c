@@ -0,0 +1,228 @@
+/**
+ * @file cloud.c
+ * @brief Grouping of related connections.
+ *
+ * Connections to the same remote address (or port) which are added within a
+ * time window from each other are considered related and put to the same
+ * group (a "cloud"). The groups are kept on an index hashed by the remote
+ * address and the time slot of the first connection on group, so finding the
+ * group for a new connection does not depend on the number of groups.
+ *
+ * A group is anchored to the time its first connection was added, connection
+ * belongs to the group if it was added less than the window before or after
+ * the anchor. Since new groups are only created when no group matches,
+ * the anchors of groups for the same remote are at least a window apart.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_GRP
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "cloud.h"
+
+/**
+ * @defgroup cloud Index for related connections
+ */
+
+/** 
+ * @brief Initialize the index.
+ * 
+ * @ingroup cloud
+ * @param window Maximum time difference (seconds) for related connections.
+ * @param policy The grouping policy, POLICY_ADDR or POLICY_PORT tells
+ * whether the remote address or port is used.
+ * 
+ * @return Pointer to the new index.
+ */
+struct cloud_index *cloud_index_init( int window, policy_flags_t policy )
+{
+        struct cloud_index *index;
+
+        index = mem_zalloc( sizeof( *index ));
+        index->window = window > 0 ? window : CLOUD_DEFAULT_WINDOW;
+        index->policy = policy;
+        hash_index_init( &index->entries, CLOUD_INDEX_INIT_SIZE );
+
+        return index;
+}
+
+/** 
+ * @brief Free the index.
+ *
+ * The groups on index are not freed, they are just detached from the index.
+ * 
+ * @ingroup cloud
+ * @param index Pointer to the index.
+ */
+void cloud_index_deinit( struct cloud_index *index )
+{
+        struct hash_link *link, *next;
+        struct cloud_entry *entry;
+        unsigned int i;
+
+        for ( i = 0; i < index->entries.size; i++ ) {
+                for ( link = index->entries.chains[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        entry = HASH_ENTRY( link, struct cloud_entry, link );
+                        entry->grp->cloud = NULL;
+                        mem_free( entry );
+                }
+        }
+        hash_index_deinit( &index->entries );
+        mem_free( index );
+}
+
+/**
+ * @brief Fill the key for connection.
+ *
+ * @param index Pointer to the index.
+ * @param conn_p The connection.
+ * @param key Buffer for the key.
+ */
+static void make_key( struct cloud_index *index, struct tcp_connection *conn_p,
+                uint8_t *key )
+{
+        in_port_t port;
+
+        memset( key, 0, CLOUD_KEY_LEN );
+        if ( index->policy & POLICY_ADDR ) {
+                if ( conn_p->family == AF_INET6 )
+                        memcpy( key, ss_get_addr6( &conn_p->raddr ), 16 );
+                else 
+                        memcpy( key, ss_get_addr( &conn_p->raddr ), 4 );
+                key[16] = conn_p->family;
+        }
+        if ( index->policy & POLICY_PORT ) {
+                port = ss_get_port( &conn_p->raddr );
+                memcpy( key + 18, &port, sizeof( port ));
+        }
+}
+
+/**
+ * @brief Calculate hash for key on given time slot (FNV-1a).
+ */
+static uint32_t hash_key( const uint8_t *key, time_t slot )
+{
+        uint64_t s = (uint64_t)slot;
+
+        return hash_fnv( hash_fnv( HASH_FNV_INIT, key, CLOUD_KEY_LEN ), 
+                        &s, sizeof( s ));
+}
+
+/** 
+ * @brief Find the group the connection is related to.
+ * 
+ * @ingroup cloud
+ * @param index Pointer to the index.
+ * @param conn_p The connection.
+ * 
+ * @return The group, NULL if the connection is not related to any group.
+ */
+struct group *cloud_index_find( struct cloud_index *index, 
+                struct tcp_connection *conn_p )
+{
+        uint8_t key[CLOUD_KEY_LEN];
+        struct cloud_entry *entry;
+        struct hash_link *link;
+        time_t added = conn_p->metadata.added;
+        time_t slot = added / index->window;
+        time_t s, diff;
+        uint32_t hash;
+
+        make_key( index, conn_p, key );
+        for ( s = slot - 1; s <= slot + 1; s++ ) {
+                hash = hash_key( key, s );
+                for ( link = hash_index_first( &index->entries, hash ); 
+                                link != NULL; link = hash_index_next( link )) {
+                        entry = HASH_ENTRY( link, struct cloud_entry, link );
+                        if ( entry->slot != s || 
+                                        memcmp( entry->key, key, CLOUD_KEY_LEN ) != 0 )
+                                continue;
+                        diff = added - entry->anchor;
+                        if ( diff < index->window && diff > -index->window ) 
+                                return entry->grp;
+                }
+        }
+        return NULL;
+}
+
+/** 
+ * @brief Add group to the index.
+ *
+ * The group is anchored to the time the given connection (the first one on
+ * group) was added.
+ * 
+ * @ingroup cloud
+ * @param index Pointer to the index.
+ * @param grp The group to add.
+ * @param conn_p The first connection on group.
+ */
+void cloud_index_add( struct cloud_index *index, struct group *grp,
+                struct tcp_connection *conn_p )
+{
+        struct cloud_entry *entry;
+
+        entry = mem_zalloc( sizeof( *entry ));
+        entry->index = index;
+        entry->anchor = conn_p->metadata.added;
+        entry->slot = entry->anchor / index->window;
+        make_key( index, conn_p, entry->key );
+        entry->grp = grp;
+        hash_index_add( &index->entries, &entry->link, 
+                        hash_key( entry->key, entry->slot ));
+        grp->cloud = entry;
+}
+
+/** 
+ * @brief Remove entry from its index.
+ *
+ * Should be called when the group is deleted.
+ * 
+ * @ingroup cloud
+ * @param entry The entry to remove.
+ */
+void cloud_index_remove( struct cloud_entry *entry )
+{
+        hash_index_remove( &entry->index->entries, &entry->link );
+        entry->grp->cloud = NULL;
+        mem_free( entry );
+}
@@ -0,0 +1,90 @@
+/**
+ * @file cloud.h
+ * @brief Time-bucketed index for the groups of related connections.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _CLOUD_H_
+#define _CLOUD_H_
+
+#include "hash.h"
+
+/**
+ * Default time window (in seconds) for connections to be related.
+ */
+#define CLOUD_DEFAULT_WINDOW 2
+
+/**
+ * Initial number of hash chains on the index.
+ */
+#define CLOUD_INDEX_INIT_SIZE 1024
+
+/**
+ * Length of the key for the entries.
+ */
+#define CLOUD_KEY_LEN 20
+
+/**
+ * Entry for one group of related connections on the index. 
+ * @ingroup cloud
+ */
+struct cloud_entry {
+        struct hash_link link; /**< Link on the index, hashed by key and slot */
+        struct cloud_index *index; /**< The index this entry is on */
+        time_t slot; /**< Time slot of the anchor (anchor / window) */
+        time_t anchor; /**< Time the first connection on group was added */
+        uint8_t key[CLOUD_KEY_LEN]; /**< Remote address or port */
+        struct group *grp; /**< The group */
+};
+
+/**
+ * Index of the groups of related connections. The groups are hashed
+ * according to the remote address (or port) and the time slot the first
+ * connection on the group was added on. The time slots are as wide as the
+ * window, hence all groups a connection can belong to are found from three
+ * slots around the time the connection was added.
+ * @ingroup cloud
+ */
+struct cloud_index {
+        int window; /**< Maximum time difference of related connections */
+        policy_flags_t policy; /**< Policy the groups are formed with */
+        struct hash_index entries; /**< The entries */
+};
+
+struct cloud_index *cloud_index_init( int window, policy_flags_t policy );
+void cloud_index_deinit( struct cloud_index *index );
+struct group *cloud_index_find( struct cloud_index *index, 
+                struct tcp_connection *conn_p );
+void cloud_index_add( struct cloud_index *index, struct group *grp,
+                struct tcp_connection *conn_p );
+void cloud_index_remove( struct cloud_entry *entry );
+
+#endif /* _CLOUD_H_ */
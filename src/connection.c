@@ -47,6 +47,11 @@
 #include <netinet/in.h>
 #endif /* OPENBSD */
 #include <arpa/inet.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif /* __AVX2__ */
 
 #define DBG_MODULE_NAME DBG_MODULE_CONN
 
@@ -54,7 +59,7 @@
 #include "debug.h"
 #include "connection.h" 
 #include "stat.h"
-#include "ui.h" /* print "resolving" banner */
+#include "dnscache.h"
 
 /* Helper macros for accessing the socket addresses in struct connection
  * in various different socket address formats.
@@ -73,6 +78,168 @@
  * @defgroup chashtbl Hashable for TCP connections. 
  */ 
 
+/**
+ * Prefix for IPv4 mapped IPv6 addresses.
+ */
+static const uint8_t v4mapped_prefix[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
+
+/**
+ * Set the key for connection.
+ *
+ * @ingroup chashtbl
+ *
+ * @param key Pointer to the key to set.
+ * @param family Address family of the connection.
+ * @param laddr Local address (network byte order, 4 or 16 bytes).
+ * @param raddr Remote address (network byte order, 4 or 16 bytes).
+ * @param lport Local port (network byte order).
+ * @param rport Remote port (network byte order).
+ */
+void conn_key_set( struct conn_key *key, sa_family_t family, 
+                const uint8_t *laddr, const uint8_t *raddr, 
+                in_port_t lport, in_port_t rport )
+{
+        if ( family == AF_INET ) {
+                memcpy( key->laddr, v4mapped_prefix, 12 );
+                memcpy( &key->laddr[12], laddr, 4 );
+                memcpy( key->raddr, v4mapped_prefix, 12 );
+                memcpy( &key->raddr[12], raddr, 4 );
+        } else {
+                memcpy( key->laddr, laddr, 16 );
+                memcpy( key->raddr, raddr, 16 );
+        }
+        key->lport = lport;
+        key->rport = rport;
+        key->family = family;
+}
+
+/**
+ * Set the key from given local and remote addresses.
+ *
+ * @param key Pointer to the key to set.
+ * @param laddr_p Pointer to the local address structure.
+ * @param raddr_p Pointer to the remote address structure. 
+ */
+void conn_key_from_ss( struct conn_key *key, 
+                struct sockaddr_storage *laddr_p, 
+                struct sockaddr_storage *raddr_p )
+{
+        ASSERT( laddr_p->ss_family == raddr_p->ss_family );
+
+        if ( laddr_p->ss_family == AF_INET ) 
+                conn_key_set( key, AF_INET, 
+                                (uint8_t *)ss_get_addr( laddr_p ), 
+                                (uint8_t *)ss_get_addr( raddr_p ),
+                                ss_get_port( laddr_p ), ss_get_port( raddr_p ));
+        else
+                conn_key_set( key, laddr_p->ss_family, 
+                                (uint8_t *)ss_get_addr6( laddr_p ), 
+                                (uint8_t *)ss_get_addr6( raddr_p ),
+                                ss_get_port( laddr_p ), ss_get_port( raddr_p ));
+}
+
+/**
+ * Calculate hash value for connection key. 
+ *
+ * The low bits of the hash select the bucket and the high 7 bits are used as
+ * the tag for the slot.
+ *
+ * @ingroup chashtbl
+ *
+ * @param key Pointer to the key.
+ * @return Hash value for the key.
+ */
+uint32_t conn_key_hash( const struct conn_key *key )
+{
+        uint32_t w[ sizeof( struct conn_key ) / 4 ];
+        uint32_t h = 0x9e3779b9;
+        unsigned int i;
+
+        memcpy( w, key, sizeof( w ) );
+        for ( i = 0; i < sizeof( w ) / 4; i++ ) {
+                h ^= w[i];
+                h *= 0x85ebca6b;
+                h ^= h >> 13;
+        }
+        h ^= h >> 16;
+        h *= 0x7feb352d;
+        h ^= h >> 15;
+        h *= 0x846ca68b;
+        h ^= h >> 16;
+
+        return h;
+}
+
+/**
+ * Get the bucket for given hash value.
+ */
+#define CHASH_BUCKET(t,h) (&(t)->buckets[ (h) & ((t)->nrof_buckets - 1) ])
+/**
+ * Get the slot tag for given hash value.
+ */
+#define CHASH_TAG(h) ((uint8_t)( 0x80 | ((h) >> 25) ))
+
+/**
+ * Check if two keys are equal. 
+ * The first 32 bytes (addresses) are compared with vector compare when
+ * possible, the rest (ports and family) as one 64 bit word. 
+ * 
+ * @param a Pointer to the first key.
+ * @param b Pointer to the second key.
+ * @return 1 if the keys are equal, 0 if not.
+ */
+static inline int key_equal( const struct conn_key *a, const struct conn_key *b )
+{
+        uint64_t ta, tb;
+#if defined(__AVX2__)
+        __m256i x = _mm256_loadu_si256( (const __m256i *)a );
+        __m256i y = _mm256_loadu_si256( (const __m256i *)b );
+
+        if ( _mm256_movemask_epi8( _mm256_cmpeq_epi8( x, y ) ) != -1 )
+                return 0;
+#elif defined(__SSE2__)
+        __m128i x0 = _mm_loadu_si128( (const __m128i *)a->laddr );
+        __m128i x1 = _mm_loadu_si128( (const __m128i *)a->raddr );
+        __m128i y0 = _mm_loadu_si128( (const __m128i *)b->laddr );
+        __m128i y1 = _mm_loadu_si128( (const __m128i *)b->raddr );
+
+        if ( _mm_movemask_epi8( _mm_and_si128( _mm_cmpeq_epi8( x0, y0 ),
+                                        _mm_cmpeq_epi8( x1, y1 ))) != 0xffff )
+                return 0;
+#else
+        if ( memcmp( a, b, 32 ) != 0 )
+                return 0;
+#endif /* __AVX2__ */
+        memcpy( &ta, &a->lport, sizeof( ta ) );
+        memcpy( &tb, &b->lport, sizeof( tb ) );
+
+        return ta == tb;
+}
+
+/**
+ * Get bitmask of slots on group having given tag.
+ *
+ * @param grp Pointer to the group.
+ * @param tag The tag to look for (0 for free slots).
+ * @return Bitmask with bit i set if slot i has the tag.
+ */
+static inline unsigned int tag_match( const struct chash_group *grp, uint8_t tag )
+{
+#ifdef __SSE2__
+        __m128i t = _mm_loadu_si128( (const __m128i *)grp->tags );
+
+        return _mm_movemask_epi8( _mm_cmpeq_epi8( t, _mm_set1_epi8( (char)tag )));
+#else
+        unsigned int mask = 0;
+        int i;
+
+        for ( i = 0; i < CHASH_GROUP_SLOTS; i++ ) {
+                if ( grp->tags[i] == tag ) 
+                        mask |= 1 << i;
+        }
+        return mask;
+#endif /* __SSE2__ */
+}
 
 /**
  * Initialize the connection hashtable.
@@ -87,15 +254,33 @@ struct chashtable *chash_init( void )
         connection_hash = mem_alloc( sizeof( struct chashtable) );
         connection_hash->size = 0;
         connection_hash->nrof_buckets = CONNECTION_HASHTABLE_SIZE; 
-
-        /*connection_hash->buckets = mem_alloc( CONNECTION_HASHTABLE_SIZE * sizeof( chlist_head ) );*/
-        memset( connection_hash->buckets, 0, CONNECTION_HASHTABLE_SIZE * sizeof( chlist_head ) );
+        connection_hash->buckets = mem_zalloc( CONNECTION_HASHTABLE_SIZE * 
+                        sizeof( struct chash_group ));
 
         DBG( "Allocated %d buckets for connection hashtable \n", CONNECTION_HASHTABLE_SIZE );
         return connection_hash;
 }
 
+/** 
+ * @brief Free the overflow groups of all buckets. 
+ * 
+ * @param table_p Pointer to the hashtable.
+ */
+static void free_overflow_groups( struct chashtable *table_p )
+{
+        struct chash_group *grp, *next;
+        int i;
 
+        for( i = 0; i < table_p->nrof_buckets; i++ ) {
+                grp = table_p->buckets[i].next;
+                while ( grp != NULL ) {
+                        next = grp->next;
+                        mem_free( grp );
+                        grp = next;
+                }
+                table_p->buckets[i].next = NULL;
+        }
+}
 
 /** 
  * @brief Deinitialize hashtable
@@ -109,6 +294,8 @@ struct chashtable *chash_init( void )
 void chash_deinit( struct chashtable *table_p )
 {
         DBG( "Deinitializing chashtable with %d connections\n", table_p->size );
+        free_overflow_groups( table_p );
+        mem_free( table_p->buckets );
         mem_free( table_p );
 }
 
@@ -122,119 +309,123 @@ void chash_deinit( struct chashtable *table_p )
  */
 void chash_clear( struct chashtable *table_p ) 
 {
-        int i;
-
         DBG( "Clearing hashtable with %d connections \n", table_p->size );
-        for( i = 0; i < table_p->nrof_buckets; i++ ) {
-                while ( table_p->buckets[i] != NULL ) {
-                        TRACE( "Removing connection %p\n", table_p->buckets[i]->connection);
-                        chash_remove_connection( table_p, table_p->buckets[i]->connection );
-                }
-        }
+        free_overflow_groups( table_p );
+        memset( table_p->buckets, 0, table_p->nrof_buckets * 
+                        sizeof( struct chash_group ));
+        table_p->size = 0;
 }
-        
 
 /**
- * Hash function for connection hashtable for IPv4 TCP connections. 
+ * @brief Call given function for every connection on the hashtable.
  *
- * Hash value is calculated for the 4-tuple <local ip, local port, remote ip,
- * remote port>.
+ * The connections are visited in bucket order, the callback must not add or
+ * remove connections from the hashtable.
  *
- * @note Mimics the INPCBHASH found on OpenBSD (sys/netinet/in_pcb.c)
+ * @ingroup chashtbl
  *
- * @param connection_hash Pointer to hashtable.
- * @param laddr Pointer to local address
- * @param raddr Pointer to remote address. 
- * @return Hash valua for the connection.
- */  
-static int chash_fn4( struct chashtable *connection_hash, struct sockaddr_in *laddr,
-                struct sockaddr_in *raddr )
+ * @param table_p Pointer to the hashtable.
+ * @param fn Function to call for each connection.
+ * @param data Pointer passed as is to @a fn.
+ */
+void chash_walk( struct chashtable *table_p,
+                void (*fn)(struct tcp_connection *, void *), void *data )
 {
-        int h = ntohl(raddr->sin_addr.s_addr) + ntohs(laddr->sin_port) + ntohs(raddr->sin_port);
-        TRACE( "chash_fn(<0x%.4x:0x%.2x, 0x%.4x:0x%.2x>)=0x%.2x\n", laddr->sin_addr.s_addr, 
-                        laddr->sin_port, raddr->sin_addr.s_addr, raddr->sin_port, h & (connection_hash->nrof_buckets -1 ));
-        
-        return h & (connection_hash->nrof_buckets - 1);
+        struct chash_group *grp;
+        int i, j;
+
+        for( i = 0; i < table_p->nrof_buckets; i++ ) {
+                for ( grp = &table_p->buckets[i]; grp != NULL; grp = grp->next ) {
+                        for ( j = 0; j < CHASH_GROUP_SLOTS; j++ ) {
+                                if ( grp->tags[j] != 0 ) 
+                                        fn( grp->conns[j], data );
+                        }
+                }
+        }
 }
 
 /**
- * Hash function for connection hashtable for IPv6 connections 
- *
- * Hash value is calculated for the 4-tuple <local ip, local port, remote ip,
- * remote port>.
- *
- * @note Mimics the IN6PCBHASH found on OpenBSD (sys/netinet/in_pcb.c)
- *
- * @param connection_hash Pointer to hashtable.
- * @param laddr Pointer to local address
- * @param raddr Pointer to remote address. 
- * @return Hash valua for the connection.
- */  
-static int chash_fn6( struct chashtable *connection_hash, struct sockaddr_in6 *laddr, 
-                struct sockaddr_in6 *raddr )
+ * Get the number of buckets holding at least one connection.
+ * @ingroup chashtbl
+ * @param table_p Pointer to the hashtable.
+ * @return Number of buckets in use.
+ */
+int chash_active_buckets( struct chashtable *table_p )
 {
-        int h;
+        int i, active = 0;
 
-        h = ntohl( raddr->sin6_addr.s6_addr[0] ) ^ htonl( raddr->sin6_addr.s6_addr[3]);
-        h += ntohs( raddr->sin6_port ) + ntohs( laddr->sin6_port );
-
-        TRACE( "chash_fn6(..)=0x%.2x\n", h & (connection_hash->nrof_buckets -1 ));
-        return h & (connection_hash->nrof_buckets - 1 );
+        for( i = 0; i < table_p->nrof_buckets; i++ ) {
+                if ( tag_match( &table_p->buckets[i], 0 ) != 
+                                (1 << CHASH_GROUP_SLOTS) - 1 ) 
+                        active++;
+        }
+        return active;
 }
 
-/** 
- * @brief Get pointer to right bucket for given connection.
+/**
+ * Put connection to the first free slot on its bucket.
  *
- * Since IPv4 and IPv6 connections are in the hashtable, some address family
- * checks have to be done. The hash function differs also for v4 vs. v6.
- * 
- * @param tab_p Pointer to hashtable.
- * @param conn_p Pointer to connection for resolving the bucket.
- * 
- * @return Pointer to the head of the correct bucket for given connection.
+ * @param connection_hash Pointer to hashtable.
+ * @param conn_p Pointer to the connection struct to add.
+ * @param hash Hash value for the key of the connection.
  */
-static chlist_head *resolve_bucket( struct chashtable *tab_p, 
-                struct tcp_connection *conn_p )
+static void put_slot( struct chashtable *connection_hash, 
+                struct tcp_connection *conn_p, uint32_t hash )
 {
-        int hash;
-        if ( conn_p->family == AF_INET ) {
-                hash =chash_fn4(tab_p, LADDR_SIN(conn_p), RADDR_SIN(conn_p));
-                return &tab_p->buckets[ hash ];
-        } else {
-                hash = chash_fn6(tab_p, LADDR_SIN6(conn_p), RADDR_SIN6(conn_p));
-                return &tab_p->buckets[ hash ];
+        struct chash_group *grp = CHASH_BUCKET( connection_hash, hash );
+        unsigned int mask;
+        int slot;
+
+        while ( (mask = tag_match( grp, 0 )) == 0 ) {
+                if ( grp->next == NULL ) {
+                        TRACE( "Allocating overflow group\n" );
+                        grp->next = mem_zalloc( sizeof( struct chash_group ) );
+                }
+                grp = grp->next;
         }
+        slot = __builtin_ctz( mask );
+        grp->tags[slot] = CHASH_TAG( hash );
+        grp->conns[slot] = conn_p;
+        connection_hash->size++;
 }
 
-/** 
- * @brief Get pointer to right bucket for given addresses.
- *
- * Since IPv4 and IPv6 connections are in the hashtable, some address family
- * checks have to be done. The hash function differs also for v4 vs. v6.
+/**
+ * Double the number of buckets and move the connections to the new buckets.
  *
- * @see resolve_bucket()
- * 
- * @param tab_p Pointer to hashtable.
- * @param laddr_p Pointer to sockaddr_storage structure holding local address.
- * @param raddr_p Pointer to sockaddr_storage structure holding remote address.
- * 
- * @return Pointer to the head of the correct bucket for given connection.
+ * @param connection_hash Pointer to hashtable.
  */
-static chlist_head *resolve_bucket_sa( struct chashtable *tab_p,
-                struct sockaddr_storage *laddr_p, struct sockaddr_storage *raddr_p)
+static void grow_buckets( struct chashtable *connection_hash )
 {
-        if ( laddr_p->ss_family == AF_INET ) {
-                return &tab_p->buckets[ chash_fn4( tab_p, (struct sockaddr_in *)laddr_p,
-                                (struct sockaddr_in *)raddr_p ) ];
-        } else {
-                return &tab_p->buckets[ chash_fn6( tab_p, (struct sockaddr_in6 *)laddr_p,
-                                (struct sockaddr_in6 *)raddr_p ) ];
+        struct chash_group *old = connection_hash->buckets;
+        struct chash_group *grp, *next;
+        int old_size = connection_hash->nrof_buckets;
+        int i, j;
+
+        connection_hash->nrof_buckets *= 2;
+        connection_hash->buckets = mem_zalloc( connection_hash->nrof_buckets * 
+                        sizeof( struct chash_group ));
+        connection_hash->size = 0;
+        for ( i = 0; i < old_size; i++ ) {
+                for ( grp = &old[i]; grp != NULL; grp = next ) {
+                        next = grp->next;
+                        for ( j = 0; j < CHASH_GROUP_SLOTS; j++ ) {
+                                if ( grp->tags[j] != 0 ) 
+                                        put_slot( connection_hash, grp->conns[j],
+                                                conn_key_hash( &grp->conns[j]->key ));
+                        }
+                        if ( grp != &old[i] ) 
+                                mem_free( grp );
+                }
         }
+        mem_free( old );
+        DBG( "Hashtable grown to %d buckets\n", connection_hash->nrof_buckets );
 }
 
 /**
  * Add connection to hashtable. 
- * Connection is added to the hashtable, note that no check for duplicates is done.
+ * Connection is added to the hashtable, note that no check for duplicates is
+ * done. If the hashtable is loaded over CHASH_MAX_LOAD, the number of buckets
+ * is doubled first.
  *
  * @ingroup chashtbl
  *
@@ -244,17 +435,11 @@ static chlist_head *resolve_bucket_sa( struct chashtable *tab_p,
  */ 
 int chash_put( struct chashtable *connection_hash, struct tcp_connection *conn_p )
 {
-        chlist_head  *head_p = resolve_bucket( connection_hash, conn_p );
-        struct chlist_node *node_p;
-
         ENTER_F();
 
-        node_p = mem_alloc( sizeof( struct chlist_node ) );
-        node_p->connection = conn_p;
-        node_p->next_node = *head_p;
-        *head_p = node_p;
-        TRACE( "[%p -> %p]\n", node_p, node_p->next_node ); 
-        connection_hash->size++;
+        if ( connection_hash->size >= connection_hash->nrof_buckets * CHASH_MAX_LOAD ) 
+                grow_buckets( connection_hash );
+        put_slot( connection_hash, conn_p, conn_key_hash( &conn_p->key ));
         DPRINT( "Hashtable size %d \n", connection_hash->size );
 
         EXIT_F();
@@ -262,29 +447,58 @@ int chash_put( struct chashtable *connection_hash, struct tcp_connection *conn_p
 }
 
 /**
- * Check if given addresses match a connection on a linked
- * list
+ * Find the slot holding connection with given key. 
  *
- * @param laddr_p Pointer to the local address structure.
- * @param raddr_p Pointer to the remote address structure.
- * @param node_p Pointer to the node to compare.
- * @return 1 if given addresses match for the connection, 0 if not.
- */ 
-static int key_cmp( struct sockaddr_storage *laddr_p,
-                struct sockaddr_storage *raddr_p, struct chlist_node *node_p )
+ * @param connection_hash Pointer to hashtable.
+ * @param key Pointer to the key to look for.
+ * @param hash Hash value for the key.
+ * @param slot_p Pointer to variable receiving the slot number.
+ * @return Pointer to the group holding the connection, NULL if not found.
+ */
+static struct chash_group *find_slot( struct chashtable *connection_hash,
+                const struct conn_key *key, uint32_t hash, int *slot_p )
 {
-        struct sockaddr_storage *node_raddr, *node_laddr;
+        struct chash_group *grp = CHASH_BUCKET( connection_hash, hash );
+        unsigned int mask;
+        int slot;
+
+        do {
+                mask = tag_match( grp, CHASH_TAG( hash ) );
+                while ( mask != 0 ) {
+                        slot = __builtin_ctz( mask );
+                        if ( key_equal( key, &grp->conns[slot]->key ) ) {
+                                *slot_p = slot;
+                                return grp;
+                        }
+                        mask &= mask - 1;
+                }
+                grp = grp->next;
+        } while ( grp != NULL );
 
-        ASSERT( laddr_p->ss_family == raddr_p->ss_family );
-        
-        node_raddr = RADDR(node_p->connection);
-        node_laddr = LADDR(node_p->connection);
+        return NULL;
+}
 
-        if (ss_match(laddr_p,node_laddr) != MATCH_BOTH ||
-            ss_match(raddr_p,node_raddr) != MATCH_BOTH)
-                return 0;
+/**
+ * Get connection with given key.
+ *
+ * @ingroup chashtbl
+ *
+ * @param connection_hash Pointer to hashtable.
+ * @param key Pointer to the key.
+ * @param hash Hash for the key (from conn_key_hash()).
+ * @return Pointer to the connection with the key, NULL if none is found.
+ */ 
+struct tcp_connection *chash_get_key( struct chashtable *connection_hash,
+                const struct conn_key *key, uint32_t hash )
+{
+        struct chash_group *grp;
+        int slot;
+
+        grp = find_slot( connection_hash, key, hash, &slot );
+        if ( grp == NULL )
+                return NULL;
 
-        return 1;
+        return grp->conns[slot];
 }
 
 /**
@@ -302,25 +516,73 @@ struct tcp_connection *chash_get( struct chashtable *connection_hash,
                 struct sockaddr_storage *laddr_p, 
                 struct sockaddr_storage *raddr_p ) 
 {
-        chlist_head *head_p = resolve_bucket_sa( connection_hash,
-                        laddr_p, raddr_p );
-        struct chlist_node *node_p = *head_p;
-        struct tcp_connection *rv = NULL;
+        struct conn_key key;
 
-        ENTER_F();
+        conn_key_from_ss( &key, laddr_p, raddr_p );
+        return chash_get_key( connection_hash, &key, conn_key_hash( &key ));
+} 
 
-        while ( node_p != NULL ) {
-                if ( key_cmp( laddr_p, raddr_p, node_p ) == 1 ) {
-                       rv = node_p->connection;
-                       break;
-                } 
+/**
+ * Prefetch the bucket for given hash value. 
+ * @ingroup chashtbl
+ * @param connection_hash Pointer to hashtable.
+ * @param hash Hash value from conn_key_hash().
+ */
+void chash_prefetch_bucket( struct chashtable *connection_hash, uint32_t hash )
+{
+        PREFETCH( CHASH_BUCKET( connection_hash, hash ) );
+}
+
+/**
+ * Prefetch the keys of connections whose tag matches the given hash value.
+ * Only the first group on the bucket is checked, it should have been
+ * prefetched earlier with chash_prefetch_bucket().
+ * @ingroup chashtbl
+ * @param connection_hash Pointer to hashtable.
+ * @param hash Hash value from conn_key_hash().
+ */
+void chash_prefetch_key( struct chashtable *connection_hash, uint32_t hash )
+{
+        struct chash_group *grp = CHASH_BUCKET( connection_hash, hash );
+        unsigned int mask = tag_match( grp, CHASH_TAG( hash ) );
 
-                node_p = node_p->next_node;
+        while ( mask != 0 ) {
+                PREFETCH( &grp->conns[ __builtin_ctz( mask ) ]->key );
+                mask &= mask - 1;
         }
+}
 
-        EXIT_F();
+/**
+ * Remove connection on given slot.
+ *
+ * @param connection_hash Pointer to hashtable.
+ * @param hash Hash value of the removed connection.
+ * @param grp Group holding the connection.
+ * @param slot Slot of the connection on the group.
+ * @return Pointer to the removed connection.
+ */
+static struct tcp_connection *remove_slot( struct chashtable *connection_hash,
+                uint32_t hash, struct chash_group *grp, int slot )
+{
+        struct tcp_connection *rv = grp->conns[slot];
+        struct chash_group *prev;
+
+        grp->tags[slot] = 0;
+        grp->conns[slot] = NULL;
+        connection_hash->size--;
+        DPRINT( "Hashtable size %d \n", connection_hash->size );
+
+        prev = CHASH_BUCKET( connection_hash, hash );
+        if ( grp != prev && tag_match( grp, 0 ) == (1 << CHASH_GROUP_SLOTS) - 1 ) {
+                /* Empty overflow group, release it */
+                while ( prev->next != grp ) 
+                        prev = prev->next;
+                prev->next = grp->next;
+                TRACE( "Releasing overflow group %p\n", grp );
+                mem_free( grp );
+        }
         return rv;
-} 
+}
 
 /**
  * Remove a connection keyed by given addresses from the hashtable. 
@@ -337,54 +599,19 @@ struct tcp_connection *chash_remove(struct chashtable *connection_hash,
                 struct sockaddr_storage *laddr_p, 
                 struct sockaddr_storage *raddr_p ) 
 {
-        chlist_head *head_p = resolve_bucket_sa( connection_hash, 
-                        laddr_p, raddr_p );
-        struct chlist_node *node_p;
-        struct tcp_connection *rv = NULL;
-
-        ENTER_F();
-        node_p = *head_p;
-
-        if ( node_p == NULL ) {
+        struct conn_key key;
+        struct chash_group *grp;
+        uint32_t hash;
+        int slot;
+
+        conn_key_from_ss( &key, laddr_p, raddr_p );
+        hash = conn_key_hash( &key );
+        grp = find_slot( connection_hash, &key, hash, &slot );
+        if ( grp == NULL ) {
                 WARN( "Trying to remove connection not in the hash!\n" );
                 return NULL;
         }
-
-        if ( key_cmp( laddr_p, raddr_p, node_p ) == 1 ) {
-                TRACE( "Removing the connection from head\n" );
-                rv = node_p->connection;
-                *head_p = node_p->next_node;
-                TRACE( "[%p -> %p]\n", node_p, *head_p );
-                mem_free( node_p );
-                connection_hash->size--;
-                DPRINT( "Hashtable size %d \n", connection_hash->size );
-                EXIT_F();
-                return rv;
-        }
-
-        while ( node_p->next_node != NULL ) {
-
-                if ( key_cmp( laddr_p, raddr_p, node_p->next_node ) == 1 ) {
-                        struct chlist_node *removed;
-
-                        TRACE( "Removing from the list \n" );
-                        removed = node_p->next_node;
-                        node_p->next_node = removed->next_node;
-
-                        TRACE( "[%p -> %p]\n", removed, node_p->next_node );
-
-                        rv = removed->connection;
-                        connection_hash->size--;
-                        DPRINT( "Hashtable size %d \n", connection_hash->size );
-
-                        mem_free( removed );
-                        break;
-                }
-                node_p = node_p->next_node;
-        }
-
-        EXIT_F();
-        return rv;
+        return remove_slot( connection_hash, hash, grp, slot );
 }
 
 /**
@@ -399,7 +626,16 @@ struct tcp_connection *chash_remove(struct chashtable *connection_hash,
 struct tcp_connection *chash_remove_connection( struct chashtable *connection_hash,
                 struct tcp_connection *conn_p )
 {
-        return chash_remove(connection_hash, LADDR(conn_p),RADDR(conn_p));
+        struct chash_group *grp;
+        uint32_t hash = conn_key_hash( &conn_p->key );
+        int slot;
+
+        grp = find_slot( connection_hash, &conn_p->key, hash, &slot );
+        if ( grp == NULL ) {
+                WARN( "Trying to remove connection not in the hash!\n" );
+                return NULL;
+        }
+        return remove_slot( connection_hash, hash, grp, slot );
 }
         
 
@@ -607,8 +843,10 @@ struct tcp_connection *connection_init(struct sockaddr_storage *local_address,
         memcpy( &(conn->raddr),remote_address, sizeof(*remote_address));
         conn->state = state;
         conn->family = local_address->ss_family;
+        conn_key_from_ss( &conn->key, local_address, remote_address );
 
         conn->metadata.added = time(NULL);
+        conn->metadata.state_since = connection_time_ms();
         metadata_set_flag(conn->metadata, METADATA_NEW);
         connection_do_addrstrings(conn);
 
@@ -627,10 +865,182 @@ struct tcp_connection *connection_init(struct sockaddr_storage *local_address,
  */  
 void connection_deinit( struct tcp_connection *con_p )
 {
+        if ( con_p->mem != NULL ) 
+                mem_free( con_p->mem );
+        if ( con_p->nat != NULL ) 
+                mem_free( con_p->nat );
+        if ( con_p->row != NULL ) 
+                mem_free( con_p->row );
         mem_free( con_p );
 
 } 
 
+/**
+ * Set the memory used by the socket of connection. 
+ * The memory held by the group the connection belongs to is updated with the
+ * change.
+ * @ingroup conn_utils
+ *
+ * @param conn_p Pointer to the connection.
+ * @param info The memory used by the socket.
+ */
+void connection_set_meminfo( struct tcp_connection *conn_p, 
+                struct conn_meminfo *info )
+{
+        uint32_t old = 0;
+
+        if ( conn_p->mem == NULL ) 
+                conn_p->mem = mem_alloc( sizeof( *conn_p->mem ));
+        else 
+                old = conn_p->mem->held;
+
+        memcpy( conn_p->mem, info, sizeof( *info ));
+        if ( conn_p->group != NULL ) 
+                conn_p->group->mem_held = conn_p->group->mem_held - old + info->held;
+}
+
+/**
+ * Forget the memory used by the socket of connection.
+ * @ingroup conn_utils
+ *
+ * @param conn_p Pointer to the connection.
+ */
+void connection_clear_meminfo( struct tcp_connection *conn_p )
+{
+        if ( conn_p->mem == NULL ) 
+                return;
+        if ( conn_p->group != NULL ) 
+                conn_p->group->mem_held -= conn_p->mem->held;
+        mem_free( conn_p->mem );
+        conn_p->mem = NULL;
+}
+
+/**
+ * Set the real remote end for connection whose remote address is
+ * translated.
+ * @ingroup conn_utils
+ *
+ * @param conn_p Pointer to the connection.
+ * @param nat The translation found for the connection.
+ */
+void connection_set_nat( struct tcp_connection *conn_p, 
+                const struct conn_nat *nat )
+{
+        if ( conn_p->nat == NULL ) 
+                conn_p->nat = mem_alloc( sizeof( *conn_p->nat ));
+        memcpy( conn_p->nat, nat, sizeof( *nat ));
+}
+
+/**
+ * Get the current wall clock time in milliseconds.
+ * @ingroup conn_utils
+ * @return Milliseconds since the epoch.
+ */
+uint64_t connection_time_ms( void )
+{
+        struct timespec ts;
+
+        clock_gettime( CLOCK_REALTIME, &ts );
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Get the current monotonic time in microseconds, for measuring durations.
+ * @ingroup conn_utils
+ * @return Microseconds since some unspecified point.
+ */
+long connection_now_usecs( void )
+{
+        struct timespec ts;
+
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/**
+ * Check if the state is one of the states for closing connection.
+ * @param state The state.
+ * @return non-zero if the connection is closing.
+ */
+static int state_is_closing( enum tcp_state state )
+{
+        return state == TCP_FIN_WAIT1 || state == TCP_FIN_WAIT2 ||
+                state == TCP_CLOSE_WAIT || state == TCP_LAST_ACK ||
+                state == TCP_CLOSING;
+}
+
+/**
+ * @brief Record the time the connection spent on its current state.
+ *
+ * The duration is added to the histogram of the group of the connection. If
+ * the connection is not yet on a group, the duration is saved and added when
+ * the connection is added to group.
+ *
+ * @param conn_p Pointer to the connection.
+ * @param kind Which histogram the duration belongs to.
+ * @param now Current time (ms).
+ */
+static void record_duration( struct tcp_connection *conn_p, 
+                enum state_hist_kind kind, uint64_t now )
+{
+        uint64_t msecs = 0;
+
+        if ( now > conn_p->metadata.state_since ) 
+                msecs = now - conn_p->metadata.state_since;
+        if ( conn_p->group != NULL ) {
+                group_record_duration( conn_p->group, kind, msecs );
+                return;
+        }
+        conn_p->metadata.pending_msecs = msecs > UINT32_MAX ? UINT32_MAX : msecs;
+        conn_p->metadata.pending_kind = kind;
+        metadata_set_flag( conn_p->metadata, METADATA_DURATION_PENDING );
+}
+
+/**
+ * @brief The connection is leaving its current state.
+ *
+ * If the connection has been on one of the closing states, the time spent on
+ * the state is recorded. This should be called also when a connection is
+ * found closed.
+ *
+ * @ingroup conn_utils
+ *
+ * @param conn_p Pointer to the connection.
+ * @param now Current time (ms).
+ */
+void connection_end_state( struct tcp_connection *conn_p, uint64_t now )
+{
+        if ( state_is_closing( conn_p->state ))
+                record_duration( conn_p, HIST_CLOSING, now );
+}
+
+/**
+ * @brief Change the state of connection.
+ *
+ * The time spent on the previous state is recorded, the state change time is
+ * saved and the connection is flagged with METADATA_STATE_CHANGED.
+ *
+ * @ingroup conn_utils
+ *
+ * @param conn_p Pointer to the connection.
+ * @param state The new state.
+ * @param now Time of the state change (ms).
+ */
+void connection_set_state( struct tcp_connection *conn_p, enum tcp_state state,
+                uint64_t now )
+{
+        if ( state == TCP_ESTABLISHED && ( conn_p->state == TCP_SYN_SENT || 
+                                conn_p->state == TCP_SYN_RECV )) 
+                record_duration( conn_p, HIST_HANDSHAKE, now );
+        else 
+                connection_end_state( conn_p, now );
+
+        conn_p->state = state;
+        conn_p->metadata.state_since = now;
+        metadata_set_flag( conn_p->metadata, METADATA_STATE_CHANGED );
+        metadata_touch( conn_p->metadata );
+}
+
 /** 
  * @brief Resolve the service name for the given port.
  * 
@@ -654,6 +1064,58 @@ static void resolve_servname( uint16_t port, struct conn_metadata *meta_p )
 
 }
 
+/**
+ * Cache for the resolved names, NULL if not in use.
+ */
+static struct dns_cache *name_cache = NULL;
+
+/** 
+ * @brief Set the cache used for resolving the remote host names.
+ *
+ * @ingroup conn_utils
+ * 
+ * @param cache The cache, NULL if no cache should be used.
+ */
+void connection_set_dns_cache( struct dns_cache *cache )
+{
+        name_cache = cache;
+}
+
+/**
+ * Function called with status messages, NULL if messages are not shown.
+ */
+static connection_status_fn status_hook = NULL;
+/**
+ * Argument for the status hook.
+ */
+static void *status_arg = NULL;
+
+/** 
+ * @brief Set the function called with status messages.
+ *
+ * The function is called with a message when a slow operation (resolving a
+ * name) starts and with NULL message when it is done.
+ *
+ * @ingroup conn_utils
+ * 
+ * @param hook The function, NULL if messages should not be shown.
+ * @param arg Argument passed to the function.
+ */
+void connection_set_status_hook( connection_status_fn hook, void *arg )
+{
+        status_hook = hook;
+        status_arg = arg;
+}
+
+/**
+ * Clear the status message shown with the status hook.
+ */
+static void clear_status( void )
+{
+        if ( status_hook != NULL )
+                status_hook( NULL, status_arg );
+}
+
 /**
  * Print a message to user that we are resolving an address.
  *
@@ -661,10 +1123,12 @@ static void resolve_servname( uint16_t port, struct conn_metadata *meta_p )
  */
 static void print_resolving( char *addr )
 {
-        char msg[80];
+        char msg[sizeof( "Resolving " ) + ADDRSTR_BUFLEN];
 
-        snprintf(msg,80, "Resolving %s", addr );
-        ui_show_message( LOCATION_STATUSBAR, msg );
+        if ( status_hook == NULL ) 
+                return;
+        snprintf( msg, sizeof( msg ), "Resolving %s", addr );
+        status_hook( msg, status_arg );
 
 }
 
@@ -698,6 +1162,8 @@ int connection_resolve( struct tcp_connection *conn_p )
                 TRACE( "Exit1\n" );
                 return 0;
         }
+        /* Names are (re)filled from here on */
+        metadata_touch( conn_p->metadata );
 
         r_port = connection_get_port( conn_p, 0 );
         resolve_servname( r_port, meta_p );
@@ -749,9 +1215,23 @@ int connection_resolve( struct tcp_connection *conn_p )
                 }
         }
 
+        if ( name_cache != NULL && dns_cache_lookup( name_cache, family, addr_p, 
+                                len, meta_p->rem_hostname, ADDRSTR_BUFLEN ) 
+                        != DNSCACHE_MISS ) {
+                metadata_set_flag(conn_p->metadata, METADATA_RESOLVED );
+                return 0;
+        }
+
         print_resolving( conn_p->metadata.raddr_string );
+        if ( name_cache != NULL ) {
+                dns_cache_resolve( name_cache, family, addr_p, len, 
+                                meta_p->rem_hostname, ADDRSTR_BUFLEN );
+                clear_status();
+                metadata_set_flag(conn_p->metadata, METADATA_RESOLVED );
+                return 0;
+        }
         hent_p = gethostbyaddr( addr_p, len, family );
-        ui_clear_message( LOCATION_STATUSBAR );
+        clear_status();
         if ( hent_p == NULL ) {
                 DBG( "gethostbyaddr() returned NULL, address was %s \n", conn_p->metadata.raddr_string );
                 meta_p->rem_hostname[0] = '\0';
@@ -41,6 +41,7 @@
 #endif /* OPENBSD */
 #include <netinet/in.h>
 
+#include "hash.h"
 
 enum tcp_state { 
         TCP_DEAD = 0, /* Not really a state, for lingering */
@@ -64,16 +65,62 @@ enum connection_dir {
 };
 
 
+/**
+ * Memory used by the socket of connection, as reported by sock_diag
+ * (INET_DIAG_SKMEMINFO). All values are in bytes.
+ */
+struct conn_meminfo {
+        uint32_t rmem_alloc; /**< Memory used by received data */
+        uint32_t rcvbuf; /**< Size of the receive buffer */
+        uint32_t wmem_alloc; /**< Memory used by data being transmitted */
+        uint32_t sndbuf; /**< Size of the send buffer */
+        uint32_t fwd_alloc; /**< Memory reserved but not yet used */
+        uint32_t wmem_queued; /**< Memory used by data on send queue */
+        uint32_t optmem; /**< Memory used by socket options */
+        uint32_t backlog; /**< Memory used by packets on backlog */
+        uint32_t drops; /**< Packets dropped */
+        uint32_t held; /**< Memory held (rmem_alloc + wmem_queued + fwd_alloc) */
+        uint32_t dump; /**< Sequence number of the dump the values are from */
+};
+
+/**
+ * Kind of address translation done for the connection.
+ */
+enum conn_nat_kind {
+        NAT_DST, /**< Destination translated, remote address is e.g. service VIP */
+        NAT_SRC /**< Source translated, remote address is masqueraded */
+};
+
+/**
+ * Real remote end of a connection whose remote address is translated, as
+ * found on the connection tracking table.
+ */
+struct conn_nat {
+        enum conn_nat_kind kind; /**< Kind of translation */
+        struct sockaddr_storage peer; /**< Real remote address and port */
+        char peer_string[INET6_ADDRSTRLEN]; /**< Real remote address as string */
+};
+
 /**
  * Structure containing metadata information for connection.
  */
 struct conn_metadata {
         time_t added; /**< Time the connection was added */
+        uint64_t state_since; /**< Time the connection entered its current state (ms) */
+        uint32_t pending_msecs; /**< Duration waiting for group (METADATA_DURATION_PENDING) */
+        uint8_t pending_kind; /**< enum state_hist_kind for the pending duration */
+        struct hash_link fold; /**< Link on the overflow index, hashed by the grouping selectors */
         enum connection_dir dir; /**< Direction of the connection. */
         uint8_t flags; /**< Metadata flags */
+        /**
+         * Bumped when information shown for the connection (other than the
+         * state and time) changes, invalidates the formatted row.
+         */
+        uint32_t version;
         const char *ifname; /**< Name of the interface, Can be NULL */
 #ifdef ENABLE_FOLLOW_PID
         ino_t inode; /**< Inode number for the local socket(?) */
+        int pid; /**< PID of the process owning the socket, 0 if not known */
 #endif /* ENABLE_FOLLOW_PID */
         char rem_hostname[ADDRSTR_BUFLEN]; /**< name of the remote host */
         char rem_servname[ADDRSTR_BUFLEN]; /**< service name from remote port */
@@ -113,6 +160,11 @@ struct conn_metadata {
  * FLag indicating that connection has been updated.
  */
 #define METADATA_UPDATED 0x04
+/**
+ * Flag indicating that a state duration was recorded while the connection
+ * was not on any group, it is added to the group the connection is put to.
+ */
+#define METADATA_DURATION_PENDING 0x08
 /**
  * Flag indicating that remote host lookup has been 
  * tried.
@@ -128,6 +180,11 @@ struct conn_metadata {
  * about this connection.
  */
 #define METADATA_WARN 0x40
+/**
+ * Flag indicating that the local port of connection is counted on the
+ * ephemeral port monitor.
+ */
+#define METADATA_EPHEMERAL 0x80
 
 /**
  * Mask for detecting if the connection has been 
@@ -137,6 +194,10 @@ struct conn_metadata {
 #define METADATA_TOUCHED_MASK 0x07
 
 #define metadata_set_flag(m,f)( m.flags = m.flags | f )
+/**
+ * Mark the information shown for the connection changed.
+ */
+#define metadata_touch(m)( m.version++ )
 #define metadata_is_new(m)( m.flags & METADATA_NEW )
 #define metadata_is_state_changed(m)( m.flags & METADATA_STATE_CHANGED )
 #define metadata_is_touched(m)( m.flags & METADATA_TOUCHED_MASK )  
@@ -149,6 +210,21 @@ struct conn_metadata {
 
 
 
+/**
+ * Normalized key identifying a TCP connection. 
+ * IPv4 addresses are stored as IPv4 mapped IPv6 addresses, so keys for both
+ * address families have the same layout and can be compared as a block of
+ * bytes (all padding is zero).
+ * @ingroup chashtbl
+ */
+struct conn_key {
+        uint8_t laddr[16]; /**< Local address (network byte order) */
+        uint8_t raddr[16]; /**< Remote address (network byte order) */
+        in_port_t lport; /**< Local port (network byte order) */
+        in_port_t rport; /**< Remote port (network byte order) */
+        uint32_t family; /**< Address family */
+};
+
 /**
  * TCP connection. The connection is identified by 4-tuple
  * &lt;sraddr,sport,dstaddr,dport&gt;. 
@@ -159,6 +235,7 @@ struct conn_metadata {
  */ 
 struct tcp_connection {
         int family; /**< Address family for the connection */
+        struct conn_key key; /**< Key for the connection on hashtable */
         struct sockaddr_storage laddr; /**< Local address for the connection */
         struct sockaddr_storage raddr; /**< Remote address for the connection */
 
@@ -169,6 +246,10 @@ struct tcp_connection {
         struct tcp_connection *next; /**< Pointer to next connection on linked list */
         struct tcp_connection *prev; /**< Pointer to previous connection on linked list */
         struct group *group; /**< Pointer to group this connection belongs to (or is a parent). */
+        struct conn_meminfo *mem; /**< Memory used by the socket, NULL if not collected */
+        struct lb_backend *backend; /**< Backend the connection is counted on, NULL if not counted */
+        struct conn_nat *nat; /**< Real remote end, NULL if not translated */
+        struct conn_row *row; /**< Formatted row for main view, NULL if not shown */
 
 };
 
@@ -186,32 +267,45 @@ struct cqueue {
 };  
 
 /**
- * Node in a connection hashtable bucket. 
- */ 
-struct chlist_node {
-        struct chlist_node *next_node; /**< Pointer to next node */
+ * Number of slots on one group of the hashtable bucket.
+ */
+#define CHASH_GROUP_SLOTS 16
 
-        struct tcp_connection *connection; /**< Pointer to the connection */
+/**
+ * Group of slots on a connection hashtable bucket. 
+ * Each used slot has a tag byte (high bit set and 7 bits from the hash for
+ * the connection), free slots have tag 0. Tags are kept together so that
+ * all slots of the group can be matched with one vector compare before the
+ * keys of the connections are touched. If all slots are in use, further
+ * connections are put to overflow group.
+ */ 
+struct chash_group {
+        uint8_t tags[CHASH_GROUP_SLOTS]; /**< Tags for the slots */
+        struct tcp_connection *conns[CHASH_GROUP_SLOTS]; /**< Connections on slots */
+        struct chash_group *next; /**< Overflow group, NULL if none */
 };
 
 /**
- * Typedef for the connection hashtable bucket list head.
- */ 
-typedef struct chlist_node *chlist_head; 
+ * Average number of connections on a bucket at which the number of buckets
+ * on the connection hashtable is doubled (3/4 of the slots on a group).
+ */
+#define CHASH_MAX_LOAD 12
 
 /**
  * Connection hashtable.
- * Connection hashtable contains connections. Hashtable contains defined
- * ammount of buckets which can contain unlimited number of connections.
- * Buckets are a linked lists of chlist_nodes which in turn contain pointers to
- * connections. One connection can be in multiple hashtables.  
+ * Connection hashtable contains connections. Hashtable starts with
+ * CONNECTION_HASHTABLE_SIZE buckets which can contain unlimited number of
+ * connections, the number of buckets is doubled when the connections fill
+ * CHASH_MAX_LOAD slots per bucket on average.
+ * Each bucket is a group of slots, with overflow groups allocated when
+ * needed. One connection can be in multiple hashtables.  
  * @ingroup chashtbl
  */ 
 struct chashtable {
         int size; /**< Number of connections on the hashtable */
-        int nrof_buckets;/**< Number of buckets on hashtable */
+        int nrof_buckets;/**< Number of buckets on hashtable (power of 2) */
         
-        chlist_head buckets[ CONNECTION_HASHTABLE_SIZE ]; /**< Buckets */
+        struct chash_group *buckets; /**< Buckets */
 };
 
 
@@ -238,18 +332,74 @@ struct group {
        struct filter *grp_filter; /**< Filter for this group */
        struct cqueue *group_q;/**< Queue for holding connections belonging to this group */
        struct tcp_connection *parent;/**< Parent connection (if it exists) for this group */
+       uint8_t flags; /**< Flags (GROUP_F_*) for this group */
+       struct state_hist *hist; /**< Time spent on states, NULL if nothing recorded */
+       struct cloud_entry *cloud; /**< Entry on index of related connections, NULL if not on index */
+       struct gkey_entry *gkey; /**< Entry on index of grouping keys, NULL if not on index */
+       uint64_t mem_held; /**< Socket memory held by the connections on group */
+       uint64_t active; /**< Time (ms) a connection was last added to or changed state on group */
+
+       struct group *next; /**< Pointer for next group on a list */
+       struct group *prev; /**< Pointer for previous group on a list */
+       struct glist *list; /**< The list the group is on, NULL if not on any */
+
+};
+
+/**
+ * Flag for group indicating that user has collapsed the group on UI.
+ * @ingroup cgrp
+ */
+#define GROUP_F_COLLAPSED 0x01
+/**
+ * Flag for group indicating that user has expanded the group on UI.
+ * @ingroup cgrp
+ */
+#define GROUP_F_EXPANDED 0x02
+/**
+ * Flag for group indicating that the group holds connections from the least
+ * recently active groups folded together.
+ * @ingroup cgrp
+ */
+#define GROUP_F_OVERFLOW 0x04
+
+/**
+ * Number of buckets on the state duration histograms. Bucket 0 holds
+ * durations under 1ms, bucket n durations from 2^(n-1) to 2^n - 1 ms and the
+ * last bucket everything longer.
+ * @ingroup cgrp
+ */
+#define STATE_HIST_BUCKETS 16
 
-       struct group *next; /**< Pointer for next connection on a list */
+/**
+ * Durations recorded for a group.
+ * @ingroup cgrp
+ */
+enum state_hist_kind {
+        HIST_HANDSHAKE = 0, /**< SYN_SENT or SYN_RECV to ESTABLISHED */
+        HIST_CLOSING, /**< Time spent on one of the closing states */
+        HIST_KINDS
+};
 
+/**
+ * Log2 histograms of the time connections on a group have spent on states.
+ * @ingroup cgrp
+ */
+struct state_hist {
+        uint32_t count[HIST_KINDS]; /**< Number of durations recorded */
+        uint32_t buckets[HIST_KINDS][STATE_HIST_BUCKETS]; /**< The histograms */
 };
 
 /**
  * A list of groups. One group can belong only to one glist. 
+ * The groups are doubly linked, hence removing a group does not need to
+ * search the list. Empty groups removed with glist_delete_grp_if_empty() are
+ * kept on the reclaim list until glist_reclaim() is called.
  * @ingroup cglst
  */ 
 struct glist {
         int size; /**< Number of elements on the list */ 
         struct group *head;/**< Pointer to the first group on list */ 
+        struct group *reclaim; /**< Removed empty groups waiting to be freed */
 };
 
 
@@ -257,8 +407,27 @@ struct glist {
 struct tcp_connection *connection_init(struct sockaddr_storage *local_address,
                 struct sockaddr_storage *remote_address, enum tcp_state state);
 void connection_deinit( struct tcp_connection *con_p );
+uint64_t connection_time_ms( void );
+long connection_now_usecs( void );
+void connection_end_state( struct tcp_connection *conn_p, uint64_t now );
+void connection_set_state( struct tcp_connection *conn_p, enum tcp_state state,
+                uint64_t now );
 int connection_resolve( struct tcp_connection *conn_p );
+struct dns_cache;
+void connection_set_dns_cache( struct dns_cache *cache );
+/**
+ * Function receiving status messages, @a msg is NULL when the status should
+ * be cleared.
+ * @ingroup conn_utils
+ */
+typedef void (*connection_status_fn)( const char *msg, void *arg );
+void connection_set_status_hook( connection_status_fn hook, void *arg );
 int connection_do_addrstrings( struct tcp_connection *con_p );
+void connection_set_meminfo( struct tcp_connection *conn_p, 
+                struct conn_meminfo *info );
+void connection_clear_meminfo( struct tcp_connection *conn_p );
+void connection_set_nat( struct tcp_connection *conn_p, 
+                const struct conn_nat *nat );
 uint16_t connection_get_port( struct tcp_connection *conn, int local );
 
 /* struct sockaddr_storage utilities */
@@ -291,13 +460,27 @@ int chash_put( struct chashtable *connection_hash,
 struct tcp_connection *chash_get( struct chashtable *connection_hash,
                 struct sockaddr_storage *laddr_p, 
                 struct sockaddr_storage *raddr_p );
+void conn_key_set( struct conn_key *key, sa_family_t family, 
+                const uint8_t *laddr, const uint8_t *raddr, 
+                in_port_t lport, in_port_t rport );
+void conn_key_from_ss( struct conn_key *key, 
+                struct sockaddr_storage *laddr_p, 
+                struct sockaddr_storage *raddr_p );
+uint32_t conn_key_hash( const struct conn_key *key );
+struct tcp_connection *chash_get_key( struct chashtable *connection_hash,
+                const struct conn_key *key, uint32_t hash );
+void chash_prefetch_bucket( struct chashtable *connection_hash, uint32_t hash );
+void chash_prefetch_key( struct chashtable *connection_hash, uint32_t hash );
+int chash_active_buckets( struct chashtable *connection_hash );
 struct tcp_connection *chash_remove( struct chashtable *connection_hash,
                 struct sockaddr_storage *laddr_p,
                 struct sockaddr_storage *raddr_p );
 struct tcp_connection *chash_remove_connection( struct chashtable *connection_hash,
                 struct tcp_connection *conn_p );
 void chash_clear( struct chashtable *table_p );
-#ifdef DEBUG 
+void chash_walk( struct chashtable *table_p,
+                void (*fn)(struct tcp_connection *, void *), void *data );
+#ifdef DEBUG
 void dump_hashtable( struct chashtable *connection_hash );
 void dump_connection( struct tcp_connection *conn_p ); 
 #endif 
@@ -334,6 +517,10 @@ void group_set_parent( struct group *group_p, struct tcp_connection *conn_p );
 uint16_t group_get_policy( struct group *group_p ); 
 struct cqueue *group_get_queue( struct group *group_p );
 int group_get_newcount( struct group *group_p );
+void group_record_duration( struct group *group_p, enum state_hist_kind kind,
+                uint64_t msecs );
+uint64_t group_duration_percentile( struct group *group_p, 
+                enum state_hist_kind kind, int pct );
 
 #ifdef DEBUG 
 void dump_group( struct group *grp );
@@ -344,6 +531,7 @@ void dump_group( struct group *grp );
 struct glist *glist_init();
 void glist_deinit( struct glist *list_p, int free_connections );
 struct group *glist_delete_grp_if_empty( struct glist *list_p, struct group *grp );
+int glist_reclaim( struct glist *list_p );
 int glist_add(struct glist *list_p, struct group *grp );
 struct group *glist_remove( struct glist *list_p, struct group *grp );
 int glist_get_size( struct glist *list_p );
@@ -126,6 +126,12 @@ struct dbg_module_info dbg_modules[] = {
         {"RTINFO", DEBUG_DEFAULT_LEVEL},
         {"VIEW", DEBUG_DEFAULT_LEVEL },
         {"READER", DEBUG_DEFAULT_LEVEL },
+        {"REC", DEBUG_DEFAULT_LEVEL },
+        {"DIAG", DEBUG_DEFAULT_LEVEL },
+        {"BPF", DEBUG_DEFAULT_LEVEL },
+        {"DNS", DEBUG_DEFAULT_LEVEL },
+        {"SNMP", DEBUG_DEFAULT_LEVEL },
+        {"CT", DEBUG_DEFAULT_LEVEL },
         {"GENERIC",DEBUG_DEFAULT_LEVEL},
 };
 #endif /* DPRINT_MODULE */
@@ -55,7 +55,7 @@
 #define DEBUG_ENTER_EXIT 
 */
 
-/* Should be power of 2 */
+/* Initial number of buckets, should be power of 2 */
 #define CONNECTION_HASHTABLE_SIZE 256
 
 #define DEBUG_DEFAULT_LEVEL 2 /* WARN */
@@ -72,6 +72,15 @@
 
 #define ADDRSTR_BUFLEN 56
 
+/**
+ * Hint the CPU to fetch the memory pointed by @a p to cache.
+ */
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) 
+#endif /* __GNUC__ */
+
 #define ENABLE_RESOLVE_POPUP
 
 #ifdef DEBUG
@@ -96,6 +105,12 @@ enum dbg_module {
         DBG_MODULE_RT,
         DBG_MODULE_VIEW,
         DBG_MODULE_READER,
+        DBG_MODULE_REC,
+        DBG_MODULE_DIAG,
+        DBG_MODULE_BPF,
+        DBG_MODULE_DNS,
+        DBG_MODULE_SNMP,
+        DBG_MODULE_CT,
         DBG_MODULE_GENERIC /* this should always be the last */
 };
 #endif /* DPRINT_MODULE */
@@ -124,7 +139,19 @@ enum dbg_module {
  * ENABLE_FOLLOW_PID - Allow following connections belonging
  * to specified processes.
  * ENABLE_IFSTATS - Gather statistics about interfaces.
+ * ENABLE_DIAG_EVENTS - Listen for closed connections with sock_diag.
+ * ENABLE_BPF_EVENTS - Read state transitions from tracepoint with BPF.
+ * ENABLE_SNMP_STATS - Show the kernel TCP counters.
+ * ENABLE_SOCK_MEM - Collect socket memory usage with sock_diag.
+ * ENABLE_PORT_MONITOR - Monitor the use of ephemeral ports.
+ * ENABLE_CONNTRACK - Map NATed connections to real peers with conntrack.
+ *
+ * The features depend on the platform, which is set on tcpstat_config.h
+ * generated by make. The generated header is installed with the library
+ * headers, so programs using the library see the same features (and the
+ * same layout for the structures) as the library was built with.
  */
+#include "tcpstat_config.h"
 
 #ifdef OPENBSD
 /* For OpenBSD, no additional features yet */
@@ -137,6 +164,12 @@ enum dbg_module {
 #define ENABLE_ROUTES
 #define ENABLE_FOLLOW_PID
 #define ENABLE_IFSTATS
+#define ENABLE_DIAG_EVENTS
+#define ENABLE_BPF_EVENTS
+#define ENABLE_SNMP_STATS
+#define ENABLE_SOCK_MEM
+#define ENABLE_PORT_MONITOR
+#define ENABLE_CONNTRACK
 #endif /* LINUX */
 
 #endif /* _DEFS_H_ */
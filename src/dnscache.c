@@ -0,0 +1,464 @@
+/**
+ * @file dnscache.c
+ * @brief Persistent cache for the reverse DNS names.
+ *
+ * Resolving the names for remote addresses is done with synchronous calls to
+ * gethostbyaddr(), which makes the first minutes on busy host slow. The names
+ * can be cached to a file which is mapped on startup and written back
+ * periodically and when exiting. 
+ *
+ * Expired entries are not resolved when the cache is loaded, instead the old
+ * name is used when the address is seen and the entry is queued for
+ * revalidation. A few entries on queue are resolved again on every round.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_DNS
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "dnscache.h"
+
+/**
+ * @defgroup dnscache Persistent cache for DNS names
+ */
+
+/**
+ * Initial number of hash chains on the index.
+ */
+#define DNSCACHE_INDEX_INIT_SIZE 256
+
+/**
+ * Get the hash for address on index.
+ */
+static uint32_t entry_hash( int family, const uint8_t *addr )
+{
+        uint8_t f = family;
+
+        return hash_fnv( hash_fnv( HASH_FNV_INIT, &f, 1 ), addr, 16 );
+}
+
+/** 
+ * @brief Find the entry for address from index.
+ * 
+ * @return The entry, NULL if not found.
+ */
+static struct dns_entry *find_entry( struct dns_cache *cache, int family, 
+                const uint8_t *addr )
+{
+        struct hash_link *link;
+        struct dns_entry *entry;
+
+        for ( link = hash_index_first( &cache->index, entry_hash( family, addr ));
+                        link != NULL; link = hash_index_next( link )) {
+                entry = HASH_ENTRY( link, struct dns_node, link )->entry;
+                if ( entry->family == family && memcmp( entry->addr, addr, 16 ) == 0 )
+                        return entry;
+        }
+        return NULL;
+}
+
+/** 
+ * @brief Put entry to index.
+ *
+ * The address should not already be on index.
+ */
+static void index_put( struct dns_cache *cache, struct dns_node *node, 
+                struct dns_entry *entry )
+{
+        node->entry = entry;
+        hash_index_add( &cache->index, &node->link, 
+                        entry_hash( entry->family, entry->addr ));
+}
+
+/**
+ * @brief Check if the entry is allocated separately (not on the mapping).
+ */
+static int entry_is_allocated( struct dns_cache *cache, struct dns_entry *entry )
+{
+        return cache->map == NULL || (char *)entry < (char *)cache->map || 
+                (char *)entry >= (char *)cache->map + cache->map_len;
+}
+
+/** 
+ * @brief Load the entries from the cache file.
+ *
+ * The file is mapped privately, so the entries can be updated in place
+ * without changing the file.
+ * 
+ * @param cache The cache.
+ * @return 0 if the file was loaded, -1 if not.
+ */
+static int load_cache( struct dns_cache *cache )
+{
+        struct dns_cache_hdr *hdr;
+        struct dns_entry *entries;
+        struct stat st;
+        unsigned int i;
+        int fd;
+
+        fd = open( cache->filename, O_RDONLY );
+        if ( fd == -1 ) {
+                DBG( "Unable to open %s: %s\n", cache->filename, strerror( errno ));
+                return -1;
+        }
+        if ( fstat( fd, &st ) != 0 || st.st_size < (off_t)sizeof( *hdr )) {
+                close( fd );
+                return -1;
+        }
+        cache->map = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+        close( fd );
+        if ( cache->map == MAP_FAILED ) {
+                WARN( "Unable to map %s: %s\n", cache->filename, strerror( errno ));
+                cache->map = NULL;
+                return -1;
+        }
+        cache->map_len = st.st_size;
+
+        hdr = cache->map;
+        if ( memcmp( hdr->magic, DNSCACHE_MAGIC, sizeof( hdr->magic )) != 0 ||
+                        hdr->version != DNSCACHE_VERSION || 
+                        hdr->entry_size != sizeof( struct dns_entry ) ||
+                        sizeof( *hdr ) + (size_t)hdr->nr_entries * sizeof( struct dns_entry ) 
+                        > cache->map_len ) {
+                WARN( "%s is not a valid cache file\n", cache->filename );
+                munmap( cache->map, cache->map_len );
+                cache->map = NULL;
+                return -1;
+        }
+
+        entries = (struct dns_entry *)( hdr + 1 );
+        if ( hdr->nr_entries > 0 )
+                cache->nodes = mem_alloc( hdr->nr_entries * sizeof( *cache->nodes ));
+        for ( i = 0; i < hdr->nr_entries; i++ ) {
+                entries[i].flags = 0;
+                entries[i].name[ADDRSTR_BUFLEN - 1] = '\0';
+                if ( find_entry( cache, entries[i].family, entries[i].addr ) != NULL ) 
+                        continue;
+                index_put( cache, &cache->nodes[cache->index.count], &entries[i] );
+        }
+        cache->loaded = cache->index.count;
+        DBG( "Loaded %u entries from %s\n", cache->loaded, cache->filename );
+
+        return 0;
+}
+
+/** 
+ * @brief Initialize the cache.
+ *
+ * The entries are loaded from the file if it exists.
+ * 
+ * @ingroup dnscache
+ * @param filename The file for the cache.
+ * 
+ * @return Pointer to the new cache.
+ */
+struct dns_cache *dns_cache_init( const char *filename )
+{
+        struct dns_cache *cache;
+        long start = connection_now_usecs();
+
+        cache = mem_zalloc( sizeof( *cache ));
+        cache->filename = mem_alloc( strlen( filename ) + 1 );
+        strcpy( cache->filename, filename );
+        cache->saved = time( NULL );
+        hash_index_init( &cache->index, DNSCACHE_INDEX_INIT_SIZE );
+
+        load_cache( cache );
+        cache->load_usecs = connection_now_usecs() - start;
+
+        return cache;
+}
+
+/** 
+ * @brief Save the cache and free it.
+ * 
+ * @ingroup dnscache
+ * @param cache The cache.
+ */
+void dns_cache_deinit( struct dns_cache *cache )
+{
+        struct hash_link *link, *next;
+        struct dns_node *node;
+        unsigned int i;
+
+        if ( cache->dirty )
+                dns_cache_save( cache );
+
+        /* Nodes for the entries not on the mapping are allocated one by one */
+        for ( i = 0; i < cache->index.size; i++ ) {
+                for ( link = cache->index.chains[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        node = HASH_ENTRY( link, struct dns_node, link );
+                        if ( entry_is_allocated( cache, node->entry )) {
+                                mem_free( node->entry );
+                                mem_free( node );
+                        }
+                }
+        }
+        if ( cache->map != NULL )
+                munmap( cache->map, cache->map_len );
+        if ( cache->nodes != NULL )
+                mem_free( cache->nodes );
+        hash_index_deinit( &cache->index );
+        mem_free( cache->filename );
+        mem_free( cache );
+}
+
+/** 
+ * @brief Write the cache to the file.
+ *
+ * The cache is written to temporary file which is then renamed over the old
+ * file, hence the mapping of the old file stays valid. Entries which have
+ * been expired for long are dropped.
+ * 
+ * @ingroup dnscache
+ * @param cache The cache.
+ * 
+ * @return 0 on success, -1 on error.
+ */
+int dns_cache_save( struct dns_cache *cache )
+{
+        struct dns_cache_hdr hdr;
+        struct dns_entry entry;
+        struct hash_link *link;
+        struct dns_node *node;
+        char *tmpname;
+        time_t now = time( NULL );
+        unsigned int i;
+        FILE *fp;
+        int rv = 0;
+
+        tmpname = mem_alloc( strlen( cache->filename ) + 5 );
+        sprintf( tmpname, "%s.tmp", cache->filename );
+        fp = fopen( tmpname, "w" );
+        if ( fp == NULL ) {
+                WARN( "Unable to open %s: %s\n", tmpname, strerror( errno ));
+                mem_free( tmpname );
+                return -1;
+        }
+
+        memset( &hdr, 0, sizeof( hdr ));
+        memcpy( hdr.magic, DNSCACHE_MAGIC, sizeof( hdr.magic ));
+        hdr.version = DNSCACHE_VERSION;
+        hdr.entry_size = sizeof( struct dns_entry );
+        /* Number of entries is fixed after the entries are written */
+        if ( fwrite( &hdr, sizeof( hdr ), 1, fp ) != 1 ) 
+                rv = -1;
+
+        for ( i = 0; i < cache->index.size && rv == 0; i++ ) {
+                for ( link = cache->index.chains[i]; link != NULL && rv == 0; 
+                                link = link->next ) {
+                        node = HASH_ENTRY( link, struct dns_node, link );
+                        if ( node->entry->expires + DNSCACHE_MAX_STALE_AGE < now )
+                                continue;
+                        entry = *node->entry;
+                        entry.flags = 0;
+                        if ( fwrite( &entry, sizeof( entry ), 1, fp ) != 1 ) 
+                                rv = -1;
+                        hdr.nr_entries++;
+                }
+        }
+        if ( rv == 0 && ( fseek( fp, 0, SEEK_SET ) != 0 || 
+                                fwrite( &hdr, sizeof( hdr ), 1, fp ) != 1 ))
+                rv = -1;
+        if ( fclose( fp ) != 0 ) 
+                rv = -1;
+
+        if ( rv == 0 && rename( tmpname, cache->filename ) != 0 ) 
+                rv = -1;
+        if ( rv != 0 ) {
+                WARN( "Unable to write cache to %s: %s\n", cache->filename, 
+                                strerror( errno ));
+                unlink( tmpname );
+        } else {
+                DBG( "Saved %u entries to %s\n", hdr.nr_entries, cache->filename );
+                cache->dirty = 0;
+        }
+        cache->saved = now;
+        mem_free( tmpname );
+
+        return rv;
+}
+
+/** 
+ * @brief Resolve the name with gethostbyaddr() and update the entry.
+ */
+static void resolve_entry( struct dns_cache *cache, struct dns_entry *entry, 
+                const void *addr, int len )
+{
+        struct hostent *hent_p;
+        long start = connection_now_usecs();
+
+        hent_p = gethostbyaddr( addr, len, entry->family );
+        if ( hent_p == NULL ) {
+                entry->name[0] = '\0';
+                entry->expires = time( NULL ) + DNSCACHE_NEGATIVE_TTL;
+        } else {
+                strncpy( entry->name, hent_p->h_name, ADDRSTR_BUFLEN - 1 );
+                entry->name[ADDRSTR_BUFLEN - 1] = '\0';
+                entry->expires = time( NULL ) + DNSCACHE_TTL;
+        }
+        cache->dirty = 1;
+        cache->resolve_usecs += connection_now_usecs() - start;
+}
+
+/**
+ * @brief Copy the address to key used on index.
+ */
+static void make_key( const void *addr, int len, uint8_t *key )
+{
+        memset( key, 0, 16 );
+        memcpy( key, addr, len > 16 ? 16 : len );
+}
+
+/** 
+ * @brief Look up the name for address from cache.
+ *
+ * If the entry has expired, the old name is returned and the entry is queued
+ * for revalidation.
+ * 
+ * @ingroup dnscache
+ * @param cache The cache.
+ * @param family Address family (AF_INET or AF_INET6).
+ * @param addr The address (struct in_addr or struct in6_addr).
+ * @param len Length of the address.
+ * @param name Buffer for the name, set to empty string if the address has no
+ * name. Not touched if the address is not found.
+ * @param namelen Size of the buffer.
+ *
+ * @return DNSCACHE_MISS if the address is not on cache, DNSCACHE_HIT or
+ * DNSCACHE_STALE if the name was found.
+ */
+enum dns_cache_result dns_cache_lookup( struct dns_cache *cache, int family, 
+                const void *addr, int len, char *name, size_t namelen )
+{
+        uint8_t key[16];
+        struct dns_entry *entry;
+        enum dns_cache_result rv = DNSCACHE_HIT;
+
+        make_key( addr, len, key );
+        entry = find_entry( cache, family, key );
+        if ( entry == NULL ) {
+                cache->misses++;
+                return DNSCACHE_MISS;
+        } 
+        if ( entry->expires < time( NULL )) {
+                cache->stale++;
+                rv = DNSCACHE_STALE;
+                if ( !( entry->flags & DNSCACHE_F_QUEUED ) && 
+                                cache->queued < DNSCACHE_REVALIDATE_QUEUE ) {
+                        entry->flags |= DNSCACHE_F_QUEUED;
+                        cache->queue[cache->queued++] = entry;
+                }
+        } else {
+                cache->hits++;
+        }
+
+        strncpy( name, entry->name, namelen - 1 );
+        name[namelen - 1] = '\0';
+        return rv;
+}
+
+/** 
+ * @brief Resolve the name for address and add it to the cache.
+ * 
+ * @ingroup dnscache
+ * @param cache The cache.
+ * @param family Address family (AF_INET or AF_INET6).
+ * @param addr The address (struct in_addr or struct in6_addr).
+ * @param len Length of the address.
+ * @param name Buffer for the name, set to empty string if the address has no
+ * name.
+ * @param namelen Size of the buffer.
+ */
+void dns_cache_resolve( struct dns_cache *cache, int family, const void *addr,
+                int len, char *name, size_t namelen )
+{
+        uint8_t key[16];
+        struct dns_entry *entry;
+
+        make_key( addr, len, key );
+        entry = find_entry( cache, family, key );
+        if ( entry == NULL ) {
+                entry = mem_zalloc( sizeof( *entry ));
+                entry->family = family;
+                memcpy( entry->addr, key, sizeof( key ));
+                index_put( cache, mem_alloc( sizeof( struct dns_node )), entry );
+        }
+        resolve_entry( cache, entry, addr, len );
+
+        strncpy( name, entry->name, namelen - 1 );
+        name[namelen - 1] = '\0';
+}
+
+/** 
+ * @brief Do the periodic work for the cache.
+ *
+ * Some of the queued stale entries are revalidated, and the cache is saved
+ * if it has changed and has not been saved for a while. Should be called
+ * once every round.
+ * 
+ * @ingroup dnscache
+ * @param cache The cache.
+ */
+void dns_cache_tick( struct dns_cache *cache )
+{
+        struct dns_entry *entry;
+        int i, len;
+
+        for ( i = 0; i < DNSCACHE_REVALIDATE_PER_ROUND && cache->queued > 0; i++ ) {
+                entry = cache->queue[--cache->queued];
+                entry->flags &= ~DNSCACHE_F_QUEUED;
+                len = entry->family == AF_INET6 ? 16 : 4;
+                DBG( "Revalidating %s\n", entry->name );
+                resolve_entry( cache, entry, entry->addr, len );
+        }
+
+        if ( cache->dirty && time( NULL ) - cache->saved >= DNSCACHE_SAVE_INTERVAL )
+                dns_cache_save( cache );
+}
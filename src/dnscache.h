@@ -0,0 +1,157 @@
+/**
+ * @file dnscache.h
+ * @brief Persistent cache for the reverse DNS names.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _DNSCACHE_H_
+#define _DNSCACHE_H_
+
+#include "hash.h"
+
+/**
+ * Magic identifying the cache file.
+ */
+#define DNSCACHE_MAGIC "TCPSDNS1"
+/**
+ * Version of the cache file format.
+ */
+#define DNSCACHE_VERSION 1
+/**
+ * Number of seconds a resolved name is valid.
+ */
+#define DNSCACHE_TTL 3600
+/**
+ * Number of seconds a failed lookup is valid.
+ */
+#define DNSCACHE_NEGATIVE_TTL 600
+/**
+ * Entries expired longer than this (seconds) are not saved.
+ */
+#define DNSCACHE_MAX_STALE_AGE ( 7 * 24 * 3600 )
+/**
+ * Minimum number of seconds between writing the cache to disk.
+ */
+#define DNSCACHE_SAVE_INTERVAL 300
+/**
+ * Maximum number of stale entries revalidated per update round.
+ */
+#define DNSCACHE_REVALIDATE_PER_ROUND 4
+/**
+ * Maximum number of stale entries waiting for revalidation.
+ */
+#define DNSCACHE_REVALIDATE_QUEUE 256
+
+/**
+ * Flag for entry waiting on revalidation queue (not saved).
+ */
+#define DNSCACHE_F_QUEUED 0x01
+
+/**
+ * Result of looking up address from cache.
+ */
+enum dns_cache_result {
+        DNSCACHE_MISS, /**< Address not on cache */
+        DNSCACHE_HIT, /**< Valid entry found */
+        DNSCACHE_STALE /**< Expired entry found */
+};
+
+/**
+ * Header of the cache file. All values are in host byte order, the cache
+ * is not meant to be moved between hosts.
+ * @ingroup dnscache
+ */
+struct dns_cache_hdr {
+        char magic[8]; /**< DNSCACHE_MAGIC */
+        uint32_t version; /**< DNSCACHE_VERSION */
+        uint32_t entry_size; /**< Size of struct dns_entry */
+        uint32_t nr_entries; /**< Number of entries following the header */
+        uint32_t pad;
+};
+
+/**
+ * One cached name, the same layout is used on file and memory.
+ * @ingroup dnscache
+ */
+struct dns_entry {
+        int64_t expires; /**< Time the entry expires */
+        uint8_t addr[16]; /**< The address, IPv4 address on first 4 bytes */
+        uint8_t family; /**< Address family */
+        uint8_t flags; /**< DNSCACHE_F_* */
+        uint8_t pad[6];
+        char name[ADDRSTR_BUFLEN]; /**< The name, empty if lookup failed */
+};
+
+/**
+ * Entry on the index of the cache. The entries on the mapping are not
+ * touched when the index is built, the nodes for them are allocated as one
+ * array.
+ * @ingroup dnscache
+ */
+struct dns_node {
+        struct hash_link link; /**< Link on the index, hashed by the address */
+        struct dns_entry *entry; /**< The entry */
+};
+
+/**
+ * The cache. The entries loaded from file are used directly from the
+ * (private) mapping of the file, new entries are allocated separately.
+ * @ingroup dnscache
+ */
+struct dns_cache {
+        char *filename; /**< File the cache is saved to */
+        void *map; /**< Mapping of the file loaded, NULL if none */
+        size_t map_len; /**< Length of the mapping */
+        struct dns_node *nodes; /**< Nodes for the entries on the mapping */
+        struct hash_index index; /**< Index of the entries */
+        struct dns_entry *queue[DNSCACHE_REVALIDATE_QUEUE]; /**< Stale entries to revalidate */
+        int queued; /**< Number of entries on queue */
+        int dirty; /**< Non-zero if there are changes not saved */
+        time_t saved; /**< Time the cache was last saved (or loaded) */
+
+        unsigned int loaded; /**< Number of entries loaded from file */
+        long load_usecs; /**< Time spent on loading the file */
+        unsigned long hits; /**< Lookups with valid entry */
+        unsigned long stale; /**< Lookups with expired entry */
+        unsigned long misses; /**< Lookups not found from cache */
+        long resolve_usecs; /**< Time spent on resolving names */
+};
+
+struct dns_cache *dns_cache_init( const char *filename );
+void dns_cache_deinit( struct dns_cache *cache );
+int dns_cache_save( struct dns_cache *cache );
+enum dns_cache_result dns_cache_lookup( struct dns_cache *cache, int family, 
+                const void *addr, int len, char *name, size_t namelen );
+void dns_cache_resolve( struct dns_cache *cache, int family, const void *addr,
+                int len, char *name, size_t namelen );
+void dns_cache_tick( struct dns_cache *cache );
+
+#endif /* _DNSCACHE_H_ */
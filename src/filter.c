@@ -49,6 +49,9 @@
 #include "defs.h"
 #include "debug.h"
 #include "connection.h"
+#include "hash.h"
+#include "cloud.h"
+#include "filtexpr.h"
 //#include "filter.h"
 
 
@@ -66,6 +69,7 @@
  *  - Source or destination address
  *  - Source or destination port
  *  - State of the connection
+ *  - Filter expression combining the above (see filtexpr.h)
  *
  * The filter has a <i>policy</i> which defines what criterias are active in
  * the filter. The policy is set with the POLICY flags. Flags can be combined
@@ -118,6 +122,8 @@ void filter_deinit( struct filter *filt, int deinit_group )
 {
         if ( deinit_group && filt->group != NULL )
                 group_deinit( filt->group, 1 );
+        if ( filt->expr != NULL )
+                fexpr_deinit( filt->expr );
 
         mem_free( filt );
 }
@@ -151,8 +157,10 @@ struct filter *filter_from_connection( struct tcp_connection *conn_p,
         }
         if ( selector_flags & POLICY_AF ) 
                 filt->af = conn_p->family; 
-        if ( selector_flags & POLICY_CLOUD ) 
-                filt->cloud_stamp = time(NULL);
+        if ( selector_flags & POLICY_CLOUD ) {
+                filt->cloud_stamp = conn_p->metadata.added;
+                filt->cloud_window = CLOUD_DEFAULT_WINDOW;
+        }
         if ( selector_flags & POLICY_IF ) 
           filt->ifname = conn_p->metadata.ifname;
 
@@ -160,6 +168,34 @@ struct filter *filter_from_connection( struct tcp_connection *conn_p,
         return filt;
 }
 
+/**
+ * @brief Create new filter matching connections with filter expression.
+ *
+ * The expression is compiled once, the group for the filter is also
+ * initialized.
+ *
+ * @ingroup filter_api
+ * @param spec The filter expression (see filtexpr.c for the syntax).
+ * @param act The action for the filter.
+ * @param errbuf Buffer for the error message if the expression is invalid.
+ * @param errlen Size of @a errbuf.
+ * @return New filter, NULL if the expression is invalid.
+ */
+struct filter *filter_from_expr( const char *spec, enum filter_action act,
+                char *errbuf, size_t errlen )
+{
+        struct filter *filt;
+        struct fexpr *expr;
+
+        expr = fexpr_compile( spec, errbuf, errlen );
+        if ( expr == NULL ) 
+                return NULL;
+
+        filt = filter_init( POLICY_EXPR, act, 1 );
+        filt->expr = expr;
+        return filt;
+}
+
 /** 
  * @brief Match sockaddr structures according to policy.
  *
@@ -215,8 +251,6 @@ static int match_saddr( struct sockaddr_storage *filt_addr,
         return rv;
 }
 
-#define CLOUD_TIME_LIMIT 2
-
 /**
  * Match the gonnection against the filter. The seletor flags in the filter are
  * used to determine which selectors are matched.
@@ -236,6 +270,14 @@ int filter_match( struct filter *filt, struct tcp_connection *conn_p )
 
         filt->evals++;
 
+        if ( filt->policy & POLICY_EXPR ) {
+                rv = fexpr_eval( filt->expr, conn_p );
+                if ( rv == 0 ) {
+                        TRACE("Expression didn't match\n");
+                        return rv;
+                }
+        }
+
         if ( filt->policy & POLICY_AF ) {
                 if ( conn_p->laddr.ss_family != filt->af ||
                      conn_p->raddr.ss_family != filt->af ) {
@@ -260,8 +302,9 @@ int filter_match( struct filter *filt, struct tcp_connection *conn_p )
 
         if ( filt->policy & POLICY_CLOUD ) {
                 TRACE("Cloud stamps, filter: %ld, conn %ld \n", filt->cloud_stamp, conn_p->metadata.added );
-                if ( conn_p->metadata.added - filt->cloud_stamp< CLOUD_TIME_LIMIT ) {
-                        TRACE("Difference %ld \n",filt->cloud_stamp - conn_p->metadata.added);
+                time_t diff = conn_p->metadata.added - filt->cloud_stamp;
+                if ( diff < filt->cloud_window && diff > -filt->cloud_window ) {
+                        TRACE("Difference %ld \n", diff );
                         TRACE("Cloud timestamp in the limit\n");
                         rv = 1;
                 } else {
@@ -296,6 +339,58 @@ int filter_match( struct filter *filt, struct tcp_connection *conn_p )
         return rv;
 }
 
+/**
+ * @brief Add the parts of the address selected by policy to the hash.
+ */
+static uint32_t hash_addr( uint32_t h, struct sockaddr_storage *ss,
+                policy_flags_t policy )
+{
+        in_port_t port;
+
+        if ( policy & POLICY_ADDR ) {
+                if ( ss->ss_family == AF_INET6 ) 
+                        h = hash_fnv( h, ss_get_addr6( ss ), 16 );
+                else 
+                        h = hash_fnv( h, ss_get_addr( ss ), 4 );
+        }
+        if ( policy & POLICY_PORT ) {
+                port = ss_get_port( ss );
+                h = hash_fnv( h, &port, sizeof( port ));
+        }
+        return h;
+}
+
+/**
+ * @brief Calculate hash of the selectors of connection for given policy.
+ *
+ * Connections that would match the same filter created with
+ * filter_from_connection() have the same hash. Cloud stamps are not hashed,
+ * for POLICY_CLOUD only the addresses are.
+ *
+ * @ingroup filter_api
+ *
+ * @param policy The selectors to hash.
+ * @param conn_p The connection.
+ * @return The hash value.
+ */
+uint32_t filter_policy_hash( policy_flags_t policy, struct tcp_connection *conn_p )
+{
+        uint32_t h = HASH_FNV_INIT;
+
+        if ( policy & ( POLICY_REMOTE | POLICY_CLOUD )) 
+                h = hash_addr( h, &conn_p->raddr, policy );
+        if ( policy & POLICY_LOCAL ) 
+                h = hash_addr( h, &conn_p->laddr, policy );
+        if ( policy & POLICY_STATE ) 
+                h = hash_fnv( h, &conn_p->state, sizeof( conn_p->state ));
+        if ( policy & POLICY_AF ) 
+                h = hash_fnv( h, &conn_p->family, sizeof( conn_p->family ));
+        if ( ( policy & POLICY_IF ) && conn_p->metadata.ifname != NULL ) 
+                h = hash_fnv( h, conn_p->metadata.ifname, 
+                                strlen( conn_p->metadata.ifname ));
+        return h;
+}
+
 /**
  * Check if the filter has the given policy flags set on.
  * Note that this check may return 1 if there are also other flags than the
@@ -354,6 +449,7 @@ struct filter_list *filtlist_init( enum filtlist_policy policy )
         rv = mem_alloc( sizeof( struct filter_list ));
         rv->policy = policy;
         rv->first = NULL;
+        rv->fields = 0;
         return rv;
 }
 
@@ -393,6 +489,9 @@ void filtlist_add( struct filter_list *list, struct filter *filt,
 {
         struct filter *iter;
 
+        list->fields |= filt->policy;
+        if ( filt->expr != NULL )
+                list->fields |= filt->expr->fields;
         if ( pol == ADD_FIRST ) {
                 filt->next = list->first;
                 list->first = filt;
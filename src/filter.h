@@ -87,6 +87,19 @@
  */
 #define POLICY_IF (0x01 << 8 )
 
+/**
+ * Flag for indicating that groups are formed with the composite key given
+ * by user (see groupkey.h), no real selector flag.
+ */
+#define POLICY_KEY (0x01 << 9 )
+
+/**
+ * Flag for indicating that filter matches with compiled filter expression
+ * (see filtexpr.h).
+ * @ingroup filter_api
+ */
+#define POLICY_EXPR (0x01 << 10 )
+
 
 typedef uint16_t policy_flags_t;
 
@@ -138,6 +151,8 @@ struct filter {
 
         const char *ifname; /**< Name of the interface to filter with */
 
+        struct fexpr *expr; /**< Compiled expression for POLICY_EXPR */
+
         /* misc metadata */
 
         /**
@@ -161,6 +176,10 @@ struct filter {
          * Timestamp for generating clouds
          */
         time_t cloud_stamp;
+        /**
+         * Maximum difference (secs) from cloud_stamp for connections to match
+         */
+        int cloud_window;
 };
 
 /**
@@ -182,6 +201,11 @@ enum filtlist_add_policy {
 struct filter_list {
         enum filtlist_policy policy; /**< Match policy for the list */
         struct filter *first; /**< Pointer to the first element */
+        /**
+         * Selectors used by the filters on list, POLICY_IF if the interface
+         * of the connection has to be known before matching.
+         */
+        policy_flags_t fields;
 };
 
 
@@ -191,8 +215,11 @@ void filter_deinit( struct filter *filt, int deinit_group );
 
 struct filter *filter_from_connection( struct tcp_connection *conn_p,
                 policy_flags_t selector_flags, enum filter_action act );
+struct filter *filter_from_expr( const char *spec, enum filter_action act,
+                char *errbuf, size_t errlen );
 int filter_match( struct filter *filt, struct tcp_connection *conn_p );
 int filter_has_policy( struct filter *filt, policy_flags_t flags );
+uint32_t filter_policy_hash( policy_flags_t policy, struct tcp_connection *conn_p );
 int filter_get_connection_count( struct filter *filt );
 int filter_set_raddr( struct filter *filt, struct sockaddr_storage *addr );
 int filter_set_rport( struct filter *filt, in_port_t port, int family );
@@ -0,0 +1,1233 @@
+/**
+ * @file filtexpr.c
+ * @brief Filter expressions compiled to bytecode.
+ *
+ * Filter expression selects connections with pcap-like syntax, for example
+ * "rport in {443,8443} and state established and not raddr 10.0.0.0/8 and if
+ * eth1". The expression is parsed once to a tree, the tree is folded
+ * (negations are pushed down to the tests, tests of the same kind are merged
+ * and constants are removed) and compiled to a flat array of instructions.
+ * Evaluating the instructions for a connection does not allocate memory.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_FILTER
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "filtexpr.h"
+
+/**
+ * @defgroup fexpr Filter expressions
+ *
+ * The grammar of the expressions:
+ * @verbatim
+   expr   := term { ( "or" | "||" ) term }
+   term   := factor { ( "and" | "&&" ) factor }
+   factor := ( "not" | "!" ) factor | "(" expr ")" | "true" | "false" | test
+   test   := ( "lport" | "rport" | "port" ) <ports>
+           | ( "laddr" | "raddr" | "addr" ) <addresses>
+           | "state" <states>
+           | "if" <interface name>
+           | "af" ( "inet" | "inet6" )
+   @endverbatim
+ * Ports, addresses and states can be given either as single value or as set
+ * "in { value, value, ... }". Port is a number, range of numbers ("1024-2048")
+ * or a service name. Address is numeric IPv4 or IPv6 address with optional
+ * prefix length ("10.0.0.0/8"). States are named as on the main view, in
+ * lower case ("established", "time_wait"). Tests "port" and "addr" match
+ * either the local or the remote end.
+ */
+
+/**
+ * Maximum nesting of parenthesis and negations on expression.
+ */
+#define FEXPR_MAX_DEPTH 64
+
+/**
+ * Mask with bits for all the TCP states set.
+ */
+#define STATE_MASK_ALL (( 1u << ( TCP_CLOSING + 1 )) - 1 )
+
+/**
+ * Names of the states for the expressions.
+ */
+static const struct {
+        const char *name;
+        enum tcp_state state;
+} fexpr_states[] = {
+        { "established", TCP_ESTABLISHED },
+        { "syn_sent", TCP_SYN_SENT },
+        { "syn_recv", TCP_SYN_RECV },
+        { "fin_wait1", TCP_FIN_WAIT1 },
+        { "fin_wait2", TCP_FIN_WAIT2 },
+        { "time_wait", TCP_TIME_WAIT },
+        { "close", TCP_CLOSE },
+        { "close_wait", TCP_CLOSE_WAIT },
+        { "last_ack", TCP_LAST_ACK },
+        { "listen", TCP_LISTEN },
+        { "closing", TCP_CLOSING },
+        { NULL, TCP_DEAD }
+};
+
+/**
+ * Types of the nodes on expression tree.
+ */
+enum fnode_type {
+        FN_CONST, /**< Constant true or false */
+        FN_AND, /**< All children have to match */
+        FN_OR, /**< One of the children has to match */
+        FN_NOT, /**< The child must not match */
+        FN_PORTS, /**< Port on the set of ranges */
+        FN_ADDR, /**< Address on prefix */
+        FN_STATE, /**< State on the mask */
+        FN_AF, /**< Address family */
+        FN_IF /**< Interface */
+};
+
+/**
+ * Which end of the connection the test is for.
+ */
+enum fnode_side {
+        SIDE_LOCAL,
+        SIDE_REMOTE
+};
+
+/**
+ * Node on the expression tree.
+ */
+struct fnode {
+        enum fnode_type type; /**< Type of the node */
+        struct fnode *next; /**< Next child of the parent */
+        struct fnode *kids; /**< Children for FN_AND, FN_OR and FN_NOT */
+        int neg; /**< Invert the result of the test */
+        enum fnode_side side; /**< End of connection for ports and address */
+        uint32_t val; /**< Constant value, state mask or address family */
+        int nr_ranges; /**< Number of port ranges */
+        struct fexpr_range *ranges; /**< Sorted, non overlapping port ranges */
+        struct fexpr_prefix prefix; /**< Address prefix */
+        char *name; /**< Interface name */
+        int patch; /**< Index of the jump following this child on code */
+};
+
+/**
+ * State for parsing the expression.
+ */
+struct fexpr_parser {
+        const char *spec; /**< The expression */
+        const char *pos; /**< Position after the current token */
+        const char *tok_start; /**< Start of the current token */
+        char tok[FEXPR_MAX_TOKEN]; /**< Current token, empty on end */
+        int depth; /**< Current nesting depth */
+        int failed; /**< Set when error has been found */
+        char *errbuf; /**< Buffer for the error message */
+        size_t errlen; /**< Size of the error buffer */
+};
+
+/**
+ * Sizes for the compiled code.
+ */
+struct fexpr_counts {
+        int code; /**< Number of instructions */
+        int ranges; /**< Number of port ranges */
+        int prefixes; /**< Number of address prefixes */
+        int names; /**< Number of interface names */
+        policy_flags_t fields; /**< Fields looked at */
+};
+
+static struct fnode *parse_or( struct fexpr_parser *p );
+
+static struct fnode *node_init( enum fnode_type type )
+{
+        struct fnode *n;
+
+        n = mem_zalloc( sizeof( *n ));
+        n->type = type;
+        return n;
+}
+
+/**
+ * @brief Free the node and all its children.
+ */
+static void node_deinit( struct fnode *n )
+{
+        struct fnode *kid, *tmp;
+
+        kid = n->kids;
+        while ( kid != NULL ) {
+                tmp = kid->next;
+                node_deinit( kid );
+                kid = tmp;
+        }
+        if ( n->ranges != NULL )
+                mem_free( n->ranges );
+        if ( n->name != NULL )
+                mem_free( n->name );
+        mem_free( n );
+}
+
+/**
+ * @brief Replace the node with constant.
+ */
+static struct fnode *node_const( struct fnode *n, int val )
+{
+        if ( n != NULL )
+                node_deinit( n );
+        n = node_init( FN_CONST );
+        n->val = val;
+        return n;
+}
+
+/*
+ * Port ranges
+ */
+
+static int range_cmp( const void *a, const void *b )
+{
+        const struct fexpr_range *r1 = a, *r2 = b;
+
+        return (int)r1->lo - (int)r2->lo;
+}
+
+/**
+ * @brief Sort the ranges and merge the overlapping and adjacent ones.
+ */
+static void ranges_normalize( struct fnode *n )
+{
+        int i, cnt = 0;
+
+        if ( n->nr_ranges == 0 )
+                return;
+        qsort( n->ranges, n->nr_ranges, sizeof( n->ranges[0] ), range_cmp );
+        for ( i = 1; i < n->nr_ranges; i++ ) {
+                if ( (int)n->ranges[i].lo <= (int)n->ranges[cnt].hi + 1 ) {
+                        if ( n->ranges[i].hi > n->ranges[cnt].hi )
+                                n->ranges[cnt].hi = n->ranges[i].hi;
+                } else {
+                        n->ranges[++cnt] = n->ranges[i];
+                }
+        }
+        n->nr_ranges = cnt + 1;
+}
+
+static void ranges_add( struct fnode *n, uint16_t lo, uint16_t hi )
+{
+        n->ranges = mem_realloc( n->ranges, 
+                        ( n->nr_ranges + 1 ) * sizeof( n->ranges[0] ));
+        n->ranges[n->nr_ranges].lo = lo;
+        n->ranges[n->nr_ranges].hi = hi;
+        n->nr_ranges++;
+}
+
+/**
+ * @brief Make the ranges on @a n the ports not on them.
+ */
+static void ranges_complement( struct fnode *n )
+{
+        struct fexpr_range *old = n->ranges;
+        int i, nr = n->nr_ranges;
+        int next = 0;
+
+        n->ranges = NULL;
+        n->nr_ranges = 0;
+        for ( i = 0; i < nr; i++ ) {
+                if ( old[i].lo > next )
+                        ranges_add( n, next, old[i].lo - 1 );
+                next = old[i].hi + 1;
+        }
+        if ( next <= 65535 )
+                ranges_add( n, next, 65535 );
+        if ( old != NULL )
+                mem_free( old );
+}
+
+/**
+ * @brief Set the ranges on @a n to the ports on both @a n and @a other.
+ */
+static void ranges_intersect( struct fnode *n, struct fnode *other )
+{
+        struct fexpr_range *old = n->ranges;
+        int i = 0, j = 0, nr = n->nr_ranges;
+        uint16_t lo, hi;
+
+        n->ranges = NULL;
+        n->nr_ranges = 0;
+        while ( i < nr && j < other->nr_ranges ) {
+                lo = old[i].lo > other->ranges[j].lo ? old[i].lo : other->ranges[j].lo;
+                hi = old[i].hi < other->ranges[j].hi ? old[i].hi : other->ranges[j].hi;
+                if ( lo <= hi )
+                        ranges_add( n, lo, hi );
+                if ( old[i].hi < other->ranges[j].hi )
+                        i++;
+                else
+                        j++;
+        }
+        if ( old != NULL )
+                mem_free( old );
+}
+
+/**
+ * @brief Add the ranges of @a other to @a n.
+ */
+static void ranges_union( struct fnode *n, struct fnode *other )
+{
+        int i;
+
+        for ( i = 0; i < other->nr_ranges; i++ )
+                ranges_add( n, other->ranges[i].lo, other->ranges[i].hi );
+        ranges_normalize( n );
+}
+
+/*
+ * Parser
+ */
+
+static int is_delim( char c )
+{
+        return c == '\0' || isspace( (unsigned char)c ) || strchr( "(){},!&|", c ) != NULL;
+}
+
+/** 
+ * @brief Set the parse error, only the first error is reported.
+ */
+static void parse_error( struct fexpr_parser *p, const char *what )
+{
+        if ( p->failed )
+                return;
+        p->failed = 1;
+        DBG( "Parse error: %s at %d\n", what, (int)( p->tok_start - p->spec ));
+        if ( p->errbuf == NULL || p->errlen == 0 )
+                return;
+        if ( p->tok[0] == '\0' )
+                snprintf( p->errbuf, p->errlen, "%s at end of expression", what );
+        else
+                snprintf( p->errbuf, p->errlen, "%s near \"%s\" (offset %d)", 
+                                what, p->tok, (int)( p->tok_start - p->spec ));
+}
+
+/**
+ * @brief Read the next token to p->tok.
+ */
+static void next_token( struct fexpr_parser *p )
+{
+        const char *s = p->pos;
+        size_t len;
+
+        while ( isspace( (unsigned char)*s ))
+                s++;
+        p->tok_start = s;
+        if ( *s == '\0' ) {
+                len = 0;
+        } else if (( s[0] == '&' && s[1] == '&' ) || ( s[0] == '|' && s[1] == '|' )) {
+                len = 2;
+        } else if ( strchr( "(){},!&|", *s ) != NULL ) {
+                len = 1;
+        } else {
+                len = 0;
+                while ( ! is_delim( s[len] ))
+                        len++;
+        }
+        p->pos = s + len;
+        if ( len >= sizeof( p->tok )) 
+                len = sizeof( p->tok ) - 1;
+        memcpy( p->tok, s, len );
+        p->tok[len] = '\0';
+        if ( (size_t)( p->pos - s ) > len ) 
+                parse_error( p, "Too long token" );
+}
+
+static int tok_is( struct fexpr_parser *p, const char *keyword )
+{
+        return strcasecmp( p->tok, keyword ) == 0;
+}
+
+/**
+ * @brief Skip the token if it is the given keyword.
+ * @return 1 if keyword was skipped, 0 if not.
+ */
+static int tok_skip( struct fexpr_parser *p, const char *keyword )
+{
+        if ( ! tok_is( p, keyword ))
+                return 0;
+        next_token( p );
+        return 1;
+}
+
+static int tok_expect( struct fexpr_parser *p, const char *keyword )
+{
+        if ( tok_skip( p, keyword ))
+                return 1;
+        if ( strcmp( keyword, "}" ) == 0 )
+                parse_error( p, "Expected \"}\"" );
+        else if ( strcmp( keyword, "{" ) == 0 )
+                parse_error( p, "Expected \"{\"" );
+        else
+                parse_error( p, "Expected \")\"" );
+        return 0;
+}
+
+/**
+ * @brief Check that the current token is value (not operator or end).
+ */
+static int is_value( struct fexpr_parser *p )
+{
+        return p->tok[0] != '\0' && ! is_delim( p->tok[0] );
+}
+
+/**
+ * @brief Parse one value or set of values "in { v, v }" with @a value.
+ * @return 0 on success, -1 on error.
+ */
+static int parse_list( struct fexpr_parser *p, struct fnode *n, 
+                int (*value)( struct fexpr_parser *p, struct fnode *n ))
+{
+        if ( ! tok_skip( p, "in" ))
+                return value( p, n );
+        if ( ! tok_expect( p, "{" ))
+                return -1;
+        do {
+                if ( value( p, n ) != 0 )
+                        return -1;
+        } while ( tok_skip( p, "," ));
+        return tok_expect( p, "}" ) ? 0 : -1;
+}
+
+static int parse_port_num( const char *str, uint16_t *port )
+{
+        char *end;
+        long val;
+
+        val = strtol( str, &end, 10 );
+        if ( end == str || val < 0 || val > 65535 )
+                return -1;
+        *port = (uint16_t)val;
+        return end - str;
+}
+
+/**
+ * @brief Parse port, port range or service name to ranges on @a n.
+ */
+static int port_value( struct fexpr_parser *p, struct fnode *n )
+{
+        struct servent *serv;
+        uint16_t lo, hi;
+        int len;
+
+        if ( ! is_value( p )) {
+                parse_error( p, "Expected port" );
+                return -1;
+        }
+        if ( isdigit( (unsigned char)p->tok[0] )) {
+                len = parse_port_num( p->tok, &lo );
+                hi = lo;
+                if ( len > 0 && p->tok[len] == '-' ) 
+                        len = len + 1 + parse_port_num( p->tok + len + 1, &hi );
+                if ( len <= 0 || p->tok[len] != '\0' || lo > hi ) {
+                        parse_error( p, "Invalid port" );
+                        return -1;
+                }
+        } else {
+                serv = getservbyname( p->tok, "tcp" );
+                if ( serv == NULL ) {
+                        parse_error( p, "Unknown service" );
+                        return -1;
+                }
+                lo = hi = ntohs( serv->s_port );
+        }
+        ranges_add( n, lo, hi );
+        next_token( p );
+        return 0;
+}
+
+/**
+ * @brief Parse address with optional prefix length, add test for it to the
+ * FN_OR node @a n.
+ */
+static int addr_value( struct fexpr_parser *p, struct fnode *n )
+{
+        struct fnode *kid;
+        char buf[FEXPR_MAX_TOKEN];
+        char *slash, *end;
+        long bits;
+        int maxbits;
+
+        if ( ! is_value( p )) {
+                parse_error( p, "Expected address" );
+                return -1;
+        }
+        strcpy( buf, p->tok );
+        slash = strchr( buf, '/' );
+        if ( slash != NULL )
+                *slash = '\0';
+
+        kid = node_init( FN_ADDR );
+        kid->side = n->side;
+        if ( inet_pton( AF_INET, buf, kid->prefix.addr ) == 1 ) {
+                kid->prefix.family = AF_INET;
+                maxbits = 32;
+        } else if ( inet_pton( AF_INET6, buf, kid->prefix.addr ) == 1 ) {
+                kid->prefix.family = AF_INET6;
+                maxbits = 128;
+        } else {
+                node_deinit( kid );
+                parse_error( p, "Invalid address" );
+                return -1;
+        }
+        bits = maxbits;
+        if ( slash != NULL ) {
+                bits = strtol( slash + 1, &end, 10 );
+                if ( end == slash + 1 || *end != '\0' || bits < 0 || bits > maxbits ) {
+                        node_deinit( kid );
+                        parse_error( p, "Invalid prefix length" );
+                        return -1;
+                }
+        }
+        kid->prefix.bits = bits;
+        kid->next = n->kids;
+        n->kids = kid;
+        next_token( p );
+        return 0;
+}
+
+static int state_value( struct fexpr_parser *p, struct fnode *n )
+{
+        int i;
+
+        for ( i = 0; fexpr_states[i].name != NULL; i++ ) {
+                if ( tok_is( p, fexpr_states[i].name )) {
+                        n->val |= 1u << fexpr_states[i].state;
+                        next_token( p );
+                        return 0;
+                }
+        }
+        parse_error( p, "Unknown state" );
+        return -1;
+}
+
+/**
+ * @brief Make node matching either end of the connection from test for local
+ * end.
+ */
+static struct fnode *either_side( struct fnode *local )
+{
+        struct fnode *n, *remote, *kid, **tail;
+
+        remote = node_init( local->type );
+        remote->side = SIDE_REMOTE;
+        if ( local->type == FN_PORTS ) {
+                ranges_union( remote, local );
+        } else {
+                /* FN_OR of addresses */
+                tail = &remote->kids;
+                for ( kid = local->kids; kid != NULL; kid = kid->next ) {
+                        *tail = node_init( FN_ADDR );
+                        (*tail)->side = SIDE_REMOTE;
+                        (*tail)->prefix = kid->prefix;
+                        tail = &(*tail)->next;
+                }
+        }
+        n = node_init( FN_OR );
+        n->kids = local;
+        local->next = remote;
+        return n;
+}
+
+static struct fnode *parse_test( struct fexpr_parser *p )
+{
+        struct fnode *n = NULL;
+        int either = 0;
+
+        if ( tok_is( p, "lport" ) || tok_is( p, "rport" ) || tok_is( p, "port" )) {
+                n = node_init( FN_PORTS );
+                n->side = tok_is( p, "rport" ) ? SIDE_REMOTE : SIDE_LOCAL;
+                either = tok_is( p, "port" );
+                next_token( p );
+                if ( parse_list( p, n, port_value ) != 0 ) 
+                        goto err;
+                ranges_normalize( n );
+        } else if ( tok_is( p, "laddr" ) || tok_is( p, "raddr" ) || tok_is( p, "addr" )) {
+                /* Set of addresses is "or" of the prefixes */
+                n = node_init( FN_OR );
+                n->side = tok_is( p, "raddr" ) ? SIDE_REMOTE : SIDE_LOCAL;
+                either = tok_is( p, "addr" );
+                next_token( p );
+                if ( parse_list( p, n, addr_value ) != 0 ) 
+                        goto err;
+        } else if ( tok_skip( p, "state" )) {
+                n = node_init( FN_STATE );
+                if ( parse_list( p, n, state_value ) != 0 ) 
+                        goto err;
+        } else if ( tok_skip( p, "if" )) {
+                if ( ! is_value( p )) {
+                        parse_error( p, "Expected interface name" );
+                        return NULL;
+                }
+                n = node_init( FN_IF );
+                n->name = mem_alloc( strlen( p->tok ) + 1 );
+                strcpy( n->name, p->tok );
+                next_token( p );
+        } else if ( tok_skip( p, "af" )) {
+                n = node_init( FN_AF );
+                if ( tok_is( p, "inet" ) || tok_is( p, "ipv4" )) {
+                        n->val = AF_INET;
+                } else if ( tok_is( p, "inet6" ) || tok_is( p, "ipv6" )) {
+                        n->val = AF_INET6;
+                } else {
+                        parse_error( p, "Expected \"inet\" or \"inet6\"" );
+                        goto err;
+                }
+                next_token( p );
+        } else {
+                parse_error( p, "Expected test" );
+                return NULL;
+        }
+        if ( either )
+                n = either_side( n );
+        return n;
+err:
+        node_deinit( n );
+        return NULL;
+}
+
+static struct fnode *parse_factor( struct fexpr_parser *p )
+{
+        struct fnode *n;
+
+        if ( p->failed )
+                return NULL;
+        if ( ++p->depth > FEXPR_MAX_DEPTH ) {
+                parse_error( p, "Expression nested too deep" );
+                return NULL;
+        }
+        if ( tok_skip( p, "not" ) || tok_skip( p, "!" )) {
+                n = parse_factor( p );
+                if ( n != NULL ) {
+                        struct fnode *not = node_init( FN_NOT );
+                        not->kids = n;
+                        n = not;
+                }
+        } else if ( tok_skip( p, "(" )) {
+                n = parse_or( p );
+                if ( n != NULL && ! tok_expect( p, ")" )) {
+                        node_deinit( n );
+                        n = NULL;
+                }
+        } else if ( tok_skip( p, "true" )) {
+                n = node_const( NULL, 1 );
+        } else if ( tok_skip( p, "false" )) {
+                n = node_const( NULL, 0 );
+        } else {
+                n = parse_test( p );
+        }
+        p->depth--;
+        return n;
+}
+
+/**
+ * @brief Parse list of @a sub separated by the operator.
+ */
+static struct fnode *parse_binary( struct fexpr_parser *p, enum fnode_type type,
+                const char *op, const char *sym,
+                struct fnode *(*sub)( struct fexpr_parser *p ))
+{
+        struct fnode *n, *first, *kid, *last;
+
+        first = sub( p );
+        if ( first == NULL )
+                return NULL;
+        if ( ! tok_is( p, op ) && ! tok_is( p, sym ))
+                return first;
+
+        n = node_init( type );
+        n->kids = first;
+        last = first;
+        while ( tok_skip( p, op ) || tok_skip( p, sym )) {
+                kid = sub( p );
+                if ( kid == NULL ) {
+                        node_deinit( n );
+                        return NULL;
+                }
+                last->next = kid;
+                last = kid;
+        }
+        return n;
+}
+
+static struct fnode *parse_and( struct fexpr_parser *p )
+{
+        return parse_binary( p, FN_AND, "and", "&&", parse_factor );
+}
+
+static struct fnode *parse_or( struct fexpr_parser *p )
+{
+        return parse_binary( p, FN_OR, "or", "||", parse_and );
+}
+
+/*
+ * Folding
+ */
+
+/**
+ * @brief Check if state or port test matches everything or nothing.
+ * @return 1 or 0 if the test is constant, -1 if not.
+ */
+static int leaf_const( struct fnode *n )
+{
+        if ( n->type == FN_STATE ) {
+                if ( n->val == 0 )
+                        return 0;
+                if ( n->val == STATE_MASK_ALL )
+                        return 1;
+        } else if ( n->type == FN_PORTS ) {
+                if ( n->nr_ranges == 0 )
+                        return 0;
+                if ( n->nr_ranges == 1 && n->ranges[0].lo == 0 && 
+                                n->ranges[0].hi == 65535 )
+                        return 1;
+        }
+        return -1;
+}
+
+/**
+ * @brief Fold the tree.
+ *
+ * Negations are pushed down to the tests, "and" and "or" nodes under node of
+ * the same type are flattened, port and state tests under the same node are
+ * merged and constants are removed. 
+ *
+ * @param n The tree to fold, the nodes not returned are freed.
+ * @param negate Non-zero if the result of the tree should be negated.
+ * @return The folded tree.
+ */
+static struct fnode *fold( struct fnode *n, int negate )
+{
+        struct fnode *kid, *next, *f, **tail;
+        struct fnode *states = NULL, *ports[2] = { NULL, NULL };
+        struct fnode *merge;
+        int absorb, cnt = 0;
+
+        switch ( n->type ) {
+                case FN_CONST :
+                        n->val ^= negate;
+                        return n;
+                case FN_NOT :
+                        kid = n->kids;
+                        n->kids = NULL;
+                        node_deinit( n );
+                        return fold( kid, ! negate );
+                case FN_STATE :
+                        if ( negate )
+                                n->val = STATE_MASK_ALL & ~n->val;
+                        break;
+                case FN_PORTS :
+                        if ( negate )
+                                ranges_complement( n );
+                        break;
+                case FN_ADDR :
+                case FN_AF :
+                case FN_IF :
+                        n->neg ^= negate;
+                        return n;
+                case FN_AND :
+                case FN_OR :
+                        if ( negate ) 
+                                n->type = n->type == FN_AND ? FN_OR : FN_AND;
+                        absorb = n->type == FN_OR;
+                        kid = n->kids;
+                        n->kids = NULL;
+                        tail = &n->kids;
+                        while ( kid != NULL ) {
+                                next = kid->next;
+                                kid->next = NULL;
+                                f = fold( kid, negate );
+                                if ( f->type == n->type ) {
+                                        /* flatten */
+                                        *tail = f->kids;
+                                        while ( *tail != NULL ) {
+                                                tail = &(*tail)->next;
+                                                cnt++;
+                                        }
+                                        f->kids = NULL;
+                                        node_deinit( f );
+                                } else {
+                                        *tail = f;
+                                        tail = &f->next;
+                                        cnt++;
+                                }
+                                kid = next;
+                        }
+
+                        /* Remove constants and merge ports and states */
+                        tail = &n->kids;
+                        while ( *tail != NULL ) {
+                                f = *tail;
+                                merge = NULL;
+                                if ( f->type == FN_CONST ) {
+                                        if ( (int)f->val == absorb ) 
+                                                return node_const( n, absorb );
+                                } else if ( f->type == FN_STATE ) {
+                                        if ( states == NULL ) 
+                                                states = f;
+                                        else 
+                                                merge = states;
+                                } else if ( f->type == FN_PORTS ) {
+                                        if ( ports[f->side] == NULL )
+                                                ports[f->side] = f;
+                                        else 
+                                                merge = ports[f->side];
+                                } else {
+                                        tail = &f->next;
+                                        continue;
+                                }
+                                if ( f->type != FN_CONST && merge == NULL ) {
+                                        tail = &f->next;
+                                        continue;
+                                }
+                                if ( merge != NULL ) {
+                                        if ( f->type == FN_STATE && absorb )
+                                                merge->val |= f->val;
+                                        else if ( f->type == FN_STATE )
+                                                merge->val &= f->val;
+                                        else if ( absorb )
+                                                ranges_union( merge, f );
+                                        else
+                                                ranges_intersect( merge, f );
+                                        /* merged tests can only become the
+                                         * absorbing constant */
+                                        if ( leaf_const( merge ) >= 0 )
+                                                return node_const( n, absorb );
+                                }
+                                *tail = f->next;
+                                f->next = NULL;
+                                node_deinit( f );
+                                cnt--;
+                        }
+                        if ( cnt == 0 ) 
+                                return node_const( n, ! absorb );
+                        if ( cnt == 1 ) {
+                                f = n->kids;
+                                n->kids = NULL;
+                                node_deinit( n );
+                                return f;
+                        }
+                        return n;
+        }
+        /* FN_STATE and FN_PORTS */
+        cnt = leaf_const( n );
+        if ( cnt >= 0 )
+                return node_const( n, cnt );
+        return n;
+}
+
+/*
+ * Compiler
+ */
+
+static void count_code( struct fnode *n, struct fexpr_counts *c )
+{
+        struct fnode *kid;
+        policy_flags_t side = n->side == SIDE_LOCAL ? POLICY_LOCAL : POLICY_REMOTE;
+
+        switch ( n->type ) {
+                case FN_AND :
+                case FN_OR :
+                        for ( kid = n->kids; kid != NULL; kid = kid->next ) {
+                                count_code( kid, c );
+                                if ( kid->next != NULL )
+                                        c->code++;
+                        }
+                        return;
+                case FN_PORTS :
+                        if ( n->nr_ranges > 1 )
+                                c->ranges += n->nr_ranges;
+                        c->fields |= side | POLICY_PORT;
+                        break;
+                case FN_ADDR :
+                        c->prefixes++;
+                        c->fields |= side | POLICY_ADDR;
+                        break;
+                case FN_STATE :
+                        c->fields |= POLICY_STATE;
+                        break;
+                case FN_AF :
+                        c->fields |= POLICY_AF;
+                        break;
+                case FN_IF :
+                        c->names++;
+                        c->fields |= POLICY_IF;
+                        break;
+                default :
+                        break;
+        }
+        c->code++;
+}
+
+static struct fexpr_insn *emit( struct fexpr *expr, enum fexpr_op op, int neg,
+                uint16_t a, uint32_t b )
+{
+        struct fexpr_insn *insn = &expr->code[expr->len++];
+
+        insn->op = op;
+        insn->neg = neg;
+        insn->a = a;
+        insn->b = b;
+        return insn;
+}
+
+static void compile( struct fexpr *expr, struct fnode *n )
+{
+        struct fnode *kid;
+        int local = n->side == SIDE_LOCAL;
+
+        switch ( n->type ) {
+                case FN_AND :
+                case FN_OR :
+                        for ( kid = n->kids; kid != NULL; kid = kid->next ) {
+                                compile( expr, kid );
+                                if ( kid->next != NULL ) {
+                                        kid->patch = expr->len;
+                                        emit( expr, n->type == FN_AND ? FOP_JF : FOP_JT, 
+                                                        0, 0, 0 );
+                                }
+                        }
+                        for ( kid = n->kids; kid->next != NULL; kid = kid->next ) 
+                                expr->code[kid->patch].a = expr->len - kid->patch - 1;
+                        break;
+                case FN_CONST :
+                        emit( expr, FOP_CONST, 0, 0, n->val );
+                        break;
+                case FN_PORTS :
+                        if ( n->nr_ranges == 1 ) {
+                                emit( expr, local ? FOP_LPORT : FOP_RPORT, 0, 
+                                                n->ranges[0].lo, n->ranges[0].hi );
+                        } else {
+                                emit( expr, local ? FOP_LPORTS : FOP_RPORTS, 0,
+                                                expr->nr_ranges, n->nr_ranges );
+                                memcpy( &expr->ranges[expr->nr_ranges], n->ranges,
+                                                n->nr_ranges * sizeof( n->ranges[0] ));
+                                expr->nr_ranges += n->nr_ranges;
+                        }
+                        break;
+                case FN_ADDR :
+                        emit( expr, local ? FOP_LADDR : FOP_RADDR, n->neg, 
+                                        expr->nr_prefixes, 0 );
+                        expr->prefixes[expr->nr_prefixes++] = n->prefix;
+                        break;
+                case FN_STATE :
+                        emit( expr, FOP_STATE, 0, 0, n->val );
+                        break;
+                case FN_AF :
+                        emit( expr, FOP_AF, n->neg, n->val, 0 );
+                        break;
+                case FN_IF :
+                        emit( expr, FOP_IF, n->neg, expr->nr_names, 0 );
+                        expr->names[expr->nr_names++] = n->name;
+                        n->name = NULL;
+                        break;
+                case FN_NOT :
+                        /* removed by fold() */
+                        break;
+        }
+}
+
+/**
+ * @brief Retarget jumps landing on other jumps.
+ *
+ * Jump landing on jump of the same kind can continue to its target, jump
+ * landing on jump of the other kind will not take it and can land right
+ * after it.
+ */
+static void thread_jumps( struct fexpr *expr )
+{
+        struct fexpr_insn *insn;
+        int i, target;
+
+        for ( i = 0; i < expr->len; i++ ) {
+                insn = &expr->code[i];
+                if ( insn->op != FOP_JT && insn->op != FOP_JF )
+                        continue;
+                target = i + 1 + insn->a;
+                while ( target < expr->len ) {
+                        if ( expr->code[target].op == insn->op )
+                                target = target + 1 + expr->code[target].a;
+                        else if ( expr->code[target].op == FOP_JT || 
+                                        expr->code[target].op == FOP_JF )
+                                target++;
+                        else
+                                break;
+                }
+                insn->a = target - i - 1;
+        }
+}
+
+#ifdef DEBUG
+static void dump_code( const struct fexpr *expr )
+{
+        static const char *names[] = { "const", "lport", "rport", "lports",
+                "rports", "laddr", "raddr", "state", "af", "if", "jt", "jf" };
+        int i;
+
+        DBG( "Compiled \"%s\" to %d instructions\n", expr->spec, expr->len );
+        for ( i = 0; i < expr->len; i++ ) 
+                DBG( "%3d: %s%-6s %u %u\n", i, expr->code[i].neg ? "!" : " ",
+                                names[expr->code[i].op], expr->code[i].a,
+                                expr->code[i].b );
+}
+#endif /* DEBUG */
+
+/** 
+ * @brief Compile the filter expression.
+ *
+ * @ingroup fexpr
+ * @param spec The expression.
+ * @param errbuf Buffer for error message, may be NULL.
+ * @param errlen Size of @a errbuf.
+ * 
+ * @return The compiled expression, NULL if the expression is invalid.
+ */
+struct fexpr *fexpr_compile( const char *spec, char *errbuf, size_t errlen )
+{
+        struct fexpr_parser p;
+        struct fexpr_counts counts;
+        struct fexpr *expr;
+        struct fnode *tree;
+
+        memset( &p, 0, sizeof( p ));
+        p.spec = spec;
+        p.pos = spec;
+        p.errbuf = errbuf;
+        p.errlen = errlen;
+        if ( errbuf != NULL && errlen > 0 )
+                errbuf[0] = '\0';
+
+        next_token( &p );
+        tree = parse_or( &p );
+        if ( tree != NULL && p.tok[0] != '\0' ) 
+                parse_error( &p, "Unexpected token" );
+        if ( p.failed ) {
+                if ( tree != NULL )
+                        node_deinit( tree );
+                return NULL;
+        }
+
+        tree = fold( tree, 0 );
+        memset( &counts, 0, sizeof( counts ));
+        count_code( tree, &counts );
+        if ( counts.code > FEXPR_MAX_CODE ) {
+                if ( errbuf != NULL && errlen > 0 )
+                        snprintf( errbuf, errlen, "Expression too long" );
+                node_deinit( tree );
+                return NULL;
+        }
+
+        expr = mem_zalloc( sizeof( *expr ));
+        expr->code = mem_alloc( counts.code * sizeof( expr->code[0] ));
+        if ( counts.ranges > 0 )
+                expr->ranges = mem_alloc( counts.ranges * sizeof( expr->ranges[0] ));
+        if ( counts.prefixes > 0 )
+                expr->prefixes = mem_alloc( counts.prefixes * sizeof( expr->prefixes[0] ));
+        if ( counts.names > 0 )
+                expr->names = mem_alloc( counts.names * sizeof( expr->names[0] ));
+        expr->fields = counts.fields;
+        expr->spec = mem_alloc( strlen( spec ) + 1 );
+        strcpy( expr->spec, spec );
+
+        compile( expr, tree );
+        thread_jumps( expr );
+        node_deinit( tree );
+#ifdef DEBUG
+        dump_code( expr );
+#endif /* DEBUG */
+
+        return expr;
+}
+
+/** 
+ * @brief Free the compiled expression.
+ * 
+ * @ingroup fexpr
+ * @param expr The expression to free.
+ */
+void fexpr_deinit( struct fexpr *expr )
+{
+        int i;
+
+        for ( i = 0; i < expr->nr_names; i++ )
+                mem_free( expr->names[i] );
+        if ( expr->names != NULL )
+                mem_free( expr->names );
+        if ( expr->prefixes != NULL )
+                mem_free( expr->prefixes );
+        if ( expr->ranges != NULL )
+                mem_free( expr->ranges );
+        mem_free( expr->code );
+        mem_free( expr->spec );
+        mem_free( expr );
+}
+
+/*
+ * Evaluation
+ */
+
+static inline int port_of( struct sockaddr_storage *ss )
+{
+        if ( ss->ss_family == AF_INET6 )
+                return ntohs( ((struct sockaddr_in6 *)ss)->sin6_port );
+        return ntohs( ((struct sockaddr_in *)ss)->sin_port );
+}
+
+static int port_in_ranges( const struct fexpr_range *ranges, int cnt, int port )
+{
+        int lo = 0, hi = cnt - 1, mid;
+
+        while ( lo <= hi ) {
+                mid = ( lo + hi ) / 2;
+                if ( port < ranges[mid].lo )
+                        hi = mid - 1;
+                else if ( port > ranges[mid].hi )
+                        lo = mid + 1;
+                else
+                        return 1;
+        }
+        return 0;
+}
+
+static int addr_in_prefix( const struct fexpr_prefix *prefix, 
+                struct sockaddr_storage *ss )
+{
+        const uint8_t *addr;
+        int bytes, bits;
+
+        if ( ss->ss_family != prefix->family )
+                return 0;
+        if ( ss->ss_family == AF_INET )
+                addr = (const uint8_t *)&((struct sockaddr_in *)ss)->sin_addr;
+        else
+                addr = (const uint8_t *)&((struct sockaddr_in6 *)ss)->sin6_addr;
+
+        bytes = prefix->bits / 8;
+        bits = prefix->bits % 8;
+        if ( memcmp( addr, prefix->addr, bytes ) != 0 )
+                return 0;
+        if ( bits == 0 )
+                return 1;
+        return (( addr[bytes] ^ prefix->addr[bytes] ) & ( 0xff << ( 8 - bits ))) == 0;
+}
+
+/** 
+ * @brief Evaluate the expression for connection.
+ *
+ * The interface of the connection has to be set before evaluating if the
+ * expression looks at it (expr->fields has POLICY_IF).
+ * 
+ * @ingroup fexpr
+ * @param expr The compiled expression.
+ * @param conn_p The connection.
+ * 
+ * @return 1 if the connection matches the expression, 0 if not.
+ */
+int fexpr_eval( const struct fexpr *expr, struct tcp_connection *conn_p )
+{
+        const struct fexpr_insn *insn = expr->code;
+        const struct fexpr_insn *end = insn + expr->len;
+        int acc = 0;
+        int port;
+
+        while ( insn < end ) {
+                switch ( insn->op ) {
+                        case FOP_CONST :
+                                acc = insn->b;
+                                break;
+                        case FOP_LPORT :
+                                port = port_of( &conn_p->laddr );
+                                acc = port >= insn->a && port <= (int)insn->b;
+                                break;
+                        case FOP_RPORT :
+                                port = port_of( &conn_p->raddr );
+                                acc = port >= insn->a && port <= (int)insn->b;
+                                break;
+                        case FOP_LPORTS :
+                                acc = port_in_ranges( &expr->ranges[insn->a], insn->b,
+                                                port_of( &conn_p->laddr ));
+                                break;
+                        case FOP_RPORTS :
+                                acc = port_in_ranges( &expr->ranges[insn->a], insn->b,
+                                                port_of( &conn_p->raddr ));
+                                break;
+                        case FOP_LADDR :
+                                acc = addr_in_prefix( &expr->prefixes[insn->a], 
+                                                &conn_p->laddr );
+                                break;
+                        case FOP_RADDR :
+                                acc = addr_in_prefix( &expr->prefixes[insn->a], 
+                                                &conn_p->raddr );
+                                break;
+                        case FOP_STATE :
+                                acc = ( insn->b >> conn_p->state ) & 1;
+                                break;
+                        case FOP_AF :
+                                acc = conn_p->laddr.ss_family == insn->a;
+                                break;
+                        case FOP_IF :
+                                acc = conn_p->metadata.ifname != NULL &&
+                                        strcmp( conn_p->metadata.ifname, 
+                                                        expr->names[insn->a] ) == 0;
+                                break;
+                        case FOP_JT :
+                                if ( acc )
+                                        insn += insn->a;
+                                insn++;
+                                continue;
+                        case FOP_JF :
+                                if ( ! acc )
+                                        insn += insn->a;
+                                insn++;
+                                continue;
+                }
+                acc ^= insn->neg;
+                insn++;
+        }
+        return acc;
+}
@@ -0,0 +1,125 @@
+/**
+ * @file filtexpr.h
+ * @brief Filter expressions compiled to bytecode.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _FILTEXPR_H_
+#define _FILTEXPR_H_
+
+/**
+ * Maximum number of instructions on compiled expression.
+ */
+#define FEXPR_MAX_CODE 4096
+/**
+ * Maximum length of one token (address, interface name etc.) on expression.
+ */
+#define FEXPR_MAX_TOKEN 64
+
+/**
+ * Instructions for the filter expression.
+ *
+ * The expression is evaluated with one boolean accumulator. Test
+ * instructions set the accumulator (inverted if the neg flag is set on
+ * instruction), the jumps implement the short circuiting of "and" and "or".
+ * @ingroup fexpr
+ */
+enum fexpr_op {
+        FOP_CONST, /**< Accumulator is b */
+        FOP_LPORT, /**< Local port in range a - b */
+        FOP_RPORT, /**< Remote port in range a - b */
+        FOP_LPORTS, /**< Local port on b ranges starting from ranges[a] */
+        FOP_RPORTS, /**< Remote port on b ranges starting from ranges[a] */
+        FOP_LADDR, /**< Local address on prefixes[a] */
+        FOP_RADDR, /**< Remote address on prefixes[a] */
+        FOP_STATE, /**< Bit for the state set on mask b */
+        FOP_AF, /**< Address family is a */
+        FOP_IF, /**< Interface is names[a] */
+        FOP_JT, /**< Skip a instructions if accumulator is set */
+        FOP_JF /**< Skip a instructions if accumulator is not set */
+};
+
+/**
+ * One instruction on the compiled expression.
+ * @ingroup fexpr
+ */
+struct fexpr_insn {
+        uint8_t op; /**< enum fexpr_op */
+        uint8_t neg; /**< Invert the result of the test */
+        uint16_t a; /**< First operand */
+        uint32_t b; /**< Second operand */
+};
+
+/**
+ * Range of ports (host byte order).
+ * @ingroup fexpr
+ */
+struct fexpr_range {
+        uint16_t lo; /**< First port on range */
+        uint16_t hi; /**< Last port on range */
+};
+
+/**
+ * Address prefix.
+ * @ingroup fexpr
+ */
+struct fexpr_prefix {
+        uint8_t family; /**< AF_INET or AF_INET6 */
+        uint8_t bits; /**< Length of the prefix in bits */
+        uint8_t addr[16]; /**< The address, network byte order */
+};
+
+/**
+ * Compiled filter expression.
+ * @ingroup fexpr
+ */
+struct fexpr {
+        int len; /**< Number of instructions */
+        struct fexpr_insn *code; /**< The instructions */
+        int nr_ranges; /**< Number of port ranges */
+        struct fexpr_range *ranges; /**< Port ranges for FOP_*PORTS */
+        int nr_prefixes; /**< Number of address prefixes */
+        struct fexpr_prefix *prefixes; /**< Prefixes for FOP_*ADDR */
+        int nr_names; /**< Number of interface names */
+        char **names; /**< Interface names for FOP_IF */
+        /**
+         * Fields of the connection the expression looks at (POLICY_ flags),
+         * POLICY_IF if the interface has to be known before evaluating.
+         */
+        policy_flags_t fields;
+        char *spec; /**< The expression the code was compiled from */
+};
+
+struct fexpr *fexpr_compile( const char *spec, char *errbuf, size_t errlen );
+void fexpr_deinit( struct fexpr *expr );
+int fexpr_eval( const struct fexpr *expr, struct tcp_connection *conn_p );
+
+#endif /* _FILTEXPR_H_ */
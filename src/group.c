@@ -46,6 +46,8 @@
 #include "debug.h"
 #include "parser.h"
 #include "connection.h"
+#include "cloud.h"
+#include "groupkey.h"
 
 
 /** @defgroup cgrp Group holding a set of connections. */
@@ -66,7 +68,10 @@ struct group *group_init( void )
         group_p->grp_filter = NULL;
         group_p->group_q = NULL;
         group_p->parent = NULL;
+        group_p->flags = 0;
         group_p->next = NULL;
+        group_p->prev = NULL;
+        group_p->list = NULL;
 
         return group_p;
 }
@@ -94,6 +99,12 @@ void group_deinit( struct group *group_p, int free_connections )
         if ( group_p->grp_filter != NULL ) {
                 filter_deinit( group_p->grp_filter, 0 );
         }
+        if ( group_p->hist != NULL ) 
+                mem_free( group_p->hist );
+        if ( group_p->cloud != NULL ) 
+                cloud_index_remove( group_p->cloud );
+        if ( group_p->gkey != NULL ) 
+                gkey_index_remove( group_p->gkey );
         mem_free( group_p );
 }
 
@@ -157,6 +168,14 @@ void group_add_connection( struct group *group_p, struct tcp_connection *conn_p
         }
         cqueue_push( group_p->group_q, conn_p );
         conn_p->group = group_p;
+        group_p->active = connection_time_ms();
+        if ( conn_p->mem != NULL ) 
+                group_p->mem_held += conn_p->mem->held;
+        if ( conn_p->metadata.flags & METADATA_DURATION_PENDING ) {
+                group_record_duration( group_p, conn_p->metadata.pending_kind,
+                                conn_p->metadata.pending_msecs );
+                conn_p->metadata.flags &= ~METADATA_DURATION_PENDING;
+        }
 }   
 
 /** 
@@ -177,6 +196,8 @@ void group_remove_connection( struct group *group_p, struct tcp_connection *conn
         } else {
                 cqueue_remove( group_p->group_q, conn_p );
                 conn_p->group = NULL;
+                if ( conn_p->mem != NULL ) 
+                        group_p->mem_held -= conn_p->mem->held;
         }
 } 
 
@@ -266,6 +287,60 @@ int group_get_newcount( struct group *group_p ) {
 }
 
 
+/**
+ * @brief Record the time a connection on the group spent on a state.
+ *
+ * @ingroup cgrp
+ * @param group_p Pointer to the group.
+ * @param kind Which histogram the duration belongs to.
+ * @param msecs The duration in milliseconds.
+ */
+void group_record_duration( struct group *group_p, enum state_hist_kind kind,
+                uint64_t msecs )
+{
+        int bucket = 0;
+
+        if ( group_p->hist == NULL ) 
+                group_p->hist = mem_zalloc( sizeof( struct state_hist ));
+
+        while ( msecs > 0 && bucket < STATE_HIST_BUCKETS - 1 ) {
+                msecs >>= 1;
+                bucket++;
+        }
+        group_p->hist->buckets[kind][bucket]++;
+        group_p->hist->count[kind]++;
+}
+
+/**
+ * @brief Get an upper bound for a percentile of the recorded durations.
+ *
+ * @ingroup cgrp
+ * @param group_p Pointer to the group.
+ * @param kind Which histogram to use.
+ * @param pct The percentile (1 - 100).
+ * @return Upper bound for the percentile in milliseconds (the upper limit of
+ * the bucket holding the percentile), 0 if no durations are recorded. For the
+ * last bucket UINT64_MAX is returned.
+ */
+uint64_t group_duration_percentile( struct group *group_p, 
+                enum state_hist_kind kind, int pct )
+{
+        struct state_hist *hist = group_p->hist;
+        uint64_t target, sum = 0;
+        int i;
+
+        if ( hist == NULL || hist->count[kind] == 0 ) 
+                return 0;
+
+        target = ( (uint64_t)hist->count[kind] * pct + 99 ) / 100;
+        for ( i = 0; i < STATE_HIST_BUCKETS - 1; i++ ) {
+                sum += hist->buckets[kind][i];
+                if ( sum >= target ) 
+                        return (uint64_t)1 << i;
+        }
+        return UINT64_MAX;
+}
+
 
 /** 
  * @brief Get pointer to the groups internal queue.
@@ -336,6 +411,7 @@ struct glist *glist_init()
         struct glist *list_p = mem_alloc( sizeof( struct glist));
         list_p->size = 0;
         list_p->head = NULL;
+        list_p->reclaim = NULL;
 
         return list_p;
 }
@@ -353,8 +429,12 @@ struct glist *glist_init()
  */
 int glist_add(struct glist *list_p, struct group *grp )
 {
+        grp->prev = NULL;
         grp->next = list_p->head;
+        if ( list_p->head != NULL ) 
+                list_p->head->prev = grp;
         list_p->head = grp;
+        grp->list = list_p;
 
         DBG( "Added group[%p], ->[%p]\n", grp, grp->next );
 
@@ -374,35 +454,31 @@ int glist_add(struct glist *list_p, struct group *grp )
  */
 struct group *glist_remove( struct glist *list_p, struct group *grp )
 {
-        struct group *rv = NULL;
-
-        if ( list_p->head  != NULL && list_p->head == grp ) {
-                DBG( "Removing group from the head\n" );
-                list_p->head = grp->next;
-                DBG( "new head [%p] \n" );
-                rv = grp;
-                list_p->size--; 
-                return rv;
-        } 
-        rv = list_p->head;
-        while ( rv != NULL ) {
-               if ( rv->next == grp ) {
-                      DBG( "Found group, removing\n" );
-                      rv->next = grp->next;
-                      rv = grp;
-                      list_p->size--; 
-                      break;
-               }
-               rv = rv->next;
+        if ( grp->list != list_p ) {
+                WARN( "Group[%p] is not on the list\n", grp );
+                return NULL;
         }
+        if ( grp->prev != NULL ) 
+                grp->prev->next = grp->next;
+        else 
+                list_p->head = grp->next;
+        if ( grp->next != NULL ) 
+                grp->next->prev = grp->prev;
 
-        return rv;
+        DBG( "Removed group[%p]\n", grp );
+        grp->next = NULL;
+        grp->prev = NULL;
+        grp->list = NULL;
+        list_p->size--; 
+
+        return grp;
 }
 
 /** 
  * @brief Delete a group from list if the group is empty.
  * 
- * Deletes, removes and deinitializes, a group from the list if it is empty.
+ * Removes a group from the list if it is empty. The group is put to the
+ * reclaim list of @a list_p and deinitialized when glist_reclaim() is called.
  * Group is considered to be empty if it does not have any connections and has
  * no parent set.
  *
@@ -428,12 +504,39 @@ struct group *glist_delete_grp_if_empty( struct glist *list_p, struct group *grp
                         WARN("Could not remove group from list!\n" );
                         return NULL;
                 }
-                /* Can be NULL, hence NULL is also valid return value */
-                group_deinit(grp, 0);
+                grp->next = list_p->reclaim;
+                list_p->reclaim = grp;
         } 
+        /* Can be NULL, hence NULL is also valid return value */
         return rv;
 }
 
+/** 
+ * @brief Free the groups deleted from the list.
+ *
+ * Deinitializes all groups put to reclaim list by
+ * glist_delete_grp_if_empty(). 
+ * 
+ * @ingroup cglst
+ * @param list_p Pointer to the list.
+ * 
+ * @return Number of groups freed.
+ */
+int glist_reclaim( struct glist *list_p )
+{
+        struct group *grp;
+        int cnt = 0;
+
+        while ( ( grp = list_p->reclaim ) != NULL ) {
+                list_p->reclaim = grp->next;
+                group_deinit( grp, 0 );
+                cnt++;
+        }
+        DBG( "Reclaimed %d empty groups\n", cnt );
+
+        return cnt;
+}
+
 /**
  * Get the number of connections on all groups on the list.
  * @note Parent connections are not counted. 
@@ -510,6 +613,7 @@ void glist_deinit( struct glist *list_p, int free_connections )
                         group_deinit( grp, free_connections );
                 }
         } 
+        glist_reclaim( list_p );
 
         mem_free( list_p );
 }
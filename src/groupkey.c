@@ -0,0 +1,406 @@
+/**
+ * @file groupkey.c
+ * @brief Composite grouping keys.
+ *
+ * The user can give the grouping as a comma separated list of fields (e.g.
+ * "lport,raddr" or "if,rport,state"). The list is parsed once to a plan
+ * telling where each field is placed on a fixed length key. Connections with
+ * equal keys belong to the same group, and the groups are found from an
+ * index hashed by the key.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_GRP
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "groupkey.h"
+
+/**
+ * @defgroup gkey Composite grouping keys
+ */
+
+/**
+ * Names and key lengths of the fields, indexed by enum gkey_field.
+ */
+static const struct {
+        const char *name;
+        uint8_t len;
+} gkey_fields[GKEY_FIELDS] = {
+        { "laddr", 17 },
+        { "lport", 2 },
+        { "raddr", 17 },
+        { "rport", 2 },
+        { "state", 1 },
+        { "if", IFNAMEMAX },
+        { "af", 1 },
+        { "pid", sizeof( int ) },
+        { "peer", 17 },
+        { "pport", 2 }
+};
+
+/** 
+ * @brief Get the name of the field.
+ * 
+ * @ingroup gkey
+ * @param field The field.
+ * 
+ * @return Name of the field as given by user.
+ */
+const char *gkey_field_name( enum gkey_field field )
+{
+        return gkey_fields[field].name;
+}
+
+/** 
+ * @brief Parse the key plan from user given specification.
+ *
+ * The specification is a comma separated list of field names, each field can
+ * be given only once.
+ * 
+ * @ingroup gkey
+ * @param spec The specification.
+ * 
+ * @return Pointer to the parsed plan, NULL if the specification is invalid.
+ */
+struct gkey_plan *gkey_plan_parse( const char *spec )
+{
+        struct gkey_plan *plan;
+        const char *start, *end;
+        size_t len;
+        int i;
+
+        plan = mem_zalloc( sizeof( *plan ));
+        start = spec;
+        while ( *start != '\0' ) {
+                end = strchr( start, ',' );
+                len = end ? (size_t)( end - start ) : strlen( start );
+                for ( i = 0; i < GKEY_FIELDS; i++ ) {
+                        if ( strlen( gkey_fields[i].name ) == len &&
+                                        strncmp( gkey_fields[i].name, start, len ) == 0 )
+                                break;
+                }
+                if ( i == GKEY_FIELDS || gkey_plan_has_field( plan, i )) {
+                        ERROR( "Invalid or duplicate field on grouping key: %.*s\n",
+                                        (int)len, start );
+                        mem_free( plan );
+                        return NULL;
+                }
+#ifndef ENABLE_FOLLOW_PID
+                if ( i == GKEY_PID ) {
+                        ERROR( "Grouping by pid not supported\n" );
+                        mem_free( plan );
+                        return NULL;
+                }
+#endif /* ENABLE_FOLLOW_PID */
+#ifndef ENABLE_CONNTRACK
+                if ( i == GKEY_PEER || i == GKEY_PEERPORT ) {
+                        ERROR( "Grouping by real peer not supported\n" );
+                        mem_free( plan );
+                        return NULL;
+                }
+#endif /* ENABLE_CONNTRACK */
+                plan->steps[plan->nr_steps].field = i;
+                plan->steps[plan->nr_steps].offset = plan->len;
+                plan->steps[plan->nr_steps].len = gkey_fields[i].len;
+                plan->len += gkey_fields[i].len;
+                plan->nr_steps++;
+
+                if ( end == NULL )
+                        break;
+                start = end + 1;
+        }
+        if ( plan->nr_steps == 0 ) {
+                mem_free( plan );
+                return NULL;
+        }
+        plan->spec = mem_alloc( strlen( spec ) + 1 );
+        strcpy( plan->spec, spec );
+
+        return plan;
+}
+
+/** 
+ * @brief Free the plan.
+ * 
+ * @ingroup gkey
+ * @param plan The plan to free.
+ */
+void gkey_plan_deinit( struct gkey_plan *plan )
+{
+        mem_free( plan->spec );
+        mem_free( plan );
+}
+
+/** 
+ * @brief Check if given field is used on the plan.
+ * 
+ * @ingroup gkey
+ * @param plan The plan.
+ * @param field The field.
+ * 
+ * @return non-zero if the field is on plan.
+ */
+int gkey_plan_has_field( struct gkey_plan *plan, enum gkey_field field )
+{
+        int i;
+
+        for ( i = 0; i < plan->nr_steps; i++ ) {
+                if ( plan->steps[i].field == field )
+                        return 1;
+        }
+        return 0;
+}
+
+/** 
+ * @brief Get the grouping policy for grouping with the plan.
+ *
+ * If the state is on key, POLICY_STATE is also set so that the connections
+ * get regrouped when their state changes.
+ * 
+ * @ingroup gkey
+ * @param plan The plan.
+ * 
+ * @return The policy flags.
+ */
+policy_flags_t gkey_plan_policy( struct gkey_plan *plan )
+{
+        policy_flags_t policy = POLICY_KEY;
+
+        if ( gkey_plan_has_field( plan, GKEY_STATE )) 
+                policy |= POLICY_STATE;
+        return policy;
+}
+
+/**
+ * @brief Copy address with the family to key.
+ */
+static void extract_addr( struct sockaddr_storage *ss, uint8_t *dst )
+{
+        if ( ss->ss_family == AF_INET6 ) 
+                memcpy( dst, ss_get_addr6( ss ), 16 );
+        else 
+                memcpy( dst, ss_get_addr( ss ), 4 );
+        dst[16] = ss->ss_family;
+}
+
+/** 
+ * @brief Extract the key for the connection.
+ * 
+ * @ingroup gkey
+ * @param plan The plan for the key.
+ * @param conn_p The connection.
+ * @param key Buffer for the key, should hold plan->len bytes.
+ */
+void gkey_extract( struct gkey_plan *plan, struct tcp_connection *conn_p, 
+                uint8_t *key )
+{
+        struct gkey_step *step;
+        in_port_t port;
+        int i;
+
+        memset( key, 0, plan->len );
+        for ( i = 0; i < plan->nr_steps; i++ ) {
+                step = &plan->steps[i];
+                switch ( step->field ) {
+                        case GKEY_LADDR :
+                                extract_addr( &conn_p->laddr, key + step->offset );
+                                break;
+                        case GKEY_RADDR :
+                                extract_addr( &conn_p->raddr, key + step->offset );
+                                break;
+                        case GKEY_LPORT :
+                                port = ss_get_port( &conn_p->laddr );
+                                memcpy( key + step->offset, &port, sizeof( port ));
+                                break;
+                        case GKEY_RPORT :
+                                port = ss_get_port( &conn_p->raddr );
+                                memcpy( key + step->offset, &port, sizeof( port ));
+                                break;
+                        case GKEY_STATE :
+                                key[step->offset] = conn_p->state;
+                                break;
+                        case GKEY_IF :
+                                if ( conn_p->metadata.ifname != NULL )
+                                        strncpy( (char *)key + step->offset,
+                                                        conn_p->metadata.ifname,
+                                                        step->len );
+                                break;
+                        case GKEY_AF :
+                                key[step->offset] = conn_p->family;
+                                break;
+#ifdef ENABLE_FOLLOW_PID
+                        case GKEY_PID :
+                                memcpy( key + step->offset, &conn_p->metadata.pid,
+                                                sizeof( int ));
+                                break;
+#endif /* ENABLE_FOLLOW_PID */
+                        case GKEY_PEER :
+                                extract_addr( conn_p->nat != NULL ? &conn_p->nat->peer :
+                                                &conn_p->raddr, key + step->offset );
+                                break;
+                        case GKEY_PEERPORT :
+                                port = ss_get_port( conn_p->nat != NULL ? 
+                                                &conn_p->nat->peer : &conn_p->raddr );
+                                memcpy( key + step->offset, &port, sizeof( port ));
+                                break;
+                }
+        }
+}
+
+/**
+ * @brief Calculate hash for the key (FNV-1a).
+ */
+static uint32_t hash_key( const uint8_t *key, int len )
+{
+        return hash_fnv( HASH_FNV_INIT, key, len );
+}
+
+/** 
+ * @brief Initialize the index.
+ * 
+ * @ingroup gkey
+ * @param plan Plan for the keys, should be valid as long as the index.
+ * 
+ * @return Pointer to the new index.
+ */
+struct gkey_index *gkey_index_init( struct gkey_plan *plan )
+{
+        struct gkey_index *index;
+
+        index = mem_zalloc( sizeof( *index ));
+        index->plan = plan;
+        hash_index_init( &index->entries, GKEY_INDEX_INIT_SIZE );
+
+        return index;
+}
+
+/** 
+ * @brief Free the index.
+ *
+ * The groups on index are not freed, they are just detached from the index.
+ * 
+ * @ingroup gkey
+ * @param index Pointer to the index.
+ */
+void gkey_index_deinit( struct gkey_index *index )
+{
+        struct hash_link *link, *next;
+        struct gkey_entry *entry;
+        unsigned int i;
+
+        for ( i = 0; i < index->entries.size; i++ ) {
+                for ( link = index->entries.chains[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        entry = HASH_ENTRY( link, struct gkey_entry, link );
+                        entry->grp->gkey = NULL;
+                        mem_free( entry );
+                }
+        }
+        hash_index_deinit( &index->entries );
+        mem_free( index );
+}
+
+/** 
+ * @brief Find the group for connection.
+ * 
+ * @ingroup gkey
+ * @param index Pointer to the index.
+ * @param conn_p The connection.
+ * 
+ * @return The group with the same key as the connection, NULL if not found.
+ */
+struct group *gkey_index_find( struct gkey_index *index, 
+                struct tcp_connection *conn_p )
+{
+        uint8_t key[GKEY_MAX_LEN];
+        struct gkey_entry *entry;
+        struct hash_link *link;
+
+        gkey_extract( index->plan, conn_p, key );
+        for ( link = hash_index_first( &index->entries, 
+                                hash_key( key, index->plan->len )); 
+                        link != NULL; link = hash_index_next( link )) {
+                entry = HASH_ENTRY( link, struct gkey_entry, link );
+                if ( memcmp( entry->key, key, index->plan->len ) == 0 )
+                        return entry->grp;
+        }
+        return NULL;
+}
+
+/** 
+ * @brief Add group to the index.
+ *
+ * The key for the group is taken from the given connection.
+ * 
+ * @ingroup gkey
+ * @param index Pointer to the index.
+ * @param grp The group to add.
+ * @param conn_p The first connection on group.
+ */
+void gkey_index_add( struct gkey_index *index, struct group *grp,
+                struct tcp_connection *conn_p )
+{
+        struct gkey_entry *entry;
+
+        entry = mem_zalloc( sizeof( *entry ) + index->plan->len );
+        entry->index = index;
+        gkey_extract( index->plan, conn_p, entry->key );
+        entry->grp = grp;
+        hash_index_add( &index->entries, &entry->link, 
+                        hash_key( entry->key, index->plan->len ));
+        grp->gkey = entry;
+}
+
+/** 
+ * @brief Remove entry from its index.
+ *
+ * Should be called when the group is deleted.
+ * 
+ * @ingroup gkey
+ * @param entry The entry to remove.
+ */
+void gkey_index_remove( struct gkey_entry *entry )
+{
+        hash_index_remove( &entry->index->entries, &entry->link );
+        entry->grp->gkey = NULL;
+        mem_free( entry );
+}
@@ -0,0 +1,127 @@
+/**
+ * @file groupkey.h
+ * @brief Composite grouping keys and the hashed index for the groups.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _GROUPKEY_H_
+#define _GROUPKEY_H_
+
+#include "hash.h"
+
+/**
+ * Fields which can be used on the grouping key.
+ * @ingroup gkey
+ */
+enum gkey_field {
+        GKEY_LADDR, /**< Local address */
+        GKEY_LPORT, /**< Local port */
+        GKEY_RADDR, /**< Remote address */
+        GKEY_RPORT, /**< Remote port */
+        GKEY_STATE, /**< TCP state */
+        GKEY_IF, /**< Interface */
+        GKEY_AF, /**< Address family */
+        GKEY_PID, /**< Process owning the socket */
+        GKEY_PEER, /**< Real remote address (from conntrack if translated) */
+        GKEY_PEERPORT, /**< Real remote port (from conntrack if translated) */
+        GKEY_FIELDS /**< Number of fields */
+};
+
+/**
+ * Maximum length of the key (all fields used once).
+ */
+#define GKEY_MAX_LEN 64
+
+/**
+ * Initial number of hash chains on the index (power of 2).
+ */
+#define GKEY_INDEX_INIT_SIZE 256
+
+/**
+ * One step on the key extraction plan.
+ * @ingroup gkey
+ */
+struct gkey_step {
+        uint8_t field; /**< enum gkey_field */
+        uint8_t offset; /**< Offset of the field on the key */
+        uint8_t len; /**< Length of the field on the key */
+};
+
+/**
+ * Plan for extracting the grouping key from connection. The plan is parsed
+ * once from the user given specification (e.g. "lport,raddr"), extracting
+ * the key is then just copying the fields on the plan.
+ * @ingroup gkey
+ */
+struct gkey_plan {
+        int nr_steps; /**< Number of fields on key */
+        struct gkey_step steps[GKEY_FIELDS]; /**< The fields in the order given */
+        int len; /**< Total length of the key */
+        char *spec; /**< The specification the plan was parsed from */
+};
+
+/**
+ * Entry for one group on the index.
+ * @ingroup gkey
+ */
+struct gkey_entry {
+        struct hash_link link; /**< Link on the index, hashed by the key */
+        struct gkey_index *index; /**< The index this entry is on */
+        struct group *grp; /**< The group */
+        uint8_t key[]; /**< The key, plan->len bytes */
+};
+
+/**
+ * Index of the groups formed with the key plan.
+ * @ingroup gkey
+ */
+struct gkey_index {
+        struct gkey_plan *plan; /**< Plan for the keys */
+        struct hash_index entries; /**< The entries */
+};
+
+struct gkey_plan *gkey_plan_parse( const char *spec );
+void gkey_plan_deinit( struct gkey_plan *plan );
+int gkey_plan_has_field( struct gkey_plan *plan, enum gkey_field field );
+policy_flags_t gkey_plan_policy( struct gkey_plan *plan );
+const char *gkey_field_name( enum gkey_field field );
+void gkey_extract( struct gkey_plan *plan, struct tcp_connection *conn_p, 
+                uint8_t *key );
+
+struct gkey_index *gkey_index_init( struct gkey_plan *plan );
+void gkey_index_deinit( struct gkey_index *index );
+struct group *gkey_index_find( struct gkey_index *index, 
+                struct tcp_connection *conn_p );
+void gkey_index_add( struct gkey_index *index, struct group *grp,
+                struct tcp_connection *conn_p );
+void gkey_index_remove( struct gkey_entry *entry );
+
+#endif /* _GROUPKEY_H_ */
@@ -0,0 +1,207 @@
+/**
+ * @file hash.c
+ * @brief Chained hash index growing with the number of entries.
+ *
+ * The entries embed a struct hash_link, so adding and removing an entry does
+ * not allocate anything and removal does not need to walk the chain. The
+ * index doubles its number of chains when there are on average two entries
+ * per chain.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "defs.h"
+#include "debug.h"
+#include "hash.h"
+
+/**
+ * @defgroup hash Hash function and hash index
+ */
+
+/**
+ * Number of chains used if no initial size is given.
+ */
+#define HASH_INDEX_DEFAULT_SIZE 64
+
+/**
+ * @brief Put link to the head of the chain for its hash.
+ */
+static void link_chain( struct hash_index *index, struct hash_link *link )
+{
+        struct hash_link **head = &HASH_CHAIN( index, link->hash );
+
+        link->next = *head;
+        link->pprev = head;
+        if ( *head != NULL )
+                (*head)->pprev = &link->next;
+        *head = link;
+}
+
+/**
+ * @brief Double the number of chains and rehash the entries.
+ */
+static void grow_index( struct hash_index *index )
+{
+        struct hash_link **old = index->chains;
+        struct hash_link *link, *next;
+        unsigned int old_size = index->size, i;
+
+        index->size *= 2;
+        index->chains = mem_zalloc( index->size * sizeof( *index->chains ));
+        for ( i = 0; i < old_size; i++ ) {
+                for ( link = old[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        link_chain( index, link );
+                }
+        }
+        mem_free( old );
+}
+
+/**
+ * @brief Initialize empty index.
+ *
+ * @ingroup hash
+ * @param index The index to initialize.
+ * @param size Initial number of chains, rounded up to power of 2. 0 for
+ * default.
+ */
+void hash_index_init( struct hash_index *index, unsigned int size )
+{
+        index->size = 1;
+        while ( index->size < ( size ? size : HASH_INDEX_DEFAULT_SIZE ))
+                index->size *= 2;
+        index->count = 0;
+        index->chains = mem_zalloc( index->size * sizeof( *index->chains ));
+}
+
+/**
+ * @brief Free the chains of the index. The entries are not touched.
+ *
+ * @ingroup hash
+ * @param index The index.
+ */
+void hash_index_deinit( struct hash_index *index )
+{
+        mem_free( index->chains );
+        index->chains = NULL;
+        index->size = 0;
+        index->count = 0;
+}
+
+/**
+ * @brief Remove all entries from the index, keeping the chains.
+ *
+ * The links of the entries are left as they were.
+ *
+ * @ingroup hash
+ * @param index The index.
+ */
+void hash_index_clear( struct hash_index *index )
+{
+        memset( index->chains, 0, index->size * sizeof( *index->chains ));
+        index->count = 0;
+}
+
+/**
+ * @brief Add entry to index.
+ *
+ * @ingroup hash
+ * @param index The index.
+ * @param link Link embedded on the entry, not on any index.
+ * @param hash Hash for the entry.
+ */
+void hash_index_add( struct hash_index *index, struct hash_link *link, uint32_t hash )
+{
+        if ( index->count >= 2 * index->size )
+                grow_index( index );
+        link->hash = hash;
+        link_chain( index, link );
+        index->count++;
+}
+
+/**
+ * @brief Remove entry from index.
+ *
+ * @ingroup hash
+ * @param index The index the entry is on.
+ * @param link Link embedded on the entry.
+ */
+void hash_index_remove( struct hash_index *index, struct hash_link *link )
+{
+        *link->pprev = link->next;
+        if ( link->next != NULL )
+                link->next->pprev = link->pprev;
+        link->next = NULL;
+        link->pprev = NULL;
+        index->count--;
+}
+
+/**
+ * @brief Get the first entry with given hash.
+ *
+ * @ingroup hash
+ * @param index The index.
+ * @param hash The hash to look for.
+ * @return Link of the first entry with the hash, NULL if none.
+ */
+struct hash_link *hash_index_first( struct hash_index *index, uint32_t hash )
+{
+        struct hash_link *link;
+
+        for ( link = HASH_CHAIN( index, hash ); link != NULL; link = link->next ) {
+                if ( link->hash == hash )
+                        return link;
+        }
+        return NULL;
+}
+
+/**
+ * @brief Get the next entry with the same hash.
+ *
+ * @ingroup hash
+ * @param link Link of an entry returned by hash_index_first() or
+ * hash_index_next().
+ * @return Link of the next entry with the same hash, NULL if none.
+ */
+struct hash_link *hash_index_next( struct hash_link *link )
+{
+        uint32_t hash = link->hash;
+
+        for ( link = link->next; link != NULL; link = link->next ) {
+                if ( link->hash == hash )
+                        return link;
+        }
+        return NULL;
+}
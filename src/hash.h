@@ -0,0 +1,115 @@
+/**
+ * @file hash.h
+ * @brief Hash function and hash index shared by the lookup tables.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Initial value for hash_fnv().
+ */
+#define HASH_FNV_INIT 2166136261u
+
+/**
+ * @brief Get the structure containing the index link.
+ *
+ * @param link Pointer to the struct hash_link.
+ * @param type Type of the structure containing the link.
+ * @param member Name of the link on the structure.
+ */
+#define HASH_ENTRY( link, type, member ) \
+        ( (type *)( (char *)( link ) - offsetof( type, member )))
+
+/**
+ * Link for an entry on hash index, embedded on the entry.
+ * @ingroup hash
+ */
+struct hash_link {
+        struct hash_link *next; /**< Next link on the chain */
+        struct hash_link **pprev; /**< The pointer pointing to this link */
+        uint32_t hash; /**< Full hash of the entry */
+};
+
+/**
+ * Chained hash index which grows with the number of entries. The index
+ * does not own the entries, it only links them by their hash.
+ * @ingroup hash
+ */
+struct hash_index {
+        unsigned int count; /**< Number of entries on index */
+        unsigned int size; /**< Number of chains (power of 2) */
+        struct hash_link **chains; /**< Hash chains */
+};
+
+/**
+ * @brief Feed bytes to FNV-1a hash.
+ *
+ * @ingroup hash
+ * @param h The hash so far, HASH_FNV_INIT to start a new one.
+ * @param data The data to hash.
+ * @param len Number of bytes on data.
+ * @return The updated hash.
+ */
+static inline uint32_t hash_fnv( uint32_t h, const void *data, size_t len )
+{
+        const uint8_t *p = data;
+        size_t i;
+
+        for ( i = 0; i < len; i++ )
+                h = ( h ^ p[i] ) * 16777619u;
+        return h;
+}
+
+/**
+ * @brief Get the first link on the chain for the hash.
+ *
+ * The chain may contain entries with other hashes too, use
+ * hash_index_first() and hash_index_next() for the entries matching the hash.
+ *
+ * @ingroup hash
+ */
+#define HASH_CHAIN( index, hash ) \
+        ( (index)->chains[(hash) & ( (index)->size - 1 )] )
+
+void hash_index_init( struct hash_index *index, unsigned int size );
+void hash_index_deinit( struct hash_index *index );
+void hash_index_clear( struct hash_index *index );
+void hash_index_add( struct hash_index *index, struct hash_link *link, uint32_t hash );
+void hash_index_remove( struct hash_index *index, struct hash_link *link );
+struct hash_link *hash_index_first( struct hash_index *index, uint32_t hash );
+struct hash_link *hash_index_next( struct hash_link *link );
+
+#endif /* _HASH_H_ */
@@ -0,0 +1,462 @@
+/**
+ * @file lbstat.c
+ * @brief Distribution of outgoing connections over the backends of a remote
+ * port.
+ *
+ * Outgoing connections are counted on the backend for their remote address
+ * when their direction is known and uncounted when they close. The backends
+ * of a pool are kept on buckets sorted by the connection count, adding or
+ * removing a connection moves the backend to the neighbouring bucket (which
+ * is created if needed), so each change costs the same regardless of the
+ * number of backends on the pool.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_GRP
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "lbstat.h"
+
+/**
+ * @defgroup lbstat Backend distribution
+ */
+
+/** 
+ * @brief Start collecting the backend distribution.
+ * 
+ * @ingroup lbstat
+ * @return Pointer to the new, empty, statistics.
+ */
+struct lb_stats *lb_stats_init( void )
+{
+        struct lb_stats *lb;
+
+        lb = mem_zalloc( sizeof( *lb ));
+        hash_index_init( &lb->backend_index, LB_BACKEND_CHAINS );
+        hash_index_init( &lb->pool_index, LB_POOL_CHAINS );
+        return lb;
+}
+
+/**
+ * @brief Free pool with its buckets.
+ *
+ * @param pool The pool.
+ */
+static void free_pool( struct lb_pool *pool )
+{
+        struct lb_bucket *bucket, *next;
+
+        for ( bucket = pool->head; bucket != NULL; bucket = next ) {
+                next = bucket->next;
+                mem_free( bucket );
+        }
+        mem_free( pool );
+}
+
+/** 
+ * @brief Stop collecting the backend distribution.
+ * 
+ * The connections counted still point to their backends, the statistics
+ * should be freed only when the connections are not used anymore.
+ *
+ * @ingroup lbstat
+ * @param lb The statistics.
+ */
+void lb_stats_deinit( struct lb_stats *lb )
+{
+        struct hash_link *link, *next;
+        unsigned int i;
+
+        for ( i = 0; i < lb->backend_index.size; i++ ) {
+                for ( link = lb->backend_index.chains[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        mem_free( HASH_ENTRY( link, struct lb_backend, link ));
+                }
+        }
+        for ( i = 0; i < lb->pool_index.size; i++ ) {
+                for ( link = lb->pool_index.chains[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        free_pool( HASH_ENTRY( link, struct lb_pool, link ));
+                }
+        }
+        hash_index_deinit( &lb->backend_index );
+        hash_index_deinit( &lb->pool_index );
+        mem_free( lb );
+}
+
+/**
+ * @brief Calculate hash for the remote endpoint of connection (FNV-1a).
+ *
+ * @param key Key of the connection.
+ * @return The hash value.
+ */
+static uint32_t hash_backend( const struct conn_key *key )
+{
+        uint32_t hash;
+
+        hash = hash_fnv( HASH_FNV_INIT, key->raddr, 16 );
+        hash = hash_fnv( hash, &key->rport, sizeof( key->rport ));
+        return hash_fnv( hash, &key->family, 1 );
+}
+
+/**
+ * Hash for the pool of remote port.
+ */
+#define pool_hash(port) ( (uint32_t)( (port) ^ ( (port) >> 8 )))
+
+/**
+ * @brief Find the pool for remote port of connection, create new if not
+ * found.
+ *
+ * @param lb The statistics.
+ * @param key Key of the connection.
+ * @return The pool.
+ */
+static struct lb_pool *get_pool( struct lb_stats *lb, const struct conn_key *key )
+{
+        struct hash_link *link;
+        struct lb_pool *pool;
+        uint32_t hash = pool_hash( key->rport );
+
+        for ( link = hash_index_first( &lb->pool_index, hash ); link != NULL;
+                        link = hash_index_next( link )) {
+                pool = HASH_ENTRY( link, struct lb_pool, link );
+                if ( pool->rport == key->rport && pool->family == key->family ) 
+                        return pool;
+        }
+        pool = mem_zalloc( sizeof( *pool ));
+        pool->family = key->family;
+        pool->rport = key->rport;
+        hash_index_add( &lb->pool_index, &pool->link, hash );
+        lb->pools++;
+        return pool;
+}
+
+/**
+ * @brief Remove the pool from the statistics and free it.
+ *
+ * @param lb The statistics.
+ * @param pool The pool, should not have any backends.
+ */
+static void remove_pool( struct lb_stats *lb, struct lb_pool *pool )
+{
+        hash_index_remove( &lb->pool_index, &pool->link );
+        free_pool( pool );
+        lb->pools--;
+}
+
+/**
+ * @brief Find the backend for remote endpoint of connection.
+ *
+ * @param lb The statistics.
+ * @param key Key of the connection.
+ * @param hash Hash for the remote endpoint.
+ * @return The backend, NULL if not found.
+ */
+static struct lb_backend *find_backend( struct lb_stats *lb, 
+                const struct conn_key *key, uint32_t hash )
+{
+        struct lb_backend *backend;
+        struct hash_link *link;
+
+        for ( link = hash_index_first( &lb->backend_index, hash ); link != NULL;
+                        link = hash_index_next( link )) {
+                backend = HASH_ENTRY( link, struct lb_backend, link );
+                if ( backend->pool->family == key->family &&
+                                backend->pool->rport == key->rport &&
+                                memcmp( backend->raddr, key->raddr, 16 ) == 0 ) 
+                        return backend;
+        }
+        return NULL;
+}
+
+/**
+ * @brief Take backend out of its bucket, the bucket is freed if it becomes
+ * empty.
+ *
+ * @param pool The pool of the backend.
+ * @param backend The backend.
+ */
+static void bucket_unlink( struct lb_pool *pool, struct lb_backend *backend )
+{
+        struct lb_bucket *bucket = backend->bucket;
+
+        if ( backend->prev != NULL ) 
+                backend->prev->next = backend->next;
+        else 
+                bucket->backends = backend->next;
+        if ( backend->next != NULL ) 
+                backend->next->prev = backend->prev;
+        backend->bucket = NULL;
+        bucket->size--;
+        if ( bucket->size > 0 ) 
+                return;
+
+        if ( bucket->prev != NULL ) 
+                bucket->prev->next = bucket->next;
+        else 
+                pool->head = bucket->next;
+        if ( bucket->next != NULL ) 
+                bucket->next->prev = bucket->prev;
+        else 
+                pool->tail = bucket->prev;
+        mem_free( bucket );
+}
+
+/**
+ * @brief Put backend to the bucket with given count.
+ *
+ * The bucket is looked for next to the neighbour bucket (the bucket the
+ * backend was on, or would have been on if it was not removed as empty),
+ * and created there if it does not exist.
+ *
+ * @param pool The pool of the backend.
+ * @param backend The backend.
+ * @param count The connection count for the backend.
+ * @param prev Bucket with count smaller than @a count, NULL if the new
+ * bucket should be the first one.
+ * @param next Bucket with count larger than @a count, NULL if the new
+ * bucket should be the last one.
+ */
+static void bucket_link( struct lb_pool *pool, struct lb_backend *backend, 
+                int count, struct lb_bucket *prev, struct lb_bucket *next )
+{
+        struct lb_bucket *bucket;
+
+        if ( prev != NULL && prev->count == count ) {
+                bucket = prev;
+        } else if ( next != NULL && next->count == count ) {
+                bucket = next;
+        } else {
+                bucket = mem_zalloc( sizeof( *bucket ));
+                bucket->count = count;
+                bucket->prev = prev;
+                bucket->next = next;
+                if ( prev != NULL ) 
+                        prev->next = bucket;
+                else 
+                        pool->head = bucket;
+                if ( next != NULL ) 
+                        next->prev = bucket;
+                else 
+                        pool->tail = bucket;
+        }
+        backend->bucket = bucket;
+        backend->prev = NULL;
+        backend->next = bucket->backends;
+        if ( bucket->backends != NULL ) 
+                bucket->backends->prev = backend;
+        bucket->backends = backend;
+        bucket->size++;
+}
+
+/** 
+ * @brief Count outgoing connection on the backend for its remote address.
+ *
+ * The connection is linked to the backend, so that it is uncounted from the
+ * same backend when it is removed. Connections already counted and
+ * listening connections are not counted.
+ * 
+ * @ingroup lbstat
+ * @param lb The statistics.
+ * @param conn_p The connection.
+ */
+void lb_add( struct lb_stats *lb, struct tcp_connection *conn_p )
+{
+        struct lb_backend *backend;
+        struct lb_bucket *bucket, *prev, *next;
+        struct lb_pool *pool;
+        uint32_t hash;
+        int count;
+
+        if ( conn_p->backend != NULL || conn_p->state == TCP_LISTEN ) 
+                return;
+
+        hash = hash_backend( &conn_p->key );
+        backend = find_backend( lb, &conn_p->key, hash );
+        if ( backend == NULL ) {
+                pool = get_pool( lb, &conn_p->key );
+                backend = mem_zalloc( sizeof( *backend ));
+                backend->pool = pool;
+                memcpy( backend->raddr, conn_p->key.raddr, 16 );
+                hash_index_add( &lb->backend_index, &backend->link, hash );
+                lb->backends++;
+                pool->backends++;
+                /* New backend goes to the bucket for count 1 */
+                count = 0;
+                prev = NULL;
+                next = pool->head;
+        } else {
+                pool = backend->pool;
+                bucket = backend->bucket;
+                count = bucket->count;
+                prev = bucket->size > 1 ? bucket : bucket->prev;
+                next = bucket->next;
+                bucket_unlink( pool, backend );
+        }
+        bucket_link( pool, backend, count + 1, prev, next );
+        /* (c + 1)^2 - c^2 */
+        pool->sumsq += 2 * count + 1;
+        pool->conns++;
+        conn_p->backend = backend;
+}
+
+/** 
+ * @brief Uncount connection from its backend.
+ *
+ * Can be called for any connection, only the connections counted with
+ * lb_add() are uncounted (once). Backends and pools left without
+ * connections are removed.
+ * 
+ * @ingroup lbstat
+ * @param lb The statistics.
+ * @param conn_p The connection.
+ */
+void lb_remove( struct lb_stats *lb, struct tcp_connection *conn_p )
+{
+        struct lb_backend *backend = conn_p->backend;
+        struct lb_bucket *bucket, *prev, *next;
+        struct lb_pool *pool;
+        int count;
+
+        if ( backend == NULL ) 
+                return;
+        conn_p->backend = NULL;
+
+        pool = backend->pool;
+        bucket = backend->bucket;
+        count = bucket->count;
+        prev = bucket->prev;
+        next = bucket->size > 1 ? bucket : bucket->next;
+        bucket_unlink( pool, backend );
+        /* (c - 1)^2 - c^2 */
+        pool->sumsq -= 2 * count - 1;
+        pool->conns--;
+
+        if ( count > 1 ) {
+                bucket_link( pool, backend, count - 1, prev, next );
+                return;
+        }
+        hash_index_remove( &lb->backend_index, &backend->link );
+        mem_free( backend );
+        lb->backends--;
+        pool->backends--;
+        if ( pool->backends == 0 ) 
+                remove_pool( lb, pool );
+}
+
+/** 
+ * @brief Calculate the distribution figures for pool.
+ *
+ * The Gini coefficient is calculated over the buckets, the backends on a
+ * bucket have consecutive ranks when the counts are sorted. 
+ * 
+ * @ingroup lbstat
+ * @param pool The pool.
+ * @param summary The figures are set here.
+ */
+void lb_pool_summary( struct lb_pool *pool, struct lb_summary *summary )
+{
+        struct lb_bucket *bucket;
+        double n = pool->backends, variance, sum = 0;
+        int rank = 0;
+
+        memset( summary, 0, sizeof( *summary ));
+        if ( pool->backends == 0 ) 
+                return;
+        summary->min = pool->head->count;
+        summary->max = pool->tail->count;
+        summary->mean = pool->conns / n;
+        variance = pool->sumsq / n - summary->mean * summary->mean;
+        summary->stddev = variance > 0 ? sqrt( variance ) : 0;
+
+        /* sum of (2i - n - 1) * x_i over the sorted counts, i = 1..n */
+        for ( bucket = pool->head; bucket != NULL; bucket = bucket->next ) {
+                sum += (double)bucket->count * bucket->size * 
+                        ( 2 * rank + bucket->size - pool->backends );
+                rank += bucket->size;
+        }
+        summary->gini = sum / ( n * pool->conns );
+}
+
+/** 
+ * @brief Format the address of backend for printing.
+ * 
+ * @ingroup lbstat
+ * @param backend The backend.
+ * @param buf Buffer for the string.
+ * @param buflen Length of the buffer.
+ * 
+ * @return Pointer to @a buf.
+ */
+char *lb_format_backend( struct lb_backend *backend, char *buf, int buflen )
+{
+        /* IPv4 addresses are kept as IPv4 mapped on the key */
+        int offset = backend->pool->family == AF_INET ? 12 : 0;
+
+        if ( inet_ntop( backend->pool->family, backend->raddr + offset, buf, 
+                                buflen ) == NULL ) 
+                snprintf( buf, buflen, "?" );
+        return buf;
+}
+
+/**
+ * Callback for counting the connections on hashtable.
+ */
+static void add_connection( struct tcp_connection *conn_p, void *data )
+{
+        if ( conn_p->state != TCP_DEAD && conn_p->metadata.dir == DIR_OUTBOUND ) 
+                lb_add( (struct lb_stats *)data, conn_p );
+}
+
+/** 
+ * @brief Count all outgoing connections on hashtable.
+ *
+ * Needed only when the statistics are started with connections already on
+ * the hashtable.
+ * 
+ * @ingroup lbstat
+ * @param lb The statistics.
+ * @param table_p The hashtable.
+ */
+void lb_add_all( struct lb_stats *lb, struct chashtable *table_p )
+{
+        chash_walk( table_p, add_connection, lb );
+}
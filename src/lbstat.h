@@ -0,0 +1,134 @@
+/**
+ * @file lbstat.h
+ * @brief Distribution of outgoing connections over the backends of a remote
+ * port.
+ *
+ * Outgoing connections are aggregated on two levels: the pool is the remote
+ * port (and address family), the backends of the pool are the remote
+ * addresses connected to on that port. The connection counts of the backends
+ * are kept on buckets of equal count, sorted by the count, so that a
+ * connection coming or going only moves one backend to the neighbouring
+ * bucket and the minimum, maximum and the imbalance of the pool can be read
+ * without looking at every backend.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _LBSTAT_H_
+#define _LBSTAT_H_
+
+#include "hash.h"
+
+/**
+ * Initial number of hash chains for the pools, the index is grown as the
+ * pools are added.
+ */
+#define LB_POOL_CHAINS 256
+/**
+ * Initial number of hash chains for the backends, the index is grown as the
+ * backends are added.
+ */
+#define LB_BACKEND_CHAINS 256
+
+struct lb_bucket;
+struct lb_pool;
+
+/**
+ * One remote address on a pool.
+ * @ingroup lbstat
+ */
+struct lb_backend {
+        struct hash_link link; /**< Link on the backend index */
+        uint8_t raddr[16]; /**< Remote address (network byte order) */
+        struct lb_pool *pool; /**< The pool the backend is on */
+        struct lb_bucket *bucket; /**< Bucket holding the connection count */
+        struct lb_backend *prev; /**< Previous backend on the bucket */
+        struct lb_backend *next; /**< Next backend on the bucket */
+};
+
+/**
+ * Backends of a pool with the same number of connections.
+ * @ingroup lbstat
+ */
+struct lb_bucket {
+        int count; /**< Number of connections to each backend on bucket */
+        int size; /**< Number of backends on bucket */
+        struct lb_backend *backends; /**< Backends on the bucket */
+        struct lb_bucket *prev; /**< Bucket with the next smaller count */
+        struct lb_bucket *next; /**< Bucket with the next larger count */
+};
+
+/**
+ * Outgoing connections toward one remote port.
+ * @ingroup lbstat
+ */
+struct lb_pool {
+        struct hash_link link; /**< Link on the pool index */
+        uint32_t family; /**< Address family */
+        in_port_t rport; /**< Remote port (network byte order) */
+        int backends; /**< Number of backends on the pool */
+        int conns; /**< Number of connections on the pool */
+        uint64_t sumsq; /**< Sum of the squared connection counts */
+        struct lb_bucket *head; /**< Bucket with the smallest count */
+        struct lb_bucket *tail; /**< Bucket with the largest count */
+};
+
+/**
+ * Distribution figures for a pool.
+ * @ingroup lbstat
+ */
+struct lb_summary {
+        int min; /**< Smallest number of connections on a backend */
+        int max; /**< Largest number of connections on a backend */
+        double mean; /**< Average number of connections on a backend */
+        double stddev; /**< Standard deviation of the connection counts */
+        double gini; /**< Gini coefficient, 0 for even distribution */
+};
+
+/**
+ * Pools and backends of all outgoing connections.
+ * @ingroup lbstat
+ */
+struct lb_stats {
+        int pools; /**< Number of pools */
+        int backends; /**< Number of backends on all pools */
+        struct hash_index backend_index; /**< Backends by remote endpoint */
+        struct hash_index pool_index; /**< Pools by remote port */
+};
+
+struct lb_stats *lb_stats_init( void );
+void lb_stats_deinit( struct lb_stats *lb );
+void lb_add( struct lb_stats *lb, struct tcp_connection *conn_p );
+void lb_remove( struct lb_stats *lb, struct tcp_connection *conn_p );
+void lb_add_all( struct lb_stats *lb, struct chashtable *table_p );
+void lb_pool_summary( struct lb_pool *pool, struct lb_summary *summary );
+char *lb_format_backend( struct lb_backend *backend, char *buf, int buflen );
+
+#endif /* _LBSTAT_H_ */
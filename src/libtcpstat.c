@@ -0,0 +1,642 @@
+/**
+ * @file libtcpstat.c
+ * @brief API for embedding the connection collector.
+ *
+ * The update round of the collector is split to tcpstat_tick(), which reads
+ * the connections and updates the groups, and tcpstat_tick_done() which
+ * clears the flags telling what changed on the round. The user looks at the
+ * groups between them.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_STAT
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "scouts.h"
+#include "record.h"
+#include "cloud.h"
+#include "groupkey.h"
+#include "dnscache.h"
+#include "portmon.h"
+#include "lbstat.h"
+#include "overflow.h"
+#include "arena.h"
+#include "libtcpstat.h"
+
+/**
+ * @defgroup libtcpstat Collector library
+ */
+
+#ifdef ENABLE_FOLLOW_PID
+/** 
+ * @brief Check if any process we are following has died. 
+ *
+ * The scan_inodes() sets <code>->pid</code> to -1 if it detects that process
+ * has died. Remove all those pidinfo structures. If the connection group
+ * inside pidinfo is not empty, then there are some connections still in the
+ * system for the dead process and such pidinfo is not removed. 
+ * 
+ * @see scan_inodes()
+ * 
+ * @param ctx Pointer to the main context.
+ * 
+ * @return Number of still alive connections. 
+ */
+static int check_dead_processes( struct stat_context *ctx )
+{
+        struct pidinfo *info_p, *prev, *next;
+        int alive_count = 0;
+
+        prev = NULL;
+        info_p = ctx->pinfo;
+
+        while ( info_p != NULL ) {
+                next = info_p->next;
+                if ( info_p->pid == -1 ) {
+                        DBG( "Found dead process\n" );
+                        if ( group_get_size( info_p->grp ) == 0 ) {
+                                if ( prev == NULL ) {
+                                        ctx->pinfo = next;
+                                } else {
+                                        prev->next = next;
+                                }
+                                free_pidinfo( info_p );
+                        } else {
+                                DBG( "Connections on dead processes group!\n" );
+                                /* we cheat, on purpose */
+                                alive_count++;
+                                prev = info_p;
+                                /* We just have to wait for these connections
+                                 * to die out 
+                                 */
+                        }
+                } else {
+                        alive_count++;
+                        prev = info_p;
+                }
+                info_p = next;
+        }
+        return alive_count;
+}
+
+/**
+ * Clear the metadata from the connections stored into pidinfo 
+ * structures. 
+ *
+ * In follow pid -mode we do not hold the connections in the
+ * listen_groups and out_groups, instead they are in the pidinfos. 
+ *
+ * @param ctx Pointer to the global context.
+ */
+static void clear_pid_metadata( struct stat_context *ctx ) 
+{
+        struct pidinfo *info_p = ctx->pinfo;
+
+        while( info_p != NULL ) {
+                group_clear_metadata_flags( info_p->grp );
+                info_p = info_p->next;
+        }
+}
+#endif /* ENABLE_FOLLOW_PID */
+
+/**
+ * Pass the status messages from connection utilities to subscribers.
+ */
+static void status_to_subscribers( const char *msg, void *arg )
+{
+        struct stat_context *ctx = arg;
+
+        TCPSTAT_EMIT( ctx, TCPSTAT_EV_STATUS, NULL, msg );
+}
+
+/** 
+ * @brief Allocate context for the collector.
+ *
+ * The context is initialized with default options, which can be changed
+ * before tcpstat_start() is called.
+ * 
+ * @ingroup libtcpstat
+ * @return Pointer to the new context.
+ */
+struct stat_context *tcpstat_init( void )
+{
+        struct stat_context *ctx;
+
+        ctx = mem_alloc( sizeof( struct stat_context) );
+        memset( ctx,0, sizeof( *ctx));
+        ctx->ops = 0;
+        ctx->listen_groups = glist_init();
+        ctx->out_groups = glist_init();
+        ctx->newq = cqueue_init();
+        ctx->chash = chash_init();
+        ctx->scratch = arena_init( ARENA_DEFAULT_SIZE );
+        ctx->new_count = 0;
+        ctx->total_count = 0;
+        ctx->common_policy = DEFAULT_POLICY;
+        ctx->update_interval = DEFAULT_UPDATE_INT;
+        ctx->pinfo = NULL;
+        ctx->collected_stats = STAT_ALL;
+        ctx->filters = filtlist_init(FIRST_MATCH);
+        ctx->cloud_window = CLOUD_DEFAULT_WINDOW;
+        ctx->max_groups = OVERFLOW_DEFAULT_MAX_GROUPS;
+#ifdef ENABLE_FOLLOW_PID
+        ctx->pid_workers = DEFAULT_PID_WORKERS;
+#endif /* ENABLE_FOLLOW_PID */
+#ifdef ENABLE_BPF_EVENTS
+        ctx->reconcile_rounds = DEFAULT_RECONCILE_ROUNDS;
+#endif /* ENABLE_BPF_EVENTS */
+
+        return ctx;
+}
+
+/** 
+ * @brief Start collecting with the options set on context.
+ *
+ * The interfaces and routes are scanned and the event sources enabled on the
+ * context are opened. If an event source is not available, the collector
+ * falls back to polling and TCPSTAT_EV_NOTICE is reported.
+ * 
+ * @ingroup libtcpstat
+ * @param ctx Pointer to the context.
+ * @return 0 on success, -1 if interfaces could not be scanned.
+ */
+int tcpstat_start( struct stat_context *ctx )
+{
+#ifdef ENABLE_FOLLOW_PID
+        if ( OPERATION_ENABLED( ctx, OP_FOLLOW_PID ) && ctx->pscan == NULL )
+                ctx->pscan = pid_scanner_init( ctx->pid_workers );
+#endif /* ENABLE_FOLLOW_PID */
+
+        ctx->iftab = scout_ifs();
+        if ( ctx->iftab == NULL ) {
+                ERROR( "Error in initializing the interface stats!\n" );
+                return -1;
+        }
+        DBG( "Scouted %d interfaces\n", ctx->iftab->size );
+
+#ifdef ENABLE_ROUTES
+        DBG("Adding routing info\n");
+        parse_routing_info(ctx->iftab);
+#endif /* ENABLE_ROUTES */
+        connection_set_status_hook( status_to_subscribers, ctx );
+
+#ifdef ENABLE_DIAG_EVENTS
+        if ( OPERATION_ENABLED( ctx, OP_DIAG_EVENTS )) {
+                ctx->diag = diag_events_init( ctx );
+                if ( ctx->diag == NULL ) {
+                        /* Fall back to polling only */
+                        OPERATION_DISABLE( ctx, OP_DIAG_EVENTS );
+                        TCPSTAT_EMIT( ctx, TCPSTAT_EV_NOTICE, NULL,
+                                        "Closed connection events not available, polling only" );
+                }
+        }
+#endif /* ENABLE_DIAG_EVENTS */
+#ifdef ENABLE_BPF_EVENTS
+        if ( OPERATION_ENABLED( ctx, OP_BPF_EVENTS )) {
+                ctx->bpf = bpf_events_init( ctx );
+                if ( ctx->bpf == NULL ) {
+                        /* Fall back to polling every round */
+                        OPERATION_DISABLE( ctx, OP_BPF_EVENTS );
+                        TCPSTAT_EMIT( ctx, TCPSTAT_EV_NOTICE, NULL,
+                                        "State change events not available, polling only" );
+                }
+        }
+#endif /* ENABLE_BPF_EVENTS */
+#ifdef ENABLE_SOCK_MEM
+        if ( OPERATION_ENABLED( ctx, OP_SOCK_MEM )) {
+                ctx->smem = sock_mem_init();
+                if ( ctx->smem == NULL ) {
+                        OPERATION_DISABLE( ctx, OP_SOCK_MEM );
+                        TCPSTAT_EMIT( ctx, TCPSTAT_EV_NOTICE, NULL,
+                                        "Socket memory not available" );
+                }
+        }
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_CONNTRACK
+        if ( ctx->gkey != NULL && ( gkey_plan_has_field( ctx->gkey, GKEY_PEER ) ||
+                                gkey_plan_has_field( ctx->gkey, GKEY_PEERPORT )))
+                OPERATION_ENABLE( ctx, OP_CONNTRACK );
+        if ( OPERATION_ENABLED( ctx, OP_CONNTRACK )) {
+                ctx->ct = ct_table_init( ctx );
+                if ( ctx->ct == NULL ) {
+                        OPERATION_DISABLE( ctx, OP_CONNTRACK );
+                        TCPSTAT_EMIT( ctx, TCPSTAT_EV_NOTICE, NULL,
+                                        "Connection tracking table not available (needs CAP_NET_ADMIN)" );
+                }
+        }
+#endif /* ENABLE_CONNTRACK */
+        /* Everything on the first round is new, load it in bulk */
+        ctx->bulk = 1;
+        return 0;
+}
+
+/** 
+ * @brief Do one update round.
+ *
+ * The collectors are read and the connections are updated to the groups.
+ * The flags telling which connections are new or changed are kept until
+ * tcpstat_tick_done() is called.
+ * 
+ * @ingroup libtcpstat
+ * @param ctx Pointer to the context.
+ * @return 0 on success, -1 on error or TCPSTAT_TICK_NO_PROCESSES if none of
+ * the followed processes is alive.
+ */
+int tcpstat_tick( struct stat_context *ctx )
+{
+#ifdef ENABLE_BPF_EVENTS
+        int poll = 1;
+#endif /* ENABLE_BPF_EVENTS */
+
+        /* Scratch allocations of the previous round (also by the user) are
+         * released here */
+        arena_reset( ctx->scratch );
+#ifdef ENABLE_FOLLOW_PID
+        if ( OPERATION_ENABLED(ctx,OP_FOLLOW_PID) ) 
+                scan_inodes( ctx->pinfo, ctx->pscan );
+#endif /* ENABLE_FOLLOW_PID */
+
+#ifdef ENABLE_IFSTATS
+        if ( OPERATION_ENABLED(ctx, OP_IFSTATS ))
+                read_interface_stat( ctx );
+#endif /* ENABLE_IFSTATS */
+#ifdef ENABLE_SNMP_STATS
+        if ( ctx->snmp != NULL && ( OPERATION_ENABLED(ctx, OP_SNMP_STATS) ||
+                                ctx->snmp->export != NULL )) {
+                read_snmp_stats( ctx->snmp );
+                if ( ctx->snmp->export != NULL )
+                        snmp_stats_export( ctx->snmp, ctx->snmp->export );
+        }
+#endif /* ENABLE_SNMP_STATS */
+#ifdef ENABLE_CONNTRACK
+        /* Before the poll, new connections look up their entries */
+        if ( ctx->ct != NULL )
+                read_conntrack( ctx );
+#endif /* ENABLE_CONNTRACK */
+#ifdef ENABLE_DIAG_EVENTS
+        /* Events first, the poll will then reconcile */
+        if ( ctx->diag != NULL )
+                read_diag_events( ctx );
+#endif /* ENABLE_DIAG_EVENTS */
+#ifdef ENABLE_BPF_EVENTS
+        /* Transitions first, every now and then (or when transitions were
+         * lost) reconcile with poll */
+        if ( ctx->bpf != NULL ) {
+                poll = ( ctx->round % ctx->reconcile_rounds ) == 0;
+                poll = read_bpf_events( ctx, poll );
+        }
+        if ( poll ) {
+                long start = connection_now_usecs();
+
+                if (read_tcp_stat(ctx) != 0 ) {
+                        ERROR("Error while reading TCP connections \n");
+                        return -1;
+                }
+                if ( ctx->bpf != NULL ) 
+                        ctx->bpf->poll_usecs = connection_now_usecs() - start;
+        }
+#else
+        if (read_tcp_stat(ctx) != 0 ) {
+                ERROR("Error while reading TCP connections \n");
+                return -1;
+        }
+#endif /* ENABLE_BPF_EVENTS */
+#ifdef ENABLE_FOLLOW_PID
+        if ( ! OPERATION_ENABLED(ctx, OP_FOLLOW_PID)) {
+                rotate_new_queue( ctx );
+        }
+#else
+        rotate_new_queue(ctx);
+#endif /* ENABLE_FOLLOW_PID */
+        ctx->bulk = 0;
+        ctx->round++;
+
+        if ( ctx->total_count != ctx->chash->size ) {
+                int count = ctx->chash->size - ctx->total_count;
+                TRACE( "Going to purge connections (total %d, hash %d)\n", ctx->total_count, ctx->chash->size );
+                /* Some connections have to be deleted. */
+                if ( count > 0 ) {
+                        if ( purge_closed_connections( ctx, count ) != 0 ) {
+                                WARN( "Purge closed blew it \n" );
+                                return -1;
+                        }
+                }
+        }  
+        /* Free the groups emptied by purge */
+        glist_reclaim( ctx->out_groups );
+        glist_reclaim( ctx->listen_groups );
+#ifdef ENABLE_FOLLOW_PID
+        if ( OPERATION_ENABLED( ctx, OP_FOLLOW_PID) ) {
+                if ( check_dead_processes( ctx ) == 0 ) 
+                        return TCPSTAT_TICK_NO_PROCESSES;
+        }
+#endif /* ENABLE_FOLLOW_PID */
+#ifdef ENABLE_SOCK_MEM
+        if ( ctx->smem != NULL && OPERATION_ENABLED( ctx, OP_SOCK_MEM ))
+                read_sock_mem( ctx );
+#endif /* ENABLE_SOCK_MEM */
+        if ( ctx->recorder != NULL )
+                record_round( ctx->recorder, ctx );
+
+        return 0;
+}
+
+/** 
+ * @brief Finish the update round.
+ *
+ * The flags telling which connections were new or updated on the round are
+ * cleared, this way we'll notice new connections (and dead) on the next
+ * round.
+ * 
+ * @ingroup libtcpstat
+ * @param ctx Pointer to the context.
+ */
+void tcpstat_tick_done( struct stat_context *ctx )
+{
+        struct filter *filt;
+
+        if ( ctx->dns != NULL )
+                dns_cache_tick( ctx->dns );
+
+#ifdef ENABLE_FOLLOW_PID 
+        if ( OPERATION_ENABLED( ctx, OP_FOLLOW_PID )) {
+                clear_pid_metadata( ctx );
+        } else {
+                clear_metadata_flags( ctx->listen_groups );
+                clear_metadata_flags( ctx->out_groups );
+        }
+#else /* ENABLE_FOLLOW_PID */
+        clear_metadata_flags(ctx->listen_groups);
+        clear_metadata_flags(ctx->out_groups);
+#endif /* ENABLE_FOLLOW_PID */
+
+        /* clear the metadata flags from the filtered connections */
+        filtlist_foreach_filter( ctx->filters, filt ) {
+                if ( filt->group != NULL )
+                        group_clear_metadata_flags( filt->group );
+        }
+
+        ctx->new_count = 0;
+        ctx->total_count = 0;
+        ctx->unsampled_count = 0;
+}
+
+/** 
+ * @brief Free the context and everything collected.
+ * 
+ * @ingroup libtcpstat
+ * @param ctx Pointer to the context.
+ */
+void tcpstat_deinit( struct stat_context *ctx )
+{
+        struct tcpstat_sub *sub;
+#ifdef ENABLE_FOLLOW_PID
+        struct pidinfo *info_p;
+#endif /* ENABLE_FOLLOW_PID */
+
+        connection_set_status_hook( NULL, NULL );
+        if ( ctx->iftab != NULL ) 
+                deinit_ifinfo_tab( ctx->iftab );
+        /* Hashtable has to be cleared befor any connections are deleted. Else
+         * we end up with pointers to freed connections on hashtable. 
+         */
+        chash_clear( ctx->chash );
+        /* Free all pidinfo structures */
+#ifdef ENABLE_FOLLOW_PID
+        info_p = ctx->pinfo;
+        while (info_p != NULL ) {
+                struct pidinfo *tmp = info_p->next;
+                free_pidinfo( info_p );
+                info_p = tmp;
+        }
+        if ( ctx->pscan != NULL )
+                pid_scanner_deinit( ctx->pscan );
+#endif /* ENABLE_FOLLOW_PID */
+#ifdef ENABLE_DIAG_EVENTS
+        if ( ctx->diag != NULL )
+                diag_events_deinit( ctx->diag );
+#endif /* ENABLE_DIAG_EVENTS */
+#ifdef ENABLE_BPF_EVENTS
+        if ( ctx->bpf != NULL )
+                bpf_events_deinit( ctx->bpf );
+#endif /* ENABLE_BPF_EVENTS */
+        filtlist_deinit( ctx->filters );
+        if ( ctx->recorder != NULL )
+                recorder_deinit( ctx->recorder );
+        if ( ctx->dns != NULL ) {
+                connection_set_dns_cache( NULL );
+                dns_cache_deinit( ctx->dns );
+        }
+#ifdef ENABLE_SOCK_MEM
+        if ( ctx->smem != NULL )
+                sock_mem_deinit( ctx->smem );
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_PORT_MONITOR
+        if ( ctx->ports != NULL )
+                portmon_deinit( ctx->ports );
+#endif /* ENABLE_PORT_MONITOR */
+        if ( ctx->lb != NULL )
+                lb_stats_deinit( ctx->lb );
+#ifdef ENABLE_CONNTRACK
+        if ( ctx->ct != NULL )
+                ct_table_deinit( ctx->ct );
+#endif /* ENABLE_CONNTRACK */
+#ifdef ENABLE_SNMP_STATS
+        if ( ctx->snmp != NULL ) {
+                if ( ctx->snmp->export != NULL && ctx->snmp->export != stdout )
+                        fclose( ctx->snmp->export );
+                snmp_stats_deinit( ctx->snmp );
+        }
+#endif /* ENABLE_SNMP_STATS */
+
+        /* Before the connections on the overflow group are freed */
+        if ( ctx->ovf != NULL )
+                overflow_deinit( ctx->ovf );
+        cqueue_deinit( ctx->newq, 1 );
+        glist_deinit( ctx->listen_groups,1  );
+        glist_deinit( ctx->out_groups,1 );
+        if ( ctx->clouds != NULL )
+                cloud_index_deinit( ctx->clouds );
+        if ( ctx->gkeys != NULL )
+                gkey_index_deinit( ctx->gkeys );
+        arena_deinit( ctx->scratch );
+        if ( ctx->gkey != NULL )
+                gkey_plan_deinit( ctx->gkey );
+        chash_deinit( ctx->chash );
+
+        while ( ( sub = ctx->subs ) != NULL ) {
+                ctx->subs = sub->next;
+                mem_free( sub );
+        }
+        mem_free( ctx );
+}
+
+/** 
+ * @brief Subscribe events from the collector.
+ *
+ * The function is called synchronously while the event is handled, i.e.
+ * from tcpstat_start(), tcpstat_tick() or while names are resolved. It
+ * should not modify the groups or connections.
+ * 
+ * @ingroup libtcpstat
+ * @param ctx Pointer to the context.
+ * @param mask The events (enum tcpstat_event) to subscribe.
+ * @param fn Function receiving the events.
+ * @param arg Argument passed to the function.
+ * @return 0 on success, -1 on error.
+ */
+int tcpstat_subscribe( struct stat_context *ctx, unsigned int mask,
+                tcpstat_event_fn fn, void *arg )
+{
+        struct tcpstat_sub *sub;
+
+        if ( fn == NULL || ( mask & TCPSTAT_EV_ALL ) == 0 ) 
+                return -1;
+
+        sub = mem_alloc( sizeof( *sub ));
+        sub->mask = mask;
+        sub->fn = fn;
+        sub->arg = arg;
+        sub->next = ctx->subs;
+        ctx->subs = sub;
+        return 0;
+}
+
+/** 
+ * @brief Report event to the subscribers.
+ *
+ * Use TCPSTAT_EMIT() which skips the call when nothing is subscribed.
+ * 
+ * @ingroup libtcpstat
+ * @param ctx Pointer to the context.
+ * @param ev The event.
+ * @param conn_p The connection for the event, NULL for messages.
+ * @param msg The message, NULL for connection events.
+ */
+void tcpstat_emit( struct stat_context *ctx, enum tcpstat_event ev,
+                struct tcp_connection *conn_p, const char *msg )
+{
+        struct tcpstat_sub *sub;
+
+        for ( sub = ctx->subs; sub != NULL; sub = sub->next ) {
+                if ( sub->mask & ev ) 
+                        sub->fn( ev, conn_p, msg, sub->arg );
+        }
+}
+
+/** 
+ * @brief Call function for each group on list.
+ *
+ * Outgoing connections folded over the group limit are on the group having
+ * GROUP_F_OVERFLOW set. The groups of followed processes are only used when
+ * OP_FOLLOW_PID is enabled, the other lists are empty then.
+ * 
+ * @ingroup libtcpstat
+ * @param ctx Pointer to the context.
+ * @param which The groups to iterate.
+ * @param fn Function to call.
+ * @param arg Argument passed to the function.
+ * @return Value returned by function if it stopped the iteration, else 0.
+ */
+int tcpstat_foreach_group( struct stat_context *ctx, enum tcpstat_groups which,
+                tcpstat_group_fn fn, void *arg )
+{
+        struct glist *list = NULL;
+        struct group *grp;
+        int rv;
+
+        switch ( which ) {
+                case TCPSTAT_LISTEN_GROUPS :
+                        list = ctx->listen_groups;
+                        break;
+                case TCPSTAT_OUT_GROUPS :
+                        list = ctx->out_groups;
+                        break;
+                case TCPSTAT_PID_GROUPS :
+#ifdef ENABLE_FOLLOW_PID
+                        {
+                                struct pidinfo *info_p;
+
+                                for ( info_p = ctx->pinfo; info_p != NULL; info_p = info_p->next ) {
+                                        if ( ( rv = fn( info_p->grp, arg )) != 0 ) 
+                                                return rv;
+                                }
+                        }
+#endif /* ENABLE_FOLLOW_PID */
+                        return 0;
+        }
+        if ( list == NULL ) 
+                return 0;
+
+        glist_foreach_group( list, grp ) {
+                if ( ( rv = fn( grp, arg )) != 0 ) 
+                        return rv;
+        }
+        return 0;
+}
+
+/** 
+ * @brief Call function for each connection on group.
+ *
+ * The parent connection (listening socket) of group is not included, it can
+ * be get with group_get_parent().
+ * 
+ * @ingroup libtcpstat
+ * @param grp The group.
+ * @param fn Function to call.
+ * @param arg Argument passed to the function.
+ * @return Value returned by function if it stopped the iteration, else 0.
+ */
+int tcpstat_foreach_connection( struct group *grp, tcpstat_conn_fn fn, void *arg )
+{
+        struct tcp_connection *conn_p;
+        int rv;
+
+        for ( conn_p = group_get_first_conn( grp ); conn_p != NULL; 
+                        conn_p = conn_p->next ) {
+                if ( ( rv = fn( conn_p, arg )) != 0 ) 
+                        return rv;
+        }
+        return 0;
+}
@@ -0,0 +1,176 @@
+/**
+ * @file libtcpstat.h
+ * @brief API for embedding the connection collector.
+ *
+ * The collector (scouts, connection tracking and grouping) is built to
+ * libtcpstat, the ncurses front end is one user of it. A program embedding
+ * the collector does:
+ *
+ * @code
+ * struct stat_context *ctx = tcpstat_init();
+ * tcpstat_subscribe( ctx, TCPSTAT_EV_NEW | TCPSTAT_EV_CLOSED, on_event, arg );
+ * if ( tcpstat_start( ctx ) != 0 ) 
+ *         ...
+ * while ( running ) {
+ *         if ( tcpstat_tick( ctx ) < 0 ) 
+ *                 break;
+ *         tcpstat_foreach_group( ctx, TCPSTAT_OUT_GROUPS, on_group, arg );
+ *         tcpstat_tick_done( ctx );
+ *         sleep( ctx->update_interval );
+ * }
+ * tcpstat_deinit( ctx );
+ * @endcode
+ *
+ * Options (grouping policy, filters, operations) are set on the context
+ * between tcpstat_init() and tcpstat_start(). Optional collectors (name
+ * cache, port monitor, kernel counters, recorder) are set on the context with
+ * their own init functions, they are freed by tcpstat_deinit().
+ *
+ * Like the other headers, this one expects defs.h, connection.h and stat.h
+ * to be included before it. defs.h takes the platform the library was built
+ * for from the installed tcpstat_config.h, no -D flags are needed.
+ *
+ * The library is not thread safe, all calls for one context should be done
+ * from the same thread. Only one context can be started at a time, since
+ * the status messages from resolving names are routed to the last started
+ * context.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _LIBTCPSTAT_H_
+#define _LIBTCPSTAT_H_
+
+/**
+ * Default interval between updates (seconds).
+ */
+#define DEFAULT_UPDATE_INT 1
+/**
+ * Default start-up policy
+ */
+#define DEFAULT_POLICY  POLICY_REMOTE | POLICY_ADDR
+
+/**
+ * Events the collector reports to subscribers.
+ * @ingroup libtcpstat
+ */
+enum tcpstat_event {
+        /** Status of slow operation (@a msg), NULL @a msg when done */
+        TCPSTAT_EV_STATUS = 0x01,
+        /** Notice for user (@a msg), e.g. collector not available */
+        TCPSTAT_EV_NOTICE = 0x02,
+        /** New connection seen (@a conn_p), it is not yet grouped */
+        TCPSTAT_EV_NEW = 0x04,
+        /** Connection (@a conn_p) changed state */
+        TCPSTAT_EV_STATE = 0x08,
+        /** Connection (@a conn_p) is closed and about to be deleted */
+        TCPSTAT_EV_CLOSED = 0x10,
+};
+
+/**
+ * Mask for subscribing all events.
+ * @ingroup libtcpstat
+ */
+#define TCPSTAT_EV_ALL 0x1f
+
+/**
+ * The group lists which can be iterated.
+ * @ingroup libtcpstat
+ */
+enum tcpstat_groups {
+        TCPSTAT_LISTEN_GROUPS, /**< Listening sockets and incoming connections */
+        TCPSTAT_OUT_GROUPS, /**< Outgoing connections */
+        TCPSTAT_PID_GROUPS, /**< Connections of the followed processes */
+};
+
+/**
+ * Return value from tcpstat_tick() when none of the followed processes is
+ * alive anymore.
+ * @ingroup libtcpstat
+ */
+#define TCPSTAT_TICK_NO_PROCESSES 1
+
+struct tcp_connection;
+struct group;
+struct stat_context;
+
+/**
+ * Function receiving events. Either @a conn_p or @a msg is set, depending
+ * on the event. The connection is only valid during the call.
+ * @ingroup libtcpstat
+ */
+typedef void (*tcpstat_event_fn)( enum tcpstat_event ev, 
+                struct tcp_connection *conn_p, const char *msg, void *arg );
+/**
+ * Function called for each group, non-zero return value stops the iteration.
+ * @ingroup libtcpstat
+ */
+typedef int (*tcpstat_group_fn)( struct group *grp, void *arg );
+/**
+ * Function called for each connection, non-zero return value stops the
+ * iteration.
+ * @ingroup libtcpstat
+ */
+typedef int (*tcpstat_conn_fn)( struct tcp_connection *conn_p, void *arg );
+
+/**
+ * Subscription for events.
+ * @ingroup libtcpstat
+ */
+struct tcpstat_sub {
+        unsigned int mask; /**< The events (enum tcpstat_event) subscribed */
+        tcpstat_event_fn fn; /**< Function receiving the events */
+        void *arg; /**< Argument for the function */
+        struct tcpstat_sub *next; /**< Next subscription */
+};
+
+/**
+ * Report event to subscribers, does nothing if there are no subscriptions.
+ * @ingroup libtcpstat
+ */
+#define TCPSTAT_EMIT( ctx, ev, conn_p, msg ) do { \
+        if ( (ctx)->subs != NULL ) \
+                tcpstat_emit( ctx, ev, conn_p, msg ); \
+} while ( 0 )
+
+struct stat_context *tcpstat_init( void );
+int tcpstat_start( struct stat_context *ctx );
+int tcpstat_tick( struct stat_context *ctx );
+void tcpstat_tick_done( struct stat_context *ctx );
+void tcpstat_deinit( struct stat_context *ctx );
+int tcpstat_subscribe( struct stat_context *ctx, unsigned int mask,
+                tcpstat_event_fn fn, void *arg );
+void tcpstat_emit( struct stat_context *ctx, enum tcpstat_event ev,
+                struct tcp_connection *conn_p, const char *msg );
+int tcpstat_foreach_group( struct stat_context *ctx, enum tcpstat_groups which,
+                tcpstat_group_fn fn, void *arg );
+int tcpstat_foreach_connection( struct group *grp, tcpstat_conn_fn fn, void *arg );
+
+#endif /* _LIBTCPSTAT_H_ */
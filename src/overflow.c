@@ -0,0 +1,317 @@
+/**
+ * @file overflow.c
+ * @brief Folding of the least recently active outgoing groups.
+ *
+ * With grouping by remote address (or key containing it) a port scan or a
+ * storm of clients creates a group, and a filter, for every peer. To keep the
+ * memory and the time spent on matching new connections bounded, only a
+ * limited number of outgoing groups are kept. When a new group would exceed
+ * the limit, the least recently active groups are folded to one "Other" group
+ * which takes their connections and the durations recorded for them.
+ *
+ * Activity for the group is the time a connection was last added to the
+ * group or a connection on it changed state. When a connection for a folded
+ * group is seen again, a new group is created for it (folding some other group
+ * in its place) and the connections on the overflow group belonging to the
+ * new group are taken back. The connections on the overflow group are indexed
+ * by the hash of the grouping selectors, so only the connections with the
+ * same hash as the new group are looked at.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_GRP
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "hash.h"
+#include "cloud.h"
+#include "groupkey.h"
+#include "overflow.h"
+#include "arena.h"
+
+/**
+ * @defgroup ovf Overflow of outgoing groups
+ */
+
+/** 
+ * @brief Initialize the overflow state.
+ * 
+ * @ingroup ovf
+ * @param max_groups Maximum number of live groups.
+ * @param policy The grouping policy.
+ * @param plan Plan for the grouping key, NULL if not grouping with key.
+ * 
+ * @return Pointer to the new overflow state.
+ */
+struct overflow *overflow_init( int max_groups, policy_flags_t policy, 
+                struct gkey_plan *plan )
+{
+        struct overflow *ovf;
+
+        ovf = mem_zalloc( sizeof( *ovf ));
+        ovf->max_groups = max_groups;
+        ovf->policy = policy;
+        if ( ( policy & POLICY_KEY ) && plan != NULL ) {
+                ovf->plan = plan;
+                ovf->key = mem_alloc( plan->len );
+        }
+        hash_index_init( &ovf->conns, OVERFLOW_HASH_SIZE );
+        return ovf;
+}
+
+/** 
+ * @brief Free the overflow state.
+ *
+ * The overflow group is not freed, it is on the list of groups. Connections
+ * still on the index are detached from it.
+ * 
+ * @ingroup ovf
+ * @param ovf Pointer to the overflow state.
+ */
+void overflow_deinit( struct overflow *ovf )
+{
+        struct hash_link *link, *next;
+        unsigned int i;
+
+        for ( i = 0; i < ovf->conns.size; i++ ) {
+                for ( link = ovf->conns.chains[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        link->next = NULL;
+                        link->pprev = NULL;
+                }
+        }
+        hash_index_deinit( &ovf->conns );
+        if ( ovf->key != NULL ) 
+                mem_free( ovf->key );
+        mem_free( ovf );
+}
+
+/**
+ * @brief Calculate hash of the grouping selectors for connection.
+ *
+ * Connections belonging to the same group have the same hash.
+ *
+ * @param ovf Pointer to the overflow state.
+ * @param conn_p The connection.
+ * @return The hash value.
+ */
+static uint32_t selector_hash( struct overflow *ovf, struct tcp_connection *conn_p )
+{
+        if ( ovf->plan != NULL ) {
+                gkey_extract( ovf->plan, conn_p, ovf->key );
+                return hash_fnv( HASH_FNV_INIT, ovf->key, ovf->plan->len );
+        }
+        return filter_policy_hash( ovf->policy, conn_p );
+}
+
+/**
+ * @brief Add durations recorded for folded group to the overflow group.
+ *
+ * @param dst The overflow group.
+ * @param hist Durations recorded for the folded group.
+ */
+static void merge_hist( struct group *dst, struct state_hist *hist )
+{
+        int kind, i;
+
+        if ( dst->hist == NULL ) 
+                dst->hist = mem_zalloc( sizeof( *dst->hist ));
+        for ( kind = 0; kind < HIST_KINDS; kind++ ) {
+                dst->hist->count[kind] += hist->count[kind];
+                for ( i = 0; i < STATE_HIST_BUCKETS; i++ ) 
+                        dst->hist->buckets[kind][i] += hist->buckets[kind][i];
+        }
+}
+
+/**
+ * @brief Move connections and counters from group to the overflow group.
+ *
+ * The group should not be on the list (already removed from it), it is
+ * freed. The overflow group is created and added to the list if needed.
+ *
+ * @ingroup ovf
+ * @param ovf Pointer to the overflow state.
+ * @param list The list the overflow group is on.
+ * @param grp The group to fold.
+ */
+void overflow_fold( struct overflow *ovf, struct glist *list, struct group *grp )
+{
+        struct tcp_connection *conn_p;
+        uint64_t active;
+
+        if ( ovf->grp == NULL ) {
+                DBG( "Creating overflow group\n" );
+                ovf->grp = group_init();
+                ovf->grp->flags = GROUP_F_OVERFLOW;
+                glist_add( list, ovf->grp );
+        }
+        /* Folding is not activity for the overflow group */
+        active = ovf->grp->active;
+        while ( ( conn_p = group_get_first_conn( grp )) != NULL ) {
+                group_remove_connection( grp, conn_p );
+                hash_index_add( &ovf->conns, &conn_p->metadata.fold, 
+                                selector_hash( ovf, conn_p ));
+                group_add_connection( ovf->grp, conn_p );
+        }
+        ovf->grp->active = active;
+        if ( grp->hist != NULL ) 
+                merge_hist( ovf->grp, grp->hist );
+        group_deinit( grp, 0 );
+        ovf->folded++;
+}
+
+static int compare_active( const void *a, const void *b )
+{
+        const struct group *g1 = *(struct group * const *)a;
+        const struct group *g2 = *(struct group * const *)b;
+
+        if ( g1->active < g2->active ) 
+                return -1;
+        return g1->active > g2->active;
+}
+
+/** 
+ * @brief Fold groups if there is no room for a new group on the list.
+ *
+ * If the list has maximum number of live groups, the least recently active
+ * ones are folded to the overflow group. To avoid sorting the groups for
+ * every new group, 1/OVERFLOW_FOLD_FRACTION of the groups are folded at once.
+ * 
+ * @ingroup ovf
+ * @param ovf Pointer to the overflow state.
+ * @param list The list of outgoing groups.
+ * @param scratch Arena for the memory needed while sorting the groups.
+ * 
+ * @return Number of groups folded.
+ */
+int overflow_make_room( struct overflow *ovf, struct glist *list,
+                struct arena *scratch )
+{
+        struct group **live, *grp;
+        int cnt = 0, nr, i;
+
+        nr = glist_get_size( list ) - ( ovf->grp != NULL ? 1 : 0 );
+        if ( nr < ovf->max_groups ) 
+                return 0;
+
+        live = arena_alloc( scratch, nr * sizeof( *live ));
+        glist_foreach_group( list, grp ) {
+                if ( ! ( grp->flags & GROUP_F_OVERFLOW )) 
+                        live[cnt++] = grp;
+        }
+        qsort( live, cnt, sizeof( *live ), compare_active );
+
+        /* Leave room for the new group and the batch */
+        nr = cnt - ( ovf->max_groups - 1 - ovf->max_groups / OVERFLOW_FOLD_FRACTION );
+        if ( nr > cnt ) 
+                nr = cnt;
+        for ( i = 0; i < nr; i++ ) {
+                glist_remove( list, live[i] );
+                overflow_fold( ovf, list, live[i] );
+        }
+        DBG( "Folded %d groups, %d connections on overflow\n", nr, 
+                        ovf->grp ? group_get_size( ovf->grp ) : 0 );
+        return nr;
+}
+
+/**
+ * @brief Check if connection belongs to the group.
+ *
+ * Groups on the indexes are looked up, since their filters do not hold all
+ * the selectors.
+ */
+static int group_owns( struct group *grp, struct tcp_connection *conn_p )
+{
+        if ( grp->gkey != NULL ) 
+                return gkey_index_find( grp->gkey->index, conn_p ) == grp;
+        if ( grp->cloud != NULL ) 
+                return cloud_index_find( grp->cloud->index, conn_p ) == grp;
+        return group_match( grp, conn_p );
+}
+
+/** 
+ * @brief Take connections belonging to new group back from overflow group.
+ * 
+ * @ingroup ovf
+ * @param ovf Pointer to the overflow state.
+ * @param grp The new group.
+ * @param conn_p The connection the group was created for.
+ * 
+ * @return Number of connections taken back.
+ */
+int overflow_promote( struct overflow *ovf, struct group *grp, 
+                struct tcp_connection *conn_p )
+{
+        struct tcp_connection *iter;
+        struct hash_link *link, *next;
+        int cnt = 0;
+
+        if ( ovf->grp == NULL ) 
+                return 0;
+
+        for ( link = hash_index_first( &ovf->conns, selector_hash( ovf, conn_p )); 
+                        link != NULL; link = next ) {
+                next = hash_index_next( link );
+                iter = HASH_ENTRY( link, struct tcp_connection, metadata.fold );
+                if ( ! group_owns( grp, iter )) 
+                        continue;
+                group_remove_connection( ovf->grp, iter );
+                overflow_forget( ovf, iter );
+                group_add_connection( grp, iter );
+                cnt++;
+        }
+        ovf->promoted += cnt;
+        TRACE( "Promoted %d connections from overflow\n", cnt );
+        return cnt;
+}
+
+/** 
+ * @brief Forget connection which was removed from the overflow group.
+ * 
+ * @ingroup ovf
+ * @param ovf Pointer to the overflow state.
+ * @param conn_p The connection.
+ */
+void overflow_forget( struct overflow *ovf, struct tcp_connection *conn_p )
+{
+        if ( conn_p->metadata.fold.pprev != NULL ) 
+                hash_index_remove( &ovf->conns, &conn_p->metadata.fold );
+}
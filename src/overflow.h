@@ -0,0 +1,86 @@
+/**
+ * @file overflow.h
+ * @brief Bounding the number of outgoing groups.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _OVERFLOW_H_
+#define _OVERFLOW_H_
+
+/**
+ * Default maximum number of live outgoing groups.
+ */
+#define OVERFLOW_DEFAULT_MAX_GROUPS 1024
+
+/**
+ * Fraction of the maximum number of groups folded at once when the limit is
+ * reached (1/n of the groups), to avoid sorting the groups on every new one.
+ */
+#define OVERFLOW_FOLD_FRACTION 8
+
+/**
+ * Initial number of hash chains on the index of folded connections.
+ */
+#define OVERFLOW_HASH_SIZE 4096
+
+/**
+ * State for the overflow of outgoing groups. When there are more live groups
+ * than allowed, the least recently active groups are folded to a single
+ * "Other" group (marked with GROUP_F_OVERFLOW) which holds their connections.
+ * The connections on the overflow group are indexed by the hash of their
+ * grouping selectors, so the connections a new group might take back from
+ * the overflow group are found without walking the whole group.
+ * @ingroup ovf
+ */
+struct overflow {
+        int max_groups; /**< Maximum number of live groups */
+        policy_flags_t policy; /**< Policy the groups are formed with */
+        struct gkey_plan *plan; /**< Plan for grouping key, NULL if not grouping with key */
+        uint8_t *key; /**< Buffer for extracting the grouping key */
+        struct group *grp; /**< The overflow group, NULL if nothing is folded */
+        int folded; /**< Number of groups folded */
+        int promoted; /**< Number of connections taken back from overflow group */
+        struct hash_index conns; /**< Connections on overflow group by hash */
+};
+
+struct arena;
+
+struct overflow *overflow_init( int max_groups, policy_flags_t policy, 
+                struct gkey_plan *plan );
+void overflow_deinit( struct overflow *ovf );
+int overflow_make_room( struct overflow *ovf, struct glist *list,
+                struct arena *scratch );
+void overflow_fold( struct overflow *ovf, struct glist *list, struct group *grp );
+int overflow_promote( struct overflow *ovf, struct group *grp, 
+                struct tcp_connection *conn_p );
+void overflow_forget( struct overflow *ovf, struct tcp_connection *conn_p );
+
+#endif /* _OVERFLOW_H_ */
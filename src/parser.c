@@ -37,7 +37,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <arpa/inet.h>
 
 #define DBG_MODULE_NAME DBG_MODULE_PARSER
 
@@ -45,130 +45,373 @@
 #include "debug.h"
 #include "parser.h"
 
-/** @defgroup parser_utils Trivial line tokenizing parser utility */
+/** @defgroup parser_utils Line parser utility for /proc files */
 
 /**
- * Get next token from given line. 
- * Token means any set of chracters not containing blank (' ','<code>\\t</code>'). Token can
- * also be ended by newline. 
- * @note This function modifies the line pointed by the parameter and returns
- * pointers to data contained in the line parameter given. Hence the tokens
- * will become invalid if the data on line is modified.
- *
- * @param line Pointer to line containing the tokens.
- * @param bytes Pointer to integer that will receive the number of bytes the
- * line has been forwarded.
- * @param token_p Pointer to token structure that should be used.
- * @return Pointer to structure that will contain the token data.
- */ 
-static struct line_token *get_next_token( char *line, int *bytes, struct line_token *token_p ) 
+ * Check if character ends a column.
+ * @param c The character.
+ * @return Non-zero if @a c is blank, newline or end of string.
+ */
+static inline int is_column_end( char c )
+{
+        return c == ' ' || c == '\t' || c == '\n' || c == '\0';
+}
+
+/**
+ * Skip the blanks separating the columns.
+ * @param p Pointer to the line.
+ * @return Pointer to first non-blank character.
+ */
+static inline const char *skip_blanks( const char *p )
+{
+        while ( *p == ' ' || *p == '\t' )
+                p++;
+        return p;
+}
+
+/**
+ * Value of one hexadecimal digit.
+ * @param c The digit.
+ * @return Value of the digit, -1 if @a c is not a hexadecimal digit.
+ */
+static inline int hex_value( char c )
+{
+        if ( c >= '0' && c <= '9' )
+                return c - '0';
+        c |= 0x20;
+        if ( c >= 'a' && c <= 'f' )
+                return c - 'a' + 10;
+        return -1;
+}
+
+/**
+ * Store integer to target of given size.
+ * @param dst Pointer to the target.
+ * @param size Size of the target (1, 2, 4 or 8).
+ * @param val The value.
+ */
+static inline void store_uint( uint8_t *dst, size_t size, uint64_t val )
 {
+        uint8_t v8;
+        uint16_t v16;
+        uint32_t v32;
 
-        char *ch_p = line;
+        switch ( size ) {
+                case 1:
+                        v8 = (uint8_t)val;
+                        memcpy( dst, &v8, 1 );
+                        break;
+                case 2:
+                        v16 = (uint16_t)val;
+                        memcpy( dst, &v16, 2 );
+                        break;
+                case 4:
+                        v32 = (uint32_t)val;
+                        memcpy( dst, &v32, 4 );
+                        break;
+                default:
+                        memcpy( dst, &val, 8 );
+                        break;
+        }
+}
+
+/**
+ * Read hexadecimal 32bit words to @a dst.
+ * @param p Pointer to the first digit.
+ * @param dst Buffer receiving the words.
+ * @param size Number of bytes to read, multiple of 4.
+ * @return Pointer to the character following the digits, NULL if there
+ * were not exactly @a size * 2 digits.
+ */
+static const char *read_hex_words( const char *p, uint8_t *dst, size_t size )
+{
+        uint32_t word;
+        size_t i;
+        int j, v;
+
+        for ( i = 0; i < size; i += 4 ) {
+                word = 0;
+                for ( j = 0; j < 8; j++ ) {
+                        v = hex_value( *p++ );
+                        if ( v < 0 )
+                                return NULL;
+                        word = ( word << 4 ) | v;
+                }
+                memcpy( dst + i, &word, 4 );
+        }
+        if ( hex_value( *p ) >= 0 )
+                return NULL;
 
-        /* Initialize the token, we always return token with next == NULL */
-         
-        token_p->token = NULL;
-        token_p->token_len = 0; 
-        token_p->next = NULL;
+        return p;
+}
 
-        *bytes = 0;
+/**
+ * Decoder for FIELD_NAME.
+ * @see schema_decoder_t
+ */
+static const char *decode_name( const char *p, uint8_t *rec,
+                const struct schema_op *op )
+{
+        char *dst = (char *)rec + op->offset;
+        size_t len = 0;
 
-        /* First remove leading newline */
-        while ( isblank( *ch_p ) ) {
-                ch_p++;
-                (*bytes)++;
+        while ( !is_column_end( *p ) ) {
+                if ( len < op->size - 1 )
+                        dst[len++] = *p;
+                p++;
         }
+        dst[len] = '\0';
+
+        return p;
+}
 
-        if ( *ch_p == '\n' || *ch_p == '\0' ) {
-                /* no token */
-                DPRINT( "No token\n" );
-                token_p->token = NULL;
-                token_p->token_len = 0;
-                return token_p;
+/**
+ * Decoder for FIELD_IFNAME.
+ * @see schema_decoder_t
+ */
+static const char *decode_ifname( const char *p, uint8_t *rec,
+                const struct schema_op *op )
+{
+        char *dst = (char *)rec + op->offset;
+        size_t len = 0;
+
+        while ( *p != ':' ) {
+                if ( is_column_end( *p ) ) {
+                        WARN( "Malformed interface name\n" );
+                        return NULL;
+                }
+                if ( len < op->size - 1 )
+                        dst[len++] = *p;
+                p++;
         }
+        dst[len] = '\0';
+
+        /* Next column may start right after the ':' */
+        return p + 1;
+}
 
-        /* save the start of the token */
-        token_p->token = ch_p;
-        token_p->token_len = 0;
+/**
+ * Decoder for FIELD_HEX.
+ * @see schema_decoder_t
+ */
+static const char *decode_hex( const char *p, uint8_t *rec,
+                const struct schema_op *op )
+{
+        uint64_t val = 0;
+        const char *start = p;
+        int v;
 
-        /* search for the end of token */
-        while ( !isblank( *ch_p ) && *ch_p != '\n' ) { 
-                ch_p++;
-                token_p->token_len++; 
-                (*bytes)++;
+        while ( ( v = hex_value( *p ) ) >= 0 ) {
+                val = ( val << 4 ) | v;
+                p++;
         }
+        if ( p == start || !is_column_end( *p ) )
+                return NULL;
 
-        /* convert the blank or newline to \0 */
-        *ch_p = '\0';
-        (*bytes)++;
+        store_uint( rec + op->offset, op->size, val );
+        return p;
+}
 
-        return token_p;
+/**
+ * Decoder for FIELD_DEC.
+ * @see schema_decoder_t
+ */
+static const char *decode_dec( const char *p, uint8_t *rec,
+                const struct schema_op *op )
+{
+        uint64_t val = 0;
+        const char *start = p;
+
+        while ( *p >= '0' && *p <= '9' ) {
+                val = val * 10 + ( *p - '0' );
+                p++;
+        }
+        if ( p == start || !is_column_end( *p ) )
+                return NULL;
+
+        store_uint( rec + op->offset, op->size, val );
+        return p;
 }
 
 /**
- * Generate a linked list of tokens from given line. 
- * Token is a set of chrarcters separaetd by blanks (' ','<code>\\t</code>'). 
- * The @a req parameter should point to structure giving details on what tokens
- * should actually be extracted, only the tokens listed as interesting are
- * returned. 
- * @bug There is no way to specify that all tokens should be extracted. 
- * 
- * @note The line given as parameter will be modified. The returned tokens will
- * point to the line, hence the line should not be modified while examining the
- * tokens. 
+ * Decoder for FIELD_HEX_BYTES.
+ * @see schema_decoder_t
+ */
+static const char *decode_hex_bytes( const char *p, uint8_t *rec,
+                const struct schema_op *op )
+{
+        uint8_t *dst = rec + op->offset;
+        size_t i;
+        int hi, lo;
+
+        for ( i = 0; i < op->size; i++ ) {
+                hi = hex_value( p[0] );
+                lo = hi < 0 ? -1 : hex_value( p[1] );
+                if ( lo < 0 )
+                        return NULL;
+                dst[i] = ( hi << 4 ) | lo;
+                p += 2;
+        }
+        if ( !is_column_end( *p ) )
+                return NULL;
+
+        return p;
+}
+
+/**
+ * Decoder for FIELD_HEX_WORDS.
+ * @see schema_decoder_t
+ */
+static const char *decode_hex_words( const char *p, uint8_t *rec,
+                const struct schema_op *op )
+{
+        p = read_hex_words( p, rec + op->offset, op->size );
+        if ( p == NULL || !is_column_end( *p ) )
+                return NULL;
+
+        return p;
+}
+
+/**
+ * Decoder for FIELD_HEX_ADDRPORT.
+ * @see schema_decoder_t
+ */
+static const char *decode_hex_addrport( const char *p, uint8_t *rec,
+                const struct schema_op *op )
+{
+        uint16_t port = 0;
+        const char *start;
+        int v;
+
+        p = read_hex_words( p, rec + op->offset, op->size );
+        if ( p == NULL || *p != ':' )
+                return NULL;
+
+        start = ++p;
+        while ( ( v = hex_value( *p ) ) >= 0 ) {
+                port = ( port << 4 ) | v;
+                p++;
+        }
+        if ( p == start || !is_column_end( *p ) )
+                return NULL;
+
+        port = htons( port );
+        memcpy( rec + op->aux, &port, sizeof( port ) );
+        return p;
+}
+
+/**
+ * Compile record schema from field descriptions.
+ * The fields are sorted by column and a decoder is selected for each of
+ * them, so that schema_decode() can handle a line in one pass.
  *
  * @ingroup parser_utils
  *
- * @param req Pointer to the structure describing what tokens to return.
- * @param line The line to tokenize 
- * @return Pointer to the linked list of tokens or NULL if no tokens were found
- * or if there were not enough tokens.
- */ 
-struct line_token *tokenize( struct parser_req *req, char *line ) 
+ * @param schema Pointer to the schema to compile.
+ * @param fields The fields to decode, in ascending column order.
+ * @param count Number of fields.
+ * @return 0 on success, -1 if the field descriptions are not valid.
+ */
+int schema_compile( struct record_schema *schema,
+                const struct schema_field *fields, int count )
 {
-        struct line_token *curr;
-        int bytes_forward = 0;
-        int count = 0;
-        int interested_cnt = 0;
+        int i, prev_col = 0;
+        struct schema_op *op;
 
-        curr = req->tokens; 
-
-        curr = get_next_token( line, &bytes_forward, curr );
-        if ( curr->token_len == 0 ) {
-                DPRINT( "No tokens in line \n" );
-                return NULL;
+        schema->nr_ops = 0;
+        if ( count > SCHEMA_MAX_FIELDS ) {
+                ERROR( "Too many fields on schema (%d)\n", count );
+                return -1;
         }
-        count++;
-
-        do { 
-                TRACE( "Token %d \n", count );
-                if ( count == req->interested_tokens[ interested_cnt ] ) {
-                        TRACE( "Found interesting one \n" );
-                        /* This is one of the tokens we are looking for */
-                        interested_cnt++;
-                        if ( interested_cnt == req->interested_size ) {
-                                TRACE( "Got all tokens \n" );
-                                /* We have collected all tokens we need */
-                                curr->next = NULL;
+
+        for ( i = 0; i < count; i++ ) {
+                if ( fields[i].column <= prev_col ) {
+                        ERROR( "Schema columns are not in ascending order\n" );
+                        return -1;
+                }
+                op = &schema->ops[i];
+                op->skip = fields[i].column - prev_col - 1;
+                op->offset = fields[i].offset;
+                op->size = fields[i].size;
+                op->aux = fields[i].aux;
+                prev_col = fields[i].column;
+
+                switch ( fields[i].type ) {
+                        case FIELD_NAME:
+                                op->decode = decode_name;
                                 break;
-                        } else {
-                                curr->next = &(req->tokens[ interested_cnt ]);
-                                curr = curr->next;
-                        }
-                } 
-                line = line + bytes_forward;
-                curr = get_next_token( line, &bytes_forward, curr );
-                count++;
-        } while ( curr->token_len != 0 );
-
-        if ( interested_cnt < req->interested_size ) {
-                WARN( "There we not enough tokens!\n" );
-                return NULL;
+                        case FIELD_IFNAME:
+                                op->decode = decode_ifname;
+                                break;
+                        case FIELD_HEX:
+                                op->decode = decode_hex;
+                                break;
+                        case FIELD_DEC:
+                                op->decode = decode_dec;
+                                break;
+                        case FIELD_HEX_BYTES:
+                                op->decode = decode_hex_bytes;
+                                break;
+                        case FIELD_HEX_WORDS:
+                        case FIELD_HEX_ADDRPORT:
+                                if ( op->size % 4 != 0 ) {
+                                        ERROR( "Size of hex words not multiple of 4\n" );
+                                        return -1;
+                                }
+                                op->decode = fields[i].type == FIELD_HEX_WORDS ?
+                                        decode_hex_words : decode_hex_addrport;
+                                break;
+                        default:
+                                ERROR( "Unknown field type %d\n", fields[i].type );
+                                return -1;
+                }
+        }
+        schema->nr_ops = count;
+
+        return 0;
+}
+
+/**
+ * Decode one line to record using compiled schema.
+ * The line is walked once; columns not on the schema are skipped and the
+ * others are decoded straight to their place on the record.
+ *
+ * @ingroup parser_utils
+ *
+ * @param schema The compiled schema.
+ * @param line The line to decode, not modified.
+ * @param rec Pointer to the record receiving the values.
+ * @return 0 on success, -1 if there were not enough columns or a column
+ * was malformed. The record may be partially written on error.
+ */
+int schema_decode( const struct record_schema *schema, const char *line,
+                void *rec )
+{
+        const struct schema_op *op;
+        const char *p = line;
+        int i, skip;
+
+        for ( i = 0; i < schema->nr_ops; i++ ) {
+                op = &schema->ops[i];
+                p = skip_blanks( p );
+                for ( skip = op->skip; skip > 0; skip-- ) {
+                        while ( !is_column_end( *p ) )
+                                p++;
+                        p = skip_blanks( p );
+                }
+                if ( *p == '\n' || *p == '\0' ) {
+                        TRACE( "Not enough columns on line\n" );
+                        return -1;
+                }
+                p = op->decode( p, rec, op );
+                if ( p == NULL ) {
+                        TRACE( "Malformed field %d on line\n", i + 1 );
+                        return -1;
+                }
         }
-                
-        return req->tokens;
-} 
+
+        return 0;
+}
 
 /** 
  * @brief Read given file line per line and call the spcecified callback for each read line.
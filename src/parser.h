@@ -37,39 +37,102 @@
 #ifndef _PARSER_H_
 #define _PARSER_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define LINELEN 260
+
+/**
+ * Maximum number of decoded fields on one record schema.
+ */
+#define SCHEMA_MAX_FIELDS 8
+
 /**
- * Structure containing one token separated from line.
+ * Types of the columns the record schema can decode.
  * @ingroup parser_utils
- */ 
-struct line_token {
-        char *token; /** The token */
-        int token_len; /** Length of the token */
+ */
+enum field_type {
+        FIELD_NAME, /**< String, copied NUL terminated to char[size] */
+        /**
+         * Interface name ending with ':'. The next column may follow the
+         * ':' without any blanks (as on <code>/proc/net/dev</code>).
+         */
+        FIELD_IFNAME,
+        FIELD_HEX, /**< Hexadecimal integer of size 1, 2, 4 or 8 bytes */
+        FIELD_DEC, /**< Decimal integer of size 1, 2, 4 or 8 bytes */
+        FIELD_HEX_BYTES, /**< size bytes written as hex, in order */
+        /**
+         * size bytes written as hex in 32bit words, each word in host byte
+         * order (addresses on /proc/net/tcp*, /proc/net/route).
+         */
+        FIELD_HEX_WORDS,
+        /**
+         * FIELD_HEX_WORDS address followed by ':' and hexadecimal port. The
+         * port is written in network byte order to in_port_t at aux.
+         */
+        FIELD_HEX_ADDRPORT
+};
 
-        struct line_token *next; /** Pointer to next token */ 
+/**
+ * Description of one column to decode from a line.
+ * @ingroup parser_utils
+ */
+struct schema_field {
+        int column; /**< Number of the column (first column is 1) */
+        enum field_type type; /**< How the column is decoded */
+        size_t offset; /**< Offset of the target on the record */
+        size_t size; /**< Size of the target on the record */
+        size_t aux; /**< Offset of the port for FIELD_HEX_ADDRPORT */
 };
 
 /**
- * Struct describing the request for for parser.  This struct contains the
- * information tokenize needs to tokenize a line.
+ * Schema field decoding column @a col to @a member on struct @a rtype.
  * @ingroup parser_utils
- */ 
-struct parser_req {
-        /**
-         * Numbers of tokens that are interesting (first token is 1 )
-         */ 
-        int *interested_tokens;
-        int interested_size;/**< Size of the interested_tokens tab */
+ */
+#define SCHEMA_FIELD( col, ftype, rtype, member ) \
+        { (col), (ftype), offsetof( rtype, member ), \
+                sizeof( ((rtype *)0)->member ), 0 }
 
-        /**
-         * Preallocated line_token structs that tokenize() will fill.
-         */  
-        struct line_token *tokens;
-        /**
-         * Number of structs allocated. 
-         * @bug Is this really needed anywhere.
-         */ 
-        int token_count;
+/**
+ * Schema field decoding "addr:port" column @a col, the address having
+ * @a alen bytes.
+ * @ingroup parser_utils
+ */
+#define SCHEMA_ADDRPORT( col, rtype, addr, alen, port ) \
+        { (col), FIELD_HEX_ADDRPORT, offsetof( rtype, addr ), (alen), \
+                offsetof( rtype, port ) }
+
+struct schema_op;
+
+/**
+ * Decoder for one column. Gets pointer to the start of the column and
+ * returns pointer to the end of it, or NULL if the column is malformed.
+ * @ingroup parser_utils
+ */
+typedef const char *(*schema_decoder_t)( const char *p, uint8_t *rec,
+                const struct schema_op *op );
+
+/**
+ * One step on compiled schema.
+ * @ingroup parser_utils
+ */
+struct schema_op {
+        int skip; /**< Number of columns to skip before this one */
+        schema_decoder_t decode; /**< Decoder for the column */
+        size_t offset; /**< Offset of the target on the record */
+        size_t size; /**< Size of the target */
+        size_t aux; /**< Offset of the port for FIELD_HEX_ADDRPORT */
+};
+
+/**
+ * Compiled record schema. A line is decoded in one pass, skipping the
+ * columns which are not needed and writing the others straight to the
+ * record.
+ * @ingroup parser_utils
+ */
+struct record_schema {
+        int nr_ops; /**< Number of decoded columns, 0 if not compiled */
+        struct schema_op ops[SCHEMA_MAX_FIELDS]; /**< The decoding steps */
 };
 
 /**
@@ -79,7 +142,10 @@ struct parser_req {
 typedef void (*parser_line_callback_t)(char *line, void *ctx); 
 
 
-struct line_token *tokenize( struct parser_req *req, char *line );
+int schema_compile( struct record_schema *schema,
+                const struct schema_field *fields, int count );
+int schema_decode( const struct record_schema *schema, const char *line,
+                void *rec );
 int parse_file_per_line( char *filename, int to_skip, parser_line_callback_t callback, void *ctx);
 
 #endif /* _PARSER_H_ */
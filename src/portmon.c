@@ -0,0 +1,381 @@
+/**
+ * @file portmon.c
+ * @brief Monitoring the use of local ephemeral ports.
+ *
+ * The ephemeral port range and the reserved ports are read once when the
+ * monitor is started. Connections whose local port is on the range are
+ * counted on the entry for their (local address, remote address, remote
+ * port) when they are inserted and uncounted when they close, connections
+ * on TIME_WAIT still hold their port.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_GRP
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "portmon.h"
+
+#ifdef ENABLE_PORT_MONITOR
+/**
+ * File holding the ephemeral port range.
+ */
+#define PORT_RANGE_FILE "/proc/sys/net/ipv4/ip_local_port_range"
+/**
+ * File holding the reserved ports.
+ */
+#define RESERVED_PORTS_FILE "/proc/sys/net/ipv4/ip_local_reserved_ports"
+
+/**
+ * @defgroup portmon Ephemeral port monitor
+ */
+
+/**
+ * Check if port is reserved.
+ */
+#define port_is_reserved(m,p) ( (m)->reserved[(p) >> 3] & ( 1 << ( (p) & 7 )))
+
+/**
+ * Read the reserved ports, the file holds comma separated list of ports and
+ * port ranges.
+ * @param pmon The monitor.
+ */
+static void read_reserved_ports( struct port_monitor *pmon )
+{
+        char buf[4096];
+        char *p, *end;
+        long first, last, port;
+        FILE *fp;
+
+        fp = fopen( RESERVED_PORTS_FILE, "r" );
+        if ( fp == NULL ) 
+                return;
+        if ( fgets( buf, sizeof( buf ), fp ) == NULL ) {
+                fclose( fp );
+                return;
+        }
+        fclose( fp );
+
+        p = buf;
+        while ( *p != '\0' && *p != '\n' ) {
+                first = strtol( p, &end, 10 );
+                if ( end == p ) 
+                        break;
+                last = first;
+                if ( *end == '-' ) {
+                        p = end + 1;
+                        last = strtol( p, &end, 10 );
+                }
+                for ( port = first; port <= last && port < 65536; port++ ) 
+                        pmon->reserved[port >> 3] |= 1 << ( port & 7 );
+                p = end;
+                if ( *p == ',' ) 
+                        p++;
+        }
+}
+
+/** 
+ * @brief Start monitoring the ephemeral ports.
+ * 
+ * @ingroup portmon
+ * @param alert_pct Utilisation (percent) to alert on.
+ * @param scale Number of connections each counted connection stands for, the
+ * sampling rate when only a sample of the connections is tracked.
+ * 
+ * @return Pointer to the new monitor, NULL if the port range could not be
+ * read.
+ */
+struct port_monitor *portmon_init( int alert_pct, int scale )
+{
+        struct port_monitor *pmon;
+        int low, high, port;
+        FILE *fp;
+
+        fp = fopen( PORT_RANGE_FILE, "r" );
+        if ( fp == NULL ) {
+                WARN( "Unable to open %s: %s\n", PORT_RANGE_FILE, strerror( errno ));
+                return NULL;
+        }
+        if ( fscanf( fp, "%d %d", &low, &high ) != 2 || low < 1 || high > 65535 || 
+                        low > high ) {
+                WARN( "Unable to parse %s\n", PORT_RANGE_FILE );
+                fclose( fp );
+                return NULL;
+        }
+        fclose( fp );
+
+        pmon = mem_zalloc( sizeof( *pmon ));
+        pmon->low = low;
+        pmon->high = high;
+        pmon->alert_pct = alert_pct;
+        pmon->scale = scale > 1 ? scale : 1;
+        hash_index_init( &pmon->index, PORTMON_INDEX_SIZE );
+        read_reserved_ports( pmon );
+        for ( port = low; port <= high; port++ ) {
+                if ( ! port_is_reserved( pmon, port )) 
+                        pmon->available++;
+        }
+        DBG( "Ephemeral ports %d-%d, %d available\n", low, high, pmon->available );
+
+        return pmon;
+}
+
+/** 
+ * @brief Stop monitoring.
+ * 
+ * @ingroup portmon
+ * @param pmon The monitor.
+ */
+void portmon_deinit( struct port_monitor *pmon )
+{
+        struct hash_link *link, *next;
+        unsigned int i;
+
+        for ( i = 0; i < pmon->index.size; i++ ) {
+                for ( link = pmon->index.chains[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        mem_free( HASH_ENTRY( link, struct port_entry, link ));
+                }
+        }
+        hash_index_deinit( &pmon->index );
+        mem_free( pmon );
+}
+
+/**
+ * @brief Calculate hash for the tuple of connection (FNV-1a).
+ *
+ * @param key Key of the connection.
+ * @return The hash value.
+ */
+static uint32_t hash_tuple( const struct conn_key *key )
+{
+        uint32_t hash;
+
+        hash = hash_fnv( HASH_FNV_INIT, key->laddr, 16 );
+        hash = hash_fnv( hash, key->raddr, 16 );
+        hash = hash_fnv( hash, &key->rport, sizeof( key->rport ));
+        return hash_fnv( hash, &key->family, 1 );
+}
+
+/**
+ * @brief Find the entry for the tuple of connection.
+ *
+ * @param pmon The monitor.
+ * @param key Key of the connection.
+ * @param hash Hash value for the tuple.
+ * @return The entry, NULL if not found.
+ */
+static struct port_entry *find_entry( struct port_monitor *pmon, 
+                const struct conn_key *key, uint32_t hash )
+{
+        struct port_entry *entry;
+        struct hash_link *link;
+
+        for ( link = hash_index_first( &pmon->index, hash ); link != NULL; 
+                        link = hash_index_next( link )) {
+                entry = HASH_ENTRY( link, struct port_entry, link );
+                if ( entry->family == key->family && entry->rport == key->rport &&
+                                memcmp( entry->laddr, key->laddr, 16 ) == 0 &&
+                                memcmp( entry->raddr, key->raddr, 16 ) == 0 ) 
+                        return entry;
+        }
+        return NULL;
+}
+
+/** 
+ * @brief Get the utilisation of the ephemeral ports for entry.
+ * 
+ * @ingroup portmon
+ * @param pmon The monitor.
+ * @param entry The entry.
+ * 
+ * @return Percentage of the available ports in use.
+ */
+int portmon_usage( struct port_monitor *pmon, struct port_entry *entry )
+{
+        if ( pmon->available == 0 ) 
+                return 100;
+        return (int)( (long)PORTMON_ESTIMATE( pmon, entry->count ) * 100 / 
+                        pmon->available );
+}
+
+/** 
+ * @brief Count the local port of connection.
+ *
+ * Listening connections, incoming connections (the local port is the
+ * listening port) and connections whose local port is not on the ephemeral
+ * range are not counted.
+ * 
+ * @ingroup portmon
+ * @param pmon The monitor.
+ * @param conn_p The connection.
+ */
+void portmon_add( struct port_monitor *pmon, struct tcp_connection *conn_p )
+{
+        struct port_entry *entry;
+        int lport = ntohs( conn_p->key.lport );
+        uint32_t hash;
+
+        if ( conn_p->state == TCP_LISTEN || conn_p->metadata.dir == DIR_INBOUND ||
+                        lport < pmon->low || lport > pmon->high ||
+                        port_is_reserved( pmon, lport ) || 
+                        ( conn_p->metadata.flags & METADATA_EPHEMERAL )) 
+                return;
+
+        hash = hash_tuple( &conn_p->key );
+        entry = find_entry( pmon, &conn_p->key, hash );
+        if ( entry == NULL ) {
+                entry = mem_zalloc( sizeof( *entry ));
+                entry->family = conn_p->key.family;
+                entry->rport = conn_p->key.rport;
+                memcpy( entry->laddr, conn_p->key.laddr, 16 );
+                memcpy( entry->raddr, conn_p->key.raddr, 16 );
+                hash_index_add( &pmon->index, &entry->link, hash );
+                pmon->entries++;
+        }
+        entry->count++;
+        if ( entry->count > entry->peak ) 
+                entry->peak = entry->count;
+        pmon->tracked++;
+        metadata_set_flag( conn_p->metadata, METADATA_EPHEMERAL );
+
+        if ( ! entry->alerted && portmon_usage( pmon, entry ) >= pmon->alert_pct ) {
+                DBG( "Ephemeral ports over %d%%\n", pmon->alert_pct );
+                entry->alerted = 1;
+                pmon->alert = entry;
+                pmon->alerts++;
+        }
+}
+
+/** 
+ * @brief Uncount the local port of connection.
+ *
+ * Can be called for any connection, only the connections counted with
+ * portmon_add() are uncounted (once).
+ * 
+ * @ingroup portmon
+ * @param pmon The monitor.
+ * @param conn_p The connection.
+ */
+void portmon_remove( struct port_monitor *pmon, struct tcp_connection *conn_p )
+{
+        struct port_entry *entry;
+
+        if ( ! ( conn_p->metadata.flags & METADATA_EPHEMERAL )) 
+                return;
+        conn_p->metadata.flags &= ~METADATA_EPHEMERAL;
+
+        entry = find_entry( pmon, &conn_p->key, hash_tuple( &conn_p->key ));
+        if ( entry == NULL ) {
+                WARN( "Counted connection not on port monitor\n" );
+                return;
+        }
+        entry->count--;
+        pmon->tracked--;
+        if ( entry->alerted && portmon_usage( pmon, entry ) < pmon->alert_pct ) {
+                entry->alerted = 0;
+                if ( pmon->alert == entry ) 
+                        pmon->alert = NULL;
+        }
+        if ( entry->count == 0 ) {
+                hash_index_remove( &pmon->index, &entry->link );
+                if ( pmon->alert == entry ) 
+                        pmon->alert = NULL;
+                mem_free( entry );
+                pmon->entries--;
+        }
+}
+
+/** 
+ * @brief Format the tuple of entry for printing.
+ * 
+ * @ingroup portmon
+ * @param entry The entry.
+ * @param buf Buffer for the string.
+ * @param buflen Length of the buffer.
+ * 
+ * @return Pointer to @a buf.
+ */
+char *portmon_format( struct port_entry *entry, char *buf, int buflen )
+{
+        char laddr[INET6_ADDRSTRLEN], raddr[INET6_ADDRSTRLEN];
+        /* IPv4 addresses are kept as IPv4 mapped on the key */
+        int offset = entry->family == AF_INET ? 12 : 0;
+
+        if ( inet_ntop( entry->family, entry->laddr + offset, laddr, 
+                                sizeof( laddr )) == NULL ) 
+                strcpy( laddr, "?" );
+        if ( inet_ntop( entry->family, entry->raddr + offset, raddr, 
+                                sizeof( raddr )) == NULL ) 
+                strcpy( raddr, "?" );
+        snprintf( buf, buflen, entry->family == AF_INET6 ? "%s -> [%s]:%hu" : 
+                        "%s -> %s:%hu", laddr, raddr, ntohs( entry->rport ));
+        return buf;
+}
+
+/**
+ * Callback for counting the connections on hashtable. Incoming connections
+ * are skipped by portmon_add().
+ */
+static void add_connection( struct tcp_connection *conn_p, void *data )
+{
+        if ( conn_p->state != TCP_DEAD ) 
+                portmon_add( (struct port_monitor *)data, conn_p );
+}
+
+/** 
+ * @brief Count all connections on hashtable.
+ *
+ * This is needed only when the monitor is started with connections already
+ * on the hashtable, after that the counters are kept up to date as the
+ * connections come and go.
+ * 
+ * @ingroup portmon
+ * @param pmon The monitor.
+ * @param table_p The hashtable.
+ */
+void portmon_add_all( struct port_monitor *pmon, struct chashtable *table_p )
+{
+        chash_walk( table_p, add_connection, pmon );
+}
+#endif /* ENABLE_PORT_MONITOR */
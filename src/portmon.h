@@ -0,0 +1,105 @@
+/**
+ * @file portmon.h
+ * @brief Monitoring the use of local ephemeral ports.
+ *
+ * Outgoing connections toward the same remote endpoint from the same local
+ * address need a local port of their own, so the ephemeral port range is
+ * the limit for the number of such connections. The monitor counts the
+ * ports in use for every (local address, remote address, remote port).
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _PORTMON_H_
+#define _PORTMON_H_
+
+#include "hash.h"
+
+/**
+ * Default utilisation (percent) of the ephemeral ports to alert on.
+ */
+#define PORTMON_DEFAULT_ALERT 80
+
+/**
+ * Initial number of hash chains on the monitor.
+ */
+#define PORTMON_INDEX_SIZE 256
+
+/**
+ * Ports used toward one remote endpoint from one local address.
+ * @ingroup portmon
+ */
+struct port_entry {
+        struct hash_link link; /**< Link on the index, hashed by the tuple */
+        uint32_t family; /**< Address family */
+        uint8_t laddr[16]; /**< Local address (network byte order) */
+        uint8_t raddr[16]; /**< Remote address (network byte order) */
+        in_port_t rport; /**< Remote port (network byte order) */
+        int count; /**< Number of local ephemeral ports in use */
+        int peak; /**< Highest number of ports in use seen */
+        int alerted; /**< Set when utilisation is over the alert limit */
+};
+
+/**
+ * Counters for the local ephemeral ports in use for each (local address,
+ * remote address, remote port) tuple. The counters are updated when
+ * connections are added and removed.
+ * @ingroup portmon
+ */
+struct port_monitor {
+        int low; /**< First port on the ephemeral range */
+        int high; /**< Last port on the ephemeral range */
+        int available; /**< Number of ports on range which are not reserved */
+        int alert_pct; /**< Utilisation to alert on (percent) */
+        int scale; /**< Connections each counted one stands for (sampling rate) */
+        int entries; /**< Number of entries on the monitor */
+        int tracked; /**< Number of connections counted */
+        unsigned long alerts; /**< Number of times an entry went over the limit */
+        struct port_entry *alert; /**< Latest entry over the limit, NULL if none */
+        uint8_t reserved[65536 / 8]; /**< Bitmap of reserved ports */
+        struct hash_index index; /**< The entries */
+};
+
+/**
+ * Estimate the number of ports in use from the number counted.
+ */
+#define PORTMON_ESTIMATE(m,n) ( (n) * (m)->scale )
+
+struct stat_context;
+
+struct port_monitor *portmon_init( int alert_pct, int scale );
+void portmon_deinit( struct port_monitor *pmon );
+void portmon_add( struct port_monitor *pmon, struct tcp_connection *conn_p );
+void portmon_remove( struct port_monitor *pmon, struct tcp_connection *conn_p );
+void portmon_add_all( struct port_monitor *pmon, struct chashtable *table_p );
+int portmon_usage( struct port_monitor *pmon, struct port_entry *entry );
+char *portmon_format( struct port_entry *entry, char *buf, int buflen );
+
+#endif /* _PORTMON_H_ */
@@ -0,0 +1,984 @@
+/**
+ * @file record.c
+ * @brief Recording connection snapshots and querying recorded sessions.
+ *
+ * When recording is enabled, all connections on the system are written to
+ * the recording file on each update round. The entries are collected into
+ * blocks of at most REC_BLOCK_ENTRIES entries spanning at most REC_BLOCK_SECS
+ * seconds. Before a block is written, a header is generated for it. The
+ * header holds the time range of the block and a bloom filter over the remote
+ * addresses and remote ports on the block.
+ *
+ * The offline query reads only the block headers for blocks not matching the
+ * query selectors and seeks over the entries. Matching entries are grouped
+ * with the same groups the live UI would use.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#define _GNU_SOURCE /* strptime() */
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_REC
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "hash.h"
+#include "groupkey.h"
+#include "stat.h"
+#include "record.h"
+
+/** @defgroup record Recording and offline queries */
+
+/**
+ * Number of bits on the block bloom filter.
+ */
+#define BLOOM_BITS (REC_BLOOM_BYTES * 8)
+
+/**
+ * Number of hash functions used for the bloom filter.
+ */
+#define BLOOM_HASHES 3
+
+/**
+ * Table holding the string representations of enum tcp_state.
+ */
+static const char *rec_state_str[] = {
+        "-",
+        "ESTABLISHED",
+        "SYN_SENT",
+        "SYN_RECV",
+        "FIN_WAIT1",
+        "FIN_WAIT2",
+        "TIME_WAIT",
+        "CLOSE",
+        "CLOSE_WAIT",
+        "LAST_ACK",
+        "LISTEN",
+        "CLOSING"
+};
+
+/**
+ * @brief Calculate the two base hashes used for the bloom filter.
+ *
+ * FNV-1a is calculated over the data with two different offset bases, the k
+ * bloom hashes are derived from these with double hashing.
+ *
+ * @param data Pointer to the data to hash.
+ * @param len Length of the data.
+ * @param h1 Pointer where the first hash is set.
+ * @param h2 Pointer where the second hash is set.
+ */
+static void bloom_base_hashes( const uint8_t *data, size_t len,
+                uint32_t *h1, uint32_t *h2 )
+{
+        *h1 = hash_fnv( HASH_FNV_INIT, data, len );
+        *h2 = hash_fnv( HASH_FNV_INIT ^ 0x5bd1e995u, data, len ) | 1;
+}
+
+/**
+ * @brief Add given key to the bloom filter.
+ *
+ * @param bloom The bloom filter.
+ * @param data The key.
+ * @param len Length of the key.
+ */
+static void bloom_add( uint8_t *bloom, const uint8_t *data, size_t len )
+{
+        uint32_t h1, h2, bit;
+        int i;
+
+        bloom_base_hashes( data, len, &h1, &h2 );
+        for ( i = 0; i < BLOOM_HASHES; i++ ) {
+                bit = (h1 + i * h2) & (BLOOM_BITS - 1);
+                bloom[bit >> 3] |= 1 << (bit & 7);
+        }
+}
+
+/**
+ * @brief Check if given key might be on the bloom filter.
+ *
+ * @param bloom The bloom filter.
+ * @param data The key.
+ * @param len Length of the key.
+ * @return 0 if the key is definitely not on the filter, 1 if it might be.
+ */
+static int bloom_test( const uint8_t *bloom, const uint8_t *data, size_t len )
+{
+        uint32_t h1, h2, bit;
+        int i;
+
+        bloom_base_hashes( data, len, &h1, &h2 );
+        for ( i = 0; i < BLOOM_HASHES; i++ ) {
+                bit = (h1 + i * h2) & (BLOOM_BITS - 1);
+                if ( (bloom[bit >> 3] & (1 << (bit & 7))) == 0 )
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * Generate the bloom key for remote address. The key is the family byte
+ * followed by the 16 address bytes.
+ */
+static void bloom_addr_key( uint8_t family, const uint8_t *addr, uint8_t *key )
+{
+        key[0] = family;
+        memcpy( key + 1, addr, 16 );
+}
+
+/**
+ * Generate the bloom key for remote port. The key is a marker byte (so that
+ * ports do not collide with addresses) followed by the port.
+ */
+static void bloom_port_key( uint16_t port, uint8_t *key )
+{
+        key[0] = 0xFF;
+        key[1] = port >> 8;
+        key[2] = port & 0xFF;
+}
+
+/**
+ * Copy the address bytes from given socket address to 16 byte buffer.
+ */
+static void ss_to_bytes( struct sockaddr_storage *ss, uint8_t *bytes )
+{
+        memset( bytes, 0, 16 );
+        if ( ss->ss_family == AF_INET ) {
+                memcpy( bytes, ss_get_addr( ss ), sizeof( struct in_addr ));
+        } else {
+                memcpy( bytes, ss_get_addr6( ss ), sizeof( struct in6_addr ));
+        }
+}
+
+/**
+ * Fill socket address from the 16 byte address buffer and port.
+ */
+static void bytes_to_ss( uint8_t family, const uint8_t *bytes, uint16_t port,
+                struct sockaddr_storage *ss )
+{
+        memset( ss, 0, sizeof( *ss ));
+        ss->ss_family = family;
+        if ( family == AF_INET ) {
+                memcpy( ss_get_addr( ss ), bytes, sizeof( struct in_addr ));
+        } else {
+                memcpy( ss_get_addr6( ss ), bytes, sizeof( struct in6_addr ));
+        }
+        ss_set_port( ss, htons( port ));
+}
+
+/**
+ * @brief Write the collected block to recording file.
+ *
+ * Block header is written followed by the entries. After writing the block
+ * is reset.
+ *
+ * @param rec Pointer to the recorder.
+ * @return 0 on success, -1 on error.
+ */
+static int write_block( struct recorder *rec )
+{
+        int rv = 0;
+        size_t nr = rec->hdr.nr_entries;
+
+        if ( nr == 0 )
+                return 0;
+
+        rec->hdr.magic = REC_BLOCK_MAGIC;
+        if ( fwrite( &rec->hdr, sizeof( rec->hdr ), 1, rec->fp ) != 1 ||
+             fwrite( rec->entries, sizeof( struct rec_entry ), nr, rec->fp ) != nr ) {
+                WARN( "Error while writing block: %s\n", strerror( errno ));
+                rv = -1;
+        }
+        fflush( rec->fp );
+        rec->blocks++;
+        DBG( "Wrote block %d with %d entries\n", rec->blocks, nr );
+
+        memset( &rec->hdr, 0, sizeof( rec->hdr ));
+        return rv;
+}
+
+/**
+ * @brief Initialize recorder writing to given file.
+ *
+ * The file is truncated and the file header is written.
+ *
+ * @ingroup record
+ *
+ * @param filename Name of the recording file.
+ * @param sample_rate Only 1/sample_rate of the connections are recorded, 0
+ * or 1 if all are.
+ * @return Pointer to initialized recorder, NULL on error.
+ */
+struct recorder *recorder_init( const char *filename, int sample_rate )
+{
+        struct recorder *rec;
+        struct rec_file_hdr fhdr;
+        FILE *fp;
+
+        fp = fopen( filename, "w" );
+        if ( fp == NULL ) {
+                WARN( "Unable to open %s: %s\n", filename, strerror( errno ));
+                return NULL;
+        }
+
+        memset( &fhdr, 0, sizeof( fhdr ));
+        memcpy( fhdr.magic, REC_FILE_MAGIC, sizeof( fhdr.magic ));
+        fhdr.version = REC_FILE_VERSION;
+        fhdr.entry_size = sizeof( struct rec_entry );
+        fhdr.sample_rate = sample_rate > 1 ? sample_rate : 1;
+        if ( fwrite( &fhdr, sizeof( fhdr ), 1, fp ) != 1 ) {
+                WARN( "Unable to write file header\n" );
+                fclose( fp );
+                return NULL;
+        }
+
+        rec = mem_zalloc( sizeof( *rec ));
+        rec->fp = fp;
+        rec->entries = mem_alloc( REC_BLOCK_ENTRIES * sizeof( struct rec_entry ));
+
+        return rec;
+}
+
+/**
+ * @brief Flush pending entries and free the recorder.
+ *
+ * @ingroup record
+ *
+ * @param rec Pointer to the recorder.
+ */
+void recorder_deinit( struct recorder *rec )
+{
+        write_block( rec );
+        fclose( rec->fp );
+        mem_free( rec->entries );
+        mem_free( rec );
+}
+
+/**
+ * @brief Add one connection to the block being collected.
+ *
+ * Callback for chash_walk(). Listening sockets, ignored connections and
+ * lingering connections are not recorded.
+ *
+ * @param conn_p The connection to record.
+ * @param data Pointer to the recorder.
+ */
+static void record_connection( struct tcp_connection *conn_p, void *data )
+{
+        struct recorder *rec = data;
+        struct rec_entry *ent;
+        uint8_t key[17];
+
+        if ( conn_p->state == TCP_LISTEN || conn_p->state == TCP_DEAD ||
+             metadata_is_ignored( conn_p->metadata ))
+                return;
+
+        if ( rec->hdr.nr_entries == REC_BLOCK_ENTRIES )
+                write_block( rec );
+
+        ent = &rec->entries[ rec->hdr.nr_entries ];
+        memset( ent, 0, sizeof( *ent ));
+        ent->stamp = rec->stamp;
+        ent->family = conn_p->family;
+        ent->state = conn_p->state;
+        ent->dir = conn_p->metadata.dir;
+        ent->lport = connection_get_port( conn_p, 1 );
+        ent->rport = connection_get_port( conn_p, 0 );
+        ss_to_bytes( &conn_p->laddr, ent->laddr );
+        ss_to_bytes( &conn_p->raddr, ent->raddr );
+        if ( conn_p->metadata.ifname != NULL )
+                strncpy( ent->ifname, conn_p->metadata.ifname, REC_IFNAMELEN - 1 );
+
+        if ( rec->hdr.nr_entries == 0 )
+                rec->hdr.min_time = ent->stamp;
+        rec->hdr.max_time = ent->stamp;
+
+        bloom_addr_key( ent->family, ent->raddr, key );
+        bloom_add( rec->hdr.bloom, key, 17 );
+        bloom_port_key( ent->rport, key );
+        bloom_add( rec->hdr.bloom, key, 3 );
+
+        rec->hdr.nr_entries++;
+}
+
+/**
+ * @brief Record all connections on this update round.
+ *
+ * Should be called once per update round, after the connections have been
+ * updated. If the block being collected would span too long time, it is
+ * written out before adding new entries.
+ *
+ * @ingroup record
+ *
+ * @param rec Pointer to the recorder.
+ * @param ctx Pointer to the global context.
+ */
+void record_round( struct recorder *rec, struct stat_context *ctx )
+{
+        rec->stamp = time( NULL );
+
+        if ( rec->hdr.nr_entries > 0 &&
+             rec->stamp - rec->hdr.min_time >= REC_BLOCK_SECS )
+                write_block( rec );
+
+        chash_walk( ctx->chash, record_connection, rec );
+}
+
+/**
+ * @brief Allocate a query with no selectors set.
+ *
+ * @ingroup record
+ *
+ * @return Pointer to the query.
+ */
+struct rec_query *rec_query_init( void )
+{
+        struct rec_query *query;
+
+        query = mem_zalloc( sizeof( *query ));
+        query->rport = -1;
+
+        return query;
+}
+
+/**
+ * @brief Free the query.
+ *
+ * @ingroup record
+ *
+ * @param query Pointer to the query.
+ */
+void rec_query_deinit( struct rec_query *query )
+{
+        mem_free( query );
+}
+
+/**
+ * Peak number of connections on a group during one minute.
+ */
+struct qpeak {
+        time_t minute; /**< Start of the minute */
+        int peak; /**< Peak number of connections seen on one round */
+};
+
+/**
+ * Query results for one group.
+ */
+struct qgroup {
+        struct hash_link link; /**< Link on the index, hashed by the selectors */
+        struct group *grp; /**< The group */
+        int inbound; /**< 1 if group holds incoming connections */
+        time_t cur_stamp; /**< Round being counted */
+        int cur_count; /**< Connections seen on the round being counted */
+        time_t cur_minute; /**< Minute being counted */
+        int minute_peak; /**< Peak seen on the minute being counted */
+        struct qpeak *peaks; /**< Peaks for the minutes already counted */
+        int nr_peaks; /**< Number of entries on peaks */
+        struct qgroup *next; /**< Pointer to next group */
+        uint8_t key[]; /**< Grouping key of outgoing group, if grouped with key */
+};
+
+/**
+ * Maximum number of different interface names on query.
+ */
+#define QUERY_MAX_IFNAMES 64
+/**
+ * Initial size of the index of query groups.
+ */
+#define QUERY_INDEX_INIT_SIZE 256
+/**
+ * Selectors for the groups of incoming connections.
+ */
+#define QUERY_INBOUND_POLICY ( POLICY_LOCAL | POLICY_PORT | POLICY_AF )
+
+/**
+ * Context for running a query.
+ */
+struct qctx {
+        struct rec_query *query; /**< The query */
+        policy_flags_t grouping; /**< Grouping for outgoing connections */
+        struct gkey_plan *plan; /**< Grouping key for outgoing connections, NULL if not used */
+        struct chashtable *chash; /**< Connections found */
+        struct qgroup *groups; /**< Groups found */
+        struct hash_index index; /**< Groups found, hashed by the selectors */
+        struct qgroup *last; /**< Group last used */
+        char ifnames[QUERY_MAX_IFNAMES][REC_IFNAMELEN]; /**< Interface names seen */
+        int nr_ifnames; /**< Number of names on ifnames */
+        int matches; /**< Number of matching entries */
+        int scale; /**< Connections each recorded one stands for */
+};
+
+/**
+ * @brief Get interned copy of given interface name.
+ *
+ * The connection metadata holds only a pointer to the interface name, the
+ * names read from the recording are held on the query context.
+ *
+ * @param qc Pointer to the query context.
+ * @param name Name to look for.
+ * @return Pointer to the interned name, NULL if none.
+ */
+static const char *intern_ifname( struct qctx *qc, const char *name )
+{
+        int i;
+
+        if ( name[0] == '\0' )
+                return NULL;
+
+        for ( i = 0; i < qc->nr_ifnames; i++ ) {
+                if ( strcmp( qc->ifnames[i], name ) == 0 )
+                        return qc->ifnames[i];
+        }
+        if ( qc->nr_ifnames == QUERY_MAX_IFNAMES ) {
+                WARN( "Too many interfaces on recording\n" );
+                return NULL;
+        }
+        snprintf( qc->ifnames[i], REC_IFNAMELEN, "%s", name );
+        qc->nr_ifnames++;
+        return qc->ifnames[i];
+}
+
+/**
+ * @brief Get the query group for given connection.
+ *
+ * The groups are formed the same way as in rotate_new_queue(): incoming
+ * connections are grouped by the local port and outgoing connections with the
+ * grouping policy, or with the grouping key if one is given. The groups are
+ * looked up from the index with the hash of the selectors of the connection,
+ * as in bulk_rotate(), or with the hash of the key, as in gkey_index_find().
+ *
+ * @param qc Pointer to the query context.
+ * @param conn_p The connection.
+ * @return Pointer to the group the connection was added to.
+ */
+static struct qgroup *group_for_connection( struct qctx *qc,
+                struct tcp_connection *conn_p )
+{
+        struct qgroup *qg;
+        struct hash_link *link;
+        int inbound = ( conn_p->metadata.dir == DIR_INBOUND );
+        policy_flags_t policy = inbound ? QUERY_INBOUND_POLICY : qc->grouping;
+        uint8_t key[GKEY_MAX_LEN];
+        int keylen = 0;
+        uint32_t hash;
+
+        if ( conn_p->group != NULL && qc->last != NULL && 
+                        qc->last->grp == conn_p->group )
+                return qc->last;
+
+        if ( ! inbound && qc->plan != NULL ) {
+                keylen = qc->plan->len;
+                gkey_extract( qc->plan, conn_p, key );
+                hash = hash_fnv( HASH_FNV_INIT, key, keylen );
+        } else {
+                hash = filter_policy_hash( policy, conn_p );
+        }
+        for ( link = hash_index_first( &qc->index, hash ); link != NULL;
+                        link = hash_index_next( link )) {
+                qg = HASH_ENTRY( link, struct qgroup, link );
+                if ( qg->inbound != inbound )
+                        continue;
+                if ( conn_p->group != NULL ) {
+                        if ( qg->grp == conn_p->group )
+                                return qg;
+                } else if ( keylen > 0 ) {
+                        if ( memcmp( qg->key, key, keylen ) == 0 ) {
+                                group_add_connection( qg->grp, conn_p );
+                                return qg;
+                        }
+                } else if ( group_match_and_add( qg->grp, conn_p ) == 1 ) {
+                        return qg;
+                }
+        }
+
+        qg = mem_zalloc( sizeof( *qg ) + keylen );
+        memcpy( qg->key, key, keylen );
+        qg->inbound = inbound;
+        qg->grp = group_init();
+        group_set_filter( qg->grp, filter_from_connection( conn_p, policy,
+                                FILTERACT_GROUP ));
+        group_add_connection( qg->grp, conn_p );
+        hash_index_add( &qc->index, &qg->link, hash );
+        qg->next = qc->groups;
+        qc->groups = qg;
+
+        return qg;
+}
+
+/**
+ * Store the peak for the minute being counted on group.
+ */
+static void qgroup_close_minute( struct qgroup *qg )
+{
+        if ( qg->cur_count > qg->minute_peak )
+                qg->minute_peak = qg->cur_count;
+        if ( qg->minute_peak == 0 )
+                return;
+
+        qg->peaks = mem_realloc( qg->peaks, (qg->nr_peaks + 1) * sizeof( struct qpeak ));
+        qg->peaks[qg->nr_peaks].minute = qg->cur_minute;
+        qg->peaks[qg->nr_peaks].peak = qg->minute_peak;
+        qg->nr_peaks++;
+        qg->minute_peak = 0;
+        qg->cur_count = 0;
+}
+
+/**
+ * @brief Count entry for the group.
+ *
+ * The entries are in time order on the recording, hence when timestamp
+ * changes, the round has been completely counted.
+ *
+ * @param qg The group.
+ * @param stamp Timestamp of the entry.
+ */
+static void qgroup_count( struct qgroup *qg, time_t stamp )
+{
+        time_t minute = stamp - (stamp % 60);
+
+        if ( stamp != qg->cur_stamp ) {
+                if ( minute != qg->cur_minute ) {
+                        qgroup_close_minute( qg );
+                        qg->cur_minute = minute;
+                } else if ( qg->cur_count > qg->minute_peak ) {
+                        qg->minute_peak = qg->cur_count;
+                }
+                qg->cur_count = 0;
+                qg->cur_stamp = stamp;
+        }
+        qg->cur_count++;
+}
+
+/**
+ * @brief Check if entry matches the query selectors.
+ *
+ * @param query The query.
+ * @param ent The entry.
+ * @return 1 if entry matches, 0 if not.
+ */
+static int entry_matches( struct rec_query *query, struct rec_entry *ent )
+{
+        uint8_t addr[16];
+
+        if ( query->from != 0 && ent->stamp < query->from )
+                return 0;
+        if ( query->to != 0 && ent->stamp > query->to )
+                return 0;
+        if ( query->rport != -1 && ent->rport != query->rport )
+                return 0;
+        if ( query->raddr.ss_family != 0 ) {
+                if ( query->raddr.ss_family != ent->family )
+                        return 0;
+                ss_to_bytes( &query->raddr, addr );
+                if ( memcmp( addr, ent->raddr, 16 ) != 0 )
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * @brief Check if the block may contain entries matching the query.
+ *
+ * Only the block header is checked.
+ *
+ * @param query The query.
+ * @param hdr The block header.
+ * @return 1 if the block should be decoded, 0 if it can be skipped.
+ */
+static int block_matches( struct rec_query *query, struct rec_block_hdr *hdr )
+{
+        uint8_t addr[16];
+        uint8_t key[17];
+
+        if ( query->from != 0 && hdr->max_time < query->from )
+                return 0;
+        if ( query->to != 0 && hdr->min_time > query->to )
+                return 0;
+        if ( query->rport != -1 ) {
+                bloom_port_key( query->rport, key );
+                if ( ! bloom_test( hdr->bloom, key, 3 ))
+                        return 0;
+        }
+        if ( query->raddr.ss_family != 0 ) {
+                ss_to_bytes( &query->raddr, addr );
+                bloom_addr_key( query->raddr.ss_family, addr, key );
+                if ( ! bloom_test( hdr->bloom, key, 17 ))
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * @brief Handle one entry matching the query.
+ *
+ * The entry is turned into connection (or existing connection is updated)
+ * and counted for the group the connection belongs to.
+ *
+ * @param qc Pointer to the query context.
+ * @param ent The entry.
+ */
+static void handle_entry( struct qctx *qc, struct rec_entry *ent )
+{
+        struct sockaddr_storage laddr, raddr;
+        struct tcp_connection *conn_p;
+        struct qgroup *qg;
+
+        bytes_to_ss( ent->family, ent->laddr, ent->lport, &laddr );
+        bytes_to_ss( ent->family, ent->raddr, ent->rport, &raddr );
+
+        conn_p = chash_get( qc->chash, &laddr, &raddr );
+        if ( conn_p == NULL ) {
+                conn_p = connection_init( &laddr, &raddr, ent->state );
+                conn_p->metadata.added = ent->stamp;
+                conn_p->metadata.dir = ent->dir;
+                ent->ifname[REC_IFNAMELEN - 1] = '\0';
+                conn_p->metadata.ifname = intern_ifname( qc, ent->ifname );
+                chash_put( qc->chash, conn_p );
+        } else if ( conn_p->state != (enum tcp_state)ent->state ) {
+                conn_p->state = ent->state;
+                if ( conn_p->group != NULL &&
+                     ( group_get_policy( conn_p->group ) & POLICY_STATE )) {
+                        /* regroup, as the live UI does */
+                        group_remove_connection( conn_p->group, conn_p );
+                }
+        }
+
+        qg = group_for_connection( qc, conn_p );
+        qc->last = qg;
+        qgroup_count( qg, ent->stamp );
+        qc->matches++;
+}
+
+/**
+ * Print the values of the key fields for group formed with grouping key, in
+ * the format used on the live UI.
+ */
+static void print_key_label( struct gkey_plan *plan, struct tcp_connection *conn_p )
+{
+        int i;
+
+        printf( "Connections with" );
+        for ( i = 0; i < plan->nr_steps; i++ ) {
+                printf( "%s %s ", i > 0 ? "," : "", 
+                                gkey_field_name( plan->steps[i].field ));
+                switch ( plan->steps[i].field ) {
+                        case GKEY_LADDR :
+                                printf( "%s", conn_p->metadata.laddr_string );
+                                break;
+                        case GKEY_RADDR :
+                        case GKEY_PEER :
+                                printf( "%s", conn_p->metadata.raddr_string );
+                                break;
+                        case GKEY_LPORT :
+                                printf( "%d", connection_get_port( conn_p, 1 ));
+                                break;
+                        case GKEY_RPORT :
+                        case GKEY_PEERPORT :
+                                printf( "%d", connection_get_port( conn_p, 0 ));
+                                break;
+                        case GKEY_STATE :
+                                printf( "%s", conn_p->state <= TCP_CLOSING ?
+                                                rec_state_str[ conn_p->state ] : "-" );
+                                break;
+                        case GKEY_IF :
+                                printf( "%s", conn_p->metadata.ifname ? 
+                                                conn_p->metadata.ifname : "unknown" );
+                                break;
+                        case GKEY_AF :
+                                printf( "%s", conn_p->family == AF_INET6 ? 
+                                                "IPv6" : "IPv4" );
+                                break;
+                        default :
+                                break;
+                }
+        }
+}
+
+/**
+ * Print the label for group, in the format used on the live UI.
+ */
+static void print_group_label( struct qctx *qc, struct qgroup *qg )
+{
+        struct tcp_connection *conn_p = group_get_first_conn( qg->grp );
+        uint16_t policy = group_get_policy( qg->grp );
+
+        if ( qg->inbound ) {
+                printf( "Incoming to port %d", connection_get_port( conn_p, 1 ));
+        } else if ( qc->plan != NULL ) {
+                print_key_label( qc->plan, conn_p );
+        } else if ( policy & POLICY_IF ) {
+                printf( "Connections in interface %s",
+                        qg->grp->grp_filter->ifname ? qg->grp->grp_filter->ifname : "?" );
+        } else if ( policy & POLICY_REMOTE ) {
+                printf( "Connections to" );
+                if ( policy & POLICY_ADDR )
+                        printf( " %s", conn_p->metadata.raddr_string );
+                if ( policy & POLICY_PORT )
+                        printf( " port %d", connection_get_port( conn_p, 0 ));
+        } else if ( policy & POLICY_STATE ) {
+                printf( "Connections on state %s",
+                                rec_state_str[ qg->grp->grp_filter->state ] );
+        } else {
+                printf( "Group" );
+        }
+        printf( " (%s%d connections)\n", qc->scale > 1 ? "~" : "",
+                        group_get_size( qg->grp ) * qc->scale );
+}
+
+/**
+ * Print the results for one group.
+ */
+static void print_group( struct qctx *qc, struct qgroup *qg )
+{
+        struct tcp_connection *conn_p;
+        char tbuf[32];
+        int i;
+
+        print_group_label( qc, qg );
+
+        printf( "  Peak per minute:" );
+        for ( i = 0; i < qg->nr_peaks; i++ ) {
+                strftime( tbuf, sizeof( tbuf ), "%H:%M",
+                                localtime( &qg->peaks[i].minute ));
+                printf( "%s %s=%s%d", i % 6 == 0 && i > 0 ? "\n                  " : "",
+                                tbuf, qc->scale > 1 ? "~" : "", 
+                                qg->peaks[i].peak * qc->scale );
+        }
+        printf( "\n" );
+
+        conn_p = group_get_first_conn( qg->grp );
+        while ( conn_p != NULL ) {
+                strftime( tbuf, sizeof( tbuf ), "%Y-%m-%d %H:%M:%S",
+                                localtime( &conn_p->metadata.added ));
+                printf( "  %s:%d %s %s:%d %-12s first seen %s\n",
+                                conn_p->metadata.laddr_string,
+                                connection_get_port( conn_p, 1 ),
+                                conn_p->metadata.dir == DIR_INBOUND ? "<--" : "-->",
+                                conn_p->metadata.raddr_string,
+                                connection_get_port( conn_p, 0 ),
+                                conn_p->state <= TCP_CLOSING ? rec_state_str[ conn_p->state ] : "-",
+                                tbuf );
+                conn_p = conn_p->next;
+        }
+}
+
+/**
+ * @brief Parse time given by user.
+ *
+ * The time can be given as "YYYY-MM-DD HH:MM[:SS]", as "HH:MM[:SS]" in which
+ * case the date of the first block on recording is used, or as seconds since
+ * epoch.
+ *
+ * @param str The string to parse.
+ * @param base Timestamp used to get the date when only time is given.
+ * @param out Pointer where the parsed time is set.
+ * @return 0 on success, -1 on error.
+ */
+static int parse_query_time( const char *str, time_t base, time_t *out )
+{
+        struct tm tm;
+        char *end;
+
+        memset( &tm, 0, sizeof( tm ));
+        end = strptime( str, "%Y-%m-%d %H:%M", &tm );
+        if ( end != NULL ) {
+                if ( *end == ':' )
+                        end = strptime( end, ":%S", &tm );
+        } else {
+                localtime_r( &base, &tm );
+                tm.tm_sec = 0;
+                end = strptime( str, "%H:%M", &tm );
+                if ( end != NULL && *end == ':' )
+                        end = strptime( end, ":%S", &tm );
+        }
+        if ( end != NULL && *end == '\0' ) {
+                tm.tm_isdst = -1;
+                *out = mktime( &tm );
+                return 0;
+        }
+
+        *out = strtol( str, &end, 10 );
+        if ( *end != '\0' || *out <= 0 )
+                return -1;
+        return 0;
+}
+
+/**
+ * @brief Run query over recording and print out the results.
+ *
+ * Each block header is read and checked against the query. The entries on
+ * matching blocks are decoded and matching entries are grouped, other blocks
+ * are skipped without reading the entries.
+ *
+ * @ingroup record
+ *
+ * @param filename Name of the recording file.
+ * @param query The query.
+ * @param grouping Grouping policy for outgoing connections.
+ * @param plan Grouping key for outgoing connections, used if grouping has
+ * POLICY_KEY set.
+ * @return 0 on success, -1 on error.
+ */
+int rec_query_run( const char *filename, struct rec_query *query,
+                policy_flags_t grouping, struct gkey_plan *plan )
+{
+        struct rec_file_hdr fhdr;
+        struct rec_block_hdr bhdr;
+        struct rec_entry *entries;
+        struct qctx *qc;
+        struct qgroup *qg;
+        long data_start;
+        int blocks = 0, decoded = 0;
+        uint32_t i;
+        FILE *fp;
+        int rv = 0;
+
+        /* The owning process is not recorded. The real peer is not either,
+         * the recorded remote address stands for it as for connections which
+         * are not translated.
+         */
+        if ( plan == NULL || ! ( grouping & POLICY_KEY )) {
+                plan = NULL;
+        } else if ( gkey_plan_has_field( plan, GKEY_PID )) {
+                fprintf( stderr, "Can not group by %s, it is not on the recording\n",
+                                gkey_field_name( GKEY_PID ));
+                return -1;
+        }
+
+        fp = fopen( filename, "r" );
+        if ( fp == NULL ) {
+                fprintf( stderr, "Unable to open %s: %s\n", filename, strerror( errno ));
+                return -1;
+        }
+        if ( fread( &fhdr, sizeof( fhdr ), 1, fp ) != 1 ||
+             memcmp( fhdr.magic, REC_FILE_MAGIC, sizeof( fhdr.magic )) != 0 ||
+             fhdr.version != REC_FILE_VERSION ||
+             fhdr.entry_size != sizeof( struct rec_entry )) {
+                fprintf( stderr, "%s is not a valid recording\n", filename );
+                fclose( fp );
+                return -1;
+        }
+        data_start = ftell( fp );
+
+        /* Date for the times given without date is taken from the first
+         * block
+         */
+        memset( &bhdr, 0, sizeof( bhdr ));
+        if ( fread( &bhdr, sizeof( bhdr ), 1, fp ) != 1 )
+                bhdr.min_time = time( NULL );
+        if (( query->from_str &&
+              parse_query_time( query->from_str, bhdr.min_time, &query->from ) != 0 ) ||
+            ( query->to_str &&
+              parse_query_time( query->to_str, bhdr.min_time, &query->to ) != 0 )) {
+                fprintf( stderr, "Invalid time on query\n" );
+                fclose( fp );
+                return -1;
+        }
+        fseek( fp, data_start, SEEK_SET );
+
+        /* Cloud grouping depends on the time the connections are seen live */
+        grouping &= ~POLICY_CLOUD;
+        if ( plan == NULL )
+                grouping &= ~POLICY_KEY;
+        if ( grouping == 0 )
+                grouping = POLICY_REMOTE | POLICY_ADDR;
+
+        qc = mem_zalloc( sizeof( *qc ));
+        qc->query = query;
+        qc->grouping = grouping;
+        qc->plan = plan;
+        qc->scale = fhdr.sample_rate > 1 ? fhdr.sample_rate : 1;
+        qc->chash = chash_init();
+        hash_index_init( &qc->index, QUERY_INDEX_INIT_SIZE );
+        entries = mem_alloc( REC_BLOCK_ENTRIES * sizeof( struct rec_entry ));
+
+        while ( fread( &bhdr, sizeof( bhdr ), 1, fp ) == 1 ) {
+                if ( bhdr.magic != REC_BLOCK_MAGIC ||
+                     bhdr.nr_entries > REC_BLOCK_ENTRIES ) {
+                        fprintf( stderr, "Corrupted block on recording\n" );
+                        rv = -1;
+                        break;
+                }
+                blocks++;
+                if ( ! block_matches( query, &bhdr )) {
+                        fseek( fp, bhdr.nr_entries * sizeof( struct rec_entry ), SEEK_CUR );
+                        continue;
+                }
+                if ( fread( entries, sizeof( struct rec_entry ), bhdr.nr_entries, fp ) !=
+                                bhdr.nr_entries ) {
+                        WARN( "Truncated block on recording\n" );
+                        break;
+                }
+                decoded++;
+                for ( i = 0; i < bhdr.nr_entries; i++ ) {
+                        if ( entry_matches( query, &entries[i] ))
+                                handle_entry( qc, &entries[i] );
+                }
+        }
+        fclose( fp );
+
+        printf( "%d blocks on recording, %d decoded, %d matching entries\n",
+                        blocks, decoded, qc->matches );
+        if ( qc->scale > 1 ) 
+                printf( "Recorded 1/%d of the connections, counts are estimates\n",
+                                qc->scale );
+        printf( "\n" );
+        for ( qg = qc->groups; qg != NULL; qg = qg->next ) {
+                qgroup_close_minute( qg );
+                if ( group_get_size( qg->grp ) > 0 )
+                        print_group( qc, qg );
+        }
+
+        chash_clear( qc->chash );
+        chash_deinit( qc->chash );
+        while ( qc->groups != NULL ) {
+                qg = qc->groups;
+                qc->groups = qg->next;
+                group_deinit( qg->grp, 1 );
+                if ( qg->peaks != NULL )
+                        mem_free( qg->peaks );
+                mem_free( qg );
+        }
+        hash_index_deinit( &qc->index );
+        mem_free( entries );
+        mem_free( qc );
+
+        return rv;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file record.h
+ * @brief Recording of connection snapshots and offline queries over them.
+ *
+ * A recording is a sequence of blocks, each holding the connections seen on
+ * a number of consecutive update rounds. Every block starts with a small
+ * index (time range and a bloom filter over the remote addresses and ports on
+ * the block) which allows the query to skip blocks without decoding them.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdio.h>
+
+/**
+ * Magic identifying a recording file.
+ */
+#define REC_FILE_MAGIC "TCPSTREC"
+/**
+ * Version of the recording format.
+ */
+#define REC_FILE_VERSION 2
+/**
+ * Magic starting every block on the recording.
+ */
+#define REC_BLOCK_MAGIC 0x314b4c42 /* "BLK1" */
+
+/**
+ * Maximum number of entries on one block.
+ */
+#define REC_BLOCK_ENTRIES 1024
+/**
+ * Maximum number of seconds one block can span.
+ */
+#define REC_BLOCK_SECS 60
+/**
+ * Size of the bloom filter on block header in bytes (should be power of 2).
+ */
+#define REC_BLOOM_BYTES 128
+/**
+ * Space reserved for interface name on entry.
+ */
+#define REC_IFNAMELEN 16
+
+/**
+ * Header for the recording file.
+ * All values on the recording are in host byte order, except the addresses
+ * which are kept in network byte order.
+ * @ingroup record
+ */
+struct rec_file_hdr {
+        char magic[8]; /**< REC_FILE_MAGIC */
+        uint32_t version; /**< REC_FILE_VERSION */
+        uint32_t entry_size; /**< Size of struct rec_entry */
+        uint32_t sample_rate; /**< Connections each recorded one stands for */
+        uint32_t pad;
+};
+
+/**
+ * Header (index) for one block on the recording.
+ * @ingroup record
+ */
+struct rec_block_hdr {
+        uint32_t magic; /**< REC_BLOCK_MAGIC */
+        uint32_t nr_entries; /**< Number of entries following the header */
+        int64_t min_time; /**< Timestamp of the first entry on block */
+        int64_t max_time; /**< Timestamp of the last entry on block */
+        /**
+         * Bloom filter containing all remote addresses and remote ports
+         * seen on the block.
+         */
+        uint8_t bloom[REC_BLOOM_BYTES];
+};
+
+/**
+ * One recorded connection on one update round.
+ * @ingroup record
+ */
+struct rec_entry {
+        int64_t stamp; /**< Time of the update round */
+        uint8_t family; /**< Address family */
+        uint8_t state; /**< TCP state */
+        uint8_t dir; /**< enum connection_dir */
+        uint8_t pad;
+        uint16_t lport; /**< Local port (host byte order) */
+        uint16_t rport; /**< Remote port (host byte order) */
+        uint8_t laddr[16]; /**< Local address */
+        uint8_t raddr[16]; /**< Remote address */
+        char ifname[REC_IFNAMELEN]; /**< Interface, empty if not known */
+};
+
+/**
+ * Context for writing a recording.
+ * @ingroup record
+ */
+struct recorder {
+        FILE *fp; /**< The recording file */
+        struct rec_block_hdr hdr; /**< Header for the block being collected */
+        struct rec_entry *entries; /**< Entries for the block being collected */
+        time_t stamp; /**< Timestamp for the round being recorded */
+        int blocks; /**< Number of blocks written */
+};
+
+/**
+ * Selectors for the offline query, unset selectors match everything.
+ * @ingroup record
+ */
+struct rec_query {
+        time_t from; /**< Start of the time range, 0 for no start */
+        time_t to; /**< End of the time range, 0 for no end */
+        /**
+         * Remote address to look for, ss_family is 0 if address should not
+         * be checked. Port is not checked.
+         */
+        struct sockaddr_storage raddr;
+        int rport; /**< Remote port to look for, -1 for any */
+        char *from_str; /**< Start of time range as given by user */
+        char *to_str; /**< End of time range as given by user */
+};
+
+struct stat_context;
+struct gkey_plan;
+
+struct recorder *recorder_init( const char *filename, int sample_rate );
+void recorder_deinit( struct recorder *rec );
+void record_round( struct recorder *rec, struct stat_context *ctx );
+
+struct rec_query *rec_query_init( void );
+void rec_query_deinit( struct rec_query *query );
+int rec_query_run( const char *filename, struct rec_query *query,
+                policy_flags_t grouping, struct gkey_plan *plan );
+
+#endif /* _RECORD_H_ */
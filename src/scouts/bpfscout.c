@@ -0,0 +1,1043 @@
+/**
+ * @file bpfscout.c
+ * @brief TCP state transitions from the sock:inet_sock_set_state tracepoint.
+ *
+ * A small BPF program is attached to the inet_sock_set_state tracepoint. For
+ * every TCP state change it copies the addresses, ports and the old and new
+ * state to a BPF ring buffer, from where the transitions are read once per
+ * update round and fed to the system as with the connections read from
+ * /proc/net/tcp. With the events the connections get their state changes and
+ * the time they were created accurately, and also the connections opened and
+ * closed between the update rounds are seen.
+ *
+ * /proc/net/tcp is still read every few rounds to reconcile the state, as
+ * connections opened before the program was started are only seen on the
+ * poll. The program counts the transitions not fitting on a full ring buffer
+ * on per-CPU counters, and when the count grows the poll is done on that
+ * round. On the rounds between the polls, connections for which no events
+ * were received are assumed to remain on their current state. Only the last
+ * transition of each socket on the round is fed to the system.
+ *
+ * The program is assembled by hand and loaded with the bpf() system call so
+ * that no BPF toolchain is needed, the offsets of the tracepoint fields are
+ * read from the format description on tracefs. Loading the program needs
+ * CAP_BPF and CAP_PERFMON (or CAP_SYS_ADMIN), and tracefs has to be
+ * mounted.
+ *
+ * When following processes, the events do not tell the inode for the socket.
+ * The inodes for new connections are looked up with sock_diag.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <linux/bpf.h>
+#include <linux/perf_event.h>
+#include <sys/time.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_BPF
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "scouts.h"
+#include "hash.h"
+
+/**
+ * Size of the ring buffer (must be power of 2 multiple of page size). One
+ * transition takes 72 bytes on the buffer.
+ */
+#define BPF_RINGBUF_SIZE (4 * 1024 * 1024)
+
+/**
+ * Maximum number of instructions on the program.
+ */
+#define BPF_PROG_MAX_INSNS 128
+
+/**
+ * Size of the buffer for the verifier log.
+ */
+#define BPF_LOG_SIZE 65536
+
+/**
+ * File listing the CPUs which can be brought online.
+ */
+#define POSSIBLE_CPUS_FILE "/sys/devices/system/cpu/possible"
+
+#ifdef ENABLE_FOLLOW_PID
+/**
+ * Time to wait for the reply for inode lookup (ms).
+ */
+#define INODE_LOOKUP_TIMEOUT 100
+#endif /* ENABLE_FOLLOW_PID */
+
+/**
+ * Directories where tracefs might be mounted.
+ */
+static const char *tracefs_dirs[] = {
+        "/sys/kernel/tracing",
+        "/sys/kernel/debug/tracing",
+        NULL
+};
+
+/**
+ * Path of the tracepoint relative to tracefs.
+ */
+#define TRACEPOINT_PATH "events/sock/inet_sock_set_state"
+
+/**
+ * One state transition as written on the ring buffer by the program. 
+ * Ports are in host byte order, addresses in network byte order.
+ */
+struct bpf_state_event {
+        uint64_t stamp; /**< CLOCK_MONOTONIC time of the transition (ns) */
+        int32_t oldstate; /**< State before the transition */
+        int32_t newstate; /**< State after the transition */
+        uint16_t sport; /**< Local port */
+        uint16_t dport; /**< Remote port */
+        uint16_t family; /**< Address family */
+        uint16_t pad;
+        uint8_t saddr[4]; /**< Local IPv4 address */
+        uint8_t daddr[4]; /**< Remote IPv4 address */
+        uint8_t saddr6[16]; /**< Local IPv6 address */
+        uint8_t daddr6[16]; /**< Remote IPv6 address */
+};
+
+/**
+ * Field on the tracepoint which is copied to the event.
+ */
+struct tp_field {
+        const char *name; /**< Name of the field on tracepoint */
+        int event_off; /**< Offset of the field on struct bpf_state_event */
+        int size; /**< Size of the field */
+        int tp_off; /**< Offset on tracepoint, -1 if not found */
+};
+
+/**
+ * Fields copied from the tracepoint to the event.
+ */
+static struct tp_field tp_fields[] = {
+        { "oldstate", offsetof( struct bpf_state_event, oldstate ), 4, -1 },
+        { "newstate", offsetof( struct bpf_state_event, newstate ), 4, -1 },
+        { "sport", offsetof( struct bpf_state_event, sport ), 2, -1 },
+        { "dport", offsetof( struct bpf_state_event, dport ), 2, -1 },
+        { "family", offsetof( struct bpf_state_event, family ), 2, -1 },
+        { "saddr", offsetof( struct bpf_state_event, saddr ), 4, -1 },
+        { "daddr", offsetof( struct bpf_state_event, daddr ), 4, -1 },
+        { "saddr_v6", offsetof( struct bpf_state_event, saddr6 ), 16, -1 },
+        { "daddr_v6", offsetof( struct bpf_state_event, daddr6 ), 16, -1 },
+        { NULL, 0, 0, -1 }
+};
+
+/**
+ * Offset of the protocol field on the tracepoint, -1 if the tracepoint does
+ * not have it (older kernels only trace TCP).
+ */
+static int tp_protocol_off = -1;
+
+/**
+ * Program being assembled.
+ */
+struct bpf_prog_buf {
+        struct bpf_insn insns[BPF_PROG_MAX_INSNS]; /**< The instructions */
+        int count; /**< Number of instructions */
+};
+
+/**
+ * Wrapper for the bpf() system call.
+ */
+static int sys_bpf( int cmd, union bpf_attr *attr )
+{
+        return syscall( __NR_bpf, cmd, attr, sizeof( *attr ));
+}
+
+/**
+ * @brief Open file for the tracepoint from tracefs.
+ *
+ * @param file Name of the file under the tracepoint directory.
+ * @return The opened file, NULL if not found.
+ */
+static FILE *open_tracepoint_file( const char *file )
+{
+        char path[256];
+        FILE *fp;
+        int i;
+
+        for ( i = 0; tracefs_dirs[i] != NULL; i++ ) {
+                snprintf( path, sizeof( path ), "%s/%s/%s", tracefs_dirs[i],
+                                TRACEPOINT_PATH, file );
+                fp = fopen( path, "r" );
+                if ( fp != NULL )
+                        return fp;
+        }
+        WARN( "Unable to find tracepoint file %s\n", file );
+        return NULL;
+}
+
+/**
+ * @brief Read the id of the tracepoint.
+ * @return The id, -1 on error.
+ */
+static int read_tracepoint_id( void )
+{
+        FILE *fp = open_tracepoint_file( "id" );
+        int id = -1;
+
+        if ( fp == NULL )
+                return -1;
+        if ( fscanf( fp, "%d", &id ) != 1 )
+                id = -1;
+        fclose( fp );
+        return id;
+}
+
+/**
+ * @brief Read the offsets of the fields from the tracepoint format.
+ *
+ * The lines on format look like
+ * <pre>
+ *  field:__u16 sport;	offset:24;	size:2;	signed:0;
+ * </pre>
+ *
+ * @return 0 if all needed fields were found, -1 if not.
+ */
+static int read_tracepoint_format( void )
+{
+        FILE *fp = open_tracepoint_file( "format" );
+        char line[256], name[64];
+        char *field, *semi, *p;
+        int off, size, i;
+
+        if ( fp == NULL )
+                return -1;
+
+        while ( fgets( line, sizeof( line ), fp ) != NULL ) {
+                field = strstr( line, "field:" );
+                if ( field == NULL )
+                        continue;
+                semi = strchr( field, ';' );
+                p = strstr( line, "offset:" );
+                if ( semi == NULL || p == NULL ||
+                                sscanf( p, "offset:%d;\tsize:%d;", &off, &size ) != 2 )
+                        continue;
+
+                /* Name is the last word before ';', without array size */
+                *semi = '\0';
+                p = strrchr( field, ' ' );
+                p = ( p != NULL ) ? p + 1 : field + strlen( "field:" );
+                strncpy( name, p, sizeof( name ) - 1 );
+                name[sizeof( name ) - 1] = '\0';
+                p = strchr( name, '[' );
+                if ( p != NULL )
+                        *p = '\0';
+
+                if ( strcmp( name, "protocol" ) == 0 && size == 2 ) {
+                        tp_protocol_off = off;
+                        continue;
+                }
+                for ( i = 0; tp_fields[i].name != NULL; i++ ) {
+                        if ( strcmp( name, tp_fields[i].name ) == 0 &&
+                                        size == tp_fields[i].size )
+                                tp_fields[i].tp_off = off;
+                }
+        }
+        fclose( fp );
+
+        for ( i = 0; tp_fields[i].name != NULL; i++ ) {
+                if ( tp_fields[i].tp_off < 0 ) {
+                        WARN( "Tracepoint field %s not found\n", tp_fields[i].name );
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/**
+ * @brief Add instruction to the program.
+ */
+static void emit( struct bpf_prog_buf *prog, uint8_t code, uint8_t dst,
+                uint8_t src, int16_t off, int32_t imm )
+{
+        struct bpf_insn *insn = &prog->insns[prog->count++];
+
+        memset( insn, 0, sizeof( *insn ));
+        insn->code = code;
+        insn->dst_reg = dst;
+        insn->src_reg = src;
+        insn->off = off;
+        insn->imm = imm;
+}
+
+/**
+ * @brief Add instructions copying one field from the tracepoint to event.
+ *
+ * The tracepoint context is on r6 and the event on r7.
+ */
+static void emit_copy( struct bpf_prog_buf *prog, struct tp_field *field )
+{
+        int chunk, sz, i;
+
+        if ( field->size % 4 == 0 ) {
+                chunk = 4;
+                sz = BPF_W;
+        } else {
+                chunk = 2;
+                sz = BPF_H;
+        }
+        for ( i = 0; i < field->size; i += chunk ) {
+                emit( prog, BPF_LDX | BPF_MEM | sz, BPF_REG_1, BPF_REG_6,
+                                field->tp_off + i, 0 );
+                emit( prog, BPF_STX | BPF_MEM | sz, BPF_REG_7, BPF_REG_1,
+                                field->event_off + i, 0 );
+        }
+}
+
+/**
+ * @brief Assemble the program.
+ *
+ * The program does (r6 holding the tracepoint context):
+ * <pre>
+ *  if ( ctx->protocol != IPPROTO_TCP ) return 0;
+ *  ev = bpf_ringbuf_reserve( map, sizeof( *ev ), 0 );
+ *  if ( ev == NULL ) goto drop;
+ *  ev->stamp = bpf_ktime_get_ns();
+ *  ev->field = ctx->field;  (for each field)
+ *  bpf_ringbuf_submit( ev, 0 );
+ *  return 0;
+ * drop:
+ *  key = 0;
+ *  cnt = bpf_map_lookup_elem( drops, &key );
+ *  if ( cnt != NULL ) *cnt += 1;
+ *  return 0;
+ * </pre>
+ *
+ * @param prog Buffer for the program.
+ * @param map_fd The ring buffer map.
+ * @param drops_fd The per-CPU counter for lost transitions.
+ */
+static void assemble_prog( struct bpf_prog_buf *prog, int map_fd, int drops_fd )
+{
+        int jumps[3], nr_jumps = 0;
+        int drop_jump, i;
+
+        prog->count = 0;
+        emit( prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0 );
+        if ( tp_protocol_off >= 0 ) {
+                emit( prog, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_2, BPF_REG_6,
+                                tp_protocol_off, 0 );
+                jumps[nr_jumps++] = prog->count;
+                emit( prog, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 0, IPPROTO_TCP );
+        }
+        /* 64-bit immediate load takes two instructions */
+        emit( prog, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd );
+        emit( prog, 0, 0, 0, 0, 0 );
+        emit( prog, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 
+                        sizeof( struct bpf_state_event ));
+        emit( prog, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0 );
+        emit( prog, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ringbuf_reserve );
+        drop_jump = prog->count;
+        emit( prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0 );
+        emit( prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0 );
+
+        emit( prog, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns );
+        emit( prog, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_7, BPF_REG_0, 
+                        offsetof( struct bpf_state_event, stamp ), 0 );
+        emit( prog, BPF_ST | BPF_MEM | BPF_H, BPF_REG_7, 0, 
+                        offsetof( struct bpf_state_event, pad ), 0 );
+        for ( i = 0; tp_fields[i].name != NULL; i++ )
+                emit_copy( prog, &tp_fields[i] );
+
+        emit( prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0 );
+        emit( prog, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0 );
+        emit( prog, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ringbuf_submit );
+        jumps[nr_jumps++] = prog->count;
+        emit( prog, BPF_JMP | BPF_JA, 0, 0, 0, 0 );
+
+        /* drop: */
+        prog->insns[drop_jump].off = prog->count - drop_jump - 1;
+        emit( prog, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, 0 );
+        emit( prog, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, drops_fd );
+        emit( prog, 0, 0, 0, 0, 0 );
+        emit( prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0 );
+        emit( prog, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4 );
+        emit( prog, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem );
+        jumps[nr_jumps++] = prog->count;
+        emit( prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0 );
+        /* Counter is per CPU, no need for atomic add */
+        emit( prog, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0 );
+        emit( prog, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, 1 );
+        emit( prog, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0 );
+
+        /* exit: */
+        for ( i = 0; i < nr_jumps; i++ )
+                prog->insns[jumps[i]].off = prog->count - jumps[i] - 1;
+        emit( prog, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0 );
+        emit( prog, BPF_JMP | BPF_EXIT, 0, 0, 0, 0 );
+}
+
+/**
+ * @brief Load the program to the kernel.
+ *
+ * If the verifier rejects the program, the load is retried with the verifier
+ * log enabled and the log is written to the debug output.
+ *
+ * @param prog The assembled program.
+ * @return File descriptor for the program, -1 on error.
+ */
+static int load_prog( struct bpf_prog_buf *prog )
+{
+        union bpf_attr attr;
+        char *log;
+        int fd, err;
+
+        memset( &attr, 0, sizeof( attr ));
+        attr.prog_type = BPF_PROG_TYPE_TRACEPOINT;
+        attr.insns = (uint64_t)(unsigned long)prog->insns;
+        attr.insn_cnt = prog->count;
+        attr.license = (uint64_t)(unsigned long)"Dual BSD/GPL";
+
+        fd = sys_bpf( BPF_PROG_LOAD, &attr );
+        if ( fd >= 0 || errno != EACCES )
+                return fd;
+
+        err = errno;
+        log = mem_zalloc( BPF_LOG_SIZE );
+        attr.log_buf = (uint64_t)(unsigned long)log;
+        attr.log_size = BPF_LOG_SIZE;
+        attr.log_level = 1;
+        fd = sys_bpf( BPF_PROG_LOAD, &attr );
+        if ( fd < 0 ) {
+                WARN( "Program rejected by verifier:\n%s\n", log );
+                errno = err;
+        }
+        mem_free( log );
+        return fd;
+}
+
+/**
+ * @brief Create the ring buffer and map it to our address space.
+ *
+ * @param ev Pointer to the event source, fd and the mappings are filled.
+ * @return 0 on success, -1 on error.
+ */
+static int create_ringbuf( struct bpf_events *ev )
+{
+        union bpf_attr attr;
+        void *p;
+
+        memset( &attr, 0, sizeof( attr ));
+        attr.map_type = BPF_MAP_TYPE_RINGBUF;
+        attr.max_entries = BPF_RINGBUF_SIZE;
+        ev->map_fd = sys_bpf( BPF_MAP_CREATE, &attr );
+        if ( ev->map_fd < 0 ) {
+                WARN( "Unable to create ring buffer: %s\n", strerror( errno ));
+                return -1;
+        }
+
+        ev->page_size = sysconf( _SC_PAGESIZE );
+        /* Consumer position is on first page, writable */
+        p = mmap( NULL, ev->page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        ev->map_fd, 0 );
+        if ( p == MAP_FAILED ) {
+                WARN( "Unable to map consumer page: %s\n", strerror( errno ));
+                return -1;
+        }
+        ev->consumer = p;
+
+        /* Producer position and the data, data is mapped twice in a row so
+         * that records wrapping around can be read as is.
+         */
+        p = mmap( NULL, ev->page_size + 2 * BPF_RINGBUF_SIZE, PROT_READ, 
+                        MAP_SHARED, ev->map_fd, ev->page_size );
+        if ( p == MAP_FAILED ) {
+                WARN( "Unable to map ring buffer: %s\n", strerror( errno ));
+                return -1;
+        }
+        ev->producer = p;
+        ev->data = (uint8_t *)p + ev->page_size;
+
+        return 0;
+}
+
+/**
+ * @brief Get the number of possible CPUs.
+ *
+ * The per-CPU maps hold a value for every CPU that can be brought online.
+ * The file lists them as ranges, like "0-3,8-11".
+ *
+ * @return Number of possible CPUs.
+ */
+static int possible_cpus( void )
+{
+        FILE *fp = fopen( POSSIBLE_CPUS_FILE, "r" );
+        char line[256], *p;
+        long cpu, max = -1;
+
+        if ( fp != NULL ) {
+                if ( fgets( line, sizeof( line ), fp ) != NULL ) {
+                        p = line;
+                        while ( *p != '\0' ) {
+                                if ( isdigit( (unsigned char)*p )) {
+                                        cpu = strtol( p, &p, 10 );
+                                        if ( cpu > max )
+                                                max = cpu;
+                                } else {
+                                        p++;
+                                }
+                        }
+                }
+                fclose( fp );
+        }
+        if ( max < 0 ) {
+                WARN( "Unable to read %s\n", POSSIBLE_CPUS_FILE );
+                return sysconf( _SC_NPROCESSORS_CONF );
+        }
+        return max + 1;
+}
+
+/**
+ * @brief Create the per-CPU counter for transitions lost with full ring
+ * buffer.
+ *
+ * @param ev Pointer to the event source, drops_fd and the buffer for the
+ * counters are filled.
+ * @return 0 on success, -1 on error.
+ */
+static int create_drop_counters( struct bpf_events *ev )
+{
+        union bpf_attr attr;
+
+        memset( &attr, 0, sizeof( attr ));
+        attr.map_type = BPF_MAP_TYPE_PERCPU_ARRAY;
+        attr.key_size = sizeof( uint32_t );
+        attr.value_size = sizeof( uint64_t );
+        attr.max_entries = 1;
+        ev->drops_fd = sys_bpf( BPF_MAP_CREATE, &attr );
+        if ( ev->drops_fd < 0 ) {
+                WARN( "Unable to create drop counters: %s\n", strerror( errno ));
+                return -1;
+        }
+        ev->nr_cpus = possible_cpus();
+        ev->drop_counts = mem_zalloc( ev->nr_cpus * sizeof( uint64_t ));
+        return 0;
+}
+
+/**
+ * @brief Read the number of transitions lost since the start.
+ *
+ * @param ev Pointer to the event source.
+ * @return Sum of the per-CPU counters, the previous count on error.
+ */
+static unsigned long read_drop_counters( struct bpf_events *ev )
+{
+        union bpf_attr attr;
+        uint32_t key = 0;
+        unsigned long sum = 0;
+        int i;
+
+        memset( &attr, 0, sizeof( attr ));
+        attr.map_fd = ev->drops_fd;
+        attr.key = (uint64_t)(unsigned long)&key;
+        attr.value = (uint64_t)(unsigned long)ev->drop_counts;
+        if ( sys_bpf( BPF_MAP_LOOKUP_ELEM, &attr ) != 0 ) {
+                WARN( "Unable to read drop counters: %s\n", strerror( errno ));
+                return ev->drops;
+        }
+        for ( i = 0; i < ev->nr_cpus; i++ )
+                sum += ev->drop_counts[i];
+        return sum;
+}
+
+#ifdef ENABLE_FOLLOW_PID
+/**
+ * @brief Open the sock_diag socket for looking up the inodes.
+ *
+ * @param ev Pointer to the event source, diag_fd is set.
+ * @return 0 on success, -1 on error.
+ */
+static int open_inode_lookup( struct bpf_events *ev )
+{
+        struct timeval tv;
+
+        ev->diag_fd = socket( AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, 
+                        NETLINK_SOCK_DIAG );
+        if ( ev->diag_fd < 0 ) {
+                WARN( "Unable to open sock_diag socket: %s\n", strerror( errno ));
+                return -1;
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = INODE_LOOKUP_TIMEOUT * 1000;
+        if ( setsockopt( ev->diag_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, 
+                                sizeof( tv )) != 0 ) {
+                WARN( "Unable to set timeout for lookups: %s\n", strerror( errno ));
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * @brief Look up the inode of a socket with sock_diag.
+ *
+ * @param ev Pointer to the event source.
+ * @param key The socket.
+ * @return The inode, 0 if the socket was not found (it may already be
+ * closed).
+ */
+static ino_t lookup_inode( struct bpf_events *ev, struct conn_key *key )
+{
+        struct {
+                struct nlmsghdr nlh;
+                struct inet_diag_req_v2 req;
+        } msg;
+        char buf[1024];
+        struct nlmsghdr *nlh;
+        struct inet_diag_msg *diag;
+        ssize_t len;
+        int alen = ( key->family == AF_INET ) ? 4 : 16;
+
+        memset( &msg, 0, sizeof( msg ));
+        msg.nlh.nlmsg_len = sizeof( msg );
+        msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+        msg.nlh.nlmsg_flags = NLM_F_REQUEST;
+        msg.nlh.nlmsg_seq = ++ev->diag_seq;
+        msg.req.sdiag_family = key->family;
+        msg.req.sdiag_protocol = IPPROTO_TCP;
+        msg.req.idiag_states = ~0U;
+        msg.req.id.idiag_sport = key->lport;
+        msg.req.id.idiag_dport = key->rport;
+        memcpy( msg.req.id.idiag_src, &key->laddr[16 - alen], alen );
+        memcpy( msg.req.id.idiag_dst, &key->raddr[16 - alen], alen );
+        msg.req.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+        msg.req.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+        if ( send( ev->diag_fd, &msg, sizeof( msg ), 0 ) < 0 ) {
+                WARN( "Unable to send inode lookup: %s\n", strerror( errno ));
+                return 0;
+        }
+
+        while ( 1 ) {
+                len = recv( ev->diag_fd, buf, sizeof( buf ), 0 );
+                if ( len < 0 ) {
+                        if ( errno == EINTR )
+                                continue;
+                        WARN( "No reply for inode lookup: %s\n", strerror( errno ));
+                        return 0;
+                }
+                for ( nlh = (struct nlmsghdr *)buf; NLMSG_OK( nlh, len ); 
+                                nlh = NLMSG_NEXT( nlh, len )) {
+                        /* Replies for lookups which timed out */
+                        if ( nlh->nlmsg_seq != ev->diag_seq ) 
+                                continue;
+                        if ( nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY ||
+                                        nlh->nlmsg_len < NLMSG_LENGTH( sizeof( *diag )))
+                                return 0;
+                        diag = NLMSG_DATA( nlh );
+                        return diag->idiag_inode;
+                }
+        }
+}
+#endif /* ENABLE_FOLLOW_PID */
+
+/**
+ * @brief Attach the program to the tracepoint.
+ *
+ * @param ev Pointer to the event source, perf_fd is filled.
+ * @param tp_id Id of the tracepoint.
+ * @return 0 on success, -1 on error.
+ */
+static int attach_prog( struct bpf_events *ev, int tp_id )
+{
+        struct perf_event_attr attr;
+
+        memset( &attr, 0, sizeof( attr ));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof( attr );
+        attr.config = tp_id;
+        attr.sample_period = 1;
+        attr.sample_type = PERF_SAMPLE_RAW;
+        attr.wakeup_events = 1;
+
+        /* The program is run on all CPUs, regardless of the CPU the event
+         * is opened for.
+         */
+        ev->perf_fd = syscall( __NR_perf_event_open, &attr, -1, 0, -1, 
+                        PERF_FLAG_FD_CLOEXEC );
+        if ( ev->perf_fd < 0 ) {
+                WARN( "Unable to open tracepoint: %s\n", strerror( errno ));
+                return -1;
+        }
+        if ( ioctl( ev->perf_fd, PERF_EVENT_IOC_SET_BPF, ev->prog_fd ) != 0 ||
+                        ioctl( ev->perf_fd, PERF_EVENT_IOC_ENABLE, 0 ) != 0 ) {
+                WARN( "Unable to attach program: %s\n", strerror( errno ));
+                return -1;
+        }
+        return 0;
+}
+
+/** 
+ * @brief Initialize the event source for state transitions.
+ *
+ * The ring buffer is created, the program is loaded and attached to the
+ * tracepoint.
+ * 
+ * @param ctx Pointer to the global context.
+ * 
+ * @return Pointer to the event source, NULL if the events are not available
+ * (errno is set). 
+ */
+struct bpf_events *bpf_events_init( struct stat_context *ctx )
+{
+        struct bpf_events *ev;
+        struct bpf_prog_buf *prog;
+        int tp_id, err;
+
+        tp_id = read_tracepoint_id();
+        if ( tp_id < 0 || read_tracepoint_format() != 0 ) {
+                errno = ENOENT;
+                return NULL;
+        }
+
+        ev = mem_zalloc( sizeof( *ev ));
+        ev->map_fd = -1;
+        ev->drops_fd = -1;
+        ev->prog_fd = -1;
+        ev->perf_fd = -1;
+        ev->pending_size = BPF_PENDING_INIT_SIZE;
+        ev->pending = mem_alloc( ev->pending_size * sizeof( *ev->pending ));
+        hash_index_init( &ev->pending_index, ev->pending_size );
+#ifdef ENABLE_FOLLOW_PID
+        ev->diag_fd = -1;
+        if ( OPERATION_ENABLED( ctx, OP_FOLLOW_PID ) && 
+                        open_inode_lookup( ev ) != 0 ) 
+                goto err_out;
+#endif /* ENABLE_FOLLOW_PID */
+        if ( create_ringbuf( ev ) != 0 || create_drop_counters( ev ) != 0 ) 
+                goto err_out;
+
+        prog = mem_alloc( sizeof( *prog ));
+        assemble_prog( prog, ev->map_fd, ev->drops_fd );
+        ev->prog_fd = load_prog( prog );
+        mem_free( prog );
+        if ( ev->prog_fd < 0 ) {
+                WARN( "Unable to load program: %s\n", strerror( errno ));
+                goto err_out;
+        }
+        if ( attach_prog( ev, tp_id ) != 0 )
+                goto err_out;
+
+        DBG( "Attached to tracepoint %d\n", tp_id );
+        return ev;
+
+err_out:
+        err = errno;
+        bpf_events_deinit( ev );
+        errno = err;
+        return NULL;
+}
+
+/** 
+ * @brief Detach the program and release the ring buffer.
+ * 
+ * @param ev Pointer to the event source.
+ */
+void bpf_events_deinit( struct bpf_events *ev )
+{
+        if ( ev->perf_fd >= 0 ) {
+                ioctl( ev->perf_fd, PERF_EVENT_IOC_DISABLE, 0 );
+                close( ev->perf_fd );
+        }
+        if ( ev->prog_fd >= 0 )
+                close( ev->prog_fd );
+        if ( ev->producer != NULL )
+                munmap( ev->producer, ev->page_size + 2 * BPF_RINGBUF_SIZE );
+        if ( ev->consumer != NULL )
+                munmap( ev->consumer, ev->page_size );
+        if ( ev->map_fd >= 0 )
+                close( ev->map_fd );
+        if ( ev->drops_fd >= 0 )
+                close( ev->drops_fd );
+#ifdef ENABLE_FOLLOW_PID
+        if ( ev->diag_fd >= 0 )
+                close( ev->diag_fd );
+#endif /* ENABLE_FOLLOW_PID */
+        if ( ev->drop_counts != NULL )
+                mem_free( ev->drop_counts );
+        hash_index_deinit( &ev->pending_index );
+        mem_free( ev->pending );
+        mem_free( ev );
+}
+
+/**
+ * @brief Get the pending transition for a socket.
+ *
+ * If the socket has no transitions on this round, a new entry is added.
+ *
+ * @param ev Pointer to the event source.
+ * @param key The socket.
+ * @return The entry for the socket.
+ */
+static struct bpf_pending *get_pending( struct bpf_events *ev, struct conn_key *key )
+{
+        struct bpf_pending *pend;
+        struct hash_link *link;
+        uint32_t hash = conn_key_hash( key );
+        int i;
+
+        for ( link = hash_index_first( &ev->pending_index, hash ); link != NULL;
+                        link = hash_index_next( link )) {
+                pend = HASH_ENTRY( link, struct bpf_pending, link );
+                if ( memcmp( &pend->key, key, sizeof( *key )) == 0 )
+                        return pend;
+        }
+
+        if ( ev->nr_pending == ev->pending_size ) {
+                /* The entries move, link them again */
+                ev->pending_size *= 2;
+                ev->pending = mem_realloc( ev->pending, 
+                                ev->pending_size * sizeof( *ev->pending ));
+                hash_index_clear( &ev->pending_index );
+                for ( i = 0; i < ev->nr_pending; i++ ) 
+                        hash_index_add( &ev->pending_index, &ev->pending[i].link, 
+                                        ev->pending[i].link.hash );
+        }
+        pend = &ev->pending[ev->nr_pending++];
+        pend->key = *key;
+        hash_index_add( &ev->pending_index, &pend->link, hash );
+        return pend;
+}
+
+/** 
+ * @brief Handle one state transition.
+ *
+ * The transition replaces the earlier transitions of the socket on this
+ * round, the connection is updated once with the state it ended up in.
+ * 
+ * @param ev Pointer to the event source.
+ * @param tev The transition.
+ * @param mono_now Current monotonic time (ns).
+ * @param now Current wall clock time (ms).
+ * @param ctx Pointer to the global context.
+ */
+static void handle_transition( struct bpf_events *ev, struct bpf_state_event *tev,
+                uint64_t mono_now, uint64_t now, struct stat_context *ctx )
+{
+        struct bpf_pending *pend;
+        struct conn_key key;
+        int state = tev->newstate;
+
+        if ( tev->family == AF_INET ) {
+                if ( ctx->collected_stats == STAT_V6_ONLY )
+                        return;
+        } else if ( tev->family == AF_INET6 ) {
+                if ( ctx->collected_stats == STAT_V4_ONLY )
+                        return;
+        } else {
+                return;
+        }
+        ev->events++;
+        ev->round_events++;
+
+        /* Connecting socket gets the local port after SYN_SENT */
+        if ( tev->sport == 0 )
+                return;
+        if ( state == TCP_CLOSE ) {
+                /* Closing listener or socket which never connected */
+                if ( tev->dport == 0 && tev->oldstate != TCP_LISTEN ) 
+                        return;
+                /* Full socket is closed when it goes to TIME_WAIT, the
+                 * poll will see when TIME_WAIT is over.
+                 */
+                if ( tev->oldstate == TCP_FIN_WAIT2 ||
+                                tev->oldstate == TCP_CLOSING ) 
+                        state = TCP_TIME_WAIT;
+        }
+
+        if ( tev->family == AF_INET ) 
+                conn_key_set( &key, AF_INET, tev->saddr, tev->daddr, 
+                                htons( tev->sport ), htons( tev->dport ));
+        else 
+                conn_key_set( &key, AF_INET6, tev->saddr6, tev->daddr6, 
+                                htons( tev->sport ), htons( tev->dport ));
+        pend = get_pending( ev, &key );
+        pend->state = state;
+        if ( tev->stamp < mono_now )
+                pend->stamp = now - ( mono_now - tev->stamp ) / 1000000;
+        else 
+                pend->stamp = now;
+}
+
+/**
+ * @brief Insert the sockets with transitions on this round to the system.
+ *
+ * When following processes, the inodes for the new connections are looked
+ * up, the connections are only added if they belong to the processes.
+ *
+ * @param ev Pointer to the event source.
+ * @param ctx Pointer to the global context.
+ */
+static void flush_pending( struct bpf_events *ev, struct stat_context *ctx )
+{
+        struct conn_batch *batch = &ev->batch;
+        struct bpf_pending *pend;
+        int alen, i, j;
+
+        for ( j = 0; j < ev->nr_pending; j++ ) {
+                pend = &ev->pending[j];
+                alen = ( pend->key.family == AF_INET ) ? 4 : 16;
+                i = batch->count;
+                batch->family[i] = pend->key.family;
+                memset( batch->laddr[i], 0, 16 );
+                memset( batch->raddr[i], 0, 16 );
+                memcpy( batch->laddr[i], &pend->key.laddr[16 - alen], alen );
+                memcpy( batch->raddr[i], &pend->key.raddr[16 - alen], alen );
+                batch->lport[i] = pend->key.lport;
+                batch->rport[i] = pend->key.rport;
+                batch->state[i] = pend->state;
+                batch->stamp[i] = pend->stamp;
+#ifdef ENABLE_FOLLOW_PID
+                batch->inode[i] = 0;
+                if ( ev->diag_fd >= 0 && chash_get_key( ctx->chash, &pend->key,
+                                        pend->link.hash ) == NULL ) 
+                        batch->inode[i] = lookup_inode( ev, &pend->key );
+#endif /* ENABLE_FOLLOW_PID */
+                batch->count++;
+                if ( batch->count == CONN_BATCH_SIZE ) 
+                        insert_connection_batch( batch, ctx );
+        }
+        if ( batch->count > 0 )
+                insert_connection_batch( batch, ctx );
+
+        ev->nr_pending = 0;
+        hash_index_clear( &ev->pending_index );
+}
+
+/**
+ * @brief Keep connection for which no events were seen.
+ *
+ * Called for all connections on hashtable when the round is not reconciled
+ * with the poll. Connections which are not closed are marked as updated.
+ *
+ * @param conn_p The connection.
+ * @param data Pointer to the global context.
+ */
+static void carry_over( struct tcp_connection *conn_p, void *data )
+{
+        struct stat_context *ctx = data;
+
+        if ( metadata_is_touched( conn_p->metadata ) ||
+                        conn_p->state == TCP_CLOSE || conn_p->state == TCP_DEAD ) 
+                return;
+        metadata_set_flag( conn_p->metadata, METADATA_UPDATED );
+        ctx->total_count++;
+}
+
+/** 
+ * @brief Read all pending state transitions. 
+ *
+ * This should be called once per update round before the connections are
+ * polled. If transitions were lost since the last round, the poll is needed
+ * on this round. If the round is not reconciled with the poll, the
+ * connections for which no events were seen are kept on their current state.
+ * 
+ * @param ctx Pointer to the global context.
+ * @param reconcile Non-zero if /proc/net/tcp is to be read on this round.
+ * 
+ * @return Non-zero if /proc/net/tcp needs to be read on this round.
+ */
+int read_bpf_events( struct stat_context *ctx, int reconcile )
+{
+        struct bpf_events *ev = ctx->bpf;
+        unsigned long cons, prod, drops;
+        uint32_t len, *hdr;
+        struct timespec ts;
+        uint64_t mono_now;
+        uint64_t now = connection_time_ms();
+        long start = connection_now_usecs();
+
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        mono_now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+        ev->round_events = 0;
+        cons = __atomic_load_n( ev->consumer, __ATOMIC_ACQUIRE );
+        prod = __atomic_load_n( ev->producer, __ATOMIC_ACQUIRE );
+        while ( cons < prod ) {
+                hdr = (uint32_t *)( ev->data + ( cons & ( BPF_RINGBUF_SIZE - 1 )));
+                len = __atomic_load_n( hdr, __ATOMIC_ACQUIRE );
+                if ( len & BPF_RINGBUF_BUSY_BIT ) 
+                        break; /* Still being written */
+
+                cons += ( ( len & ~BPF_RINGBUF_DISCARD_BIT ) + BPF_RINGBUF_HDR_SZ + 7 ) & ~7UL;
+                if ( !( len & BPF_RINGBUF_DISCARD_BIT ) && 
+                                len >= sizeof( struct bpf_state_event )) {
+                        handle_transition( ev, (struct bpf_state_event *)
+                                        ((uint8_t *)hdr + BPF_RINGBUF_HDR_SZ ),
+                                        mono_now, now, ctx );
+                }
+                /* Release the space as we go, the producer can continue */
+                __atomic_store_n( ev->consumer, cons, __ATOMIC_RELEASE );
+                if ( cons == prod ) 
+                        prod = __atomic_load_n( ev->producer, __ATOMIC_ACQUIRE );
+        }
+        flush_pending( ev, ctx );
+
+        drops = read_drop_counters( ev );
+        if ( drops != ev->drops ) {
+                WARN( "Lost %lu transitions, polling\n", drops - ev->drops );
+                ev->drops = drops;
+                if ( ! reconcile ) {
+                        ev->forced_polls++;
+                        reconcile = 1;
+                }
+        }
+
+        if ( ! reconcile ) 
+                chash_walk( ctx->chash, carry_over, ctx );
+        ev->event_usecs = connection_now_usecs() - start;
+
+        return reconcile;
+}
@@ -0,0 +1,824 @@
+/**
+ * @file ctscout.c
+ * @brief Real peers of NATed connections from the connection tracking table.
+ *
+ * On NAT gateways and container hosts the sockets show the translated
+ * addresses (service VIPs, masqueraded sources) instead of the real peers.
+ * The conntrack entries hold both the original and the reply tuple, so the
+ * real remote end for a local socket can be found from the entry whose tuple
+ * (as seen by the socket) matches the connection.
+ *
+ * With CAP_NET_ADMIN the table is dumped with ctnetlink once and then kept
+ * up to date with the NEW and DESTROY events, the table is dumped again only
+ * if events are lost. Without the capability (or without ctnetlink)
+ * /proc/net/nf_conntrack is read every CT_PROC_ROUNDS rounds, if it is
+ * readable.
+ *
+ * Connections seen before their entry get the real peer when the entry is
+ * read, if the connections are grouped by the real peer they are grouped
+ * again.
+ *
+ * Only translated TCP connections are kept on the table. An entry whose
+ * original destination differs from the reply source (DNAT) is keyed by the
+ * original tuple, which is what a local client socket has. An entry whose
+ * original source differs from the reply destination (SNAT, masquerade) is
+ * keyed by the reply tuple, which is what a local server socket has.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/capability.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_CT
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "groupkey.h"
+#include "scouts.h"
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif /* SOL_NETLINK */
+
+/**
+ * Connection tracking table on proc.
+ */
+#define CT_PROC_FILE "/proc/net/nf_conntrack"
+/**
+ * File holding the capabilities of the process.
+ */
+#define CT_STATUS_FILE "/proc/self/status"
+/**
+ * Size of the receive buffer requested for the event socket.
+ */
+#define CT_RCVBUF_SIZE (4 * 1024 * 1024)
+
+/**
+ * One direction of a conntrack entry. Addresses and ports are in network
+ * byte order.
+ */
+struct ct_tuple {
+        uint8_t src[16]; /**< Source address */
+        uint8_t dst[16]; /**< Destination address */
+        in_port_t sport; /**< Source port */
+        in_port_t dport; /**< Destination port */
+};
+
+/**
+ * @defgroup ctscout_api Connection tracking
+ *
+ * ct_table_init() selects the source for the table and reads it, 
+ * read_conntrack() updates the table once per round, ct_annotate() sets
+ * the real peer for new connections and ct_forget() is called for the
+ * connections deleted.
+ */
+
+/**
+ * Check if the process has CAP_NET_ADMIN (in its user namespace), needed
+ * for ctnetlink.
+ * @return non-zero if the capability is effective.
+ */
+static int has_net_admin( void )
+{
+        char line[128];
+        unsigned long long caps = 0;
+        FILE *fp;
+
+        fp = fopen( CT_STATUS_FILE, "r" );
+        if ( fp == NULL ) 
+                return 0;
+        while ( fgets( line, sizeof( line ), fp ) != NULL ) {
+                if ( strncmp( line, "CapEff:", 7 ) == 0 ) {
+                        caps = strtoull( line + 7, NULL, 16 );
+                        break;
+                }
+        }
+        fclose( fp );
+        return ( caps & ( 1ULL << CAP_NET_ADMIN )) != 0;
+}
+
+/**
+ * Compare the endpoints on tuples.
+ */
+static int same_endpoint( const uint8_t *a, in_port_t aport, const uint8_t *b, 
+                in_port_t bport, int alen )
+{
+        return aport == bport && memcmp( a, b, alen ) == 0;
+}
+
+/**
+ * Check if the connections are grouped by the real peer.
+ * @param ctx Pointer to the global context.
+ * @return non-zero if the grouping key has the real peer.
+ */
+static int grouped_by_peer( struct stat_context *ctx )
+{
+        return ctx->gkey != NULL && ( gkey_plan_has_field( ctx->gkey, GKEY_PEER ) ||
+                        gkey_plan_has_field( ctx->gkey, GKEY_PEERPORT ));
+}
+
+/**
+ * Free all entries on table.
+ * @param ct The table.
+ */
+static void clear_table( struct ct_table *ct )
+{
+        struct hash_link *link, *next;
+        unsigned int i;
+
+        for ( i = 0; i < ct->entries.size; i++ ) {
+                for ( link = ct->entries.chains[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        mem_free( HASH_ENTRY( link, struct ct_entry, link ));
+                }
+                ct->entries.chains[i] = NULL;
+        }
+        ct->entries.count = 0;
+}
+
+/**
+ * Find the entry with given key.
+ * @param ct The table.
+ * @param key The key.
+ * @param hash Hash value for the key.
+ * @return The entry, NULL if not found.
+ */
+static struct ct_entry *find_entry( struct ct_table *ct, const struct conn_key *key,
+                uint32_t hash )
+{
+        struct ct_entry *entry;
+        struct hash_link *link;
+
+        for ( link = hash_index_first( &ct->entries, hash ); link != NULL; 
+                        link = hash_index_next( link )) {
+                entry = HASH_ENTRY( link, struct ct_entry, link );
+                if ( memcmp( &entry->key, key, sizeof( *key )) == 0 ) 
+                        return entry;
+        }
+        return NULL;
+}
+
+/**
+ * Add (or update) entry on table. If the connection is already known, its
+ * real peer is set and the connection is grouped again if the peer changed.
+ * @param ct The table.
+ * @param ctx Pointer to the global context.
+ * @param key Tuple as seen by the local socket.
+ * @param kind Kind of the translation.
+ * @param addr Real remote address.
+ * @param port Real remote port.
+ */
+static void add_entry( struct ct_table *ct, struct stat_context *ctx, 
+                const struct conn_key *key, enum conn_nat_kind kind, 
+                const uint8_t *addr, in_port_t port )
+{
+        uint32_t hash = conn_key_hash( key );
+        struct tcp_connection *conn_p;
+        struct ct_entry *entry;
+        struct sockaddr_storage *ss;
+        int changed;
+
+        entry = find_entry( ct, key, hash );
+        if ( entry == NULL ) {
+                entry = mem_zalloc( sizeof( *entry ));
+                memcpy( &entry->key, key, sizeof( *key ));
+                hash_index_add( &ct->entries, &entry->link, hash );
+        }
+        entry->gen = ct->gen;
+        entry->nat.kind = kind;
+        ss = &entry->nat.peer;
+        memset( ss, 0, sizeof( *ss ));
+        ss->ss_family = key->family;
+        if ( key->family == AF_INET ) 
+                memcpy( ss_get_addr( ss ), addr, 4 );
+        else 
+                memcpy( ss_get_addr6( ss ), addr, 16 );
+        ss_set_port( ss, port );
+        inet_ntop( key->family, addr, entry->nat.peer_string, 
+                        sizeof( entry->nat.peer_string ));
+
+        conn_p = chash_get_key( ctx->chash, key, hash );
+        if ( conn_p == NULL ) 
+                return;
+        changed = conn_p->nat == NULL || 
+                memcmp( &conn_p->nat->peer, ss, sizeof( *ss )) != 0;
+        if ( conn_p->nat == NULL ) 
+                ct->annotated++;
+        connection_set_nat( conn_p, &entry->nat );
+        if ( changed && grouped_by_peer( ctx )) 
+                regroup_connection( ctx, conn_p, POLICY_KEY );
+}
+
+/**
+ * Remove entry with given key from table.
+ * @param ct The table.
+ * @param key The key.
+ */
+static void remove_entry( struct ct_table *ct, const struct conn_key *key )
+{
+        struct ct_entry *entry;
+
+        entry = find_entry( ct, key, conn_key_hash( key ));
+        if ( entry == NULL ) 
+                return;
+        hash_index_remove( &ct->entries, &entry->link );
+        mem_free( entry );
+}
+
+/**
+ * Handle one conntrack entry. Entries without translation are ignored.
+ * @param ct The table.
+ * @param ctx Pointer to the global context.
+ * @param family Address family of the entry.
+ * @param orig The original tuple.
+ * @param reply The reply tuple.
+ * @param destroy non-zero if the entry was destroyed.
+ */
+static void handle_entry( struct ct_table *ct, struct stat_context *ctx, 
+                int family, struct ct_tuple *orig, struct ct_tuple *reply,
+                int destroy )
+{
+        struct conn_key key;
+        int alen = family == AF_INET ? 4 : 16;
+
+        if ( ! same_endpoint( orig->dst, orig->dport, reply->src, reply->sport, alen )) {
+                /* Local client connected to the translated destination */
+                conn_key_set( &key, family, orig->src, orig->dst, orig->sport, 
+                                orig->dport );
+                if ( destroy ) 
+                        remove_entry( ct, &key );
+                else 
+                        add_entry( ct, ctx, &key, NAT_DST, reply->src, reply->sport );
+        }
+        if ( ! same_endpoint( orig->src, orig->sport, reply->dst, reply->dport, alen )) {
+                /* Local server connected from the translated source */
+                conn_key_set( &key, family, reply->src, reply->dst, reply->sport, 
+                                reply->dport );
+                if ( destroy ) 
+                        remove_entry( ct, &key );
+                else 
+                        add_entry( ct, ctx, &key, NAT_SRC, orig->src, orig->sport );
+        }
+}
+
+/**
+ * Collect the attributes on buffer to table indexed by the attribute type.
+ * @param attr The first attribute.
+ * @param len Length of the attributes.
+ * @param tb Table for the attributes, cleared first.
+ * @param max Largest attribute type to collect.
+ */
+static void parse_attrs( struct nlattr *attr, int len, struct nlattr **tb, int max )
+{
+        int type;
+
+        memset( tb, 0, ( max + 1 ) * sizeof( *tb ));
+        while ( len >= NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN && 
+                        attr->nla_len <= len ) {
+                type = attr->nla_type & NLA_TYPE_MASK;
+                if ( type <= max ) 
+                        tb[type] = attr;
+                len -= NLA_ALIGN( attr->nla_len );
+                attr = (struct nlattr *)( (char *)attr + NLA_ALIGN( attr->nla_len ));
+        }
+}
+
+/**
+ * Get the payload of attribute.
+ */
+#define attr_data(a) ( (void *)( (char *)(a) + NLA_HDRLEN ))
+/**
+ * Get the length of the payload of attribute.
+ */
+#define attr_len(a) ( (a)->nla_len - NLA_HDRLEN )
+
+/**
+ * Parse a nested tuple attribute.
+ * @param nest The CTA_TUPLE_ORIG or CTA_TUPLE_REPLY attribute.
+ * @param family Address family of the entry.
+ * @param tuple The tuple is set here.
+ * @return 0 if the tuple is for TCP and was parsed, -1 otherwise.
+ */
+static int parse_tuple( struct nlattr *nest, int family, struct ct_tuple *tuple )
+{
+        struct nlattr *tb[CTA_TUPLE_MAX + 1];
+        struct nlattr *ip[CTA_IP_MAX + 1];
+        struct nlattr *proto[CTA_PROTO_MAX + 1];
+        int src = CTA_IP_V4_SRC, dst = CTA_IP_V4_DST, alen = 4;
+
+        parse_attrs( attr_data( nest ), attr_len( nest ), tb, CTA_TUPLE_MAX );
+        if ( tb[CTA_TUPLE_IP] == NULL || tb[CTA_TUPLE_PROTO] == NULL ) 
+                return -1;
+        parse_attrs( attr_data( tb[CTA_TUPLE_PROTO] ), attr_len( tb[CTA_TUPLE_PROTO] ),
+                        proto, CTA_PROTO_MAX );
+        if ( proto[CTA_PROTO_NUM] == NULL || attr_len( proto[CTA_PROTO_NUM] ) < 1 ||
+                        *(uint8_t *)attr_data( proto[CTA_PROTO_NUM] ) != IPPROTO_TCP ||
+                        proto[CTA_PROTO_SRC_PORT] == NULL ||
+                        proto[CTA_PROTO_DST_PORT] == NULL ||
+                        attr_len( proto[CTA_PROTO_SRC_PORT] ) < (int)sizeof( in_port_t ) ||
+                        attr_len( proto[CTA_PROTO_DST_PORT] ) < (int)sizeof( in_port_t ))
+                return -1;
+
+        if ( family == AF_INET6 ) {
+                src = CTA_IP_V6_SRC;
+                dst = CTA_IP_V6_DST;
+                alen = 16;
+        }
+        parse_attrs( attr_data( tb[CTA_TUPLE_IP] ), attr_len( tb[CTA_TUPLE_IP] ), 
+                        ip, CTA_IP_MAX );
+        if ( ip[src] == NULL || ip[dst] == NULL || attr_len( ip[src] ) < alen ||
+                        attr_len( ip[dst] ) < alen ) 
+                return -1;
+        memcpy( tuple->src, attr_data( ip[src] ), alen );
+        memcpy( tuple->dst, attr_data( ip[dst] ), alen );
+        memcpy( &tuple->sport, attr_data( proto[CTA_PROTO_SRC_PORT] ), sizeof( in_port_t ));
+        memcpy( &tuple->dport, attr_data( proto[CTA_PROTO_DST_PORT] ), sizeof( in_port_t ));
+        return 0;
+}
+
+/**
+ * Handle one ctnetlink message (dumped entry or event).
+ * @param ct The table.
+ * @param nlh The message.
+ * @param ctx Pointer to the global context.
+ */
+static void handle_message( struct ct_table *ct, struct nlmsghdr *nlh,
+                struct stat_context *ctx )
+{
+        struct nfgenmsg *nfg = NLMSG_DATA( nlh );
+        struct nlattr *tb[CTA_MAX + 1];
+        struct ct_tuple orig, reply;
+        int type = NFNL_MSG_TYPE( nlh->nlmsg_type );
+
+        if ( NFNL_SUBSYS_ID( nlh->nlmsg_type ) != NFNL_SUBSYS_CTNETLINK ||
+                        ( type != IPCTNL_MSG_CT_NEW && type != IPCTNL_MSG_CT_DELETE ) ||
+                        nlh->nlmsg_len < NLMSG_LENGTH( sizeof( *nfg ))) 
+                return;
+        if ( ( nfg->nfgen_family == AF_INET && ctx->collected_stats == STAT_V6_ONLY ) ||
+             ( nfg->nfgen_family == AF_INET6 && ctx->collected_stats == STAT_V4_ONLY ) ||
+             ( nfg->nfgen_family != AF_INET && nfg->nfgen_family != AF_INET6 )) 
+                return;
+
+        parse_attrs( (struct nlattr *)( (char *)nfg + NLMSG_ALIGN( sizeof( *nfg ))),
+                        nlh->nlmsg_len - NLMSG_LENGTH( sizeof( *nfg )), tb, CTA_MAX );
+        if ( tb[CTA_TUPLE_ORIG] == NULL || tb[CTA_TUPLE_REPLY] == NULL ||
+                        parse_tuple( tb[CTA_TUPLE_ORIG], nfg->nfgen_family, &orig ) != 0 ||
+                        parse_tuple( tb[CTA_TUPLE_REPLY], nfg->nfgen_family, &reply ) != 0 ) 
+                return;
+        handle_entry( ct, ctx, nfg->nfgen_family, &orig, &reply, 
+                        type == IPCTNL_MSG_CT_DELETE );
+}
+
+/**
+ * Dump the conntrack entries for one address family.
+ * @param ct The table.
+ * @param fd Netlink socket for the dump.
+ * @param family The address family.
+ * @param ctx Pointer to the global context.
+ * @return 0 on success, -1 on error.
+ */
+static int dump_family( struct ct_table *ct, int fd, int family, 
+                struct stat_context *ctx )
+{
+        struct {
+                struct nlmsghdr nlh;
+                struct nfgenmsg nfg;
+        } msg;
+        struct nlmsghdr *nlh;
+        ssize_t len;
+
+        memset( &msg, 0, sizeof( msg ));
+        msg.nlh.nlmsg_len = sizeof( msg );
+        msg.nlh.nlmsg_type = ( NFNL_SUBSYS_CTNETLINK << 8 ) | IPCTNL_MSG_CT_GET;
+        msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        msg.nlh.nlmsg_seq = ++ct->seq;
+        msg.nfg.nfgen_family = family;
+        msg.nfg.version = NFNETLINK_V0;
+        if ( send( fd, &msg, sizeof( msg ), 0 ) < 0 ) {
+                WARN( "Unable to send conntrack dump request: %s\n", strerror( errno ));
+                return -1;
+        }
+
+        while ( 1 ) {
+                len = recv( fd, ct->buf, CT_BUF_SIZE, 0 );
+                if ( len < 0 ) {
+                        if ( errno == EINTR ) 
+                                continue;
+                        WARN( "Error while reading conntrack dump: %s\n", strerror( errno ));
+                        return -1;
+                }
+                for ( nlh = (struct nlmsghdr *)ct->buf; NLMSG_OK( nlh, len ); 
+                                nlh = NLMSG_NEXT( nlh, len )) {
+                        if ( nlh->nlmsg_seq != ct->seq ) 
+                                continue;
+                        if ( nlh->nlmsg_type == NLMSG_DONE ) 
+                                return 0;
+                        if ( nlh->nlmsg_type == NLMSG_ERROR ) {
+                                WARN( "Error on conntrack dump: %s\n", strerror( 
+                                                        -((struct nlmsgerr *)NLMSG_DATA( nlh ))->error ));
+                                return -1;
+                        }
+                        handle_message( ct, nlh, ctx );
+                }
+        }
+}
+
+/**
+ * Dump the whole conntrack table with ctnetlink. The entries on table are
+ * replaced with the dumped ones.
+ * @param ct The table.
+ * @param ctx Pointer to the global context.
+ * @return 0 on success, -1 on error.
+ */
+static int dump_table( struct ct_table *ct, struct stat_context *ctx )
+{
+        struct sockaddr_nl addr;
+        int fd, rv = 0;
+
+        fd = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER );
+        if ( fd < 0 ) {
+                WARN( "Unable to open ctnetlink socket: %s\n", strerror( errno ));
+                return -1;
+        }
+        memset( &addr, 0, sizeof( addr ));
+        addr.nl_family = AF_NETLINK;
+        if ( bind( fd, (struct sockaddr *)&addr, sizeof( addr )) != 0 ) {
+                WARN( "Unable to bind ctnetlink socket: %s\n", strerror( errno ));
+                close( fd );
+                return -1;
+        }
+
+        clear_table( ct );
+        if ( ctx->collected_stats != STAT_V6_ONLY && 
+                        dump_family( ct, fd, AF_INET, ctx ) != 0 ) 
+                rv = -1;
+        if ( rv == 0 && ctx->collected_stats != STAT_V4_ONLY && 
+                        dump_family( ct, fd, AF_INET6, ctx ) != 0 ) 
+                rv = -1;
+        close( fd );
+        DBG( "Dumped %d translated connections\n", ct->entries.count );
+        return rv;
+}
+
+/**
+ * Open the socket for conntrack NEW and DESTROY events.
+ * @return The socket, -1 on error.
+ */
+static int open_events( void )
+{
+        struct sockaddr_nl addr;
+        int fd, group, size = CT_RCVBUF_SIZE;
+
+        fd = socket( AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 
+                        NETLINK_NETFILTER );
+        if ( fd < 0 ) {
+                WARN( "Unable to open ctnetlink socket: %s\n", strerror( errno ));
+                return -1;
+        }
+        memset( &addr, 0, sizeof( addr ));
+        addr.nl_family = AF_NETLINK;
+        if ( bind( fd, (struct sockaddr *)&addr, sizeof( addr )) != 0 ) {
+                WARN( "Unable to bind ctnetlink socket: %s\n", strerror( errno ));
+                close( fd );
+                return -1;
+        }
+        group = NFNLGRP_CONNTRACK_NEW;
+        if ( setsockopt( fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, 
+                                sizeof( group )) != 0 ) {
+                WARN( "Unable to join conntrack group: %s\n", strerror( errno ));
+                close( fd );
+                return -1;
+        }
+        group = NFNLGRP_CONNTRACK_DESTROY;
+        if ( setsockopt( fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, 
+                                sizeof( group )) != 0 ) {
+                WARN( "Unable to join conntrack group: %s\n", strerror( errno ));
+                close( fd );
+                return -1;
+        }
+        /* Not fatal, lost events cause a new dump */
+        if ( setsockopt( fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof( size )) != 0 &&
+             setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof( size )) != 0 ) {
+                WARN( "Unable to set receive buffer size: %s\n", strerror( errno ));
+        }
+        return fd;
+}
+
+/**
+ * Parse one tuple from line on /proc/net/nf_conntrack.
+ * @param p Pointer to the line, moved past the tuple.
+ * @param family Address family of the entry.
+ * @param tuple The tuple is set here.
+ * @return 0 on success, -1 if the tuple could not be parsed.
+ */
+static int parse_proc_tuple( char **p, int family, struct ct_tuple *tuple )
+{
+        char *s = *p, *end, addr[INET6_ADDRSTRLEN];
+        int found = 0;
+        size_t len;
+
+        while ( found != 0x0f ) {
+                while ( *s == ' ' ) 
+                        s++;
+                if ( *s == '\0' || *s == '\n' ) 
+                        return -1;
+                end = s + strcspn( s, " \n" );
+                len = end - s;
+                if ( strncmp( s, "src=", 4 ) == 0 || strncmp( s, "dst=", 4 ) == 0 ) {
+                        if ( len - 4 >= sizeof( addr )) 
+                                return -1;
+                        memcpy( addr, s + 4, len - 4 );
+                        addr[len - 4] = '\0';
+                        if ( inet_pton( family, addr, s[0] == 's' ? tuple->src : 
+                                                tuple->dst ) != 1 ) 
+                                return -1;
+                        found |= s[0] == 's' ? 0x01 : 0x02;
+                } else if ( strncmp( s, "sport=", 6 ) == 0 ) {
+                        tuple->sport = htons( strtol( s + 6, NULL, 10 ));
+                        found |= 0x04;
+                } else if ( strncmp( s, "dport=", 6 ) == 0 ) {
+                        tuple->dport = htons( strtol( s + 6, NULL, 10 ));
+                        found |= 0x08;
+                }
+                s = end;
+        }
+        *p = s;
+        return 0;
+}
+
+/**
+ * Remove the entries not seen on the last read of the table.
+ * @param ct The table.
+ */
+static void remove_stale( struct ct_table *ct )
+{
+        struct hash_link *link, *next;
+        struct ct_entry *entry;
+        unsigned int i;
+
+        for ( i = 0; i < ct->entries.size; i++ ) {
+                for ( link = ct->entries.chains[i]; link != NULL; link = next ) {
+                        next = link->next;
+                        entry = HASH_ENTRY( link, struct ct_entry, link );
+                        if ( entry->gen == ct->gen ) 
+                                continue;
+                        hash_index_remove( &ct->entries, link );
+                        mem_free( entry );
+                }
+        }
+}
+
+/**
+ * Read the translated TCP connections from /proc/net/nf_conntrack. The
+ * entries still on the file are updated in place, the ones gone are
+ * removed.
+ * @param ct The table.
+ * @param ctx Pointer to the global context.
+ * @return 0 on success, -1 on error.
+ */
+static int read_proc( struct ct_table *ct, struct stat_context *ctx )
+{
+        struct ct_tuple orig, reply;
+        char *p;
+        int family;
+        FILE *fp;
+
+        fp = fopen( CT_PROC_FILE, "r" );
+        if ( fp == NULL ) {
+                WARN( "Unable to open %s: %s\n", CT_PROC_FILE, strerror( errno ));
+                return -1;
+        }
+        ct->gen++;
+        while ( fgets( ct->buf, CT_BUF_SIZE, fp ) != NULL ) {
+                /* ipv4     2 tcp      6 431999 ESTABLISHED src=... */
+                if ( strncmp( ct->buf, "ipv4 ", 5 ) == 0 ) {
+                        if ( ctx->collected_stats == STAT_V6_ONLY ) 
+                                continue;
+                        family = AF_INET;
+                } else if ( strncmp( ct->buf, "ipv6 ", 5 ) == 0 ) {
+                        if ( ctx->collected_stats == STAT_V4_ONLY ) 
+                                continue;
+                        family = AF_INET6;
+                } else {
+                        continue;
+                }
+                p = strstr( ct->buf, " tcp " );
+                if ( p == NULL ) 
+                        continue;
+                if ( parse_proc_tuple( &p, family, &orig ) != 0 ||
+                                parse_proc_tuple( &p, family, &reply ) != 0 ) 
+                        continue;
+                handle_entry( ct, ctx, family, &orig, &reply, 0 );
+        }
+        fclose( fp );
+        remove_stale( ct );
+        return 0;
+}
+
+/** 
+ * @brief Start reading the connection tracking table.
+ *
+ * ctnetlink is used if the process has CAP_NET_ADMIN (which it also has as
+ * root of an unprivileged user and network namespace), /proc/net/nf_conntrack
+ * otherwise.
+ * @ingroup ctscout_api
+ * 
+ * @param ctx Pointer to the global context.
+ * 
+ * @return Pointer to the table, NULL if the table is not available.
+ */
+struct ct_table *ct_table_init( struct stat_context *ctx )
+{
+        struct ct_table *ct;
+
+        ct = mem_zalloc( sizeof( *ct ));
+        ct->fd = -1;
+        ct->buf = mem_alloc( CT_BUF_SIZE );
+        hash_index_init( &ct->entries, CT_INDEX_INIT_SIZE );
+
+        if ( has_net_admin() ) {
+                /* Events first, so that nothing is missed during the dump */
+                ct->fd = open_events();
+                if ( ct->fd >= 0 && dump_table( ct, ctx ) == 0 ) {
+                        ct->source = CT_SOURCE_NETLINK;
+                        DBG( "Reading conntrack with ctnetlink\n" );
+                        return ct;
+                }
+                if ( ct->fd >= 0 ) 
+                        close( ct->fd );
+                ct->fd = -1;
+        } else {
+                DBG( "No CAP_NET_ADMIN, ctnetlink not used\n" );
+        }
+
+        ct->source = CT_SOURCE_PROC;
+        if ( read_proc( ct, ctx ) == 0 ) {
+                DBG( "Reading conntrack from %s\n", CT_PROC_FILE );
+                return ct;
+        }
+        ct_table_deinit( ct );
+        return NULL;
+}
+
+/** 
+ * @brief Stop reading the connection tracking table.
+ * @ingroup ctscout_api
+ * 
+ * @param ct The table.
+ */
+void ct_table_deinit( struct ct_table *ct )
+{
+        if ( ct->fd >= 0 ) 
+                close( ct->fd );
+        clear_table( ct );
+        hash_index_deinit( &ct->entries );
+        mem_free( ct->buf );
+        mem_free( ct );
+}
+
+/** 
+ * @brief Get name for the source of the table.
+ * @ingroup ctscout_api
+ * 
+ * @param ct The table.
+ * 
+ * @return Name of the source.
+ */
+const char *ct_source_name( struct ct_table *ct )
+{
+        return ct->source == CT_SOURCE_NETLINK ? "ctnetlink" : CT_PROC_FILE;
+}
+
+/** 
+ * @brief Update the connection tracking table.
+ *
+ * With ctnetlink the pending events are read, if events have been lost (or
+ * CT_RESYNC_ROUNDS rounds have passed) the table is dumped again. Otherwise
+ * the table is read again from proc every CT_PROC_ROUNDS rounds. This should
+ * be called before the connections are polled, so that the new connections
+ * find their entries.
+ * @ingroup ctscout_api
+ * 
+ * @param ctx Pointer to the global context.
+ * 
+ * @return 0 on success, -1 on error.
+ */
+int read_conntrack( struct stat_context *ctx )
+{
+        struct ct_table *ct = ctx->ct;
+        struct nlmsghdr *nlh;
+        ssize_t len;
+        int lost = 0;
+
+        if ( ct->source == CT_SOURCE_PROC ) {
+                if ( ++ct->rounds < CT_PROC_ROUNDS ) 
+                        return 0;
+                ct->rounds = 0;
+                return read_proc( ct, ctx );
+        }
+
+        while ( 1 ) {
+                len = recv( ct->fd, ct->buf, CT_BUF_SIZE, 0 );
+                if ( len < 0 ) {
+                        if ( errno == EINTR ) 
+                                continue;
+                        if ( errno == ENOBUFS ) {
+                                WARN( "Lost conntrack events\n" );
+                                lost = 1;
+                                continue;
+                        }
+                        if ( errno == EAGAIN || errno == EWOULDBLOCK ) 
+                                break;
+                        WARN( "Error while reading conntrack events: %s\n", 
+                                        strerror( errno ));
+                        return -1;
+                }
+                for ( nlh = (struct nlmsghdr *)ct->buf; NLMSG_OK( nlh, len ); 
+                                nlh = NLMSG_NEXT( nlh, len )) {
+                        ct->events++;
+                        handle_message( ct, nlh, ctx );
+                }
+        }
+        if ( lost ) 
+                ct->resyncs++;
+        if ( lost || ++ct->rounds >= CT_RESYNC_ROUNDS ) {
+                ct->rounds = 0;
+                return dump_table( ct, ctx );
+        }
+        return 0;
+}
+
+/** 
+ * @brief Forget connection which is about to be deleted.
+ * @ingroup ctscout_api
+ * 
+ * @param ct The table.
+ * @param conn_p The connection.
+ */
+void ct_forget( struct ct_table *ct, struct tcp_connection *conn_p )
+{
+        if ( conn_p->nat != NULL ) 
+                ct->annotated--;
+}
+
+/** 
+ * @brief Set the real peer for connection if it is translated.
+ * @ingroup ctscout_api
+ * 
+ * @param ct The table.
+ * @param conn_p The connection.
+ */
+void ct_annotate( struct ct_table *ct, struct tcp_connection *conn_p )
+{
+        struct ct_entry *entry;
+
+        entry = find_entry( ct, &conn_p->key, conn_key_hash( &conn_p->key ));
+        if ( entry != NULL ) {
+                if ( conn_p->nat == NULL ) 
+                        ct->annotated++;
+                connection_set_nat( conn_p, &entry->nat );
+        }
+}
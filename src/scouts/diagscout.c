@@ -0,0 +1,295 @@
+/**
+ * @file diagscout.c
+ * @brief Events for closed TCP connections via sock_diag.
+ *
+ * Connections living shorter than the update interval never show up on
+ * /proc/net/tcp. The kernel broadcasts every destroyed TCP socket to the
+ * sock_diag destroy multicast groups, this module listens to those groups
+ * and feeds the closed connections to the system between the polls. 
+ *
+ * The events are only used to complement the polling, the periodic read of
+ * /proc/net/tcp is still done and reconciles the state of the connections.
+ * Connections already known are left for the poll to close, the events for
+ * them are only used for the lifetime statistics. Connections not seen
+ * before are inserted as new (short-lived) connections with the state they
+ * had when they were destroyed, they will be closed by the normal purging of
+ * connections not found on the next poll.
+ *
+ * Joining the multicast groups requires CAP_NET_ADMIN.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_DIAG
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "scouts.h"
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif /* SOL_NETLINK */
+
+/**
+ * Size of the receive buffer requested for the netlink socket. The events are
+ * only read once per update round, so there should be room for a burst.
+ */
+#define DIAG_RCVBUF_SIZE (4 * 1024 * 1024)
+
+/**
+ * Size of the buffer used for reading the messages.
+ */
+#define DIAG_MSGBUF_SIZE 32768
+
+/**
+ * Join given sock_diag multicast group.
+ *
+ * @param fd The netlink socket.
+ * @param group The group to join.
+ * @return -1 on error, 0 on success.
+ */
+static int join_group( int fd, int group )
+{
+        if ( setsockopt( fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, 
+                                sizeof( group )) != 0 ) {
+                WARN( "Unable to join sock_diag group %d: %s\n", group, 
+                                strerror( errno ));
+                return -1;
+        }
+        return 0;
+}
+
+/** 
+ * @brief Initialize the event source for closed connections.
+ *
+ * A netlink socket is opened and the TCP destroy groups for address families
+ * collected are joined. 
+ * 
+ * @param ctx Pointer to the global context.
+ * 
+ * @return Pointer to the event source, NULL if the events are not available
+ * (errno is set). 
+ */
+struct diag_events *diag_events_init( struct stat_context *ctx )
+{
+        struct diag_events *ev;
+        struct sockaddr_nl addr;
+        int fd, size = DIAG_RCVBUF_SIZE;
+        int err;
+
+        fd = socket( AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 
+                        NETLINK_SOCK_DIAG );
+        if ( fd < 0 ) {
+                WARN( "Unable to open sock_diag socket: %s\n", strerror( errno ));
+                return NULL;
+        }
+
+        memset( &addr, 0, sizeof( addr ));
+        addr.nl_family = AF_NETLINK;
+        if ( bind( fd, (struct sockaddr *)&addr, sizeof( addr )) != 0 ) {
+                err = errno;
+                WARN( "Unable to bind sock_diag socket: %s\n", strerror( errno ));
+                close( fd );
+                errno = err;
+                return NULL;
+        }
+
+        if ( (ctx->collected_stats != STAT_V6_ONLY && 
+                                join_group( fd, SKNLGRP_INET_TCP_DESTROY ) != 0) ||
+             (ctx->collected_stats != STAT_V4_ONLY &&
+                                join_group( fd, SKNLGRP_INET6_TCP_DESTROY ) != 0) ) {
+                err = errno;
+                close( fd );
+                errno = err;
+                return NULL;
+        }
+
+        /* Not fatal, we just lose events on bursts */
+        if ( setsockopt( fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof( size )) != 0 &&
+             setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof( size )) != 0 ) {
+                WARN( "Unable to set receive buffer size: %s\n", strerror( errno ));
+        }
+
+        ev = mem_zalloc( sizeof( *ev ));
+        ev->fd = fd;
+        DBG( "Listening for TCP destroy events\n" );
+
+        return ev;
+}
+
+/** 
+ * @brief Close the event source.
+ * 
+ * @param ev Pointer to the event source.
+ */
+void diag_events_deinit( struct diag_events *ev )
+{
+        close( ev->fd );
+        mem_free( ev );
+}
+
+/** 
+ * @brief Handle one destroyed socket.
+ *
+ * If the connection is known, only the lifetime statistics are updated.
+ * Otherwise the connection is added to the batch to be inserted. 
+ * 
+ * @param ev Pointer to the event source.
+ * @param msg Message for the destroyed socket.
+ * @param ctx Pointer to the global context.
+ */
+static void handle_destroy( struct diag_events *ev, struct inet_diag_msg *msg, 
+                struct stat_context *ctx )
+{
+        struct conn_batch *batch = &ev->batch;
+        struct tcp_connection *conn_p;
+        struct conn_key key;
+        int alen, i;
+
+        if ( msg->idiag_family == AF_INET ) {
+                if ( ctx->collected_stats == STAT_V6_ONLY )
+                        return;
+                alen = 4;
+        } else if ( msg->idiag_family == AF_INET6 ) {
+                if ( ctx->collected_stats == STAT_V4_ONLY )
+                        return;
+                alen = 16;
+        } else {
+                return;
+        }
+
+        /* Listening sockets are not connections, sockets reset by the
+         * local end have lost the remote port */
+        if ( msg->idiag_state == TCP_LISTEN || msg->id.idiag_dport == 0 ) 
+                return;
+
+        ev->events++;
+        conn_key_set( &key, msg->idiag_family, (uint8_t *)msg->id.idiag_src, 
+                        (uint8_t *)msg->id.idiag_dst, 
+                        msg->id.idiag_sport, msg->id.idiag_dport );
+        conn_p = chash_get_key( ctx->chash, &key, conn_key_hash( &key ));
+        if ( conn_p != NULL ) {
+                /* Seen on poll, the poll will close it */
+                ev->closed++;
+                ev->lifetime_sum += time( NULL ) - conn_p->metadata.added;
+                return;
+        }
+        TRACE( "Short-lived connection, state %d\n", msg->idiag_state );
+        ev->shortlived++;
+        ev->round_shortlived++;
+
+        i = batch->count;
+        batch->family[i] = msg->idiag_family;
+        memset( batch->laddr[i], 0, 16 );
+        memset( batch->raddr[i], 0, 16 );
+        memcpy( batch->laddr[i], msg->id.idiag_src, alen );
+        memcpy( batch->raddr[i], msg->id.idiag_dst, alen );
+        batch->lport[i] = msg->id.idiag_sport;
+        batch->rport[i] = msg->id.idiag_dport;
+        batch->state[i] = msg->idiag_state;
+        /* The message does not tell when the socket was destroyed */
+        batch->stamp[i] = 0;
+#ifdef ENABLE_FOLLOW_PID
+        batch->inode[i] = msg->idiag_inode;
+#endif /* ENABLE_FOLLOW_PID */
+        batch->count++;
+        if ( batch->count == CONN_BATCH_SIZE ) 
+                insert_connection_batch( batch, ctx );
+}
+
+/** 
+ * @brief Read all pending destroy events. 
+ *
+ * This should be called once per update round before the connections are
+ * polled.
+ * 
+ * @param ctx Pointer to the global context.
+ * 
+ * @return Number of events read, -1 on error.
+ */
+int read_diag_events( struct stat_context *ctx )
+{
+        struct diag_events *ev = ctx->diag;
+        static char buf[DIAG_MSGBUF_SIZE];
+        struct nlmsghdr *nlh;
+        ssize_t len;
+        int count = 0;
+
+        ev->round_shortlived = 0;
+        while ( 1 ) {
+                len = recv( ev->fd, buf, sizeof( buf ), 0 );
+                if ( len < 0 ) {
+                        if ( errno == EINTR ) 
+                                continue;
+                        if ( errno == ENOBUFS ) {
+                                /* Overrun, the poll will catch up */
+                                WARN( "Lost destroy events\n" );
+                                ev->overruns++;
+                                continue;
+                        }
+                        if ( errno == EAGAIN || errno == EWOULDBLOCK ) 
+                                break;
+                        WARN( "Error while reading events: %s\n", strerror( errno ));
+                        count = -1;
+                        break;
+                }
+
+                for ( nlh = (struct nlmsghdr *)buf; NLMSG_OK( nlh, len ); 
+                                nlh = NLMSG_NEXT( nlh, len )) {
+                        if ( nlh->nlmsg_type == NLMSG_DONE || 
+                                        nlh->nlmsg_type == NLMSG_ERROR ) 
+                                continue;
+                        if ( nlh->nlmsg_len < NLMSG_LENGTH( sizeof( struct inet_diag_msg )))
+                                continue;
+                        handle_destroy( ev, NLMSG_DATA( nlh ), ctx );
+                        count++;
+                }
+        }
+        if ( ev->batch.count > 0 )
+                insert_connection_batch( &ev->batch, ctx );
+
+        return count;
+}
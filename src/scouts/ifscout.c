@@ -458,6 +458,19 @@ void deinit_ifinfo_tab( struct ifinfo_tab *tab_p )
 
 }
 #ifndef USE_GETIFADDRS
+/**
+ * One line of <code>/proc/net/if_inet6</code> decoded by the schema.
+ */
+struct if6_record {
+        uint8_t addr[16]; /**< The address, network byte order */
+        char ifname[IFNAMEMAX]; /**< Name of the interface */
+};
+
+/**
+ * Compiled schema for <code>/proc/net/if_inet6</code>.
+ */
+static struct record_schema if6_schema;
+
 /**
  * Line parser callback called for every line in 
  * <code>/proc/net/if_inet6</code>. Parses IPv6 addresses for interfaces.
@@ -466,41 +479,18 @@ void deinit_ifinfo_tab( struct ifinfo_tab *tab_p )
  */
 static void parse_v6addresses( char *line, void *ctx )
 {
-#define NROF_WANTED_TOKENS 2
-        struct line_token *tokens_p;
-        int wanted[NROF_WANTED_TOKENS] = {1,6};
-        struct line_token tokens[NROF_WANTED_TOKENS];
-        struct parser_req req = {
-                .interested_tokens = wanted,
-                .interested_size = NROF_WANTED_TOKENS,
-                .tokens = tokens,
-                .token_count = NROF_WANTED_TOKENS
-        };
         struct ifinfo *inf_p;
         struct ifinfo_addr *new_addr;
-        uint8_t data_buf[16]; /* temp for the IPv6 addr */
-        int len;
-
-        TRACE("Tokenizing\n");
+        struct if6_record rec;
 
-        tokens_p = tokenize( &req, line );
-        if ( tokens_p == NULL ) 
-                return;
-
-        /* First token should be the IPv6 address */
-        str2bytes( tokens_p->token, data_buf, &len );
-        if ( len != 16 ) {
-                WARN( "Error while reading the IPv6 address bytes, got %d bytes\n", len );
+        if ( schema_decode( &if6_schema, line, &rec ) != 0 ) {
+                WARN( "Error while reading the IPv6 address for interface\n" );
                 return;
         }
 
-        tokens_p = tokens_p->next;
-        /* Second token (6th field on the file) should be the name of the
-         * iterface 
-         */
-        inf_p = get_ifinfo_by_name((struct ifinfo_tab *)ctx, tokens_p->token );
+        inf_p = get_ifinfo_by_name((struct ifinfo_tab *)ctx, rec.ifname );
         if ( inf_p == NULL ) {
-                WARN("Did not find interface %s\n",tokens_p->token );
+                WARN("Did not find interface %s\n", rec.ifname );
                 /* XXX Add the interface, but the table is fixed-size */
                 return;
         } else {
@@ -508,7 +498,7 @@ static void parse_v6addresses( char *line, void *ctx )
                 new_addr = mem_alloc( sizeof( struct ifinfo_addr));
                 memset( new_addr, 0, sizeof( struct ifinfo_addr));
                 new_addr->family = AF_INET6;
-                memcpy( new_addr->ifinfo_v6addr.s6_addr, data_buf, 16 );
+                memcpy( new_addr->ifinfo_v6addr.s6_addr, rec.addr, 16 );
                 new_addr->next = NULL;
 
                 iter = inf_p->ifaddr;
@@ -517,7 +507,6 @@ static void parse_v6addresses( char *line, void *ctx )
 
                 iter->next = new_addr;
         }
-#undef NROF_WANTED_TOKENS
 }
 
 /**
@@ -527,16 +516,54 @@ static void parse_v6addresses( char *line, void *ctx )
  */
 static void read_interface_v6addrs( struct ifinfo_tab *info )
 {
+        const struct schema_field fields[] = {
+                SCHEMA_FIELD( 1, FIELD_HEX_BYTES, struct if6_record, addr ),
+                SCHEMA_FIELD( 6, FIELD_NAME, struct if6_record, ifname )
+        };
+
         if ( info == NULL )
                 return;
 
+        if ( if6_schema.nr_ops == 0 &&
+                        schema_compile( &if6_schema, fields, 2 ) != 0 )
+                return;
+
         parse_file_per_line( IF6_FILE, 0, parse_v6addresses, info);
 }
 #endif /* not USE_GETIFADDRS */
 
 #ifdef ENABLE_IFSTATS
+/**
+ * One line of <code>/proc/net/dev</code> decoded by the schema.
+ */
+struct ifstat_record {
+        char ifname[IFNAMEMAX]; /**< Name of the interface */
+        unsigned long long rx_bytes; /**< Received bytes */
+        unsigned long long rx_packets; /**< Received packets */
+        unsigned long long tx_bytes; /**< Sent bytes */
+        unsigned long long tx_packets; /**< Sent packets */
+};
+
+/**
+ * Compiled schema for <code>/proc/net/dev</code>.
+ */
+static struct record_schema ifstat_schema;
+
+/**
+ * Update counter and its difference to previous value.
+ * @param cnt Pointer to the counter.
+ * @param diff Pointer to the difference.
+ * @param val The new value for the counter.
+ */
+static inline void update_ifstat( unsigned long long *cnt, 
+                unsigned long long *diff, unsigned long long val )
+{
+        *diff = val - *cnt;
+        *cnt = val;
+}
+
 /** 
- * @brief Parse interface statistic for tokenized lines. 
+ * @brief Parse interface statistic for one line.
  * This is a callback which should be called for every line read from
  * <code>/proc/net/dev</code> (excluding the first two lines. Extracts the RX
  * and TX bytes and packets, and calculates the difference to previous values.
@@ -548,93 +575,30 @@ static void read_interface_v6addrs( struct ifinfo_tab *info )
  */
 static void parse_ifstat_data( char *line, void *ctx )
 {
-#define NROF_WANTED_TOKENS 6
-        struct line_token *tokens_p;
-        int wanted[NROF_WANTED_TOKENS] = { 1,2,3,9,10,11 };
-        struct line_token tokens[NROF_WANTED_TOKENS];
-        struct parser_req req = {
-                .interested_tokens = wanted,
-                .interested_size = NROF_WANTED_TOKENS,
-                .tokens = tokens, 
-                .token_count = NROF_WANTED_TOKENS 
-        };
         struct ifinfo *inf_p;
         struct ifinfo_tab *tab_p = (struct ifinfo_tab *)ctx;
-        char *end;
-        int mangled = 0;
-        unsigned long long tmp;
-
-        TRACE("Tokenizing\n" );
-        tokens_p = tokenize( &req, line );
+        struct ifstat_record rec;
 
-        if ( tokens_p == NULL ) {
-                WARN( "Empty line?\n" );
+        if ( schema_decode( &ifstat_schema, line, &rec ) != 0 ) {
+                WARN( "Malformed interface statistics line\n" );
                 return;
         }
 
-        /* First token, interface name */
-        TRACE("Interface name:%s\n", tokens->token );
-        end = strchr( tokens_p->token, ':' );
-        if ( end == NULL ) {
-                WARN( "Malformed interface name. Stopping\n");
-                return;
-        } 
-        if ( *(end+1) != '\0' ) {
-                TRACE("Found the if stats on same token\n" );
-                *end = '\0';
-                end = end+1;
-                mangled = 1;
-        } else {
-                *end = '\0';
-        }
-        inf_p = get_ifinfo_by_name( tab_p, tokens_p->token );
+        TRACE("Interface name:%s\n", rec.ifname );
+        inf_p = get_ifinfo_by_name( tab_p, rec.ifname );
         if ( inf_p == NULL ) {
                 TRACE( "Did not find match for interface.\n");
                 return;
         }
 
-        /* RX bytes. 
-         * Note that if the value grows large enough there might not be space
-         * between the interface name and the RX bytes value.  Hence they both
-         * will be on the first token. Oh the joy.
-         */
-        if ( mangled ) {
-                tmp = strtoull(end, NULL, 10 );
-                inf_p->stats.rx_bytes_diff = tmp - inf_p->stats.rx_bytes;
-                inf_p->stats.rx_bytes = tmp;
-        } else {
-                tokens_p = tokens_p->next;
-                tmp = strtoull( tokens_p->token, NULL, 10 );
-                inf_p->stats.rx_bytes_diff = tmp - inf_p->stats.rx_bytes;
-                inf_p->stats.rx_bytes = tmp;
-        }
-        tokens_p = tokens_p->next;
-
-        /* RX packets */
-        tmp = strtoull( tokens_p->token, NULL, 10 );
-        inf_p->stats.rx_packets_diff = tmp - inf_p->stats.rx_packets;
-        inf_p->stats.rx_packets = tmp;
-        tokens_p = tokens_p->next;
-
-        /* This is a kludge. If the interface name and RX bytes stats were at
-         * the same token we need to skip the token '3' which does not contain
-         * any data we want. In case the interface name and RX bytes were not
-         * on the same token, then we need to skip the token '9' which does not
-         * contain any data we need. Messy.
-         */
-        tokens_p = tokens_p->next;
-
-
-        /* TX bytes */
-        tmp = strtoull( tokens_p->token, NULL, 10 );
-        inf_p->stats.tx_bytes_diff = tmp - inf_p->stats.tx_bytes;
-        inf_p->stats.tx_bytes = tmp;
-        tokens_p = tokens_p->next;
-
-        /* TX packets */
-        tmp = strtoull( tokens_p->token, NULL, 10 );
-        inf_p->stats.tx_packets_diff = tmp - inf_p->stats.tx_packets;
-        inf_p->stats.tx_packets = tmp;
+        update_ifstat( &inf_p->stats.rx_bytes, &inf_p->stats.rx_bytes_diff,
+                        rec.rx_bytes );
+        update_ifstat( &inf_p->stats.rx_packets, &inf_p->stats.rx_packets_diff,
+                        rec.rx_packets );
+        update_ifstat( &inf_p->stats.tx_bytes, &inf_p->stats.tx_bytes_diff,
+                        rec.tx_bytes );
+        update_ifstat( &inf_p->stats.tx_packets, &inf_p->stats.tx_packets_diff,
+                        rec.tx_packets );
 
         time_t now = time(NULL);
         if ( inf_p->stats.stamp == 0 ) {
@@ -659,6 +623,21 @@ static void parse_ifstat_data( char *line, void *ctx )
  */
 void read_interface_stat( struct stat_context *ctx )
 {
+        /* The RX bytes may follow the interface name without blanks when
+         * the value grows large, FIELD_IFNAME handles that.
+         */
+        const struct schema_field fields[] = {
+                SCHEMA_FIELD( 1, FIELD_IFNAME, struct ifstat_record, ifname ),
+                SCHEMA_FIELD( 2, FIELD_DEC, struct ifstat_record, rx_bytes ),
+                SCHEMA_FIELD( 3, FIELD_DEC, struct ifstat_record, rx_packets ),
+                SCHEMA_FIELD( 10, FIELD_DEC, struct ifstat_record, tx_bytes ),
+                SCHEMA_FIELD( 11, FIELD_DEC, struct ifstat_record, tx_packets )
+        };
+
+        if ( ifstat_schema.nr_ops == 0 &&
+                        schema_compile( &ifstat_schema, fields, 5 ) != 0 )
+                return;
+
         parse_file_per_line( IFSTAT_FILE, 2, parse_ifstat_data, ctx->iftab );
 }
 #endif /* ENABLE_IFSTATS */
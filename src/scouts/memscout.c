@@ -0,0 +1,383 @@
+/**
+ * @file memscout.c
+ * @brief Memory used by the TCP sockets via sock_diag.
+ *
+ * When the kernel runs short of memory for TCP (tcp_mem), it is useful to
+ * know which peers the buffered data belongs to. This module dumps all TCP
+ * sockets with sock_diag asking for the memory information
+ * (INET_DIAG_SKMEMINFO) and sets it for the known connections. The groups
+ * keep a running sum of the memory held by their connections.
+ *
+ * The dump is only done when the collection is enabled, connections do not
+ * carry any memory information otherwise.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_DIAG
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "scouts.h"
+
+/**
+ * File holding the memory limits for TCP.
+ */
+#define TCP_MEM_FILE "/proc/sys/net/ipv4/tcp_mem"
+/**
+ * File holding the memory currently allocated for TCP.
+ */
+#define SOCKSTAT_FILE "/proc/net/sockstat"
+
+/**
+ * Sockets on these states do not have memory information (or the
+ * information is not interesting).
+ */
+#define SOCK_MEM_SKIP_STATES ( ( 1 << TCP_LISTEN ) | ( 1 << TCP_TIME_WAIT ) | \
+                ( 1 << TCP_SYN_RECV ))
+
+/**
+ * Read the limits for TCP memory.
+ * @param smem The memory collection.
+ */
+static void read_tcp_mem( struct sock_mem *smem )
+{
+        FILE *fp;
+
+        fp = fopen( TCP_MEM_FILE, "r" );
+        if ( fp == NULL ) {
+                WARN( "Unable to open %s: %s\n", TCP_MEM_FILE, strerror( errno ));
+                return;
+        }
+        if ( fscanf( fp, "%ld %ld %ld", &smem->tcp_mem[0], &smem->tcp_mem[1],
+                                &smem->tcp_mem[2] ) != 3 ) {
+                WARN( "Unable to parse %s\n", TCP_MEM_FILE );
+        }
+        fclose( fp );
+}
+
+/**
+ * Read the number of pages the kernel has allocated for TCP.
+ * @param smem The memory collection.
+ */
+static void read_sockstat( struct sock_mem *smem )
+{
+        char line[256];
+        char *p;
+        FILE *fp;
+
+        fp = fopen( SOCKSTAT_FILE, "r" );
+        if ( fp == NULL ) 
+                return;
+        while ( fgets( line, sizeof( line ), fp ) != NULL ) {
+                if ( strncmp( line, "TCP:", 4 ) != 0 ) 
+                        continue;
+                p = strstr( line, " mem " );
+                if ( p != NULL ) 
+                        smem->kernel_pages = strtol( p + 5, NULL, 10 );
+                break;
+        }
+        fclose( fp );
+}
+
+/**
+ * @defgroup memscout_api Socket memory collection
+ *
+ * sock_mem_init() opens the netlink socket used for the dumps,
+ * read_sock_mem() dumps the sockets and sets the memory information for the
+ * known connections, sock_mem_clear() removes the information when
+ * collection is stopped.
+ */
+
+/** 
+ * @brief Initialize the socket memory collection.
+ * @ingroup memscout_api
+ * 
+ * @return Pointer to the collection, NULL if sock_diag is not available.
+ */
+struct sock_mem *sock_mem_init( void )
+{
+        struct sock_mem *smem;
+        struct sockaddr_nl addr;
+        int fd;
+
+        fd = socket( AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG );
+        if ( fd < 0 ) {
+                WARN( "Unable to open sock_diag socket: %s\n", strerror( errno ));
+                return NULL;
+        }
+
+        memset( &addr, 0, sizeof( addr ));
+        addr.nl_family = AF_NETLINK;
+        if ( bind( fd, (struct sockaddr *)&addr, sizeof( addr )) != 0 ) {
+                WARN( "Unable to bind sock_diag socket: %s\n", strerror( errno ));
+                close( fd );
+                return NULL;
+        }
+
+        smem = mem_zalloc( sizeof( *smem ));
+        smem->fd = fd;
+        smem->buf = mem_alloc( SOCK_MEM_BUF_SIZE );
+        smem->page_size = sysconf( _SC_PAGESIZE );
+        read_tcp_mem( smem );
+        DBG( "Socket memory collection initialized\n" );
+
+        return smem;
+}
+
+/** 
+ * @brief Stop the socket memory collection. 
+ * @ingroup memscout_api
+ * 
+ * @param smem The memory collection.
+ */
+void sock_mem_deinit( struct sock_mem *smem )
+{
+        close( smem->fd );
+        mem_free( smem->buf );
+        mem_free( smem );
+}
+
+/**
+ * Send request to dump all TCP sockets of given family with memory
+ * information.
+ * @param smem The memory collection.
+ * @param family The address family.
+ * @return 0 on success, -1 on error.
+ */
+static int send_dump_request( struct sock_mem *smem, int family )
+{
+        struct {
+                struct nlmsghdr nlh;
+                struct inet_diag_req_v2 req;
+        } msg;
+        struct sockaddr_nl addr;
+
+        memset( &msg, 0, sizeof( msg ));
+        msg.nlh.nlmsg_len = sizeof( msg );
+        msg.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+        msg.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        msg.nlh.nlmsg_seq = ++smem->seq;
+        msg.req.sdiag_family = family;
+        msg.req.sdiag_protocol = IPPROTO_TCP;
+        msg.req.idiag_ext = 1 << ( INET_DIAG_SKMEMINFO - 1 );
+        msg.req.idiag_states = ~SOCK_MEM_SKIP_STATES;
+
+        memset( &addr, 0, sizeof( addr ));
+        addr.nl_family = AF_NETLINK;
+        if ( sendto( smem->fd, &msg, sizeof( msg ), 0, (struct sockaddr *)&addr,
+                                sizeof( addr )) < 0 ) {
+                WARN( "Unable to send dump request: %s\n", strerror( errno ));
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * Handle one socket on the dump.
+ * @param smem The memory collection.
+ * @param nlh The message for the socket.
+ * @param ctx Pointer to the global context.
+ */
+static void handle_socket( struct sock_mem *smem, struct nlmsghdr *nlh,
+                struct stat_context *ctx )
+{
+        struct inet_diag_msg *msg = NLMSG_DATA( nlh );
+        struct rtattr *attr;
+        struct tcp_connection *conn_p;
+        struct conn_meminfo info;
+        struct conn_key key;
+        uint32_t *skmem = NULL;
+        int len;
+
+        len = nlh->nlmsg_len - NLMSG_LENGTH( sizeof( *msg ));
+        for ( attr = (struct rtattr *)( msg + 1 ); RTA_OK( attr, len ); 
+                        attr = RTA_NEXT( attr, len )) {
+                if ( attr->rta_type == INET_DIAG_SKMEMINFO &&
+                                RTA_PAYLOAD( attr ) >= SK_MEMINFO_DROPS * sizeof( uint32_t )) {
+                        skmem = RTA_DATA( attr );
+                        break;
+                }
+        }
+        if ( skmem == NULL ) 
+                return;
+
+        memset( &info, 0, sizeof( info ));
+        info.rmem_alloc = skmem[SK_MEMINFO_RMEM_ALLOC];
+        info.rcvbuf = skmem[SK_MEMINFO_RCVBUF];
+        info.wmem_alloc = skmem[SK_MEMINFO_WMEM_ALLOC];
+        info.sndbuf = skmem[SK_MEMINFO_SNDBUF];
+        info.fwd_alloc = skmem[SK_MEMINFO_FWD_ALLOC];
+        info.wmem_queued = skmem[SK_MEMINFO_WMEM_QUEUED];
+        info.optmem = skmem[SK_MEMINFO_OPTMEM];
+        info.backlog = skmem[SK_MEMINFO_BACKLOG];
+        if ( RTA_PAYLOAD( attr ) > SK_MEMINFO_DROPS * sizeof( uint32_t )) 
+                info.drops = skmem[SK_MEMINFO_DROPS];
+        info.held = info.rmem_alloc + info.wmem_queued + info.fwd_alloc;
+        info.dump = smem->seq;
+
+        smem->sockets++;
+        smem->total += info.held;
+
+        conn_key_set( &key, msg->idiag_family, (uint8_t *)msg->id.idiag_src, 
+                        (uint8_t *)msg->id.idiag_dst, 
+                        msg->id.idiag_sport, msg->id.idiag_dport );
+        conn_p = chash_get_key( ctx->chash, &key, conn_key_hash( &key ));
+        if ( conn_p == NULL ) 
+                return;
+        smem->matched++;
+        connection_set_meminfo( conn_p, &info );
+}
+
+/**
+ * Read the dump for one address family.
+ * @param smem The memory collection.
+ * @param ctx Pointer to the global context.
+ * @return 0 on success, -1 on error.
+ */
+static int read_dump( struct sock_mem *smem, struct stat_context *ctx )
+{
+        struct nlmsghdr *nlh;
+        ssize_t len;
+
+        while ( 1 ) {
+                len = recv( smem->fd, smem->buf, SOCK_MEM_BUF_SIZE, 0 );
+                if ( len < 0 ) {
+                        if ( errno == EINTR ) 
+                                continue;
+                        WARN( "Error while reading dump: %s\n", strerror( errno ));
+                        return -1;
+                }
+                for ( nlh = (struct nlmsghdr *)smem->buf; NLMSG_OK( nlh, len ); 
+                                nlh = NLMSG_NEXT( nlh, len )) {
+                        if ( nlh->nlmsg_seq != smem->seq ) 
+                                continue;
+                        if ( nlh->nlmsg_type == NLMSG_DONE ) 
+                                return 0;
+                        if ( nlh->nlmsg_type == NLMSG_ERROR ) {
+                                WARN( "Error on dump\n" );
+                                return -1;
+                        }
+                        if ( nlh->nlmsg_len < NLMSG_LENGTH( sizeof( struct inet_diag_msg )))
+                                continue;
+                        handle_socket( smem, nlh, ctx );
+                }
+        }
+}
+
+/**
+ * Forget the memory information not updated on the last dump.
+ * @param conn_p The connection.
+ * @param data The sequence number for the first request of the dump.
+ */
+static void clear_stale( struct tcp_connection *conn_p, void *data )
+{
+        uint32_t first = *(uint32_t *)data;
+
+        if ( conn_p->mem != NULL && conn_p->mem->dump < first ) 
+                connection_clear_meminfo( conn_p );
+}
+
+/**
+ * Forget the memory information of a connection.
+ * @param conn_p The connection.
+ * @param data Unused.
+ */
+static void clear_meminfo( struct tcp_connection *conn_p, _UNUSED void *data )
+{
+        connection_clear_meminfo( conn_p );
+}
+
+/** 
+ * @brief Dump the TCP sockets and update the memory used by the connections.
+ *
+ * This should be called after the connections have been polled, so that
+ * the new connections are on the hashtable. Connections not on the dump
+ * (closed ones and ones on TIME_WAIT) lose their memory information.
+ * @ingroup memscout_api
+ * 
+ * @param ctx Pointer to the global context.
+ * 
+ * @return 0 on success, -1 on error.
+ */
+int read_sock_mem( struct stat_context *ctx )
+{
+        struct sock_mem *smem = ctx->smem;
+        long start = connection_now_usecs();
+        uint32_t first = smem->seq + 1;
+        int rv = 0;
+
+        smem->total = 0;
+        smem->sockets = 0;
+        smem->matched = 0;
+        if ( ctx->collected_stats != STAT_V6_ONLY ) {
+                if ( send_dump_request( smem, AF_INET ) != 0 || 
+                                read_dump( smem, ctx ) != 0 ) 
+                        rv = -1;
+        }
+        if ( ctx->collected_stats != STAT_V4_ONLY ) {
+                if ( send_dump_request( smem, AF_INET6 ) != 0 || 
+                                read_dump( smem, ctx ) != 0 ) 
+                        rv = -1;
+        }
+        chash_walk( ctx->chash, clear_stale, &first );
+        read_sockstat( smem );
+        smem->dump_usecs = connection_now_usecs() - start;
+
+        return rv;
+}
+
+/** 
+ * @brief Remove the memory information from all connections.
+ * @ingroup memscout_api
+ * 
+ * @param ctx Pointer to the global context.
+ */
+void sock_mem_clear( struct stat_context *ctx )
+{
+        chash_walk( ctx->chash, clear_meminfo, NULL );
+}
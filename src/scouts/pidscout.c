@@ -43,6 +43,8 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 
 #define DBG_MODULE_NAME DBG_MODULE_PID
 
@@ -221,27 +223,251 @@ static void dump_pidinfos( struct pidinfo *pinfo_p )
 
 
 
+/**
+ * One entry on the inode index.
+ */
+struct inode_entry {
+        ino_t inode; /**< The inode, 0 for empty slot */
+        struct pidinfo *info; /**< Process owning the inode */
+};
+
+/**
+ * Pool of worker threads for scanning the inodes and the index from inodes to
+ * the processes built from the results.
+ *
+ * The workers are started once and they wait for a new scan to be started.
+ * Each worker takes the next unscanned pidinfo from the list until all have
+ * been scanned. The pidinfo structures are not shared between workers, hence
+ * scout_pid() can be run without locking.
+ */
+struct pid_scanner {
+        int nr_workers; /**< Number of worker threads, 0 for no threads */
+        pthread_t *workers; /**< The worker threads */
+        pthread_mutex_t lock; /**< Lock protecting the fields below */
+        pthread_cond_t work_cond; /**< Signalled when new scan is started */
+        pthread_cond_t done_cond; /**< Signalled when workers are done */
+        struct pidinfo *next_job; /**< Next pidinfo to scan */
+        unsigned int generation; /**< Incremented when new scan is started */
+        int active; /**< Number of workers still scanning */
+        int quit; /**< Set when workers should exit */
+
+        struct inode_entry *index; /**< Open addressing hash, inode -> pidinfo */
+        unsigned int index_size; /**< Number of slots on index (power of 2) */
+};
+
+/**
+ * @brief Scan the inodes for one process and record the time spent.
+ *
+ * If the process has died, pid on the struct is set to -1.
+ *
+ * @param info_p Pointer to the pidinfo to scan.
+ */
+static void scan_one( struct pidinfo *info_p )
+{
+        long start = connection_now_usecs();
+
+        TRACE( "Scanning inodes for PID %d\n", info_p->pid );
+        if ( scout_pid( info_p ) == -1 ) {
+                DBG( "Process %d has possibly died!\n", info_p->pid );
+                info_p->pid = -1;
+        }
+        info_p->scan_usecs = connection_now_usecs() - start;
+}
+
+/**
+ * @brief Main loop for worker thread.
+ *
+ * @param arg Pointer to the pid_scanner.
+ * @return NULL
+ */
+static void *scan_worker( void *arg )
+{
+        struct pid_scanner *scanner = arg;
+        struct pidinfo *job;
+        unsigned int seen = 0;
+
+        pthread_mutex_lock( &scanner->lock );
+        while ( 1 ) {
+                while ( ! scanner->quit && scanner->generation == seen )
+                        pthread_cond_wait( &scanner->work_cond, &scanner->lock );
+                if ( scanner->quit )
+                        break;
+                seen = scanner->generation;
+
+                while ( (job = scanner->next_job) != NULL ) {
+                        scanner->next_job = job->next;
+                        pthread_mutex_unlock( &scanner->lock );
+                        scan_one( job );
+                        pthread_mutex_lock( &scanner->lock );
+                }
+                scanner->active--;
+                if ( scanner->active == 0 )
+                        pthread_cond_signal( &scanner->done_cond );
+        }
+        pthread_mutex_unlock( &scanner->lock );
+
+        return NULL;
+}
+
+/**
+ * @brief Initialize scanner for the process inodes.
+ *
+ * @a workers threads are started for scanning, if @a workers is 0, the scan is
+ * done on the calling thread.
+ *
+ * @note When memory debugging is enabled, no threads are used since the
+ * allocation tracking is not thread safe.
+ *
+ * @ingroup pidscout_grp
+ *
+ * @param workers Number of worker threads to use.
+ * @return Pointer to the initialized scanner.
+ */
+struct pid_scanner *pid_scanner_init( int workers )
+{
+        struct pid_scanner *scanner;
+        int i;
+
+        scanner = mem_zalloc( sizeof( *scanner ));
+#ifdef DEBUG_SH_MEM
+        workers = 0;
+#endif /* DEBUG_SH_MEM */
+        if ( workers > MAX_PID_WORKERS )
+                workers = MAX_PID_WORKERS;
+
+        pthread_mutex_init( &scanner->lock, NULL );
+        pthread_cond_init( &scanner->work_cond, NULL );
+        pthread_cond_init( &scanner->done_cond, NULL );
+
+        if ( workers > 0 )
+                scanner->workers = mem_alloc( workers * sizeof( pthread_t ));
+        for ( i = 0; i < workers; i++ ) {
+                if ( pthread_create( &scanner->workers[i], NULL, scan_worker, scanner ) != 0 ) {
+                        WARN( "Unable to start worker thread: %s\n", strerror( errno ));
+                        break;
+                }
+        }
+        scanner->nr_workers = i;
+        DBG( "Started %d workers for scanning the inodes\n", i );
+
+        return scanner;
+}
+
+/**
+ * @brief Stop the worker threads and free the scanner.
+ *
+ * @ingroup pidscout_grp
+ *
+ * @param scanner Pointer to the scanner.
+ */
+void pid_scanner_deinit( struct pid_scanner *scanner )
+{
+        int i;
+
+        pthread_mutex_lock( &scanner->lock );
+        scanner->quit = 1;
+        pthread_cond_broadcast( &scanner->work_cond );
+        pthread_mutex_unlock( &scanner->lock );
+
+        for ( i = 0; i < scanner->nr_workers; i++ )
+                pthread_join( scanner->workers[i], NULL );
+
+        pthread_mutex_destroy( &scanner->lock );
+        pthread_cond_destroy( &scanner->work_cond );
+        pthread_cond_destroy( &scanner->done_cond );
+        if ( scanner->workers != NULL )
+                mem_free( scanner->workers );
+        if ( scanner->index != NULL )
+                mem_free( scanner->index );
+        mem_free( scanner );
+}
+
+/**
+ * Get the slot on index for given inode.
+ */
+static unsigned int inode_slot( struct pid_scanner *scanner, ino_t inode )
+{
+        uint64_t h = (uint64_t)inode * 0x9E3779B97F4A7C15ULL;
+
+        return (unsigned int)(h >> 32) & (scanner->index_size - 1);
+}
+
+/**
+ * @brief Rebuild the inode index from the scanned pidinfos.
+ *
+ * The index is sized to be at most half full. If the same inode is used by
+ * multiple processes, the first process on the list owns it.
+ *
+ * @param scanner Pointer to the scanner.
+ * @param info_p Pointer to the first pidinfo on list.
+ */
+static void build_index( struct pid_scanner *scanner, struct pidinfo *info_p )
+{
+        struct pidinfo *iterator;
+        unsigned int total = 0, size = 16, slot;
+        int i;
+
+        for ( iterator = info_p; iterator != NULL; iterator = iterator->next )
+                total += iterator->nr_inodes;
+        while ( size < 2 * total )
+                size <<= 1;
+
+        if ( size != scanner->index_size ) {
+                if ( scanner->index != NULL )
+                        mem_free( scanner->index );
+                scanner->index = mem_alloc( size * sizeof( struct inode_entry ));
+                scanner->index_size = size;
+        }
+        memset( scanner->index, 0, size * sizeof( struct inode_entry ));
+
+        for ( iterator = info_p; iterator != NULL; iterator = iterator->next ) {
+                for ( i = 0; i < iterator->nr_inodes; i++ ) {
+                        slot = inode_slot( scanner, iterator->inodetab[i] );
+                        while ( scanner->index[slot].inode != 0 &&
+                                scanner->index[slot].inode != iterator->inodetab[i] )
+                                slot = (slot + 1) & (size - 1);
+                        if ( scanner->index[slot].inode == 0 ) {
+                                scanner->index[slot].inode = iterator->inodetab[i];
+                                scanner->index[slot].info = iterator;
+                        }
+                }
+        }
+}
+
 /** 
  * @brief Scout inodes for all pidinfo structures on the linked list. 
+ *
+ * The pidinfos are scanned concurrently by the worker threads of the scanner
+ * (or on the calling thread if there are no workers). When all processes
+ * have been scanned, the inode index used by get_pidinfo_by_inode() is
+ * rebuilt.
  * 
  * @param info_p Pointer to the entry on the list where scan should start.
+ * @param scanner Pointer to the scanner.
  * @return 0 if operation was succesfull,  -1 otherwise.
  */
-int scan_inodes( struct pidinfo *info_p )
+int scan_inodes( struct pidinfo *info_p, struct pid_scanner *scanner )
 {
         struct pidinfo *iterator = info_p;
-        
 
-        while (iterator != NULL ) {
-                /* XXX return value */
-                TRACE( "Scanning inodes for PID %d\n", iterator->pid );
-                if ( scout_pid( iterator ) == -1 ) {
-                        DBG( "Process %d has possibly died!\n" );
-                        iterator->pid = -1;
+        if ( scanner->nr_workers == 0 || info_p == NULL || info_p->next == NULL ) {
+                /* Not worth waking up the workers */
+                while (iterator != NULL ) {
+                        scan_one( iterator );
+                        iterator = iterator->next;
                 }
-                TRACE( "Next ptr %p\n", iterator->next );
-                iterator = iterator->next;
+        } else {
+                pthread_mutex_lock( &scanner->lock );
+                scanner->next_job = info_p;
+                scanner->active = scanner->nr_workers;
+                scanner->generation++;
+                pthread_cond_broadcast( &scanner->work_cond );
+                while ( scanner->active > 0 )
+                        pthread_cond_wait( &scanner->done_cond, &scanner->lock );
+                pthread_mutex_unlock( &scanner->lock );
         }
+
+        build_index( scanner, info_p );
 #ifdef DEBUG
         dump_pidinfos(info_p);
 #endif /* DEBUG */
@@ -307,36 +533,89 @@ void free_pidinfo( struct pidinfo *info_p )
 }
 
 /** 
- * @brief Find pidinfo file containing given inode.
+ * @brief Find pidinfo containing given inode.
  *
- * First pidinfo file that contains the given inode is returned. 
+ * The inode index built by the last scan_inodes() is used for the lookup.
  * 
  * @ingroup pidscout_grp
  * @param inode Inode to search.
- * @param info_p Pointer to the first pidinfo structure on the list of
- * structures. 
- * @return Pointer to pidinfo file is match is found. 
+ * @param scanner Pointer to the scanner which has done the scan.
+ * @return Pointer to pidinfo if match is found, NULL if not.
  */
-struct pidinfo *get_pidinfo_by_inode( ino_t inode, struct pidinfo *info_p )
+struct pidinfo *get_pidinfo_by_inode( ino_t inode, struct pid_scanner *scanner )
 {
-        int i;
-        struct pidinfo *iterator, *rv;
-
-        rv = NULL;
-        iterator = info_p;
-        while (iterator != NULL ) {
-                TRACE( "Searching inodes of PID %d\n", iterator->pid );
-                for( i =0; i < iterator->nr_inodes; i++ ) {
-                        TRACE( "tab[%d] %d <--> %d\n", i, iterator->inodetab[i], inode );
-                        if ( iterator->inodetab[i] == inode ) {
-                                TRACE( "Found match\n" );
-                                rv = iterator;
-                                return rv;
-                               
-                        }
+        unsigned int slot;
+
+        if ( scanner->index == NULL || inode == 0 )
+                return NULL;
+
+        slot = inode_slot( scanner, inode );
+        while ( scanner->index[slot].inode != 0 ) {
+                if ( scanner->index[slot].inode == inode ) {
+                        TRACE( "Found match\n" );
+                        return scanner->index[slot].info;
                 }
-                iterator = iterator->next;
+                slot = (slot + 1) & (scanner->index_size - 1);
         }
-        return rv;
+        return NULL;
+}
+
+/** 
+ * @brief Scan the socket inodes of all processes.
+ *
+ * A pidinfo is created for every process found on /proc and the inodes are
+ * scanned with the scanner. The index used by get_pidinfo_by_inode() points
+ * to the returned pidinfos until free_all_processes() is called.
+ *
+ * @ingroup pidscout_grp
+ * @param scanner Pointer to the scanner.
+ * @return List of pidinfos, NULL if no processes could be read.
+ */
+struct pidinfo *scan_all_processes( struct pid_scanner *scanner )
+{
+        struct pidinfo *list = NULL, *info_p;
+        struct dirent *ent_p;
+        DIR *dir;
+        char *end;
+        long pid;
+
+        dir = opendir( "/proc" );
+        if ( dir == NULL ) {
+                WARN( "Could not open /proc: %s\n", strerror( errno ));
+                return NULL;
+        }
+        while ( (ent_p = readdir( dir )) != NULL ) {
+                pid = strtol( ent_p->d_name, &end, 10 );
+                if ( *end != '\0' || pid <= 0 )
+                        continue;
+                info_p = init_pidinfo( pid );
+                info_p->next = list;
+                list = info_p;
+        }
+        closedir( dir );
+
+        scan_inodes( list, scanner );
+        return list;
+}
+
+/** 
+ * @brief Free the pidinfos returned by scan_all_processes().
+ *
+ * The inode index on scanner is cleared.
+ *
+ * @ingroup pidscout_grp
+ * @param list List of pidinfos.
+ * @param scanner Pointer to the scanner used for the scan.
+ */
+void free_all_processes( struct pidinfo *list, struct pid_scanner *scanner )
+{
+        struct pidinfo *next;
+
+        while ( list != NULL ) {
+                next = list->next;
+                free_pidinfo( list );
+                list = next;
+        }
+        build_index( scanner, NULL );
 }
 #endif /* ENABLE_FOLLOW_PID */
@@ -284,6 +284,11 @@ int rtinfo_is_on_local_net( struct rtinfo *info_p )
 }
 
 
+/**
+ * Compiled schema for the <code>/proc/net/route</code>.
+ */
+static struct record_schema rt_v4_schema;
+
 /** 
  * @brief Parse the IPv4 routing information from the /proc/net/route.
  *
@@ -297,83 +302,28 @@ int rtinfo_is_on_local_net( struct rtinfo *info_p )
  */
 static void parse_rt_v4_data( char *line, void *ctx )
 {
-#define NROF_WANTED_TOKENS 4
-        struct line_token *tokens_p, tokens[NROF_WANTED_TOKENS];
-
-        int wanted[NROF_WANTED_TOKENS] = {1,2,3,8};
-        struct parser_req req = {
-                .interested_tokens = wanted,
-                .interested_size = NROF_WANTED_TOKENS,
-                .tokens = tokens,
-                .token_count = NROF_WANTED_TOKENS
-        };
-        uint8_t data_buf[4];
-        int len;
         struct rtinfo *info_p;
         struct ifinfo *iinfo;
-        //struct rtlist *list_p = (struct rtlist *)ctx;
         struct ifinfo_tab *ifs = (struct ifinfo_tab *)ctx;
 
-        tokens_p = tokenize( &req, line );
-        
-        if ( tokens_p == NULL ) 
-                return;
-
         info_p = mem_alloc( sizeof( *info_p ));
         memset( info_p, 0, sizeof( *info_p));
         info_p->family = AF_INET;
 
-        /* First token, interface name */
-        TRACE("Token 1, interface: %s\n", tokens_p->token );
-
-        strncpy( info_p->ifname, tokens_p->token, IFNAMEMAX ); 
-        info_p->ifname[IFNAMEMAX-1] = '\0';
-
-        tokens_p = tokens_p->next;
-
-        /* 2nd token, destination address */
-        TRACE("Token 2, destination addr %s\n", tokens_p->token );
-        str2bytes( tokens_p->token, data_buf, &len );
-        if ( len != 4 ) {
-                WARN("Error while reading IPv4 address bytes!");
-                return;
-        }
-        //info_p->rtinfo_v4.dst.s_addr = (uint32_t)data_buf; /* XXX endianess? */
-        memcpy( &(info_p->rtinfo_v4.dst.s_addr), data_buf, 4 );
-        info_p->rtinfo_v4.dst.s_addr = ntohl( info_p->rtinfo_v4.dst.s_addr );
-
-        /* 3rd token, gateway address */
-        tokens_p = tokens_p->next;
-        TRACE("Token 3, gw address %s \n", tokens_p->token );
-        str2bytes( tokens_p->token, data_buf, &len );
-        if ( len != 4 ) {
-                WARN("Error while reading IPv4 address bytes!");
+        /* The addresses are printed as 32bit words in host byte order */
+        if ( schema_decode( &rt_v4_schema, line, info_p ) != 0 ) {
+                WARN("Error while reading IPv4 routing information!\n");
+                mem_free( info_p );
                 return;
         }
-        //info_p->rtinfo_v4.gw.s_addr = (uint32_t)data_buf; /* XXX endianess? */
-        memcpy( &(info_p->rtinfo_v4.gw.s_addr), data_buf, 4 );
-        info_p->rtinfo_v4.gw.s_addr = ntohl( info_p->rtinfo_v4.gw.s_addr );
+        TRACE("Route for interface %s\n", info_p->ifname );
+
         if ( inet_ntop( AF_INET, &(info_p->rtinfo_v4.gw), 
                                 info_p->addr_str, ADDRSTR_BUFLEN) == NULL ) {
                 WARN("inet_ntop() failed, no addrstr\n");
                 info_p->addr_str[0] = '\0';
         }
 
-        /* last token, the destination mask */
-        tokens_p = tokens_p->next;
-        TRACE("Token 4, mask %s \n", tokens_p->token );
-        str2bytes( tokens_p->token, data_buf, &len );
-        if ( len != 4 ) {
-                WARN("Error while reading IPv4 address bytes!");
-                return;
-        }
-        //info_p->rtinfo_v4.mask = (uint32_t)data_buf; /* XXX endianess? */
-        memcpy( &(info_p->rtinfo_v4.mask), data_buf, 4 );
-        info_p->rtinfo_v4.mask = ntohl( info_p->rtinfo_v4.mask);
-
-
-        ASSERT( tokens_p->next == NULL );
-
         //rtlist_add( list_p, info_p );
         iinfo = get_ifinfo_by_name( ifs, info_p->ifname );
         if ( iinfo == NULL ) {
@@ -400,6 +350,17 @@ static void parse_rt_v4_data( char *line, void *ctx )
  */
 void parse_routing_info( struct ifinfo_tab *ifs ) 
 {
+        const struct schema_field fields[] = {
+                SCHEMA_FIELD( 1, FIELD_NAME, struct rtinfo, ifname ),
+                SCHEMA_FIELD( 2, FIELD_HEX_WORDS, struct rtinfo, rtinfo_v4.dst ),
+                SCHEMA_FIELD( 3, FIELD_HEX_WORDS, struct rtinfo, rtinfo_v4.gw ),
+                SCHEMA_FIELD( 8, FIELD_HEX, struct rtinfo, rtinfo_v4.mask )
+        };
+
+        if ( rt_v4_schema.nr_ops == 0 &&
+                        schema_compile( &rt_v4_schema, fields, 4 ) != 0 )
+                return;
+
         parse_file_per_line( IPV4_RT_FILE, 1, parse_rt_v4_data, ifs );
 }
 #endif /* ENABLE_ROUTES */
@@ -36,6 +36,8 @@
 #ifndef _SCOUTS_H_
 #define _SCOUTS_H_
 
+#include "hash.h"
+
 #ifdef ENABLE_ROUTES 
 
 /**
@@ -168,12 +170,263 @@ struct pidinfo {
         int inodetab_size; /**< Maximum number of entries in tab */
         struct pidinfo *next; /**< Pointer to next pidinfo struct */
         struct group *grp;/**< Group for connections for this PID */
+        long scan_usecs; /**< Time spent on last inode scan (microseconds) */
+};
+
+/**
+ * Default number of worker threads used for scanning the inodes.
+ */
+#define DEFAULT_PID_WORKERS 4
+/**
+ * Maximum number of worker threads used for scanning the inodes.
+ */
+#define MAX_PID_WORKERS 64
+
+struct pid_scanner;
+#endif /* ENABLE_FOLLOW_PID */
+
+#ifdef ENABLE_SNMP_STATS
+/**
+ * Maximum number of counters shown.
+ */
+#define SNMP_MAX_COUNTERS 32
+/**
+ * Maximum length of counter name (including the prefix).
+ */
+#define SNMP_NAME_LEN 48
+/**
+ * Size of the buffer the counter files are read to.
+ */
+#define SNMP_BUF_SIZE 32768
+/**
+ * Counters shown if user does not select them.
+ */
+#define SNMP_DEFAULT_COUNTERS "Tcp.ActiveOpens,Tcp.PassiveOpens,Tcp.RetransSegs,"\
+        "TcpExt.ListenOverflows,TcpExt.ListenDrops,TcpExt.TCPTimeouts,"\
+        "TcpExt.TCPAbortOnMemory"
+
+/**
+ * The files the counters are read from.
+ */
+enum snmp_file {
+        SNMP_FILE_SNMP, /**< /proc/net/snmp */
+        SNMP_FILE_NETSTAT, /**< /proc/net/netstat */
+        SNMP_FILES
+};
+
+/**
+ * One kernel counter. The location of the value is found from the header
+ * line when the counters are initialized.
+ */
+struct snmp_counter {
+        char name[SNMP_NAME_LEN]; /**< Name of the counter (Prefix.Name) */
+        uint8_t file; /**< enum snmp_file */
+        uint16_t line; /**< Line holding the value on the file */
+        uint16_t column; /**< Column of the value on line (0 is the prefix) */
+        uint64_t value; /**< Last value read */
+        uint64_t delta; /**< Change since the previous read */
+        unsigned long rate; /**< Change per second */
+};
+
+/**
+ * The selected kernel counters.
+ * @see snmpscout.c
+ */
+struct snmp_stats {
+        int fds[SNMP_FILES]; /**< The open counter files */
+        char *buf; /**< Buffer for reading the files */
+        int nr_counters; /**< Number of counters */
+        /** 
+         * The counters, sorted by the location on files.
+         */
+        struct snmp_counter counters[SNMP_MAX_COUNTERS]; 
+        long stamp; /**< Time of the last read (ms, monotonic) */
+        int reads; /**< Number of times the counters have been read */
+        long read_usecs; /**< Time spent on last read */
+        FILE *export; /**< File the counters are exported to, NULL if none */
+};
+#endif /* ENABLE_SNMP_STATS */
+
+#ifdef ENABLE_DIAG_EVENTS
+/**
+ * Event source for closed connections.
+ * @see diagscout.c
+ */
+struct diag_events {
+        int fd; /**< The netlink socket */
+        struct conn_batch batch; /**< Batch for short-lived connections */
+        unsigned long events; /**< Number of destroy events received */
+        unsigned long shortlived; /**< Number of connections only seen on events */
+        unsigned long closed; /**< Number of known connections closed */
+        unsigned long overruns; /**< Number of times events were lost */
+        time_t lifetime_sum; /**< Sum of the lifetimes of known closed connections */
+        int round_shortlived; /**< Short-lived connections on this round */
+};
+#endif /* ENABLE_DIAG_EVENTS */
+
+#ifdef ENABLE_BPF_EVENTS
+/**
+ * Default number of update rounds between the polls of /proc/net/tcp when
+ * the state transitions are read from the tracepoint.
+ */
+#define DEFAULT_RECONCILE_ROUNDS 10
+
+/**
+ * Initial number of sockets with transitions kept for one round.
+ */
+#define BPF_PENDING_INIT_SIZE 256
+
+/**
+ * Last transition of a socket on the update round. 
+ */
+struct bpf_pending {
+        struct hash_link link; /**< Link on the index, hashed by the key */
+        struct conn_key key; /**< The socket */
+        uint8_t state; /**< State after the last transition */
+        uint64_t stamp; /**< Time of the last transition (ms) */
 };
+
+/**
+ * Event source for TCP state transitions.
+ * @see bpfscout.c
+ */
+struct bpf_events {
+        int map_fd; /**< The ring buffer map */
+        int drops_fd; /**< Per-CPU counters of transitions not fitting on ring buffer */
+        int prog_fd; /**< The program attached to tracepoint */
+        int perf_fd; /**< The tracepoint event */
+        long page_size; /**< Size of the pages mapped for ring buffer */
+        unsigned long *consumer; /**< Consumer position on ring buffer */
+        unsigned long *producer; /**< Producer position on ring buffer */
+        uint8_t *data; /**< Data on ring buffer */
+        int nr_cpus; /**< Number of possible CPUs, one counter for each */
+        uint64_t *drop_counts; /**< Buffer for reading the counters */
+        struct bpf_pending *pending; /**< Sockets with transitions on this round */
+        int nr_pending; /**< Number of sockets on pending */
+        int pending_size; /**< Room on pending */
+        struct hash_index pending_index; /**< The pending sockets by key */
+#ifdef ENABLE_FOLLOW_PID
+        int diag_fd; /**< sock_diag socket for finding inodes, -1 if not following processes */
+        uint32_t diag_seq; /**< Sequence number for the next lookup */
 #endif /* ENABLE_FOLLOW_PID */
+        struct conn_batch batch; /**< Batch for the transitions */
+        unsigned long events; /**< Number of transitions received */
+        unsigned long drops; /**< Number of transitions lost with full ring buffer */
+        unsigned long forced_polls; /**< Polls done because transitions were lost */
+        int round_events; /**< Transitions received on this round */
+        long event_usecs; /**< Time spent reading the transitions on last round */
+        long poll_usecs; /**< Time spent on last poll of /proc/net/tcp */
+};
+#endif /* ENABLE_BPF_EVENTS */
+
+#ifdef ENABLE_SOCK_MEM
+/**
+ * Size of the buffer for receiving the sock_diag dump.
+ */
+#define SOCK_MEM_BUF_SIZE 65536
+
+/**
+ * Collection of memory used by the TCP sockets.
+ * @see memscout.c
+ */
+struct sock_mem {
+        int fd; /**< The netlink socket */
+        uint32_t seq; /**< Sequence number for the next dump request */
+        char *buf; /**< Buffer for receiving the dump */
+        uint64_t total; /**< Memory held by all sockets on last dump (bytes) */
+        int sockets; /**< Number of sockets on last dump */
+        int matched; /**< Number of sockets matched to known connections */
+        long tcp_mem[3]; /**< Limits from /proc/sys/net/ipv4/tcp_mem (pages) */
+        long kernel_pages; /**< Pages allocated according to /proc/net/sockstat */
+        long page_size; /**< Size of the page in bytes */
+        long dump_usecs; /**< Time spent on last dump */
+};
+#endif /* ENABLE_SOCK_MEM */
+
+#ifdef ENABLE_CONNTRACK
+/**
+ * Size of the buffer for receiving conntrack messages.
+ */
+#define CT_BUF_SIZE 65536
+/**
+ * Initial number of hash chains on the conntrack table (power of 2).
+ */
+#define CT_INDEX_INIT_SIZE 256
+/**
+ * Number of rounds between full dumps with ctnetlink. Entries created before
+ * the events were subscribed do not send DESTROY events (with the default
+ * nf_conntrack_events=2), these are cleaned up by the dump.
+ */
+#define CT_RESYNC_ROUNDS 300
+/**
+ * Rounds between reads of /proc/net/nf_conntrack.
+ */
+#define CT_PROC_ROUNDS 5
+
+/**
+ * Where the connection tracking table is read from.
+ */
+enum ct_source {
+        CT_SOURCE_NETLINK, /**< ctnetlink dump, kept up to date with events */
+        CT_SOURCE_PROC /**< /proc/net/nf_conntrack, read every CT_PROC_ROUNDS rounds */
+};
+
+/**
+ * Translated connection on the conntrack table, keyed by the tuple the local
+ * socket has.
+ */
+struct ct_entry {
+        struct hash_link link; /**< Link on the table, hashed by the key */
+        struct conn_key key; /**< Tuple as seen by the local socket */
+        struct conn_nat nat; /**< The real remote end */
+        unsigned int gen; /**< Read of the table the entry was last seen on */
+};
+
+/**
+ * Translated TCP connections from the connection tracking table.
+ * @see ctscout.c
+ */
+struct ct_table {
+        enum ct_source source; /**< Where the table is read from */
+        int fd; /**< Netlink socket for the events, -1 if not used */
+        uint32_t seq; /**< Sequence number for the next dump request */
+        char *buf; /**< Buffer for receiving the messages */
+        struct hash_index entries; /**< The entries */
+        unsigned long events; /**< Number of events received */
+        unsigned long resyncs; /**< Number of dumps done after lost events */
+        int rounds; /**< Rounds since the last dump (or read of proc) */
+        unsigned int gen; /**< Number of reads of proc */
+        unsigned long annotated; /**< Number of connections with real peer */
+};
+#endif /* ENABLE_CONNTRACK */
 /*
  * Function prototypes
  */
 int read_tcp_stat( struct stat_context *ctx );
+#ifdef ENABLE_DIAG_EVENTS
+struct diag_events *diag_events_init( struct stat_context *ctx );
+void diag_events_deinit( struct diag_events *ev );
+int read_diag_events( struct stat_context *ctx );
+#endif /* ENABLE_DIAG_EVENTS */
+#ifdef ENABLE_BPF_EVENTS
+struct bpf_events *bpf_events_init( struct stat_context *ctx );
+void bpf_events_deinit( struct bpf_events *ev );
+int read_bpf_events( struct stat_context *ctx, int reconcile );
+#endif /* ENABLE_BPF_EVENTS */
+#ifdef ENABLE_SOCK_MEM
+struct sock_mem *sock_mem_init( void );
+void sock_mem_deinit( struct sock_mem *smem );
+int read_sock_mem( struct stat_context *ctx );
+void sock_mem_clear( struct stat_context *ctx );
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_CONNTRACK
+struct ct_table *ct_table_init( struct stat_context *ctx );
+void ct_table_deinit( struct ct_table *ct );
+int read_conntrack( struct stat_context *ctx );
+void ct_annotate( struct ct_table *ct, struct tcp_connection *conn_p );
+void ct_forget( struct ct_table *ct, struct tcp_connection *conn_p );
+const char *ct_source_name( struct ct_table *ct );
+#endif /* ENABLE_CONNTRACK */
 
 /*
  * Interface Information API
@@ -186,6 +439,15 @@ int iftab_has_routes( struct ifinfo_tab *tab_p );
 #ifdef ENABLE_IFSTATS
 void read_interface_stat( struct stat_context *ctx );
 #endif /* ENABLE_IFSTATS */
+#ifdef ENABLE_SNMP_STATS
+/*
+ * Kernel TCP counters API
+ */
+struct snmp_stats *snmp_stats_init( const char *names );
+void snmp_stats_deinit( struct snmp_stats *stats );
+int read_snmp_stats( struct snmp_stats *stats );
+void snmp_stats_export( struct snmp_stats *stats, FILE *fp );
+#endif /* ENABLE_SNMP_STATS */
 #ifdef ENABLE_ROUTES
 
 /* 
@@ -211,11 +473,15 @@ void parse_routing_info( struct ifinfo_tab *ifs );
  * process information API
  */
 int scout_pid( struct pidinfo *info_p );
-int scan_inodes( struct pidinfo *info_p );
+struct pid_scanner *pid_scanner_init( int workers );
+void pid_scanner_deinit( struct pid_scanner *scanner );
+int scan_inodes( struct pidinfo *info_p, struct pid_scanner *scanner );
 void scan_cmdline( struct pidinfo *info_p );
 void free_pidinfo( struct pidinfo *info_p );
 struct pidinfo *init_pidinfo( int pid );
-struct pidinfo *get_pidinfo_by_inode( ino_t inode, struct pidinfo *info_p );
+struct pidinfo *get_pidinfo_by_inode( ino_t inode, struct pid_scanner *scanner );
+struct pidinfo *scan_all_processes( struct pid_scanner *scanner );
+void free_all_processes( struct pidinfo *list, struct pid_scanner *scanner );
 #endif /* ENABLE_FOLLOW_PID */
 
 #endif /* _SCOUTS_H_ */
@@ -0,0 +1,369 @@
+/**
+ * @file snmpscout.c
+ * @brief Kernel wide TCP counters from /proc/net/snmp and /proc/net/netstat.
+ *
+ * The counter files have the names of the counters on a header line which is
+ * followed by a line holding the values, for example
+ * <pre>
+ * Tcp: RtoAlgorithm RtoMin ... ActiveOpens PassiveOpens ...
+ * Tcp: 1 200 ... 1234 567 ...
+ * </pre>
+ * The header lines are read only once when the counters are selected, the
+ * location (line and column) of every selected counter is saved. On every
+ * update the files are re-read to a buffer and the values are picked from the
+ * saved locations without looking at the names again.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_SNMP
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "scouts.h"
+
+/**
+ * Names of the counter files, indexed with enum snmp_file.
+ */
+static const char *snmp_files[SNMP_FILES] = {
+        "/proc/net/snmp",
+        "/proc/net/netstat"
+};
+
+/**
+ * Read the whole counter file to the buffer. 
+ * @param stats The counters.
+ * @param file The file to read.
+ * @return Number of bytes read, -1 on error.
+ */
+static int read_counter_file( struct snmp_stats *stats, int file )
+{
+        ssize_t cnt;
+
+        cnt = pread( stats->fds[file], stats->buf, SNMP_BUF_SIZE - 1, 0 );
+        if ( cnt < 0 ) {
+                WARN( "Unable to read %s: %s\n", snmp_files[file], strerror( errno ));
+                return -1;
+        }
+        stats->buf[cnt] = '\0';
+        return cnt;
+}
+
+/**
+ * Skip to the beginning of the next token on line.
+ * @param p Pointer to the current token.
+ * @return Pointer to the next token, or to the end of line if there are no
+ * more tokens.
+ */
+static char *next_token( char *p )
+{
+        while ( *p != '\0' && *p != ' ' && *p != '\n' )
+                p++;
+        while ( *p == ' ' )
+                p++;
+        return p;
+}
+
+/**
+ * Skip to the beginning of the next line.
+ * @param p Pointer to the current line.
+ * @return Pointer to the next line, or to the terminating nul.
+ */
+static char *next_line( char *p )
+{
+        p = strchr( p, '\n' );
+        return p != NULL ? p + 1 : NULL;
+}
+
+/**
+ * Check if counter named on header line matches the name user has given.
+ * @param name The name given by user, "Prefix.Name" or just "Name".
+ * @param prefix The prefix for the header line (without the colon).
+ * @param plen Length of the prefix.
+ * @param token The counter name on header line.
+ * @param tlen Length of the counter name.
+ * @return 1 if the names match.
+ */
+static int name_matches( const char *name, const char *prefix, int plen,
+                const char *token, int tlen )
+{
+        const char *dot = strchr( name, '.' );
+
+        if ( dot != NULL ) {
+                if ( dot - name != plen || strncmp( name, prefix, plen ) != 0 )
+                        return 0;
+                name = dot + 1;
+        }
+        return (int)strlen( name ) == tlen && strncmp( name, token, tlen ) == 0;
+}
+
+/**
+ * Find the location of counter from the header lines on file.
+ * The file should be read to the buffer.
+ * @param stats The counters.
+ * @param file The file on buffer.
+ * @param name The name of the counter to look for.
+ * @param counter The counter to fill in if the name is found.
+ * @return 1 if the counter was found, 0 if not.
+ */
+static int locate_counter( struct snmp_stats *stats, int file, const char *name,
+                struct snmp_counter *counter )
+{
+        char *line = stats->buf;
+        char *p, *colon;
+        int lineno = 0;
+        int column, plen;
+
+        /* header lines are on even lines, values follow on odd lines */
+        while ( line != NULL && *line != '\0' ) {
+                colon = strchr( line, ':' );
+                if ( colon == NULL )
+                        break;
+                plen = colon - line;
+                column = 0;
+                p = next_token( line );
+                while ( *p != '\0' && *p != '\n' ) {
+                        char *end = p;
+
+                        column++;
+                        while ( *end != '\0' && *end != ' ' && *end != '\n' )
+                                end++;
+                        if ( name_matches( name, line, plen, p, end - p )) {
+                                snprintf( counter->name, SNMP_NAME_LEN, "%.*s.%.*s",
+                                                plen, line, (int)(end - p), p );
+                                counter->file = file;
+                                counter->line = lineno + 1;
+                                counter->column = column;
+                                return 1;
+                        }
+                        p = next_token( p );
+                }
+                line = next_line( line );
+                if ( line != NULL )
+                        line = next_line( line );
+                lineno += 2;
+        }
+        return 0;
+}
+
+/**
+ * Compare the locations of two counters for sorting.
+ */
+static int counter_cmp( const void *a, const void *b )
+{
+        const struct snmp_counter *ca = a, *cb = b;
+
+        if ( ca->file != cb->file )
+                return ca->file - cb->file;
+        if ( ca->line != cb->line )
+                return ca->line - cb->line;
+        return ca->column - cb->column;
+}
+
+/**
+ * @defgroup snmpscout_api Kernel TCP counters
+ *
+ * snmp_stats_init() selects the counters and finds their locations,
+ * read_snmp_stats() updates the values and rates for the selected counters.
+ */
+
+/**
+ * Open the counter files and select the counters to follow.
+ * Names which are not found from the files are ignored with a warning.
+ * @ingroup snmpscout_api
+ * @param names Comma separated list of counter names, NULL for the default
+ * counters (SNMP_DEFAULT_COUNTERS).
+ * @return Pointer to the counters, NULL if none of the counters could be
+ * found.
+ */
+struct snmp_stats *snmp_stats_init( const char *names )
+{
+        struct snmp_stats *stats;
+        char *list, *name, *saveptr;
+        int i, found;
+
+        stats = mem_zalloc( sizeof(*stats));
+        stats->buf = mem_alloc( SNMP_BUF_SIZE );
+        for ( i = 0; i < SNMP_FILES; i++ ) {
+                stats->fds[i] = open( snmp_files[i], O_RDONLY );
+                if ( stats->fds[i] < 0 ) {
+                        WARN( "Unable to open %s: %s\n", snmp_files[i], strerror( errno ));
+                }
+        }
+
+        list = strdup( names != NULL ? names : SNMP_DEFAULT_COUNTERS );
+        for ( name = strtok_r( list, ",", &saveptr ); name != NULL;
+                        name = strtok_r( NULL, ",", &saveptr )) {
+                if ( stats->nr_counters == SNMP_MAX_COUNTERS ) {
+                        WARN( "Too many counters, ignoring %s\n", name );
+                        continue;
+                }
+                found = 0;
+                for ( i = 0; i < SNMP_FILES && ! found; i++ ) {
+                        if ( stats->fds[i] < 0 || read_counter_file( stats, i ) < 0 )
+                                continue;
+                        found = locate_counter( stats, i, name, 
+                                        &stats->counters[stats->nr_counters] );
+                }
+                if ( found ) {
+                        DBG( "Counter %s is on line %d column %d\n", name,
+                                        stats->counters[stats->nr_counters].line,
+                                        stats->counters[stats->nr_counters].column );
+                        stats->nr_counters++;
+                } else {
+                        WARN( "Unknown counter %s\n", name );
+                }
+        }
+        free( list );
+
+        if ( stats->nr_counters == 0 ) {
+                snmp_stats_deinit( stats );
+                return NULL;
+        }
+        qsort( stats->counters, stats->nr_counters, sizeof(struct snmp_counter),
+                        counter_cmp );
+        return stats;
+}
+
+/**
+ * Close the counter files and free the counters.
+ * @ingroup snmpscout_api
+ * @param stats The counters.
+ */
+void snmp_stats_deinit( struct snmp_stats *stats )
+{
+        int i;
+
+        if ( stats == NULL )
+                return;
+        for ( i = 0; i < SNMP_FILES; i++ ) {
+                if ( stats->fds[i] >= 0 )
+                        close( stats->fds[i] );
+        }
+        mem_free( stats->buf );
+        mem_free( stats );
+}
+
+/**
+ * Read new values for the counters and calculate the rates.
+ * Since the counters are sorted by their location, every file is read once
+ * and scanned once from start to the last counter on it.
+ * @ingroup snmpscout_api
+ * @param stats The counters.
+ * @return 0 on success, -1 if some of the files could not be read.
+ */
+int read_snmp_stats( struct snmp_stats *stats )
+{
+        struct snmp_counter *c = stats->counters;
+        struct snmp_counter *last = stats->counters + stats->nr_counters;
+        long start = connection_now_usecs();
+        long elapsed_ms;
+        int file, line, column, rv = 0;
+        uint64_t value;
+        char *p;
+
+        elapsed_ms = ( start / 1000 ) - stats->stamp;
+        while ( c < last ) {
+                file = c->file;
+                if ( read_counter_file( stats, file ) < 0 ) {
+                        rv = -1;
+                        while ( c < last && c->file == file )
+                                c++;
+                        continue;
+                }
+                p = stats->buf;
+                line = 0;
+                column = 0;
+                for ( ; c < last && c->file == file; c++ ) {
+                        while ( p != NULL && line < c->line ) {
+                                p = next_line( p );
+                                line++;
+                                column = 0;
+                        }
+                        while ( p != NULL && column < c->column ) {
+                                p = next_token( p );
+                                column++;
+                        }
+                        if ( p == NULL || *p == '\0' || *p == '\n' ) {
+                                WARN( "Counter %s not found\n", c->name );
+                                continue;
+                        }
+                        value = strtoull( p, NULL, 10 );
+                        if ( stats->reads > 0 ) {
+                                c->delta = value - c->value;
+                                c->rate = elapsed_ms > 0 ? 
+                                        ( c->delta * 1000 ) / elapsed_ms : 0;
+                        }
+                        c->value = value;
+                }
+        }
+        stats->stamp = start / 1000;
+        stats->reads++;
+        stats->read_usecs = connection_now_usecs() - start;
+        return rv;
+}
+
+/**
+ * Write the per second rates of the counters as comma separated values.
+ * Header line with the names of the counters is written on first call, the
+ * values are written once the counters have been read twice.
+ * @ingroup snmpscout_api
+ * @param stats The counters.
+ * @param fp The file to write to.
+ */
+void snmp_stats_export( struct snmp_stats *stats, FILE *fp )
+{
+        int i;
+
+        if ( stats->reads == 1 ) {
+                fprintf( fp, "time" );
+                for ( i = 0; i < stats->nr_counters; i++ )
+                        fprintf( fp, ",%s", stats->counters[i].name );
+                fprintf( fp, "\n" );
+        } else if ( stats->reads > 1 ) {
+                fprintf( fp, "%ld", (long)time( NULL ));
+                for ( i = 0; i < stats->nr_counters; i++ )
+                        fprintf( fp, ",%lu", stats->counters[i].rate );
+                fprintf( fp, "\n" );
+        }
+        fflush( fp );
+}
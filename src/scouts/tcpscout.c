@@ -54,303 +54,155 @@
 #include "connection.h"
 #include "stat.h"
 
-#ifdef ENABLE_FOLLOW_PID
-        #define NROF_WANTED_TOKENS 4
-#else 
-        #define NROF_WANTED_TOKENS 3
-#endif /* ENABLE_FOLLOW_PID */
-
 #define STATFILE "/proc/net/tcp"
 #define STAT6FILE "/proc/net/tcp6"
 
 
 /**
- * Convert a IPv4 address on token read from proc/net/tcp (of format
- * "addr:port" ) to struct sockaddr.
- *
- * @param token Pointer to read token.
- * @param addr_p Pointer to struct sockaddr that should receive the address.
- * @return -1 on error, 0 on success.
- */ 
-        
-static int token_to_addr( struct line_token *token, struct sockaddr_storage *addr_p )
-{
-        char *ptr = strchr( token->token, ':' );
-        char *port; 
-        uint8_t buffer[4];
-        int len;
-        struct sockaddr_in *addrin_p;
-        uint32_t *addr;
-        int rv = 0;
-
-        if ( ptr == NULL ) {
-                WARN( "Not valid ip address and port \n" );
-                return -1;
-        }
-
-        port = ptr + 1;
-        *ptr = '\0';
-
-        addrin_p = (struct sockaddr_in *)addr_p;
-
-        /* XXX len!! */
-        str2bytes( token->token, buffer, &len );
-        addr = (uint32_t *)buffer;
+ * Context passed for the line parsing callbacks.
+ */
+struct tcp_parse_ctx {
+        struct stat_context *ctx; /**< The main context */
+        struct conn_batch *batch; /**< Batch receiving the records */
+};
 
-        addrin_p->sin_addr.s_addr = htonl(*addr);
-        addrin_p->sin_family = AF_INET;
+/**
+ * Batch used for collecting the records read from /proc/net/tcp*.
+ */
+static struct conn_batch tcp_batch;
 
-        addrin_p->sin_port = htons( (uint16_t)strtol( port, NULL, 16 ) );
+/**
+ * One line of /proc/net/tcp or /proc/net/tcp6 decoded by the schema.
+ */
+struct tcp_record {
+        uint8_t laddr[16]; /**< Local address, network byte order */
+        uint8_t raddr[16]; /**< Remote address, network byte order */
+        in_port_t lport; /**< Local port, network byte order */
+        in_port_t rport; /**< Remote port, network byte order */
+        uint8_t state; /**< TCP state */
+#ifdef ENABLE_FOLLOW_PID
+        ino_t inode; /**< Socket inode */
+#endif /* ENABLE_FOLLOW_PID */
+};
 
-        TRACE( "The ip |%s| and port 0x%x/%d \n", inet_ntoa( addrin_p->sin_addr ), addrin_p->sin_port, addrin_p->sin_port );
+/**
+ * The columns read from the TCP stats, @a alen is the length of the
+ * addresses.
+ * The addresses are printed as 32bit words in host byte order, hence they
+ * end up in network byte order when stored as host order words.
+ */
+#ifdef ENABLE_FOLLOW_PID
+#define TCP_SCHEMA_FIELDS( alen ) { \
+        SCHEMA_ADDRPORT( 2, struct tcp_record, laddr, alen, lport ), \
+        SCHEMA_ADDRPORT( 3, struct tcp_record, raddr, alen, rport ), \
+        SCHEMA_FIELD( 4, FIELD_HEX, struct tcp_record, state ), \
+        SCHEMA_FIELD( 10, FIELD_DEC, struct tcp_record, inode ) }
+#else
+#define TCP_SCHEMA_FIELDS( alen ) { \
+        SCHEMA_ADDRPORT( 2, struct tcp_record, laddr, alen, lport ), \
+        SCHEMA_ADDRPORT( 3, struct tcp_record, raddr, alen, rport ), \
+        SCHEMA_FIELD( 4, FIELD_HEX, struct tcp_record, state ) }
+#endif /* ENABLE_FOLLOW_PID */
 
-        return rv;
-}
+/**
+ * Compiled schemas for /proc/net/tcp and /proc/net/tcp6.
+ */
+static struct record_schema tcp_schema, tcp6_schema;
 
 /**
- * Convert a IPv6 address on token read from proc/net/tcp6 (of format
- * <code>addr:port</code> ) to struct sockaddr.
- *
- * @param token Pointer to read token.
- * @param addr_p Pointer to struct sockaddr (really a sockaddr_in6) that should
- * receive the address.
- * @return -1 on error, 0 on success.
+ * Compile the schemas for the TCP stats, if not already compiled.
+ * @return 0 on success, -1 on error.
  */
-static int token_to_addr6( struct line_token *token, struct sockaddr_storage *addr_p )
+static int compile_tcp_schemas( void )
 {
-        char *ptr = strchr( token->token, ':' );
-        char *port;
-        uint8_t buffer[16];
-        int len;
-        struct sockaddr_in6 *addrin_p;
-        int rv = 0;
-        int i;
-        uint32_t *bufp;
-
-        if ( ptr == NULL ) {
-                WARN( "Not valid IPv6 address and port on token\n" );
-                return -1;
-        }
+        const struct schema_field v4_fields[] = TCP_SCHEMA_FIELDS( 4 );
+        const struct schema_field v6_fields[] = TCP_SCHEMA_FIELDS( 16 );
+        int count = sizeof( v4_fields ) / sizeof( v4_fields[0] );
 
-        port = ptr + 1;
-        *ptr = '\0';
+        if ( tcp_schema.nr_ops != 0 )
+                return 0;
 
-        str2bytes( token->token, buffer, &len );
-        if ( len != 16 ) {
-                WARN("Malformed IPv6 address in tcp6 stats\n");
+        if ( schema_compile( &tcp6_schema, v6_fields, count ) != 0 ||
+                        schema_compile( &tcp_schema, v4_fields, count ) != 0 )
                 return -1;
-        }
-
-        /* The IPv6 address in /proc/net/tcp6 is printed as 4 32bit parts, each
-         * part being in host byte order. Hence (for little endian platforms,
-         * anyway) we have to walk through the address in 32bit chunks and
-         * switch their byte order. 
-         */
-        bufp = (uint32_t *)buffer;
-        for ( i = 0; i < 4; i++ ) {
-                *bufp = htonl(*bufp);
-                bufp++;
-        }
 
-        addrin_p = (struct sockaddr_in6 *)addr_p;
-        memcpy( &(addrin_p->sin6_addr.s6_addr), buffer, 16 );
-        addrin_p->sin6_family = AF_INET6;
-        addrin_p->sin6_port = htons( (uint16_t)strtol( port, NULL, 16));
-
-        return rv;
+        return 0;
 }
 
-
-
-
 /** 
- * @brief Parse one line of TCP stats.
- * This is a callback function which is called for each line parsed by
- * parse_file_per_line() when parsing the <code>/proc/net/tcp</code>.
- * A line of information from /proc/net/tcp is parsed and interested components
- * (src and dst addresses and ports, connection state and inode number) are
- * extracted. The connection information is then inserted to system with
- * insert_connection(). 
+ * @brief Parse one line of TCP stats to the batch.
+ * A line of information from /proc/net/tcp or /proc/net/tcp6 is decoded and
+ * interested components (src and dst addresses and ports, connection state
+ * and inode number) are copied to the next free record on the batch. When
+ * the batch is full, the records on it are inserted to the system with
+ * insert_connection_batch(). 
  * 
  * @param line Line read from file. 
- * @param ctx Pointer to the main context.
+ * @param pctx Pointer to the parsing context.
+ * @param family Address family for the addresses on the line.
  */
-static void parse_connection_data( char *line, void *ctx ) 
+static void parse_line_to_batch( char *line, struct tcp_parse_ctx *pctx, 
+                sa_family_t family ) 
 {
-        struct line_token *tokens_p;
-        struct sockaddr_storage local_addr, remote_addr;
-        int state;
-#ifdef ENABLE_FOLLOW_PID
-        int wanted[NROF_WANTED_TOKENS] = { 2,3,4,10 };
-#else
-        int wanted[NROF_WANTED_TOKENS] = { 2,3,4 };
-#endif /* ENABLE_FOLLOW_PID */
-        struct line_token tokens[NROF_WANTED_TOKENS];
-        struct parser_req req = {
-                .interested_tokens = wanted,
-                .interested_size = NROF_WANTED_TOKENS,
-                .tokens = tokens,
-                .token_count = NROF_WANTED_TOKENS
-        };
-#ifdef ENABLE_FOLLOW_PID
-        ino_t inode; 
-#endif /* ENABLE_FOLLOW_PID */
-
-        TRACE("Tokenizing\n" );
-        tokens_p = tokenize( &req, line );
-        TRACE("Done\n");
+        struct conn_batch *batch = pctx->batch;
+        int i = batch->count;
+        struct tcp_record rec;
+        size_t alen = family == AF_INET ? 4 : 16;
 
-        TRACE( "Building connection \n" );
-
-        if ( tokens_p == NULL ) {
-                WARN( "Error in generating interesting tokens \n" );
-                return;
-        } 
-                
-        memset( &local_addr, 0, sizeof( local_addr ) );
-        memset( &remote_addr, 0, sizeof( remote_addr ) );
-
-        TRACE( "token 1:(%d)*%s*\n", tokens_p->token_len, tokens_p->token );
-        TRACE( "Decoding the local address \n" );
-        if ( token_to_addr( tokens_p, &local_addr ) != 0 ) {
+        if ( schema_decode( family == AF_INET ? &tcp_schema : &tcp6_schema,
+                                line, &rec ) != 0 ) {
                WARN( "Error while parsing data, discarding connection! \n" );
                return;
-        } 
-
-        tokens_p = tokens_p->next;
-        TRACE( "token 2:(%d)*%s*\n", tokens_p->token_len, tokens_p->token );
-        TRACE( "Decoding the remote address \n" );
-        if ( token_to_addr( tokens_p, &remote_addr ) != 0 ) {
-               WARN( "Error while parsing data, discarding connection! \n" );
-               return;
-        } 
-
-        tokens_p = tokens_p->next;
-        TRACE( "token 3:(%d)*%s*\n", tokens_p->token_len, tokens_p->token );
-        state = strtol( tokens_p->token, NULL, 16 );
-        TRACE( "State %d \n", state ); 
-
-#ifdef ENABLE_FOLLOW_PID
-        tokens_p = tokens_p->next;
-        TRACE( "token 4:(%d)*%s*\n", tokens_p->token_len, tokens_p->token );
-        inode = strtol( tokens_p->token, NULL, 10 );
-        TRACE( "Inode %d \n", inode );
-#endif /* ENABLE_FOLLOW_PID */
-        
-
-        TRACE("Done\n" );
-        if ( tokens_p->next != NULL ) {
-                WARN( "Eccess elements in token structure \n" );
         }
 
+        batch->family[i] = family;
+        memcpy( batch->laddr[i], rec.laddr, alen );
+        memcpy( batch->raddr[i], rec.raddr, alen );
+        batch->lport[i] = rec.lport;
+        batch->rport[i] = rec.rport;
+        batch->state[i] = rec.state;
 #ifdef ENABLE_FOLLOW_PID
-        insert_connection( &local_addr, &remote_addr, state, inode, (struct stat_context *)ctx );
-#else
-        insert_connection( &local_addr, &remote_addr, state, (struct stat_context *)ctx );
+        batch->inode[i] = rec.inode;
 #endif /* ENABLE_FOLLOW_PID */
+        TRACE( "State %d \n", batch->state[i] ); 
+
+        batch->count++;
+        if ( batch->count == CONN_BATCH_SIZE ) 
+                insert_connection_batch( batch, pctx->ctx );
+}
 
+/** 
+ * @brief Parse one line of TCP stats.
+ * This is a callback function which is called for each line parsed by
+ * parse_file_per_line() when parsing the <code>/proc/net/tcp</code>.
+ * @see parse_line_to_batch()
+ * 
+ * @param line Line read from file. 
+ * @param ctx Pointer to the parsing context.
+ */
+static void parse_connection_data( char *line, void *ctx ) 
+{
+        parse_line_to_batch( line, (struct tcp_parse_ctx *)ctx, AF_INET );
 }
 
 /** 
  * @brief Parse one line of TCP stats.
  * This is a callback function which is called for each line parsed by
  * parse_file_per_line() when parsing the <code>/proc/net/tcp6</code>.
- * A line of information from /proc/net/tcp6 is parsed and interested components
- * (src and dst addresses and ports, connection state and inode number) are
- * extracted. The connection information is then inserted to system with
- * insert_connection(). 
+ * @see parse_line_to_batch()
  * 
  * @param line Line read from file. 
- * @param ctx Pointer to the main context.
+ * @param ctx Pointer to the parsing context.
  */
 static void parse_connection6_data( char *line, void *ctx ) 
 {
-        struct line_token *tokens_p;
-        struct sockaddr_storage local_addr, remote_addr;
-        int state;
-#ifdef ENABLE_FOLLOW_PID
-        int wanted[NROF_WANTED_TOKENS] = { 2,3,4,10 };
-#else
-        int wanted[NROF_WANTED_TOKENS] = { 2,3,4};
-#endif /* ENABLE_FOLLOW_PID */
-        struct line_token tokens[NROF_WANTED_TOKENS];
-        struct parser_req req = {
-                .interested_tokens = wanted,
-                .interested_size = NROF_WANTED_TOKENS,
-                .tokens = tokens,
-                .token_count = NROF_WANTED_TOKENS
-        };
-#ifdef ENABLE_FOLLOW_PID 
-        ino_t inode; 
-#endif /* ENABLE_FOLLOW_PID */
-        char addrbuf[INET6_ADDRSTRLEN];
-
-        TRACE("Tokenizing\n" );
-        tokens_p = tokenize( &req, line );
-        TRACE("Done\n");
-
-        TRACE( "Building connection \n" );
-
-        if ( tokens_p == NULL ) {
-                WARN( "Error in generating interesting tokens \n" );
-                return;
-        } 
-                
-        memset( &local_addr, 0, sizeof( local_addr ) );
-        memset( &remote_addr, 0, sizeof( local_addr ) );
-
-        TRACE( "token 1:(%d)*%s*\n", tokens_p->token_len, tokens_p->token );
-        TRACE( "Decoding the local address \n" );
-        if ( token_to_addr6( tokens_p, (struct sockaddr_storage *)&local_addr ) != 0 ) {
-               WARN( "Error while parsing data, discarding connection! \n" );
-               return;
-        } 
-
-        tokens_p = tokens_p->next;
-        TRACE( "token 2:(%d)*%s*\n", tokens_p->token_len, tokens_p->token );
-        TRACE( "Decoding the remote address \n" );
-        if ( token_to_addr6( tokens_p, (struct sockaddr_storage *)&remote_addr ) != 0 ) {
-               WARN( "Error while parsing data, discarding connection! \n" );
-               return;
-        } 
-
-        tokens_p = tokens_p->next;
-        TRACE( "token 3:(%d)*%s*\n", tokens_p->token_len, tokens_p->token );
-        state = strtol( tokens_p->token, NULL, 16 );
-        TRACE( "State %d \n", state ); 
-
-#ifdef ENABLE_FOLLOW_PID
-        tokens_p = tokens_p->next;
-        TRACE( "token 4:(%d)*%s*\n", tokens_p->token_len, tokens_p->token );
-        inode = strtol( tokens_p->token, NULL, 10 );
-        TRACE( "Inode %d \n", inode );
-#endif /* ENABLE_FOLLOW_PID */
-        
-
-        TRACE("Done\n" );
-        if ( tokens_p->next != NULL ) {
-                WARN( "Eccess elements in token structure \n" );
-        }
-
-        inet_ntop( local_addr.ss_family,
-                        ss_get_addr6( &local_addr ),addrbuf, INET6_ADDRSTRLEN );
-        DBG( "Read local IPV6 address %s \n", addrbuf );
-        inet_ntop( remote_addr.ss_family,
-                        ss_get_addr6( &remote_addr ), addrbuf, INET6_ADDRSTRLEN );
-        DBG( "Read remote IPV6 address %s \n", addrbuf );
-
-
-#ifdef ENABLE_FOLLOW_PID
-        insert_connection( &local_addr, &remote_addr, state, inode, (struct stat_context *)ctx );
-#else
-        insert_connection( &local_addr, &remote_addr, state, (struct stat_context *)ctx );
-#endif /* ENABLE_FOLLOW_PID */
-
+        parse_line_to_batch( line, (struct tcp_parse_ctx *)ctx, AF_INET6 );
 }
 
 /** 
  * @brief Read TCP stats from /proc/net/tcp.
- * TCP stats are read and parsed. The detected connections are inserted.
+ * TCP stats are read and parsed. The detected connections are inserted in
+ * batches.
  *
  * Parses both ipv4 and ipv6 stats (if enabled).
  * 
@@ -361,14 +213,27 @@ static void parse_connection6_data( char *line, void *ctx )
 int read_tcp_stat( struct stat_context *ctx )
 {
         int ret = -1;
+        struct tcp_parse_ctx pctx = {
+                .ctx = ctx,
+                .batch = &tcp_batch
+        };
+
+        if ( compile_tcp_schemas() != 0 )
+                return -1;
+
+        tcp_batch.count = 0;
         if (ctx->collected_stats != STAT_V4_ONLY) {
                 ret = parse_file_per_line(STAT6FILE,1,parse_connection6_data,
-                                ctx);
+                                &pctx);
                 if (ret == -1)
                         return ret;
         }
         if (ctx->collected_stats != STAT_V6_ONLY)
-                ret = parse_file_per_line( STATFILE, 1, parse_connection_data, ctx );
+                ret = parse_file_per_line( STATFILE, 1, parse_connection_data, &pctx );
+
+        /* Insert the records left on batch */
+        if ( tcp_batch.count > 0 )
+                insert_connection_batch( &tcp_batch, ctx );
 
         return ret;
 }
@@ -53,7 +53,15 @@
 #include "parser.h"
 #include "connection.h"
 #include "stat.h"
+#include "cloud.h"
+#include "groupkey.h"
+#include "portmon.h"
+#include "lbstat.h"
+#include "overflow.h"
+#include "arena.h"
 #include "scouts.h"
+#include "bulk.h"
+#include "libtcpstat.h"
 
 /*#define LINELEN 160 */
 
@@ -92,11 +100,21 @@ void resolve_route_for_connection( struct stat_context *ctx,
 }
 #endif /* ENABLE_ROUTES */
 
+static int update_connection( struct tcp_connection *conn_p, 
+                struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr,
+                enum tcp_state state, uint64_t stamp,
+#ifdef ENABLE_FOLLOW_PID
+                ino_t inode,
+#endif /* ENABLE_FOLLOW_PID */
+                struct stat_context *ctx );
+
 /** 
  * @brief Add new connection to system.
  * Metadata information is filled and the new connection is added to the
  * hashtable. If the connection is not in LISTEN state, it is also added to the
- * new queue for rotating. 
+ * new queue for rotating. While loading the initial snapshot (ctx->bulk), the
+ * interface and route for connections added to the new queue are left to be
+ * set when the queue is rotated.
  *
  * @note If @a info_p is not NULL, then connection is added to the group found on the
  * structure. Also listening connections. 
@@ -117,16 +135,34 @@ static void insert_new_connection( struct tcp_connection *conn_p,
 #ifdef ENABLE_FOLLOW_PID
         conn_p->metadata.inode = inode;
 #endif /* ENABLE_FOLLOW_PID */
-        conn_p->metadata.ifname = ifname_for_addr( ctx->iftab, &(conn_p->laddr) );
+        if ( ! ctx->bulk || conn_p->state == TCP_LISTEN ||
+#ifdef ENABLE_FOLLOW_PID
+                        info_p != NULL ||
+#endif /* ENABLE_FOLLOW_PID */
+                        metadata_is_ignored( conn_p->metadata )) {
+                conn_p->metadata.ifname = ifname_for_addr( ctx->iftab, &(conn_p->laddr) );
 #ifdef ENABLE_ROUTES 
-        resolve_route_for_connection( ctx, conn_p );
+                resolve_route_for_connection( ctx, conn_p );
 #endif /* ENABLE_ROUTES */
+        } 
+        /* else connection goes to the new queue, interface and route are set
+         * for all of them with bulk_attribute() */
+
+#ifdef ENABLE_CONNTRACK
+        if ( ctx->ct != NULL )
+                ct_annotate( ctx->ct, conn_p );
+#endif /* ENABLE_CONNTRACK */
 
         /* Put the connection to hashtable */
         chash_put(ctx->chash, conn_p );
+#ifdef ENABLE_PORT_MONITOR
+        if ( ctx->ports != NULL )
+                portmon_add( ctx->ports, conn_p );
+#endif /* ENABLE_PORT_MONITOR */
 
         if ( metadata_is_ignored( conn_p->metadata ) )
                 return;
+        TCPSTAT_EMIT( ctx, TCPSTAT_EV_NEW, conn_p, NULL );
 
 #ifdef ENABLE_FOLLOW_PID
         if ( info_p != NULL ) {
@@ -134,6 +170,7 @@ static void insert_new_connection( struct tcp_connection *conn_p,
                  * pushing it to newq. Also connections on LISTEN state will be
                  * added to it.
                  */
+                conn_p->metadata.pid = info_p->pid;
                 group_add_connection(info_p->grp, conn_p);
                 return;
         }
@@ -156,6 +193,32 @@ static void insert_new_connection( struct tcp_connection *conn_p,
 }
 
                         
+/**
+ * @brief Check if connection is on the sampled slice of connections.
+ *
+ * Connection is sampled if its hash falls to the first 1/sample_rate slice of
+ * the hash values, hence the same connections are sampled on every round.
+ * The hash is mixed once more since the hashtable uses its low bits for the
+ * bucket and high bits for the tags. Listening sockets are always sampled,
+ * they are needed for telling the incoming connections apart.
+ *
+ * @param ctx Pointer to the global context.
+ * @param hash Hash for the connection (from conn_key_hash()).
+ * @param state State of the connection.
+ *
+ * @return non-zero if the connection is sampled.
+ */
+static inline int is_sampled( struct stat_context *ctx, uint32_t hash,
+                enum tcp_state state )
+{
+        if ( state == TCP_LISTEN ) 
+                return 1;
+        hash ^= hash >> 15;
+        hash *= 0x2c1b3c6d;
+        hash ^= hash >> 12;
+        return hash % ctx->sample_rate == 0;
+}
+
 /** 
  * @brief Insert a connection with given properties to the system. 
  * The connection can be new, just found, or old one that has been detected
@@ -180,6 +243,189 @@ int insert_connection( struct sockaddr_storage *local_addr, struct sockaddr_stor
                 ino_t inode,
 #endif /* ENABLE_FOLLOW_PID */
                 struct stat_context *ctx )
+{
+        struct tcp_connection *conn_p;
+        struct conn_key key;
+        uint32_t hash;
+
+        conn_key_from_ss( &key, local_addr, remote_addr );
+        hash = conn_key_hash( &key );
+        if ( SAMPLING( ctx ) && ! is_sampled( ctx, hash, state ) ) {
+                ctx->unsampled_count++;
+                return 0;
+        }
+        conn_p = chash_get_key( ctx->chash, &key, hash );
+
+#ifdef ENABLE_FOLLOW_PID
+        return update_connection( conn_p, local_addr, remote_addr, state, 0, inode, ctx );
+#else
+        return update_connection( conn_p, local_addr, remote_addr, state, 0, ctx );
+#endif /* ENABLE_FOLLOW_PID */
+}
+
+/**
+ * Number of records to look ahead when prefetching the connections on batch.
+ */
+#define BATCH_PREFETCH_DISTANCE 4
+
+/** 
+ * @brief Get the addresses for given record on batch. 
+ * 
+ * @param batch Pointer to the batch.
+ * @param i Index of the record.
+ * @param local_addr Pointer to the structure which receives the local address.
+ * @param remote_addr Pointer to the structure which receives the remote address.
+ */
+static void batch_get_addrs( struct conn_batch *batch, int i, 
+                struct sockaddr_storage *local_addr, 
+                struct sockaddr_storage *remote_addr )
+{
+        memset( local_addr, 0, sizeof( *local_addr ) );
+        memset( remote_addr, 0, sizeof( *remote_addr ) );
+
+        local_addr->ss_family = batch->family[i];
+        remote_addr->ss_family = batch->family[i];
+        if ( batch->family[i] == AF_INET ) {
+                memcpy( ss_get_addr( local_addr ), batch->laddr[i], 4 );
+                memcpy( ss_get_addr( remote_addr ), batch->raddr[i], 4 );
+        } else {
+                memcpy( ss_get_addr6( local_addr ), batch->laddr[i], 16 );
+                memcpy( ss_get_addr6( remote_addr ), batch->raddr[i], 16 );
+        }
+        ss_set_port( local_addr, batch->lport[i] );
+        ss_set_port( remote_addr, batch->rport[i] );
+}
+
+/** 
+ * @brief Insert all connections on batch to the system.
+ *
+ * The records are processed in stages: first the keys and hash values for
+ * all records are calculated and the hashtable buckets prefetched, then the
+ * connections are looked up and updated as with insert_connection(). While
+ * one record is being updated, the keys of the connections for a record a
+ * few steps ahead are being fetched to cache. When sampling, the records not
+ * sampled are dropped on the first stage.
+ *
+ * The batch is empty after this call.
+ *
+ * @see insert_connection()
+ * 
+ * @param batch Pointer to the batch holding the records.
+ * @param ctx Pointer to the global context.
+ * 
+ * @return always 0.
+ */
+int insert_connection_batch( struct conn_batch *batch, struct stat_context *ctx )
+{
+        struct sockaddr_storage local_addr, remote_addr;
+        struct sockaddr_storage *laddr_p, *raddr_p;
+        struct tcp_connection *conn_p;
+        int idx[CONN_BATCH_SIZE]; /* Indexes of the sampled records */
+        int i, j, cnt = 0;
+
+        for ( i = 0; i < batch->count; i++ ) {
+                conn_key_set( &batch->key[i], batch->family[i], 
+                                batch->laddr[i], batch->raddr[i], 
+                                batch->lport[i], batch->rport[i] );
+                batch->hash[i] = conn_key_hash( &batch->key[i] );
+                if ( SAMPLING( ctx ) && 
+                                ! is_sampled( ctx, batch->hash[i], batch->state[i] )) {
+                        ctx->unsampled_count++;
+                        continue;
+                }
+                chash_prefetch_bucket( ctx->chash, batch->hash[i] );
+                idx[cnt++] = i;
+        }
+
+        for ( j = 0; j < cnt && j < BATCH_PREFETCH_DISTANCE; j++ ) 
+                chash_prefetch_key( ctx->chash, batch->hash[idx[j]] );
+
+        for ( j = 0; j < cnt; j++ ) {
+                i = idx[j];
+                if ( j + BATCH_PREFETCH_DISTANCE < cnt ) 
+                        chash_prefetch_key( ctx->chash, 
+                                        batch->hash[idx[j + BATCH_PREFETCH_DISTANCE]] );
+
+                conn_p = chash_get_key( ctx->chash, &batch->key[i], 
+                                batch->hash[i] );
+                /* Addresses are only needed for new connections */
+                laddr_p = NULL;
+                raddr_p = NULL;
+                if ( conn_p == NULL ) {
+                        batch_get_addrs( batch, i, &local_addr, &remote_addr );
+                        laddr_p = &local_addr;
+                        raddr_p = &remote_addr;
+                }
+#ifdef ENABLE_FOLLOW_PID
+                update_connection( conn_p, laddr_p, raddr_p, 
+                                batch->state[i], batch->stamp[i], 
+                                batch->inode[i], ctx );
+#else
+                update_connection( conn_p, laddr_p, raddr_p, 
+                                batch->state[i], batch->stamp[i], ctx );
+#endif /* ENABLE_FOLLOW_PID */
+        }
+        batch->count = 0;
+
+        return 0;
+}
+
+/** 
+ * @brief Take connection out of its group to be grouped again.
+ * The connection is removed from its group and put to the new queue if the
+ * group is formed by any of the given policy flags, e.g. after the state or
+ * the real peer of the connection has changed.
+ * 
+ * @param ctx Pointer to the global context.
+ * @param conn_p The connection.
+ * @param policy The policy flags the changed information is grouped by.
+ * 
+ * @return non-zero if the connection was taken out of its group.
+ */
+int regroup_connection( struct stat_context *ctx, struct tcp_connection *conn_p,
+                policy_flags_t policy )
+{
+        struct group *grp = conn_p->group;
+
+        if ( grp == NULL || ! ( ( group_get_policy( grp ) & policy ) ||
+                                ( ( grp->flags & GROUP_F_OVERFLOW ) && 
+                                  ( ctx->ovf->policy & policy ))))
+                return 0;
+        if ( grp->flags & GROUP_F_OVERFLOW ) 
+                overflow_forget( ctx->ovf, conn_p );
+        group_remove_connection( grp, conn_p );
+        /* It will be added to proper group via newq. */
+        cqueue_push( ctx->newq, conn_p );
+        return 1;
+}
+
+/** 
+ * @brief Update the information for connection found from /proc (or
+ * equivalent).
+ * If @a conn_p is NULL, the connection is new and it is added to the system.
+ * Otherwise the state of the existing connection is updated. 
+ *
+ * @see insert_connection()
+ * 
+ * @param conn_p Pointer to the connection on hashtable, NULL if the connection
+ * is not on the hashtable.
+ * @param local_addr Local address for the connection, only used (and may be
+ * NULL otherwise) when @a conn_p is NULL.
+ * @param remote_addr Remote address for the connection, as @a local_addr.
+ * @param state State of the connection.
+ * @param stamp Time the connection was seen in this state (ms), 0 for now.
+ * @param inode Inode for the socket allocated for this connection. 
+ * @param ctx Context holding the tables etc. 
+ * 
+ * @return always 0.
+ */
+static int update_connection( struct tcp_connection *conn_p, 
+                struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr,
+                enum tcp_state state, uint64_t stamp,
+#ifdef ENABLE_FOLLOW_PID
+                ino_t inode,
+#endif /* ENABLE_FOLLOW_PID */
+                struct stat_context *ctx )
 {
         struct group *grp;
 #ifdef ENABLE_FOLLOW_PID
@@ -187,12 +433,10 @@ int insert_connection( struct sockaddr_storage *local_addr, struct sockaddr_stor
 #endif /* ENABLE_FOLLOW_PID */
         struct filter *filt;
 
-        struct tcp_connection *conn_p = chash_get(ctx->chash, local_addr, remote_addr );
-        
         if ( conn_p == NULL ) {
 #ifdef ENABLE_FOLLOW_PID
                 if ( OPERATION_ENABLED(ctx,OP_FOLLOW_PID) ) {
-                        info_p = get_pidinfo_by_inode( inode, ctx->pinfo );
+                        info_p = get_pidinfo_by_inode( inode, ctx->pscan );
                         if (info_p == NULL ) {
                                 /* Does not belong to process we are following. */
                                 TRACE( "Discarding connection since inode doesn't match!\n" );
@@ -205,7 +449,16 @@ int insert_connection( struct sockaddr_storage *local_addr, struct sockaddr_stor
                         
                 ctx->new_count++;
                 conn_p = connection_init(local_addr, remote_addr, state);
+                if ( stamp != 0 ) {
+                        conn_p->metadata.added = stamp / 1000;
+                        conn_p->metadata.state_since = stamp;
+                }
 
+                /* Filters looking at the interface need it before
+                 * the connection is inserted */
+                if ( ctx->filters->fields & POLICY_IF ) 
+                        conn_p->metadata.ifname = ifname_for_addr( ctx->iftab, 
+                                        &(conn_p->laddr) );
                 filt = filtlist_match( ctx->filters, conn_p );
                 if ( filt != NULL ) {
                         if ( filt->action == FILTERACT_IGNORE ) {
@@ -238,18 +491,17 @@ int insert_connection( struct sockaddr_storage *local_addr, struct sockaddr_stor
                 if ( conn_p->state != state ) {
                         grp = conn_p->group;
                         DBG( "State changed %d -> %d \n", conn_p->state, state );
-                        conn_p->state = state;
-                        metadata_set_flag( conn_p->metadata, METADATA_STATE_CHANGED );
-                        if ( grp && ( group_get_policy( grp ) & POLICY_STATE ) ) {
-                                /* The connection belongs to group
-                                 * which is grouped by state, we need
-                                 * to take the connection out from the
-                                 * group
-                                 */
-                                group_remove_connection( grp, conn_p );
-                                /* It will be added to proper group via newq. */
-                                cqueue_push( ctx->newq, conn_p );
-                        }
+                        if ( stamp == 0 ) 
+                                stamp = connection_time_ms();
+                        connection_set_state( conn_p, state, stamp );
+                        TCPSTAT_EMIT( ctx, TCPSTAT_EV_STATE, conn_p, NULL );
+                        if ( grp ) 
+                                grp->active = stamp;
+                        /* The connection belongs to group which is grouped
+                         * by state, we need to take the connection out from
+                         * the group
+                         */
+                        regroup_connection( ctx, conn_p, POLICY_STATE );
                 }
         }  
         ctx->total_count++;
@@ -275,6 +527,9 @@ static int iterate_glist_with_connection( struct glist *list_p, struct tcp_conne
         int found = 0; /* Set to 1 if found a matching group */
 
         glist_foreach_group( list_p, grp_p ) {
+                /* Overflow group has no selectors, it would match anything */
+                if ( grp_p->flags & GROUP_F_OVERFLOW ) 
+                        continue;
                 if ( group_match_and_add( grp_p, con_p ) == 1 ) {
                         found = 1;
                         TRACE( "Found match!\n" );
@@ -285,12 +540,44 @@ static int iterate_glist_with_connection( struct glist *list_p, struct tcp_conne
         return found;
 }
 
+#ifdef ENABLE_FOLLOW_PID
+/** 
+ * @brief Find the processes owning the sockets for new connections.
+ *
+ * The sockets of all processes are scanned and the PID is set to the
+ * metadata of every connection on newqueue whose owner is not yet known. 
+ * Only done when grouping by key containing the PID, since scanning all the
+ * processes is not cheap.
+ * 
+ * @param ctx Pointer to the global context.
+ */
+static void resolve_socket_owners( struct stat_context *ctx )
+{
+        struct pidinfo *list, *info_p;
+        struct tcp_connection *conn_p;
+
+        if ( ctx->pscan == NULL ) 
+                ctx->pscan = pid_scanner_init( ctx->pid_workers );
+
+        list = scan_all_processes( ctx->pscan );
+        for ( conn_p = cqueue_get_head( ctx->newq ); conn_p != NULL; 
+                        conn_p = conn_p->next ) {
+                if ( conn_p->metadata.pid != 0 ) 
+                        continue;
+                info_p = get_pidinfo_by_inode( conn_p->metadata.inode, ctx->pscan );
+                if ( info_p != NULL ) 
+                        conn_p->metadata.pid = info_p->pid;
+        }
+        free_all_processes( list, ctx->pscan );
+}
+#endif /* ENABLE_FOLLOW_PID */
 
 /** 
  * @brief Go through all connection on newqueue and add them to proper groups. 
  * All connections are either added to groups with matching selectors or new
  * group for the connection is created. First all listen groups are iterated,
  * if no match is found it is assumed that the connection is outbound. 
+ * Large queues (initial snapshot) are rotated with bulk_rotate() when possible.
  * 
  * @param ctx Pointer to the context holding the newqueue and the grouplists.  
  */
@@ -300,6 +587,16 @@ void rotate_new_queue( struct stat_context *ctx )
         struct group *grp_p;
         struct filter *filt;
 
+#ifdef ENABLE_FOLLOW_PID
+        if ( ( ctx->common_policy & POLICY_KEY ) && 
+                        gkey_plan_has_field( ctx->gkey, GKEY_PID ) &&
+                        ! OPERATION_ENABLED( ctx, OP_FOLLOW_PID ) &&
+                        cqueue_get_size( ctx->newq ) > 0 ) 
+                resolve_socket_owners( ctx );
+#endif /* ENABLE_FOLLOW_PID */
+        if ( bulk_rotate( ctx ) ) 
+                return;
+
         con_p = cqueue_pop( ctx->newq );
         while ( con_p != NULL ) {
 
@@ -309,6 +606,11 @@ void rotate_new_queue( struct stat_context *ctx )
                 TRACE( "Iterating listen_groups \n" );
                 if ( iterate_glist_with_connection( ctx->listen_groups, con_p ) ) {
                         con_p->metadata.dir = DIR_INBOUND;
+#ifdef ENABLE_PORT_MONITOR
+                        /* Local port is the listening port, not ephemeral */
+                        if ( ctx->ports != NULL )
+                                portmon_remove( ctx->ports, con_p );
+#endif /* ENABLE_PORT_MONITOR */
                         con_p = cqueue_pop( ctx->newq );
                         continue;
                 }
@@ -318,23 +620,63 @@ void rotate_new_queue( struct stat_context *ctx )
                  * XXX: Not 100% accurate.
                  */ 
                 con_p->metadata.dir = DIR_OUTBOUND;
-                TRACE( "Iterating outgoing groups \n" );
-                if ( iterate_glist_with_connection( ctx->out_groups, con_p ) ) {
-                        con_p = cqueue_pop( ctx->newq );
-                        continue;
+                if ( ctx->lb != NULL )
+                        lb_add( ctx->lb, con_p );
+                if ( ctx->common_policy & POLICY_CLOUD ) {
+                        /* Related connections are looked up from the index
+                         * instead of matching each group filter.
+                         */
+                        if ( ctx->clouds == NULL ) 
+                                ctx->clouds = cloud_index_init( ctx->cloud_window,
+                                                ctx->common_policy );
+                        grp_p = cloud_index_find( ctx->clouds, con_p );
+                        if ( grp_p != NULL ) {
+                                group_add_connection( grp_p, con_p );
+                                con_p = cqueue_pop( ctx->newq );
+                                continue;
+                        }
+                } else if ( ctx->common_policy & POLICY_KEY ) {
+                        if ( ctx->gkeys == NULL ) 
+                                ctx->gkeys = gkey_index_init( ctx->gkey );
+                        grp_p = gkey_index_find( ctx->gkeys, con_p );
+                        if ( grp_p != NULL ) {
+                                group_add_connection( grp_p, con_p );
+                                con_p = cqueue_pop( ctx->newq );
+                                continue;
+                        }
+                } else {
+                        TRACE( "Iterating outgoing groups \n" );
+                        if ( iterate_glist_with_connection( ctx->out_groups, con_p ) ) {
+                                con_p = cqueue_pop( ctx->newq );
+                                continue;
+                        }
+                        TRACE( "Done\n" );
                 }
-                TRACE( "Done\n" );
 
                /* No match for any groups we have, create a new group for this
                 * connection 
                 */ 
                 TRACE( "Generating new group for the connection \n" );
+                if ( ctx->max_groups > 0 ) {
+                        if ( ctx->ovf == NULL ) 
+                                ctx->ovf = overflow_init( ctx->max_groups,
+                                                ctx->common_policy, ctx->gkey );
+                        overflow_make_room( ctx->ovf, ctx->out_groups, ctx->scratch );
+                }
                 grp_p = group_init();
                 filt = filter_from_connection( con_p, ctx->common_policy, FILTERACT_GROUP );
                 group_set_filter( grp_p, filt );
                 group_add_connection( grp_p, con_p );
+                if ( ctx->common_policy & POLICY_CLOUD ) {
+                        filt->cloud_window = ctx->clouds->window;
+                        cloud_index_add( ctx->clouds, grp_p, con_p );
+                } else if ( ctx->common_policy & POLICY_KEY ) {
+                        gkey_index_add( ctx->gkeys, grp_p, con_p );
+                }
 
                 glist_add( ctx->out_groups, grp_p );
+                if ( ctx->ovf != NULL ) 
+                        overflow_promote( ctx->ovf, grp_p, con_p );
                 con_p = cqueue_pop( ctx->newq );
 
         }
@@ -360,6 +702,7 @@ static int do_lingering( struct tcp_connection *con_p )
                 DBG( "Starting to linger connection\n" );
                 con_p->metadata.linger_secs = now + LINGER_MAX_TIME;
                 con_p->state = TCP_DEAD;
+                metadata_touch( con_p->metadata );
         } else {
                 if ( con_p->metadata.linger_secs < now ){
                         rv = 1;
@@ -377,23 +720,33 @@ static int do_lingering( struct tcp_connection *con_p )
  * update) from given group. 
  * @note The connections removed are also deleted.
  *
- * @param table_p Pointer to hashtable from where the connection should also be
- * deleted (NULL if connection should not be deleted from any hashtable ).
+ * @param ctx Pointer to the main context, the connections are also deleted
+ * from the hashtable on it.
  * @param grp Pointer to group from where the closed connections are searched.
  * @param do_linger nonzero if dead connections should be lingered. 
  * 
  * @return Number of connections removed or lingering.
  */
-static int purge_closed_from_group( struct chashtable *table_p, struct group *grp,
+static int purge_closed_from_group( struct stat_context *ctx, struct group *grp,
                int do_linger )
 { 
 
         int cnt = 0;
+        uint64_t now = connection_time_ms();
         struct tcp_connection *con_p = group_get_first_conn( grp );
         /* Iterate though all connections */
         while ( con_p != NULL ) {
                 if ( ! metadata_is_touched( con_p->metadata ) ) {
                         cnt++; 
+                        if ( con_p->state != TCP_DEAD )
+                                connection_end_state( con_p, now );
+#ifdef ENABLE_PORT_MONITOR
+                        /* The local port is free, also when lingering */
+                        if ( ctx->ports != NULL )
+                                portmon_remove( ctx->ports, con_p );
+#endif /* ENABLE_PORT_MONITOR */
+                        if ( ctx->lb != NULL )
+                                lb_remove( ctx->lb, con_p );
                         if ( do_linger && !do_lingering( con_p ) ) {
                                 con_p = con_p->next;
                                 continue;
@@ -406,10 +759,15 @@ static int purge_closed_from_group( struct chashtable *table_p, struct group *gr
                          */
                         tmp_con = con_p->next;
 
+                        if ( grp->flags & GROUP_F_OVERFLOW ) 
+                                overflow_forget( ctx->ovf, con_p );
                         group_remove_connection( grp, con_p );
-                        if ( table_p != NULL ) {
-                                chash_remove_connection(table_p, con_p );
-                        }
+                        chash_remove_connection( ctx->chash, con_p );
+#ifdef ENABLE_CONNTRACK
+                        if ( ctx->ct != NULL )
+                                ct_forget( ctx->ct, con_p );
+#endif /* ENABLE_CONNTRACK */
+                        TCPSTAT_EMIT( ctx, TCPSTAT_EV_CLOSED, con_p, NULL );
                         connection_deinit( con_p );
                         con_p = tmp_con;
                 } else {
@@ -425,7 +783,8 @@ static int purge_closed_from_group( struct chashtable *table_p, struct group *gr
  *
  * All groups (listen and outgoing) are looked and all connections whose
  * metadata has not been touched will be deleted. Groups who lose all
- * connections will be deleted. 
+ * connections will be removed from the lists, they are freed with
+ * glist_reclaim() once per round.
  * 
  * @param ctx Pointer to the main context.
  * @param closed_cnt Number of closed connections.
@@ -445,7 +804,7 @@ int purge_closed_connections( struct stat_context *ctx, int closed_cnt )
         /* first, lets see if there are any on filtered connections */
         filtlist_foreach_filter( ctx->filters, filt ) {
                 closed_cnt = closed_cnt - purge_closed_from_group(
-                                ctx->chash, filt->group, 
+                                ctx, filt->group, 
                                 OPERATION_ENABLED(ctx,OP_LINGER) );
         }
 
@@ -457,7 +816,7 @@ int purge_closed_connections( struct stat_context *ctx, int closed_cnt )
                 info_p = ctx->pinfo;
                 while (info_p != NULL && closed_cnt > 0) {
                         closed_cnt = closed_cnt - purge_closed_from_group(
-                                        ctx->chash, info_p->grp, 
+                                        ctx, info_p->grp, 
                                         OPERATION_ENABLED(ctx,OP_LINGER) );
                         info_p = info_p->next;
                 }
@@ -467,8 +826,11 @@ int purge_closed_connections( struct stat_context *ctx, int closed_cnt )
          
         grp = glist_get_head( ctx->out_groups );
         while ( grp != NULL  && closed_cnt > 0 ) {
-                closed_cnt = closed_cnt - purge_closed_from_group(ctx->chash, 
+                closed_cnt = closed_cnt - purge_closed_from_group( ctx, 
                                 grp, OPERATION_ENABLED(ctx,OP_LINGER) );
+                if ( ctx->ovf != NULL && grp == ctx->ovf->grp && 
+                                group_get_size( grp ) == 0 ) 
+                        ctx->ovf->grp = NULL;
                 grp = glist_delete_grp_if_empty(ctx->out_groups, grp );
         }
 
@@ -480,10 +842,15 @@ int purge_closed_connections( struct stat_context *ctx, int closed_cnt )
                         DBG( "Purging listening parent! {%p} \n", con_p );
                         grp->parent = NULL;
                         chash_remove_connection(ctx->chash, con_p );
+#ifdef ENABLE_CONNTRACK
+                        if ( ctx->ct != NULL )
+                                ct_forget( ctx->ct, con_p );
+#endif /* ENABLE_CONNTRACK */
+                        TCPSTAT_EMIT( ctx, TCPSTAT_EV_CLOSED, con_p, NULL );
                         connection_deinit( con_p );
                         closed_cnt--;
                 }
-                closed_cnt = closed_cnt - purge_closed_from_group(ctx->chash, 
+                closed_cnt = closed_cnt - purge_closed_from_group( ctx, 
                                 grp, OPERATION_ENABLED(ctx,OP_LINGER) );
                 grp = glist_delete_grp_if_empty(ctx->listen_groups, grp );
         }
@@ -492,6 +859,45 @@ int purge_closed_connections( struct stat_context *ctx, int closed_cnt )
         return closed_cnt;
 }
 
+static int compare_added( const void *a, const void *b )
+{
+        const struct tcp_connection *c1 = *(struct tcp_connection * const *)a;
+        const struct tcp_connection *c2 = *(struct tcp_connection * const *)b;
+
+        if ( c1->metadata.added < c2->metadata.added ) 
+                return -1;
+        return c1->metadata.added > c2->metadata.added;
+}
+
+/** 
+ * @brief Sort the connections on queue by the time they were added.
+ *
+ * After sorting the oldest connection is the first one popped from the
+ * queue. Related connections are grouped around the first connection seen,
+ * hence when regrouping the connections have to be rotated in the order they
+ * were seen.
+ * 
+ * @param queue_p The queue to sort.
+ * @param scratch Arena for the memory needed while sorting.
+ */
+static void sort_queue_by_added( struct cqueue *queue_p, struct arena *scratch )
+{
+        struct tcp_connection **conns;
+        int i, cnt;
+
+        cnt = cqueue_get_size( queue_p );
+        if ( cnt < 2 ) 
+                return;
+
+        conns = arena_alloc( scratch, cnt * sizeof( *conns ));
+        for ( i = 0; i < cnt; i++ ) 
+                conns[i] = cqueue_pop( queue_p );
+        qsort( conns, cnt, sizeof( *conns ), compare_added );
+        /* Queue is LIFO, push the newest first */
+        for ( i = cnt - 1; i >= 0; i-- ) 
+                cqueue_push( queue_p, conns[i] );
+}
+
 /** 
  * @brief Switch the common grouping policy of outgoing connections. 
  *
@@ -537,9 +943,21 @@ void switch_grouping( struct stat_context *ctx, policy_flags_t new_grouping )
 #endif /* DEBUG */
 
         glist_deinit( ctx->out_groups,0 );
+        if ( ctx->clouds != NULL ) {
+                /* Groups removed themselves from the index when deleted */
+                cloud_index_deinit( ctx->clouds );
+                ctx->clouds = NULL;
+        }
+        if ( ctx->ovf != NULL ) {
+                /* The overflow group was freed with the list */
+                overflow_deinit( ctx->ovf );
+                ctx->ovf = NULL;
+        }
         ctx->common_policy = new_grouping;
         TRACE("Changed the default grouping to 0x%x\n", new_grouping );
         ctx->out_groups = glist_init();
+        if ( new_grouping & POLICY_CLOUD ) 
+                sort_queue_by_added( ctx->newq, ctx->scratch );
         rotate_new_queue( ctx );
 }
 
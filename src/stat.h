@@ -80,11 +80,36 @@
  * be shown.
  */
 #define OP_SHOW_LISTEN 0x10
+/**
+ * Flag indicating that closed connections should be
+ * received as events between the polls.
+ */
+#define OP_DIAG_EVENTS 0x20
+/**
+ * Flag indicating that state transitions should be read
+ * from the tracepoint.
+ */
+#define OP_BPF_EVENTS 0x40
+/**
+ * Flag indicating that the kernel TCP counters should 
+ * be shown.
+ */
+#define OP_SNMP_STATS 0x80
+/**
+ * Flag indicating that the memory used by the sockets should
+ * be collected.
+ */
+#define OP_SOCK_MEM 0x100
+/**
+ * Flag indicating that the connection tracking table should be read for
+ * the real peers of NATed connections.
+ */
+#define OP_CONNTRACK 0x200
 
 /**
  * typedef for the type holding the operation flags,
  */
-typedef uint8_t operation_flags_t;
+typedef uint16_t operation_flags_t;
 
 /**
  * The main context holding together all information.
@@ -108,10 +133,81 @@ struct stat_context {
         struct ifinfo_tab *iftab;/**< Table containing interface information */
         struct pidinfo *pinfo; /**< Struct containing information for followed processes. */
         struct filter_list *filters; /**< Filters for new connections */
+        struct recorder *recorder; /**< Recorder for the session, NULL if not recording */
+        struct dns_cache *dns; /**< Cache for the resolved names, NULL if not in use */
+        struct cloud_index *clouds; /**< Index of groups of related connections, NULL if not grouping by them */
+        int cloud_window; /**< Maximum time difference (secs) for related connections */
+        struct gkey_plan *gkey; /**< Grouping key given by user, NULL if not given */
+        struct gkey_index *gkeys; /**< Index of groups formed with the grouping key */
+        int max_groups; /**< Maximum number of live outgoing groups, 0 for no limit */
+        struct overflow *ovf; /**< Groups folded over the limit, NULL if none folded yet */
+        int sample_rate; /**< Only 1/sample_rate of the connections are tracked, 0 or 1 for all */
+        int unsampled_count; /**< Number of connections left out by sampling on round */
+        struct arena *scratch; /**< Memory needed during the update round, reset after every round */
+        int bulk; /**< Non-zero while the initial snapshot is being loaded */
+        int round; /**< Number of update rounds done */
+        struct tcpstat_sub *subs; /**< Subscriptions for events, NULL if none */
+        long first_screen_usecs; /**< Time from start to the first screen, 0 until shown */
+#ifdef ENABLE_FOLLOW_PID
+        int pid_workers; /**< Number of threads used for scanning process inodes */
+        struct pid_scanner *pscan; /**< Scanner for the process inodes */
+#endif /* ENABLE_FOLLOW_PID */
+#ifdef ENABLE_DIAG_EVENTS
+        struct diag_events *diag; /**< Source for closed connections, NULL if not in use */
+#endif /* ENABLE_DIAG_EVENTS */
+#ifdef ENABLE_BPF_EVENTS
+        struct bpf_events *bpf; /**< Source for state transitions, NULL if not in use */
+        int reconcile_rounds; /**< Rounds between polls when reading transitions */
+#endif /* ENABLE_BPF_EVENTS */
+#ifdef ENABLE_SNMP_STATS
+        struct snmp_stats *snmp; /**< Kernel TCP counters, NULL if not available */
+#endif /* ENABLE_SNMP_STATS */
+#ifdef ENABLE_SOCK_MEM
+        struct sock_mem *smem; /**< Socket memory collection, NULL if not active */
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_PORT_MONITOR
+        struct port_monitor *ports; /**< Ephemeral port monitor, NULL if not active */
+#endif /* ENABLE_PORT_MONITOR */
+#ifdef ENABLE_CONNTRACK
+        struct ct_table *ct; /**< Connection tracking table, NULL if not in use */
+#endif /* ENABLE_CONNTRACK */
+        struct lb_stats *lb; /**< Backend distribution, NULL if not collected */
+};
+
+/**
+ * Maximum number of connection records on one batch.
+ */
+#define CONN_BATCH_SIZE 128
+
+/**
+ * Batch of connection records read by scout.
+ * The records are kept as structure of arrays, index i on each array holding
+ * the information for the i:th record. Addresses and ports are in network
+ * byte order, for IPv4 records only the first 4 bytes of the address are
+ * used. The timestamps are only set by scouts which know when the connection
+ * was seen, for others they are left 0.
+ * @see insert_connection_batch()
+ */
+struct conn_batch {
+        int count; /**< Number of records on batch */
+        sa_family_t family[CONN_BATCH_SIZE]; /**< Address families */
+        uint8_t laddr[CONN_BATCH_SIZE][16]; /**< Local addresses */
+        uint8_t raddr[CONN_BATCH_SIZE][16]; /**< Remote addresses */
+        in_port_t lport[CONN_BATCH_SIZE]; /**< Local ports */
+        in_port_t rport[CONN_BATCH_SIZE]; /**< Remote ports */
+        uint8_t state[CONN_BATCH_SIZE]; /**< TCP states */
+        uint64_t stamp[CONN_BATCH_SIZE]; /**< Time the record was seen (ms), 0 for now */
+#ifdef ENABLE_FOLLOW_PID
+        ino_t inode[CONN_BATCH_SIZE]; /**< Socket inodes */
+#endif /* ENABLE_FOLLOW_PID */
+        struct conn_key key[CONN_BATCH_SIZE]; /**< Hashtable keys for the records */
+        uint32_t hash[CONN_BATCH_SIZE]; /**< Hash values for the keys */
 };
 
 void switch_grouping( struct stat_context *ctx, policy_flags_t new_grouping );
 void rotate_new_queue( struct stat_context *ctx );
+int regroup_connection( struct stat_context *ctx, struct tcp_connection *conn_p,
+                policy_flags_t policy );
 int purge_closed_connections( struct stat_context *ctx, int closed_cnt );
 int insert_connection( struct sockaddr_storage *local_addr, struct sockaddr_storage *remote_addr,
                 enum tcp_state state,
@@ -119,11 +215,25 @@ int insert_connection( struct sockaddr_storage *local_addr, struct sockaddr_stor
                 ino_t inode,
 #endif /* ENABLE_FOLLOW_PID */
                 struct stat_context *ctx );
+int insert_connection_batch( struct conn_batch *batch, struct stat_context *ctx );
 void clear_metadata_flags( struct glist *list );
 void group_clear_metadata_flags( struct group *grp );
 void resolve_route_for_connection( struct stat_context *ctx, struct tcp_connection *conn_p);
 int get_ignored_count( struct stat_context *ctx );
 
+/**
+ * Check if only a sample of the connections is tracked.
+ */
+#define SAMPLING(c) ( (c)->sample_rate > 1 )
+/**
+ * Estimate the number of all connections from the number of sampled ones.
+ */
+#define SAMPLE_ESTIMATE(c,n) ( SAMPLING(c) ? (n) * (c)->sample_rate : (n) )
+/**
+ * Marker printed before the estimated numbers.
+ */
+#define SAMPLE_MARK(c) ( SAMPLING(c) ? "~" : "" )
+
 /**
  * Enable the given operation (turn the flag on)
  */
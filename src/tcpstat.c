@@ -60,94 +60,91 @@
 #include "stat.h"
 #include "ui.h"
 #include "scouts.h"
+#include "record.h"
+#include "cloud.h"
+#include "groupkey.h"
+#include "dnscache.h"
+#include "portmon.h"
+#include "lbstat.h"
+#include "overflow.h"
+#include "arena.h"
+#include "libtcpstat.h"
 
 #define STATFILE "/proc/net/tcp"
 #define PROGNAMELEN 20
-#define DEFAULT_UPDATE_INT 1
-/**
- * Default start-up policy
- */
-#define DEFAULT_POLICY  POLICY_REMOTE | POLICY_ADDR
 
 static char progname[ PROGNAMELEN ];
-
+/**
+ * Recording to run offline query on, NULL if running live.
+ */
+static char *query_file = NULL;
+/**
+ * File to record the connections to, NULL if not recording.
+ */
+static char *record_file = NULL;
+/**
+ * File for the cache of resolved names, NULL if not caching.
+ */
+static char *dns_cache_file = NULL;
+#ifdef ENABLE_PORT_MONITOR
+/**
+ * Set if ephemeral ports should be monitored from start.
+ */
+static int port_monitor = 0;
+/**
+ * Utilisation of ephemeral ports (percent) to alert on.
+ */
+static int port_alert = PORTMON_DEFAULT_ALERT;
+#endif /* ENABLE_PORT_MONITOR */
+#ifdef ENABLE_SNMP_STATS
+/**
+ * Comma separated list of kernel counters to show, NULL for defaults.
+ */
+static char *snmp_counters = NULL;
+/**
+ * File to export the kernel counters to, "-" for running without UI.
+ */
+static char *snmp_export_file = NULL;
+#endif /* ENABLE_SNMP_STATS */
+/**
+ * Selectors for the offline query.
+ */
+static struct rec_query *query = NULL;
 
 /** 
- * @brief Check if any process we are following has died. 
+ * @brief Show messages from the collector to user.
  *
- * The scan_inodes() sets <code>->pid</code> to -1 if it detects that process
- * has died. Remove all those pidinfo structures. If the connection group
- * inside pidinfo is not empty, then there are some connections still in the
- * system for the dead process and such pidinfo is not removed. 
- * 
- * @see scan_inodes()
- * 
- * @param ctx Pointer to the main context.
- * 
- * @return Number of still alive connections. 
+ * Status messages are shown on the status bar, notices on the banner.
  */
-#ifdef ENABLE_FOLLOW_PID
-static int check_dead_processes( struct stat_context *ctx )
+static void show_message( enum tcpstat_event ev, _UNUSED struct tcp_connection *conn_p,
+                const char *msg, _UNUSED void *arg )
 {
-        struct pidinfo *info_p, *prev;
-        int alive_count = 0;
-
-        prev = NULL;
-        info_p = ctx->pinfo;
-
-        while ( info_p != NULL ) {
-                if ( info_p->pid == -1 ) {
-                        DBG( "Found dead process\n" );
-                        if ( group_get_size( info_p->grp ) == 0 ) {
-                                if ( prev == NULL ) {
-                                        ctx->pinfo = info_p->next;
-                                } else {
-                                        prev->next = info_p->next;
-                                }
-                                free_pidinfo( info_p );
-                                info_p = info_p->next;
-                        } else {
-                                DBG( "Connections on dead processes group!\n" );
-                                /* we cheat, on purpose */
-                                alive_count++;
-                                prev = info_p;
-                                info_p = info_p->next;
-                                /* We just have to wait for these connections
-                                 * to die out 
-                                 */
-                        }
-                } else {
-                        alive_count++;
-                        prev = info_p;
-                        info_p = info_p->next;
-                }
-        }
-        return alive_count;
+        if ( ev == TCPSTAT_EV_NOTICE ) 
+                ui_show_message( LOCATION_BANNER, (char *)msg );
+        else if ( msg != NULL ) 
+                ui_show_message( LOCATION_STATUSBAR, (char *)msg );
+        else 
+                ui_clear_message( LOCATION_STATUSBAR );
 }
-#endif /* ENABLE_FOLLOW_PID */
 
-#ifdef ENABLE_FOLLOW_PID
-/**
- * Clear the metadata from the connections stored into pidinfo 
- * structures. 
- *
- * In follow pid -mode we do not hold the connections in the
- * listen_groups and out_groups, instead they are in the pidinfos. 
- *
+/** 
+ * @brief Report the time it took to show the first screen.
+ * 
  * @param ctx Pointer to the global context.
+ * @param start_usecs Time the program was started.
  */
-static void clear_pid_metadata( struct stat_context *ctx ) 
+static void report_first_screen( struct stat_context *ctx, long start_usecs )
 {
-        struct pidinfo *info_p = ctx->pinfo;
-
-        while( info_p != NULL ) {
-                group_clear_metadata_flags( info_p->grp );
-                info_p = info_p->next;
-        }
+        char msg[80];
+
+        ctx->first_screen_usecs = connection_now_usecs() - start_usecs;
+        DBG( "First screen in %ld us, %d connections\n", 
+                        ctx->first_screen_usecs, ctx->chash->size );
+        snprintf( msg, sizeof( msg ), "First screen in %ld ms (%d connections)",
+                        ctx->first_screen_usecs / 1000, ctx->chash->size );
+        ui_show_message( LOCATION_BANNER, msg );
 }
-#endif /* ENABLE_FOLLOW_PID */
 
-        
 static void print_help( char *name  )
 {
 #ifdef BUILDID
@@ -163,20 +160,52 @@ static void print_help( char *name  )
         printf( "\t   \"port\"  -- Group by destination port\n" );
         printf( "\t   \"state\" -- Group by connection state\n" );
         printf( "\t   \"if\"    -- Group by interface\n" ); 
-#if 0 /* not yet */
-        printf( "\t   \"cloud\" -- Group related connections (based on address) (EXPERIMENTAL)\n");
-        printf( "\t   \"cloudp\"-- Group related connections (based on port) (EXPERIMENTAL)\n\n"); 
-#endif 
+        printf( "\t   \"cloud\" -- Group related connections (based on address)\n");
+        printf( "\t   \"cloudp\"-- Group related connections (based on port)\n"); 
+        printf( "\t   or comma separated list of fields to group by, fields are\n\t   laddr, lport, raddr, rport, state, if, af" );
+#ifdef ENABLE_FOLLOW_PID
+        printf( ", pid" );
+#endif /* ENABLE_FOLLOW_PID */
+#ifdef ENABLE_CONNTRACK
+        printf( ", peer, pport" );
+#endif /* ENABLE_CONNTRACK */
+        printf( "\n\t   (for example \"lport,raddr\")\n" );
+        printf( "\t--cloud-window <sec> : Connections opened within <sec> seconds\n\t  from each other are related. Default is %d sec\n", CLOUD_DEFAULT_WINDOW );
+        printf( "\t--max-groups <n> : Keep at most <n> outgoing groups, least recently\n\t  active are folded to \"Other\" group (0 for no limit). Default is %d\n", OVERFLOW_DEFAULT_MAX_GROUPS );
+        printf( "\t--sample <n> : Track only 1/<n> of the connections (selected by hash),\n\t  counts shown are estimates\n" );
 #ifdef ENABLE_FOLLOW_PID
         printf( "\t--pid <pid> or -p <pid> : Show only connection for process\n\t  with pid <pid>\n" );
+        printf( "\t--pid-workers <n> : Use <n> threads for scanning the processes\n\t  (0 for no threads). Default is %d\n", DEFAULT_PID_WORKERS );
 #endif /* ENABLE_FOLLOW_PID */
         printf( "\t--delay <sec> or -d <sec> : Set delay betveen updates to \n\t  <sec> seconds. Default is %d sec\n",DEFAULT_UPDATE_INT );
+#ifdef ENABLE_DIAG_EVENTS
+        printf( "\t--events : Catch connections closed between updates (needs\n\t  CAP_NET_ADMIN)\n" );
+#endif /* ENABLE_DIAG_EVENTS */
+#ifdef ENABLE_BPF_EVENTS
+        printf( "\t--bpf-events : Read connection state changes from the kernel\n\t  tracepoint (needs CAP_BPF and CAP_PERFMON)\n" );
+        printf( "\t--reconcile <n> : With --bpf-events, read all connections every\n\t  <n> rounds. Default is %d\n", DEFAULT_RECONCILE_ROUNDS );
+#endif /* ENABLE_BPF_EVENTS */
         printf( "\t--numeric or -n : Don't resolve hostnames\n" );
         printf( "\t--listen or -l  : Print information about listening connections\n" );
         printf( "\t--linger or -L  : Linger closed connections for a while\n" );
 #ifdef ENABLE_IFSTATS
         printf( "\t--ifstat or -i  : Collect and display interface statistics\n");
 #endif /* ENABLE_IFSTATS */
+#ifdef ENABLE_PORT_MONITOR
+        printf( "\t--port-monitor : Count the ephemeral ports in use toward remote\n\t  endpoints\n" );
+        printf( "\t--port-alert <pct> : Alert when <pct> percent of the ephemeral\n\t  ports are in use. Default is %d\n", PORTMON_DEFAULT_ALERT );
+#endif /* ENABLE_PORT_MONITOR */
+#ifdef ENABLE_SOCK_MEM
+        printf( "\t--sock-mem : Collect memory held by the sockets (needs\n\t  CAP_NET_ADMIN for sockets of other users)\n" );
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_CONNTRACK
+        printf( "\t--conntrack : Find the real peers of NATed connections from the\n\t  connection tracking table (needs CAP_NET_ADMIN or readable\n\t  /proc/net/nf_conntrack), implied by grouping with peer or pport\n" );
+#endif /* ENABLE_CONNTRACK */
+#ifdef ENABLE_SNMP_STATS
+        printf( "\t--snmp or -s    : Display kernel TCP counters\n");
+        printf( "\t--snmp-counters <name>[,<name>] : Kernel TCP counters to display\n\t  (for example \"TcpExt.ListenDrops,Tcp.RetransSegs\")\n" );
+        printf( "\t--snmp-export <file> : Write the kernel TCP counters per second to\n\t  <file>, with \"-\" write to stdout without UI\n" );
+#endif /* ENABLE_SNMP_STATS */
         printf( "\t--ipv4 or -4    : Collect only IPv4 TCP connection statistics\n" ); 
         printf( "\t--ipv6 or -6    : Collect only IPv6 TCP connection statistics\n" ); 
         printf( "\tFiltering options : \n");
@@ -184,6 +213,21 @@ static void print_help( char *name  )
         printf( "\t--ignore-raddr <addr>[:port] : Ignore connections with given remote\n\t  address (and port)\n" );
         printf( "\t--warn-raddr <addr>[:port] : Warn about (mark with !) connections with\n\t  given remote address (and port)\n" );
         printf( "\t--warn-rport <port>[,<port>,<port>] : Warn (mark with !) about\n\t  connections with given  remote port(s)\n");
+        printf( "\t--ignore <expr> : Ignore connections matching filter expression\n" );
+        printf( "\t--warn <expr> : Warn about (mark with !) connections matching filter\n\t  expression\n" );
+        printf( "\t  Expression combines tests with and, or, not and parenthesis:\n" );
+        printf( "\t  lport|rport|port <port>, laddr|raddr|addr <addr>[/<bits>],\n" );
+        printf( "\t  state <state>, if <name>, af inet|inet6. Sets are given as\n" );
+        printf( "\t  \"in {<value>,<value>}\", for example\n" );
+        printf( "\t  \"rport in {443,8443} and state established and not raddr 10.0.0.0/8\"\n" );
+        printf( "\tRecording options : \n");
+        printf( "\t--dns-cache <file> : Keep the resolved host names on <file> over\n\t  restarts\n" );
+        printf( "\t--record <file> : Record all connections seen to <file>\n" );
+        printf( "\t--query <file> : Query recording on <file> and print out the\n\t  matching connections grouped with the grouping set\n" );
+        printf( "\t--from <time> : Query only connections seen after <time>\n\t  (\"YYYY-MM-DD HH:MM[:SS]\" or \"HH:MM[:SS]\")\n" );
+        printf( "\t--to <time> : Query only connections seen before <time>\n" );
+        printf( "\t--raddr <addr> : Query only connections with remote address <addr>\n" );
+        printf( "\t--rport <port> : Query only connections with remote port <port>\n" );
 #ifdef DEBUG
         printf( "\t--debug <lvl> or -D <lvl> : Set debug level (0,1,2,3)\n" );
 #endif /* DEBUG */
@@ -197,6 +241,7 @@ static void print_help( char *name  )
  */ 
 static int set_grouping( struct stat_context *ctx, char *modifier )
 {
+        struct gkey_plan *plan;
         int rv = 0;
 
         TRACE( "Doing grouping, modifier |%s| \n", modifier ); 
@@ -217,6 +262,12 @@ static int set_grouping( struct stat_context *ctx, char *modifier )
                 ctx->common_policy = POLICY_CLOUD | POLICY_REMOTE | POLICY_PORT;
         } else if ( strcmp( modifier, "if" ) == 0 ) {
                 ctx->common_policy = POLICY_IF;
+        } else if ( (plan = gkey_plan_parse( modifier )) != NULL ) {
+                DBG( "Grouping with key %s\n", modifier );
+                if ( ctx->gkey != NULL )
+                        gkey_plan_deinit( ctx->gkey );
+                ctx->gkey = plan;
+                ctx->common_policy = gkey_plan_policy( plan );
         } else {
                 ERROR("Unkonwn grouping %s! \n", modifier );
                 rv = -1;
@@ -401,6 +452,50 @@ static int parse_addr_filter( struct stat_context *ctx, policy_flags_t policy,
         return 0;
 }
 
+/** 
+ * @brief Create a filter matching the filter expression given as argument.
+ *
+ * @param ctx Pointer to the global context.
+ * @param act Action to set for the filter.
+ * @param argstr The filter expression.
+ * @param errbuf Buffer for the error message.
+ * @param errlen Size of @a errbuf.
+ * 
+ * @return 0 on success, -1 on error.
+ */
+static int parse_expr_filter( struct stat_context *ctx, enum filter_action act,
+                char *argstr, char *errbuf, size_t errlen )
+{
+        struct filter *filt;
+
+        filt = filter_from_expr( argstr, act, errbuf, errlen );
+        if ( filt == NULL ) 
+                return -1;
+
+        filtlist_add( ctx->filters, filt, ADD_LAST );
+        return 0;
+}
+
+/**
+ * @brief Parse the remote address selector for offline query.
+ *
+ * @param argstr String containing the numeric address.
+ * @return 0 on success, -1 on error.
+ */
+static int parse_query_addr( char *argstr )
+{
+        struct addrinfo hints, *ainfo;
+
+        memset( &hints, 0, sizeof( hints ));
+        hints.ai_flags = AI_NUMERICHOST;
+        if ( getaddrinfo( argstr, NULL, &hints, &ainfo ) != 0 ) {
+                return -1;
+        }
+        memcpy( &query->raddr, ainfo->ai_addr, ainfo->ai_addrlen );
+        freeaddrinfo( ainfo );
+        return 0;
+}
+
 /** 
  * @brief Do graceful exit of the program.
  *
@@ -412,36 +507,9 @@ static int parse_addr_filter( struct stat_context *ctx, policy_flags_t policy,
  */
 void do_exit( struct stat_context *ctx, char *exit_msg, int success )
 {
-#ifdef ENABLE_FOLLOW_PID
-        struct pidinfo *info_p;
-#endif /* ENABLE_FOLLOW_PID */
-
         DBG( "Exiting!\n" );
         ui_deinit();
-
-        if ( ctx->iftab != NULL ) 
-                deinit_ifinfo_tab( ctx->iftab );
-        /* Hashtable has to be cleared befor any connections are deleted. Else
-         * we end up with pointers to freed connections on hashtable. 
-         */
-        chash_clear( ctx->chash );
-        /* Free all pidinfo structures */
-#ifdef ENABLE_FOLLOW_PID
-        info_p = ctx->pinfo;
-        while (info_p != NULL ) {
-                struct pidinfo *tmp = info_p->next;
-                free_pidinfo( info_p );
-                info_p = tmp;
-        }
-#endif /* ENABLE_FOLLOW_PID */
-        filtlist_deinit( ctx->filters );
-
-        cqueue_deinit( ctx->newq, 1 );
-        glist_deinit( ctx->listen_groups,1  );
-        glist_deinit( ctx->out_groups,1 );
-        chash_deinit( ctx->chash );
-
-        mem_free( ctx );
+        tcpstat_deinit( ctx );
 
         if ( exit_msg )
                 printf("\n%s\n", exit_msg );
@@ -495,6 +563,10 @@ static void parse_args( int argc, char **argv, struct stat_context *ctx )
 {
        int c;
        int option_index;
+       in_port_t port;
+       char *end;
+       char errbuf[128];
+       char msg[192];
        struct option sw_long_options[] = {
                { "help", 0 ,0, 'h' },
                { "group",1,0,'g'},
@@ -510,6 +582,43 @@ static void parse_args( int argc, char **argv, struct stat_context *ctx )
                { "ignore-raddr",1,0,'A'},
                { "warn-raddr",1,0,'w' },
                { "warn-rport",1,0,'W' },
+               { "ignore",1,0,'I' },
+               { "warn",1,0,'E' },
+#ifdef ENABLE_FOLLOW_PID
+               { "pid-workers",1,0,'j' },
+#endif /* ENABLE_FOLLOW_PID */
+#ifdef ENABLE_DIAG_EVENTS
+               { "events",0,0,'e' },
+#endif /* ENABLE_DIAG_EVENTS */
+#ifdef ENABLE_BPF_EVENTS
+               { "bpf-events",0,0,'b' },
+               { "reconcile",1,0,'c' },
+#endif /* ENABLE_BPF_EVENTS */
+#ifdef ENABLE_PORT_MONITOR
+               { "port-monitor",0,0,'U' },
+               { "port-alert",1,0,'V' },
+#endif /* ENABLE_PORT_MONITOR */
+#ifdef ENABLE_SOCK_MEM
+               { "sock-mem",0,0,'m' },
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_CONNTRACK
+               { "conntrack",0,0,'K' },
+#endif /* ENABLE_CONNTRACK */
+#ifdef ENABLE_SNMP_STATS
+               { "snmp",0,0,'s' },
+               { "snmp-counters",1,0,'u' },
+               { "snmp-export",1,0,'x' },
+#endif /* ENABLE_SNMP_STATS */
+               { "dns-cache",1,0,'H' },
+               { "record",1,0,'o' },
+               { "query",1,0,'Q' },
+               { "from",1,0,'F' },
+               { "to",1,0,'T' },
+               { "raddr",1,0,'a' },
+               { "rport",1,0,'P' },
+               { "cloud-window",1,0,'C' },
+               { "max-groups",1,0,'G' },
+               { "sample",1,0,'S' },
 #ifdef DEBUG
                { "debug",1,0,'D'},
 #endif /* DEBUG */    
@@ -517,7 +626,7 @@ static void parse_args( int argc, char **argv, struct stat_context *ctx )
        };      
 
        while( 1 ) {
-              c = getopt_long( argc, argv, "hlnLi46rg:d:p:R:A:", sw_long_options, &option_index );
+              c = getopt_long( argc, argv, "hlnLi46rsg:d:p:R:A:", sw_long_options, &option_index );
               if ( c == -1 ) {
                      break;
               }
@@ -578,7 +687,53 @@ static void parse_args( int argc, char **argv, struct stat_context *ctx )
                              }
                              OPERATION_ENABLE(ctx, OP_FOLLOW_PID);
                              break;
+                      case 'j' :
+                             ctx->pid_workers = strtol( optarg, &end, 10 );
+                             if ( end == optarg || *end != '\0' || 
+                                             ctx->pid_workers < 0 || ctx->pid_workers > MAX_PID_WORKERS ) {
+                                     print_user_error( "Invalid number of workers");
+                                     exit( EXIT_FAILURE );
+                             }
+                             break;
 #endif /* ENABLE_FOLLOW_PID */
+#ifdef ENABLE_DIAG_EVENTS
+                      case 'e' :
+                             OPERATION_ENABLE(ctx, OP_DIAG_EVENTS);
+                             break;
+#endif /* ENABLE_DIAG_EVENTS */
+#ifdef ENABLE_BPF_EVENTS
+                      case 'b' :
+                             OPERATION_ENABLE(ctx, OP_BPF_EVENTS);
+                             break;
+                      case 'c' :
+                             ctx->reconcile_rounds = strtol( optarg, NULL, 10 );
+                             if ( ctx->reconcile_rounds < 1 ) {
+                                     print_user_error( "Invalid number of rounds for reconcile");
+                                     exit( EXIT_FAILURE );
+                             }
+                             break;
+#endif /* ENABLE_BPF_EVENTS */
+                      case 'C' :
+                             ctx->cloud_window = strtol( optarg, &end, 10 );
+                             if ( end == optarg || *end != '\0' || ctx->cloud_window < 1 ) {
+                                     print_user_error( "Invalid time window for related connections");
+                                     exit( EXIT_FAILURE );
+                             }
+                             break;
+                      case 'G' :
+                             ctx->max_groups = strtol( optarg, NULL, 10 );
+                             if ( ctx->max_groups < 0 ) {
+                                     print_user_error( "Invalid maximum number of groups");
+                                     exit( EXIT_FAILURE );
+                             }
+                             break;
+                      case 'S' :
+                             ctx->sample_rate = strtol( optarg, &end, 10 );
+                             if ( end == optarg || *end != '\0' || ctx->sample_rate < 1 ) {
+                                     print_user_error( "Invalid sampling rate");
+                                     exit( EXIT_FAILURE );
+                             }
+                             break;
                       case 'R' :
                              if ( parse_port_filter( ctx, POLICY_REMOTE | POLICY_PORT, FILTERACT_IGNORE, 
                                                      optarg ) < 0 ) {
@@ -607,6 +762,79 @@ static void parse_args( int argc, char **argv, struct stat_context *ctx )
                                      exit(EXIT_FAILURE);
                              }
                              break;
+                      case 'I' :
+                      case 'E' :
+                             if ( parse_expr_filter( ctx, 
+                                                     c == 'I' ? FILTERACT_IGNORE : FILTERACT_WARN,
+                                                     optarg, errbuf, sizeof( errbuf )) < 0 ) {
+                                     snprintf( msg, sizeof( msg ), 
+                                                     "Invalid filter expression: %s", errbuf );
+                                     print_user_error( msg );
+                                     exit( EXIT_FAILURE );
+                             }
+                             break;
+                      case 'o' :
+                             record_file = optarg;
+                             break;
+                      case 'Q' :
+                             query_file = optarg;
+                             break;
+                      case 'H' :
+                             dns_cache_file = optarg;
+                             break;
+#ifdef ENABLE_PORT_MONITOR
+                      case 'U' :
+                             port_monitor = 1;
+                             break;
+                      case 'V' :
+                             port_alert = strtol( optarg, NULL, 10 );
+                             if ( port_alert < 1 || port_alert > 100 ) {
+                                     print_user_error( "Invalid percentage for port alert");
+                                     exit( EXIT_FAILURE );
+                             }
+                             port_monitor = 1;
+                             break;
+#endif /* ENABLE_PORT_MONITOR */
+#ifdef ENABLE_SOCK_MEM
+                      case 'm' :
+                             OPERATION_ENABLE(ctx, OP_SOCK_MEM);
+                             break;
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_CONNTRACK
+                      case 'K' :
+                             OPERATION_ENABLE(ctx, OP_CONNTRACK);
+                             break;
+#endif /* ENABLE_CONNTRACK */
+#ifdef ENABLE_SNMP_STATS
+                      case 's' :
+                             OPERATION_ENABLE(ctx, OP_SNMP_STATS);
+                             break;
+                      case 'u' :
+                             snmp_counters = optarg;
+                             break;
+                      case 'x' :
+                             snmp_export_file = optarg;
+                             break;
+#endif /* ENABLE_SNMP_STATS */
+                      case 'F' :
+                             query->from_str = optarg;
+                             break;
+                      case 'T' :
+                             query->to_str = optarg;
+                             break;
+                      case 'a' :
+                             if ( parse_query_addr( optarg ) != 0 ) {
+                                     print_user_error("Invalid address for raddr");
+                                     exit(EXIT_FAILURE);
+                             }
+                             break;
+                      case 'P' :
+                             if ( parse_port_value( optarg, &port ) != 0 ) {
+                                     print_user_error("Invalid port for rport");
+                                     exit(EXIT_FAILURE);
+                             }
+                             query->rport = port;
+                             break;
                       default :
                              print_help( argv[0] );
                              mem_free( ctx );
@@ -623,8 +851,8 @@ static void parse_args( int argc, char **argv, struct stat_context *ctx )
 int main( int argc, char *argv[] ) 
 {
         struct stat_context *ctx;
-        struct filter *filt;
-        int round =0;
+        long start_usecs = connection_now_usecs();
+        int rv;
 
 
         if ( signal( SIGTERM, do_sighandler ) == SIG_ERR ) {
@@ -649,110 +877,95 @@ int main( int argc, char *argv[] )
         DBG_MODULE_LEVEL( DBG_MODULE_RT, DBG_L_TRACE );
 #endif 
 
-        ctx = mem_alloc( sizeof( struct stat_context) );
-        memset( ctx,0, sizeof( *ctx));
-        ctx->ops = 0;
-        ctx->listen_groups = glist_init();
-        ctx->out_groups = glist_init();
-        ctx->newq = cqueue_init();
-        ctx->chash = chash_init();
-        ctx->new_count = 0;
-        ctx->total_count = 0;
-        ctx->common_policy = DEFAULT_POLICY;
-        ctx->update_interval = DEFAULT_UPDATE_INT;
-        ctx->pinfo = NULL;
-        ctx->collected_stats = STAT_ALL;
-        ctx->filters = filtlist_init(FIRST_MATCH);
-        
+        ctx = tcpstat_init();
         OPERATION_ENABLE( ctx, OP_RESOLVE);
 
         strncpy( progname, argv[0], PROGNAMELEN );
 
+        query = rec_query_init();
         parse_args( argc, argv, ctx );
 
-        ctx->iftab = scout_ifs();
-        if ( ctx->iftab == NULL ) {
-                ERROR( "Error in initializing the interface stats!\n" );
-                return -1;
+        if ( query_file != NULL ) {
+                /* Offline mode, no UI */
+                rv = rec_query_run( query_file, query, ctx->common_policy,
+                                ctx->gkey );
+                rec_query_deinit( query );
+                tcpstat_deinit( ctx );
+                return rv == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        rec_query_deinit( query );
+        query = NULL;
+
+        if ( record_file != NULL ) {
+                /* Opened once all options are known, the header holds the sampling rate */
+                ctx->recorder = recorder_init( record_file, ctx->sample_rate );
+                if ( ctx->recorder == NULL ) {
+                        print_user_error("Unable to open recording file");
+                        exit(EXIT_FAILURE);
+                }
         }
-        DBG( "Scouted %d interfaces\n", ctx->iftab->size );
-
-#ifdef ENABLE_ROUTES
-        DBG("Adding routing info\n");
-        parse_routing_info(ctx->iftab);
-#endif /* ENABLE_ROUTES */
-
-
-
-        ui_init( ctx );
-        while ( 1 )  {
-#ifdef ENABLE_FOLLOW_PID
-                if ( OPERATION_ENABLED(ctx,OP_FOLLOW_PID) ) 
-                        scan_inodes( ctx->pinfo );
-#endif /* ENABLE_FOLLOW_PID */
 
-#ifdef ENABLE_IFSTATS
-                if ( OPERATION_ENABLED(ctx, OP_IFSTATS ))
-                        read_interface_stat( ctx );
-#endif /* ENABLE_IFSTATS */
-                if (read_tcp_stat(ctx) != 0 ) {
-                        ERROR("Error while reading TCP connections \n");
-                        break;
+#ifdef ENABLE_SNMP_STATS
+        ctx->snmp = snmp_stats_init( snmp_counters );
+        if ( ctx->snmp == NULL ) {
+                if ( snmp_counters != NULL || snmp_export_file != NULL ) {
+                        print_user_error( "Unable to read kernel TCP counters" );
+                        exit( EXIT_FAILURE );
                 }
-#ifdef ENABLE_FOLLOW_PID
-                if ( ! OPERATION_ENABLED(ctx, OP_FOLLOW_PID)) {
-                        rotate_new_queue( ctx );
+                OPERATION_DISABLE( ctx, OP_SNMP_STATS );
+        }
+        if ( snmp_export_file != NULL && strcmp( snmp_export_file, "-" ) == 0 ) {
+                /* Only export the counters, no UI */
+                ctx->snmp->export = stdout;
+                while ( 1 ) {
+                        read_snmp_stats( ctx->snmp );
+                        snmp_stats_export( ctx->snmp, stdout );
+                        sleep( ctx->update_interval );
                 }
-#else
-                rotate_new_queue(ctx);
-#endif /* ENABLE_FOLLOW_PID */
-                round++;
-
-                if ( ctx->total_count != ctx->chash->size ) {
-                        int count = ctx->chash->size - ctx->total_count;
-                        TRACE( "Going to purge connections (total %d, hash %d)\n", ctx->total_count, ctx->chash->size );
-                        /* Some connections have to be deleted. */
-                        if ( count > 0 ) {
-                                if ( purge_closed_connections( ctx, count ) != 0 ) {
-                                        WARN( "Purge closed blew it \n" );
-                                        do_exit( ctx, "Fatal internal error!\n",-1 );
-                                }
-                        }
-                }  
-#ifdef ENABLE_FOLLOW_PID
-                if ( OPERATION_ENABLED( ctx, OP_FOLLOW_PID) ) {
-                        if ( check_dead_processes( ctx ) == 0 ) {
-                                /* XXX - Some message is needed */
-                                do_exit( ctx, "No more processes to follow!\n",0 );
-                        }
+        } else if ( snmp_export_file != NULL ) {
+                ctx->snmp->export = fopen( snmp_export_file, "w" );
+                if ( ctx->snmp->export == NULL ) {
+                        print_user_error( "Unable to open file for kernel TCP counters" );
+                        exit( EXIT_FAILURE );
                 }
-#endif /* ENABLE_FOLLOW_PID */
-                ui_update_view( ctx );
+        }
+#endif /* ENABLE_SNMP_STATS */
 
-                /* clear metadata flags from all the connections, 
-                 * this way we'll notice new connections (and dead) 
-                 * on next round...
-                 */
-#ifdef ENABLE_FOLLOW_PID 
-                if ( OPERATION_ENABLED( ctx, OP_FOLLOW_PID )) {
-                        clear_pid_metadata( ctx );
-                } else {
-                        clear_metadata_flags( ctx->listen_groups );
-                        clear_metadata_flags( ctx->out_groups );
-                }
-#else /* ENABLE_FOLLOW_PID */
-                clear_metadata_flags(ctx->listen_groups);
-                clear_metadata_flags(ctx->out_groups);
-#endif /* ENABLE_FOLLOW_PID */
+        if ( dns_cache_file != NULL ) {
+                ctx->dns = dns_cache_init( dns_cache_file );
+                connection_set_dns_cache( ctx->dns );
+        }
 
-                /* clear the metadata flags from the filtered connections */
-                filtlist_foreach_filter( ctx->filters, filt ) {
-                        if ( filt->group != NULL )
-                                group_clear_metadata_flags( filt->group );
+#ifdef ENABLE_PORT_MONITOR
+        if ( port_monitor ) {
+                ctx->ports = portmon_init( port_alert, ctx->sample_rate );
+                if ( ctx->ports == NULL ) {
+                        print_user_error( "Unable to read the ephemeral port range" );
+                        exit( EXIT_FAILURE );
                 }
+        }
+#endif /* ENABLE_PORT_MONITOR */
+
+        tcpstat_subscribe( ctx, TCPSTAT_EV_STATUS | TCPSTAT_EV_NOTICE, 
+                        show_message, NULL );
+        if ( tcpstat_start( ctx ) != 0 ) {
+                print_user_error( "Unable to read the network interfaces" );
+                exit( EXIT_FAILURE );
+        }
 
-                ctx->new_count = 0;
-                ctx->total_count = 0;
+        ui_init( ctx );
+        while ( 1 )  {
+                rv = tcpstat_tick( ctx );
+                if ( rv < 0 ) 
+                        do_exit( ctx, "Fatal internal error!\n",-1 );
+                else if ( rv == TCPSTAT_TICK_NO_PROCESSES ) 
+                        /* XXX - Some message is needed */
+                        do_exit( ctx, "No more processes to follow!\n",0 );
+
+                ui_update_view( ctx );
+                if ( ctx->round == 1 ) 
+                        report_first_screen( ctx, start_usecs );
+                tcpstat_tick_done( ctx );
                 /*sleep( ctx->update_interval );*/
                 ui_input_loop( ctx );
         }
@@ -53,6 +53,11 @@
 #include "connection.h"
 #include "stat.h"
 #include "scouts.h"
+#include "groupkey.h"
+#include "dnscache.h"
+#include "portmon.h"
+#include "overflow.h"
+#include "arena.h"
 #include "printout_curses.h"
 
 #ifdef DEBUG 
@@ -70,19 +75,18 @@ extern unsigned long int mem_dbg_alloc_peak;
  */
 void gui_print_dbg_banner( struct stat_context *ctx )
 {
-        int active_buckets = 0;
+        int active_buckets;
         struct chashtable *ch;
-        int i;
 
         ch = ctx->chash;
-        for( i=0; i < ch->nrof_buckets; i++ ) {
-                if ( ch->buckets[i] != NULL ) {
-                        active_buckets++;
-                }
-        }
+        active_buckets = chash_active_buckets( ch );
 
         //attron( A_REVERSE );
         add_to_linebuf( "DBG: hashtable{%d (%d/%d active)} dimensions(%dx%d)", ch->size, ch->nrof_buckets, active_buckets,COLS,LINES );
+        add_to_linebuf( " scratch{%zubytes/peak %zubytes}", ctx->scratch->last_used,
+                        ctx->scratch->high_water );
+        add_to_linebuf( " render{%ldus}", main_render_usecs() );
+        add_to_linebuf( " first{%ldms}", ctx->first_screen_usecs / 1000 );
 #ifdef DEBUG_MEM
         add_to_linebuf(" mem{%dbytes/peak %dbytes}", mem_dbg_alloc, mem_dbg_alloc_peak );
 #endif /* DEBUG_MEM */
@@ -102,6 +106,116 @@ static void write_statnum( int num, char *text )
 }
 
 
+/**
+ * Print a line containing statistics for the closed connection events.
+ * @ingroup gui_c
+ * @param ev Pointer to the event source.
+ */
+#ifdef ENABLE_DIAG_EVENTS
+static void gui_print_diag_banner( struct diag_events *ev )
+{
+        add_to_linebuf( "Closed:" );
+        write_linebuf_partial();
+        write_statnum( ev->round_shortlived, " short-lived now," );
+        write_statnum( (int)ev->shortlived, " short-lived total," );
+        write_statnum( (int)ev->closed, " closed" );
+        if ( ev->closed > 0 ) 
+                add_to_linebuf( ", avg lifetime %lds", 
+                                (long)(ev->lifetime_sum / ev->closed ));
+        if ( ev->overruns > 0 ) 
+                add_to_linebuf( ", %lu overruns", ev->overruns );
+        write_linebuf();
+}
+#endif /* ENABLE_DIAG_EVENTS */
+
+/**
+ * Print a line containing statistics for the state transition events and
+ * the time spent on collecting the connections.
+ * @ingroup gui_c
+ * @param ev Pointer to the event source.
+ */
+#ifdef ENABLE_BPF_EVENTS
+static void gui_print_bpf_banner( struct bpf_events *ev )
+{
+        add_to_linebuf( "Transitions:" );
+        write_linebuf_partial();
+        write_statnum( ev->round_events, " now," );
+        write_statnum( (int)ev->events, " total," );
+        if ( ev->drops > 0 ) {
+                write_statnum( (int)ev->drops, " lost," );
+                write_statnum( (int)ev->forced_polls, " extra polls," );
+        }
+        add_to_linebuf( " read %ldus, last poll %ldus", ev->event_usecs, 
+                        ev->poll_usecs );
+        write_linebuf();
+}
+#endif /* ENABLE_BPF_EVENTS */
+
+/**
+ * Print banner containing the statistics for the name cache.
+ * @param cache Pointer to the cache.
+ */
+static void gui_print_dns_banner( struct dns_cache *cache )
+{
+        add_to_linebuf( "Names:" );
+        write_linebuf_partial();
+        write_statnum( (int)cache->index.count, " cached," );
+        write_statnum( (int)cache->hits, " hits," );
+        write_statnum( (int)cache->stale, " stale," );
+        write_statnum( (int)cache->misses, " misses," );
+        add_to_linebuf( " loaded in %ldus, resolving %ldms", cache->load_usecs,
+                        cache->resolve_usecs / 1000 );
+        write_linebuf();
+}
+
+#ifdef ENABLE_SOCK_MEM
+/**
+ * Print banner containing the memory held by the sockets and the limits
+ * for TCP memory.
+ * @param smem The socket memory collection.
+ */
+static void gui_print_mem_banner( struct sock_mem *smem )
+{
+        add_to_linebuf( "Socket memory:" );
+        write_linebuf_partial();
+        add_to_linebuf( " %luK", (unsigned long)( smem->total / 1024 ));
+        write_linebuf_partial_attr( A_BOLD );
+        add_to_linebuf( " held by %d sockets (%d known), kernel", smem->sockets,
+                        smem->matched );
+        write_linebuf_partial();
+        add_to_linebuf( " %ld", smem->kernel_pages );
+        if ( smem->tcp_mem[1] > 0 && smem->kernel_pages >= smem->tcp_mem[1] ) 
+                add_to_linebuf( " (under pressure)" );
+        write_linebuf_partial_attr( A_BOLD );
+        add_to_linebuf( " pages of tcp_mem %ld %ld %ld (page %ldB), dump %ldus",
+                        smem->tcp_mem[0], smem->tcp_mem[1], smem->tcp_mem[2],
+                        smem->page_size, smem->dump_usecs );
+        write_linebuf();
+}
+#endif /* ENABLE_SOCK_MEM */
+
+#ifdef ENABLE_PORT_MONITOR
+/**
+ * Print alert about the ephemeral ports running out.
+ * @param pmon The port monitor.
+ */
+static void gui_print_ports_alert( struct port_monitor *pmon )
+{
+        char buf[2 * INET6_ADDRSTRLEN + 16];
+
+        add_to_linebuf( "Ephemeral ports:" );
+        write_linebuf_partial();
+        add_to_linebuf( " %d%% in use (%s%d of %d)", 
+                        portmon_usage( pmon, pmon->alert ), 
+                        pmon->scale > 1 ? "~" : "",
+                        PORTMON_ESTIMATE( pmon, pmon->alert->count ),
+                        pmon->available );
+        write_linebuf_partial_attr( A_BOLD );
+        add_to_linebuf( " from %s", portmon_format( pmon->alert, buf, sizeof( buf )));
+        write_linebuf();
+}
+#endif /* ENABLE_PORT_MONITOR */
+
 /** 
  * @brief Print the "main" banner.
  * @ingroup gui_c
@@ -131,7 +245,10 @@ void gui_print_banner( struct stat_context *ctx )
         write_linebuf_partial();
 
         if ( ctx->common_policy & POLICY_CLOUD ) {
-                add_to_linebuf( " Related" );
+                add_to_linebuf( " Related (%ds)", ctx->cloud_window );
+                write_linebuf_partial_attr( A_BOLD );
+        } else if ( ctx->common_policy & POLICY_KEY ) {
+                add_to_linebuf( " %s", ctx->gkey->spec );
                 write_linebuf_partial_attr( A_BOLD );
         } else if ( ctx->common_policy & POLICY_IF ) {
                 add_to_linebuf( " Interface" );
@@ -195,23 +312,46 @@ void gui_print_banner( struct stat_context *ctx )
         }
 #endif /* ENABLE_FOLLOW_PID */
 
-        add_to_linebuf( "Connections:");
+        if ( SAMPLING( ctx ) ) 
+                add_to_linebuf( "Connections (estimated from 1/%d):", ctx->sample_rate );
+        else 
+                add_to_linebuf( "Connections:");
         write_linebuf_partial();
-        write_statnum( ctx->total_count, " total,");
-        write_statnum( ctx->new_count, " new,");
+        write_statnum( ctx->total_count + ctx->unsampled_count, " total,");
+        write_statnum( SAMPLE_ESTIMATE( ctx, ctx->new_count ), " new,");
 
         if ( ! OPERATION_ENABLED(ctx, OP_FOLLOW_PID) ) {
                 /* we do not know the direction of connections on
                  * "follow pid" mode. 
                  */
-                write_statnum( glist_connection_count(ctx->out_groups), " outgoing,");
-                write_statnum( glist_connection_count(ctx->listen_groups), " incoming,");
+                write_statnum( SAMPLE_ESTIMATE( ctx, 
+                                glist_connection_count(ctx->out_groups)), " outgoing,");
+                write_statnum( SAMPLE_ESTIMATE( ctx,
+                                glist_connection_count(ctx->listen_groups)), " incoming,");
         }
 
         write_statnum( glist_parent_count( ctx->listen_groups), " listening,");
-        write_statnum( get_ignored_count(ctx), " ignored");
+        write_statnum( SAMPLE_ESTIMATE( ctx, get_ignored_count(ctx)), " ignored");
 
         write_linebuf();
+#ifdef ENABLE_DIAG_EVENTS
+        if ( ctx->diag != NULL ) 
+                gui_print_diag_banner( ctx->diag );
+#endif /* ENABLE_DIAG_EVENTS */
+#ifdef ENABLE_BPF_EVENTS
+        if ( ctx->bpf != NULL ) 
+                gui_print_bpf_banner( ctx->bpf );
+#endif /* ENABLE_BPF_EVENTS */
+        if ( ctx->dns != NULL && OPERATION_ENABLED( ctx, OP_RESOLVE )) 
+                gui_print_dns_banner( ctx->dns );
+#ifdef ENABLE_SOCK_MEM
+        if ( ctx->smem != NULL && OPERATION_ENABLED( ctx, OP_SOCK_MEM )) 
+                gui_print_mem_banner( ctx->smem );
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_PORT_MONITOR
+        if ( ctx->ports != NULL && ctx->ports->alert != NULL ) 
+                gui_print_ports_alert( ctx->ports );
+#endif /* ENABLE_PORT_MONITOR */
         
         //attroff( A_REVERSE );
 }
@@ -231,10 +371,10 @@ void gui_print_if_banners( struct stat_context *ctx )
                 WARN( "Empty interface table\n" );
         }
      
-        attron( A_REVERSE );
+        gui_attron( A_REVERSE );
         add_to_linebuf("\t\t\t Interface statistics \t\t\t");
         write_linebuf();
-        attroff( A_REVERSE );
+        gui_attroff( A_REVERSE );
 
 
         if_p = tab_p->ifs;
@@ -289,6 +429,42 @@ void gui_print_if_banners( struct stat_context *ctx )
         }
 }
 #endif /* ENABLE_IFSTATS */
+
+#ifdef ENABLE_SNMP_STATS
+/**
+ * Number of counters shown on one line.
+ */
+#define SNMP_COUNTERS_PER_LINE 4
+
+/**
+ * Print banner containing the kernel TCP counters (changes per second).
+ * @ingroup gui_c
+ * @param ctx Pointer to the global context.
+ */
+void gui_print_snmp_banners( struct stat_context *ctx )
+{
+        struct snmp_stats *stats = ctx->snmp;
+        const char *name;
+        int i;
+
+        gui_attron( A_REVERSE );
+        add_to_linebuf("\t\t\t Kernel TCP counters (per second) \t\t\t");
+        write_linebuf();
+        gui_attroff( A_REVERSE );
+
+        for ( i = 0; i < stats->nr_counters; i++ ) {
+                name = strchr( stats->counters[i].name, '.' );
+                name = name != NULL ? name + 1 : stats->counters[i].name;
+                add_to_linebuf( " %-18s", name );
+                write_linebuf_partial();
+                add_to_linebuf( "%8lu", stats->counters[i].rate );
+                write_linebuf_partial_attr( A_BOLD );
+                if ( ( i + 1 ) % SNMP_COUNTERS_PER_LINE == 0 ||
+                                i == stats->nr_counters - 1 )
+                        write_linebuf();
+        }
+}
+#endif /* ENABLE_SNMP_STATS */
                 
 
 
@@ -303,7 +479,7 @@ void gui_print_if_banners( struct stat_context *ctx )
  */
 void gui_print_in_banner( struct stat_context *ctx )
 {
-        attron( A_REVERSE );
+        gui_attron( A_REVERSE );
         if ( OPERATION_ENABLED(ctx, OP_SHOW_LISTEN) ) {
                 add_to_linebuf( "\t\t\t Listening and incoming (%d groups )\t\t\t",
                                 glist_get_size( ctx->listen_groups));
@@ -313,7 +489,7 @@ void gui_print_in_banner( struct stat_context *ctx )
         }
 
         write_linebuf();
-        attroff( A_REVERSE );
+        gui_attroff( A_REVERSE );
 }
 
 /** 
@@ -324,11 +500,15 @@ void gui_print_in_banner( struct stat_context *ctx )
  */
 void gui_print_out_banner( struct stat_context *ctx )
 {
-        attron( A_REVERSE );
-        add_to_linebuf( "\t\t\t Outgoing (%d groups )\t\t\t",
-                        glist_get_size( ctx->out_groups));
+        gui_attron( A_REVERSE );
+        if ( ctx->ovf != NULL && ctx->ovf->folded > 0 ) 
+                add_to_linebuf( "\t\t\t Outgoing (%d groups, %d folded )\t\t\t",
+                                glist_get_size( ctx->out_groups), ctx->ovf->folded );
+        else 
+                add_to_linebuf( "\t\t\t Outgoing (%d groups )\t\t\t",
+                                glist_get_size( ctx->out_groups));
         write_linebuf();
-        attroff( A_REVERSE );
+        gui_attroff( A_REVERSE );
 }
 
 /** 
@@ -340,14 +520,14 @@ void gui_print_out_banner( struct stat_context *ctx )
 #ifdef ENABLE_FOLLOW_PID
 void gui_print_pid_banner( struct pidinfo *info_p )
 {
-        attron( A_REVERSE );
+        gui_attron( A_REVERSE );
         if ( info_p->pid == -1 )
                 add_to_linebuf("\t Remaining connections for dead process %s (%d connections)\n",
                              info_p->progname, group_get_size( info_p->grp) );
-        add_to_linebuf("\t Connections by %s(%d) (%d connections)", info_p->progname, 
-                        info_p->pid, group_get_size( info_p->grp ));
+        add_to_linebuf("\t Connections by %s(%d) (%d connections) [scan %ld us]", info_p->progname, 
+                        info_p->pid, group_get_size( info_p->grp ), info_p->scan_usecs );
         write_linebuf();
-        attroff( A_REVERSE );
+        gui_attroff( A_REVERSE );
 }
 #endif /* ENABLE_FOLLOW_PID */
 
@@ -177,10 +177,10 @@ int endpoint_update( struct stat_context *ctx )
 {
         struct group *grp;
 
-        attron( A_REVERSE );
+        gui_attron( A_REVERSE );
         add_to_linebuf("\t\tOutgoing connection endpoint(s): ");
         write_linebuf();
-        attroff( A_REVERSE );
+        gui_attroff( A_REVERSE );
 
         glist_foreach_group( ctx->out_groups, grp ) {
                 do_group( grp );
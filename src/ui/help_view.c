@@ -77,10 +77,10 @@ int init_help_view( _UNUSED struct stat_context *ctx )
  */
 static void print_generic_help()
 {
-        attron( A_UNDERLINE );
+        gui_attron( A_UNDERLINE );
         add_to_linebuf("\tGeneric commands:");
         write_linebuf();
-        attroff( A_UNDERLINE );
+        gui_attroff( A_UNDERLINE );
         add_to_linebuf(" q  ");
         write_linebuf_partial_attr( A_BOLD);
         add_to_linebuf(" Quit program");
@@ -97,10 +97,14 @@ static void print_generic_help()
         write_linebuf_partial_attr( A_BOLD);
         add_to_linebuf(" Toggle display of interface stats");
         write_linebuf();
-        attron( A_UNDERLINE );
+        add_to_linebuf(" C  ");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" Toggle display of kernel TCP counters");
+        write_linebuf();
+        gui_attron( A_UNDERLINE );
         add_to_linebuf("\tViews:");
         write_linebuf();
-        attroff( A_UNDERLINE );
+        gui_attroff( A_UNDERLINE );
         add_to_linebuf(" M  ");
         write_linebuf_partial_attr( A_BOLD);
         add_to_linebuf(" Switch to main view");
@@ -109,6 +113,32 @@ static void print_generic_help()
         write_linebuf_partial_attr( A_BOLD);
         add_to_linebuf(" Switch to endpoint view");
         write_linebuf();
+        add_to_linebuf(" O  ");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" Switch to state view (oldest connections on state)");
+        write_linebuf();
+#ifdef ENABLE_SOCK_MEM
+        add_to_linebuf(" B  ");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" Switch to memory view (socket memory held by groups)");
+        write_linebuf();
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_PORT_MONITOR
+        add_to_linebuf(" U  ");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" Switch to ports view (ephemeral port utilisation)");
+        write_linebuf();
+#endif /* ENABLE_PORT_MONITOR */
+        add_to_linebuf(" D  ");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" Switch to backend view (connections over remote addresses of a port)");
+        write_linebuf();
+#ifdef ENABLE_CONNTRACK
+        add_to_linebuf(" X  ");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" Switch to NAT view (real peers of translated connections)");
+        write_linebuf();
+#endif /* ENABLE_CONNTRACK */
         add_to_linebuf(" H  ");
         write_linebuf_partial_attr( A_BOLD);
         add_to_linebuf(" Show Help");
@@ -128,15 +158,17 @@ static void print_generic_help()
 int help_update( _UNUSED struct stat_context *ctx )
 {
 
-        attron( A_REVERSE );
+        gui_attron( A_REVERSE );
         add_to_linebuf("\t\tAvailable commands: ");
         write_linebuf();
-        attroff( A_REVERSE );
+        gui_attroff( A_REVERSE );
 
         print_generic_help();
 
         main_print_help();
 
+        state_print_help();
+
         write_linebuf();
         add_to_linebuf(" Select a view to exit from help ");
         write_linebuf();
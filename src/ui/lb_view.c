@@ -0,0 +1,342 @@
+/**
+ * @file lb_view.c
+ * @brief Implementation for the backend distribution view.
+ *
+ * The backend view lists the remote ports connected to (pools), with the
+ * distribution of the connections over the remote addresses (backends) of
+ * each port, the most imbalanced pools first. The backends of the selected
+ * pool are listed below the pools. Collecting the distribution is started
+ * when the view is entered for the first time and kept running after that.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ncurses.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_VIEW
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "arena.h"
+#include "lbstat.h"
+#include "printout_curses.h"
+#include "ui.h"
+
+/**
+ * Maximum number of pools listed.
+ */
+#define LB_VIEW_MAX_POOLS 100
+/**
+ * Maximum number of backends listed for the selected pool.
+ */
+#define LB_VIEW_MAX_BACKENDS 50
+/**
+ * Pools with Gini coefficient at least this are highlighted.
+ */
+#define LB_VIEW_IMBALANCE 0.25
+
+/**
+ * Pool collected on update with its distribution figures. The pool itself
+ * is valid only during the update, family and port identify the pool
+ * between updates.
+ */
+struct lb_row {
+        struct lb_pool *pool; /**< The pool */
+        uint32_t family; /**< Address family of the pool */
+        in_port_t rport; /**< Remote port of the pool */
+        struct lb_summary sum; /**< Distribution figures */
+};
+
+/**
+ * Pools collected on every update.
+ */
+static struct {
+        struct lb_row *rows; /**< The pools */
+        int count; /**< Number of pools collected */
+        int size; /**< Number of slots on rows */
+} found;
+
+/**
+ * The pool whose backends are listed.
+ */
+static struct {
+        uint32_t family; /**< Address family, 0 if nothing is selected */
+        in_port_t rport; /**< Remote port */
+} selected;
+
+/**
+ * @defgroup lbview Backend view functions
+ */
+
+/** 
+ * @brief Initialize the backend view.
+ *
+ * Collecting the distribution is started if it is not running, the outgoing
+ * connections already known are counted.
+ * 
+ * @ingroup lbview
+ * @param ctx Pointer to global context
+ * 
+ * @return 0.
+ */
+int init_lb_view( struct stat_context *ctx )
+{
+        TRACE("Initializing backend view\n");
+        if ( gui_get_current_view() == LB_VIEW ) 
+                return 0;
+
+        if ( ctx->lb == NULL ) {
+                ctx->lb = lb_stats_init();
+                lb_add_all( ctx->lb, ctx->chash );
+        }
+        gui_set_current_view( LB_VIEW );
+        return 0;
+}
+
+/** 
+ * @brief Deinitialize the backend view.
+ *
+ * The collected pools are dropped, the distribution is still
+ * collected.
+ * 
+ * @ingroup lbview
+ * @param ctx Pointer to global context
+ */
+void deinit_lb_view( _UNUSED struct stat_context *ctx )
+{
+        /* The rows were allocated from the scratch arena */
+        found.rows = NULL;
+        found.size = 0;
+        found.count = 0;
+}
+
+/**
+ * Compare the pools by imbalance, most imbalanced first. Pools with equal
+ * imbalance are ordered by the number of connections.
+ */
+static int compare_gini( const void *a, const void *b )
+{
+        const struct lb_row *ra = a;
+        const struct lb_row *rb = b;
+
+        if ( ra->sum.gini != rb->sum.gini ) 
+                return ra->sum.gini < rb->sum.gini ? 1 : -1;
+        return rb->pool->conns - ra->pool->conns;
+}
+
+/**
+ * @brief Find the row for the selected pool.
+ *
+ * @return Index of the selected pool on found rows, -1 if not found.
+ */
+static int selected_row( void )
+{
+        int i;
+
+        for ( i = 0; i < found.count; i++ ) {
+                if ( found.rows[i].family == selected.family && 
+                                found.rows[i].rport == selected.rport ) 
+                        return i;
+        }
+        return -1;
+}
+
+/**
+ * @brief Print the backends of pool, most connections first.
+ *
+ * @param pool The pool.
+ * @param scale Connections each counted connection stands for.
+ */
+static void print_backends( struct lb_pool *pool, int scale )
+{
+        struct lb_bucket *bucket;
+        struct lb_backend *backend;
+        char buf[INET6_ADDRSTRLEN];
+        int cnt = 0;
+
+        gui_attron( A_UNDERLINE );
+        add_to_linebuf( "%8s %7s  Backends for port %hu%s", "Conns", "Share", 
+                        ntohs( pool->rport ), pool->family == AF_INET6 ? " (IPv6)" : "" );
+        write_linebuf();
+        gui_attroff( A_UNDERLINE );
+
+        for ( bucket = pool->tail; bucket != NULL; bucket = bucket->prev ) {
+                for ( backend = bucket->backends; backend != NULL; 
+                                backend = backend->next ) {
+                        if ( cnt++ == LB_VIEW_MAX_BACKENDS ) 
+                                break;
+                        add_to_linebuf( "%8d %6.1f%%  %s", bucket->count * scale, 
+                                        100.0 * bucket->count / pool->conns,
+                                        lb_format_backend( backend, buf, sizeof( buf )));
+                        write_linebuf();
+                }
+        }
+        if ( pool->backends > LB_VIEW_MAX_BACKENDS ) {
+                add_to_linebuf( "  ... %d more", pool->backends - LB_VIEW_MAX_BACKENDS );
+                write_linebuf();
+        }
+}
+
+/** 
+ * @brief Update the UI with the backend view.
+ *
+ * @ingroup lbview
+ * @param ctx Pointer to the global context.
+ * 
+ * @return 0.
+ */
+int lb_update( struct stat_context *ctx )
+{
+        struct lb_stats *lb = ctx->lb;
+        struct hash_link *link;
+        struct lb_pool *pool;
+        struct lb_row *row;
+        unsigned int chain;
+        int i, sel;
+
+        found.rows = NULL;
+        found.count = 0;
+        found.size = 0;
+        for ( chain = 0; chain < lb->pool_index.size; chain++ ) {
+                for ( link = lb->pool_index.chains[chain]; link != NULL; link = link->next ) {
+                        pool = HASH_ENTRY( link, struct lb_pool, link );
+                        if ( found.count == found.size ) {
+                                found.size = found.size ? found.size * 2 : 64;
+                                found.rows = arena_grow( ctx->scratch, found.rows, 
+                                                found.count * sizeof( *found.rows ),
+                                                found.size * sizeof( *found.rows ));
+                        }
+                        row = &found.rows[found.count++];
+                        row->pool = pool;
+                        row->family = pool->family;
+                        row->rport = pool->rport;
+                        lb_pool_summary( pool, &row->sum );
+                }
+        }
+        qsort( found.rows, found.count, sizeof( *found.rows ), compare_gini );
+        sel = selected_row();
+        if ( sel < 0 && found.count > 0 ) {
+                sel = 0;
+                selected.family = found.rows[0].family;
+                selected.rport = found.rows[0].rport;
+        }
+
+        gui_pad_begin();
+        gui_attron( A_REVERSE );
+        add_to_linebuf( "\t\tBackend distribution, %d ports, %d backends (s/S: select port) ",
+                        lb->pools, lb->backends );
+        if ( SAMPLING( ctx )) 
+                add_to_linebuf( "(connections estimated from 1/%d) ", ctx->sample_rate );
+        write_linebuf();
+        gui_attroff( A_REVERSE );
+
+        gui_attron( A_UNDERLINE );
+        add_to_linebuf( "  %-7s %8s %8s %6s %6s %8s %8s %6s", "Port", "Backends", 
+                        "Conns", "Min", "Max", "Mean", "Stddev", "Gini" );
+        write_linebuf();
+        gui_attroff( A_UNDERLINE );
+
+        for ( i = 0; i < found.count && i < LB_VIEW_MAX_POOLS; i++ ) {
+                row = &found.rows[i];
+                add_to_linebuf( "%c %-7hu %8d %8d %6d %6d %8.1f %8.1f %6.2f%s", 
+                                i == sel ? '>' : ' ', ntohs( row->rport ), 
+                                row->pool->backends, 
+                                SAMPLE_ESTIMATE( ctx, row->pool->conns ), 
+                                SAMPLE_ESTIMATE( ctx, row->sum.min ), 
+                                SAMPLE_ESTIMATE( ctx, row->sum.max ), 
+                                SAMPLE_ESTIMATE( ctx, row->sum.mean ), 
+                                SAMPLE_ESTIMATE( ctx, row->sum.stddev ), 
+                                row->sum.gini, row->family == AF_INET6 ? " IPv6" : "" );
+                if ( row->pool->backends > 1 && row->sum.gini >= LB_VIEW_IMBALANCE ) 
+                        write_linebuf_partial_attr( A_BOLD );
+                write_linebuf();
+        }
+        if ( found.count > LB_VIEW_MAX_POOLS ) {
+                add_to_linebuf( "  ... %d more", found.count - LB_VIEW_MAX_POOLS );
+                write_linebuf();
+        }
+        if ( sel >= 0 ) {
+                write_linebuf();
+                print_backends( found.rows[sel].pool, 
+                                SAMPLING( ctx ) ? ctx->sample_rate : 1 );
+        }
+        gui_pad_end();
+
+        return 0;
+}
+
+/** 
+ * @brief Handle the commands for backend view.
+ *
+ * @ingroup lbview
+ * @param ctx Pointer to the global context
+ * @param key The key pressed by user.
+ * 
+ * @return 0 if the key did not match any command, 1 if it did.
+ */
+int lb_input( _UNUSED struct stat_context *ctx, int key )
+{
+        int rv = 1, sel;
+
+        switch ( key ) {
+                case 's' :
+                case 'S' :
+                        if ( found.count == 0 ) 
+                                break;
+                        sel = selected_row();
+                        if ( key == 's' ) 
+                                sel = ( sel + 1 ) % found.count;
+                        else 
+                                sel = sel <= 0 ? found.count - 1 : sel - 1;
+                        selected.family = found.rows[sel].family;
+                        selected.rport = found.rows[sel].rport;
+                        break;
+                case KEY_NPAGE :
+                        gui_pad_scroll( gui_pad_page_size() );
+                        break;
+                case KEY_PPAGE :
+                        gui_pad_scroll( -gui_pad_page_size() );
+                        break;
+                default :
+                        rv = 0;
+                        break;
+        }
+        return rv;
+}
@@ -51,6 +51,7 @@
 #include "connection.h"
 #include "stat.h"
 #include "scouts.h"
+#include "groupkey.h"
 #include "printout_curses.h"
 
 /*
@@ -77,6 +78,39 @@
  */
 #define SYMBOL_DEFAULT ' ' 
 
+/**
+ * State of the group selection on main view. 
+ *
+ * The selected group is remembered by pointer, the index is used if the
+ * group has vanished since last update. The pointer is only compared against
+ * the groups being printed, the group it points to is never accessed
+ * directly.
+ */
+static struct {
+        struct group *grp; /**< Selected group */
+        int index; /**< Index of the selected group */
+        int count; /**< Number of selectable groups on last update */
+        int next; /**< Index of the group being printed */
+        int present; /**< Non-zero if the selected group is on the view */
+        int follow; /**< Non-zero if the view should scroll to selected group */
+        int toggle; /**< Non-zero if selected group should be collapsed/expanded */
+} sel;
+
+/**
+ * Sampling rate for the connections on last update, the sizes of groups are
+ * estimated by multiplying with it. 1 if all connections are tracked.
+ */
+static int sample_rate = 1;
+
+/**
+ * Number of connections on group, estimated when sampling.
+ */
+#define GROUP_SIZE_EST(g) ( group_get_size( g ) * sample_rate )
+/**
+ * Marker for estimated sizes.
+ */
+#define EST_MARK ( sample_rate > 1 ? "~" : "" )
+
 /**
  * Table holding the string representations of enum tcp_state.
  */
@@ -123,7 +157,7 @@ static char *dir_to_string( enum connection_dir dir )
  * @param state The enum constant to get string for.
  * @return String containing the string representation of the enum constant.
  */ 
-static char *conn_state_to_str( enum tcp_state state ) 
+char *conn_state_to_str( enum tcp_state state ) 
 {
         if ( state > TCP_CLOSING ) {
                 state = 0;
@@ -330,8 +364,95 @@ static void print_rt_info( struct tcp_connection *conn_p )
 }
 #endif /* ENABLE_ROUTES */
 
+/**
+ * Formatted row segment of a connection, from the interface name up to the
+ * route. The segment changes rarely, hence it is kept with the connection
+ * and reused until the connection or the view changes.
+ */
+struct conn_row {
+        uint32_t gen; /**< render_gen the segment was formatted on */
+        uint32_t version; /**< Version of the connection metadata */
+        size_t size; /**< Space allocated for the text */
+        char text[]; /**< The formatted segment */
+};
+
+/**
+ * Render generation, changed when the screen width or the options
+ * affecting the formatted rows change.
+ */
+static uint32_t render_gen = 1;
+
+/**
+ * Time spent formatting the main view on last update (microseconds).
+ */
+static long render_usecs;
+
+/**
+ * Start new render generation if the screen width or options affecting the
+ * formatted rows have changed since last update.
+ */
+static void check_render_gen( void )
+{
+        static int cols = -1, opts = -1;
+        int now_opts = 0;
+
+        if ( gui_is_enabled( UI_RESOLVE_NAMES ))
+                now_opts |= 0x01;
+        if ( gui_is_enabled( UI_SHOW_ROUTE ))
+                now_opts |= 0x02;
+
+        if ( cols != gui_get_columns() || opts != now_opts ) {
+                cols = gui_get_columns();
+                opts = now_opts;
+                render_gen++;
+        }
+}
+
+/**
+ * Add the interface, address and route information of the connection to the
+ * line buffer. The segment is formatted only if the one saved with the
+ * connection is out of date.
+ *
+ * @param conn_p Pointer to the connection.
+ */
+static void print_connection_row( struct tcp_connection *conn_p )
+{
+        struct conn_row *row = conn_p->row;
+        const char *seg;
+        size_t start, len;
+
+        if ( row != NULL && row->gen == render_gen && 
+                        row->version == conn_p->metadata.version ) {
+                add_str_to_linebuf( row->text );
+                return;
+        }
+
+        start = strlen( get_linebuf() );
+        add_to_linebuf( "%4s   ", 
+                        conn_p->metadata.ifname?conn_p->metadata.ifname:"N/A");
+        print_connection_addrs( conn_p );
+#ifdef ENABLE_ROUTES
+        if (gui_is_enabled(UI_SHOW_ROUTE))
+                print_rt_info( conn_p );
+#endif /* ENABLE_ROUTES */
+
+        seg = get_linebuf() + start;
+        len = strlen( seg );
+        if ( row == NULL || row->size <= len ) {
+                row = mem_realloc( row, sizeof( *row ) + len + 1 );
+                row->size = len + 1;
+                conn_p->row = row;
+        }
+        memcpy( row->text, seg, len + 1 );
+        row->gen = render_gen;
+        /* resolving may have changed the version while formatting */
+        row->version = conn_p->metadata.version;
+}
+
 /**
  * Print a line containing the connection information. 
+ * Only the update symbol, state and time are formatted on every update, the
+ * rest of the line is kept formatted with the connection.
  * @ingroup gui_c
  * @bug Layout of the line is messed up the address fields should change
  * dynamically according to the available row length.
@@ -344,26 +465,21 @@ static void gui_print_connection( struct tcp_connection *conn_p )
         if ( conn_p->state == TCP_DEAD ) {
                 /* lingering, already dead connection */
                 update_symbol = SYMBOL_DEAD;
-                attron( A_DIM );
+                gui_attron( A_DIM );
         } else if ( metadata_is_state_changed( conn_p->metadata ) ){
                 update_symbol = SYMBOL_NEW_STATE;
                 //attron( A_UNDERLINE );
         }  else if ( metadata_is_new( conn_p->metadata ) ) {
                 update_symbol = SYMBOL_NEW;
-                attron( A_STANDOUT );
+                gui_attron( A_STANDOUT );
         } else if ( metadata_is_warn( conn_p->metadata)) {
                 update_symbol = SYMBOL_WARN;
         } else {
                 update_symbol = SYMBOL_DEFAULT;
         }
 
-        add_to_linebuf( "%c %4s   ",update_symbol, 
-                        conn_p->metadata.ifname?conn_p->metadata.ifname:"N/A");
-        print_connection_addrs( conn_p );
-#ifdef ENABLE_ROUTES
-        if (gui_is_enabled(UI_SHOW_ROUTE))
-                print_rt_info( conn_p );
-#endif /* ENABLE_ROUTES */
+        add_to_linebuf( "%c ", update_symbol );
+        print_connection_row( conn_p );
 
         write_linebuf_partial();
         add_to_linebuf( " %-12s", conn_state_to_str( conn_p->state ));
@@ -374,7 +490,7 @@ static void gui_print_connection( struct tcp_connection *conn_p )
         add_to_linebuf( " %-9s", get_live_time( &(conn_p->metadata),live_time,10 ) );
         write_linebuf();
 
-        attrset(A_NORMAL);
+        gui_attrset(A_NORMAL);
 
 }
 
@@ -410,6 +526,140 @@ static void print_titlebar()
 
 
 
+/**
+ * Check if a group is collapsed, i.e. only the banner for it is shown. 
+ * Unless the user has collapsed or expanded the group, groups with more than
+ * GUI_GROUP_COLLAPSE_LIMIT connections are collapsed.
+ *
+ * @param grp Pointer to the group.
+ * @return non-zero if group is collapsed, 0 if not.
+ */
+static int group_is_collapsed( struct group *grp )
+{
+        if ( grp->flags & GROUP_F_COLLAPSED )
+                return 1;
+        if ( grp->flags & GROUP_F_EXPANDED )
+                return 0;
+
+        return group_get_size( grp ) > GUI_GROUP_COLLAPSE_LIMIT;
+}
+
+/**
+ * Collapse expanded group or expand collapsed group.
+ * @param grp Pointer to the group.
+ */
+static void group_toggle_collapsed( struct group *grp )
+{
+        if ( group_is_collapsed( grp ) ) 
+                grp->flags = (grp->flags & ~GROUP_F_COLLAPSED) | GROUP_F_EXPANDED;
+        else
+                grp->flags = (grp->flags & ~GROUP_F_EXPANDED) | GROUP_F_COLLAPSED;
+}
+
+/**
+ * Check if banner will be printed for the group.
+ * @see gui_print_group()
+ * @param grp Pointer to the group.
+ * @param print_parent non-zero if parent is printed.
+ * @param print_banner non-zero if banners are printed.
+ * @return non-zero if banner will be printed.
+ */
+static int group_has_banner( struct group *grp, int print_parent, int print_banner )
+{
+        return print_banner && (print_parent || group_get_size( grp ) > 0);
+}
+
+/**
+ * Check if the group whose banner is being printed is the selected one.
+ * Groups are numbered in the order their banners are printed.
+ * @param grp Pointer to the group being printed.
+ * @return non-zero if the group is selected.
+ */
+static int group_is_selected( struct group *grp )
+{
+        int idx = sel.next++;
+
+        if ( sel.present ) {
+                if ( grp != sel.grp ) 
+                        return 0;
+                sel.index = idx;
+        } else {
+                if ( idx != sel.index ) 
+                        return 0;
+                sel.grp = grp;
+        }
+        return 1;
+}
+
+/** 
+ * @brief Add the banner for group formed with grouping key to linebuf.
+ *
+ * The values for the fields on key are taken from the first connection on
+ * group.
+ * 
+ * @param grp Pointer to the group.
+ */
+static void add_key_banner( struct group *grp )
+{
+        struct gkey_plan *plan = grp->gkey->index->plan;
+        struct tcp_connection *conn_p = group_get_first_conn( grp );
+        int i;
+
+        if ( conn_p == NULL ) {
+                add_to_linebuf( "Connections by %s (0 connections)", plan->spec );
+                return;
+        }
+
+        add_to_linebuf( "Connections with" );
+        for ( i = 0; i < plan->nr_steps; i++ ) {
+                add_to_linebuf( "%s %s ", i > 0 ? "," : "", 
+                                gkey_field_name( plan->steps[i].field ));
+                switch ( plan->steps[i].field ) {
+                        case GKEY_LADDR :
+                                add_to_linebuf( "%s", conn_p->metadata.laddr_string );
+                                break;
+                        case GKEY_RADDR :
+                                add_to_linebuf( "%s", conn_p->metadata.raddr_string );
+                                break;
+                        case GKEY_LPORT :
+                                add_to_linebuf( "%d", connection_get_port( conn_p, 1 ));
+                                break;
+                        case GKEY_RPORT :
+                                add_to_linebuf( "%d", connection_get_port( conn_p, 0 ));
+                                break;
+                        case GKEY_STATE :
+                                add_to_linebuf( "%s", conn_state_to_str( conn_p->state ));
+                                break;
+                        case GKEY_IF :
+                                add_to_linebuf( "%s", conn_p->metadata.ifname ? 
+                                                conn_p->metadata.ifname : "unknown" );
+                                break;
+                        case GKEY_AF :
+                                add_to_linebuf( "%s", conn_p->family == AF_INET6 ? 
+                                                "IPv6" : "IPv4" );
+                                break;
+#ifdef ENABLE_FOLLOW_PID
+                        case GKEY_PID :
+                                if ( conn_p->metadata.pid != 0 ) 
+                                        add_to_linebuf( "%d", conn_p->metadata.pid );
+                                else 
+                                        add_to_linebuf( "unknown" );
+                                break;
+#endif /* ENABLE_FOLLOW_PID */
+                        case GKEY_PEER :
+                                add_to_linebuf( "%s", conn_p->nat != NULL ? 
+                                                conn_p->nat->peer_string :
+                                                conn_p->metadata.raddr_string );
+                                break;
+                        case GKEY_PEERPORT :
+                                add_to_linebuf( "%hu", ntohs( ss_get_port( conn_p->nat != NULL ?
+                                                &conn_p->nat->peer : &conn_p->raddr )));
+                                break;
+                }
+        }
+        add_to_linebuf( " (%s%d connections)", EST_MARK, GROUP_SIZE_EST( grp ));
+}
+
 /** 
  * @brief Print information for a connection group.
  * A line containing information for each connection on the group is printed.
@@ -425,17 +675,36 @@ static void print_titlebar()
 static void gui_print_group( struct group *grp, int print_parent, int print_banner )
 {
         struct tcp_connection *conn_p;
+        int collapsed = 0;
 
         uint16_t policy = group_get_policy( grp );
 
-        if ( print_banner && (print_parent || group_get_size( grp ) > 0) ) {
-
+        if ( group_has_banner( grp, print_parent, print_banner ) ) {
 
-                attron( A_UNDERLINE );
-                if ( policy & POLICY_IF ) {
+                if ( group_is_selected( grp ) ) {
+                        if ( sel.toggle ) {
+                                group_toggle_collapsed( grp );
+                                sel.toggle = 0;
+                        }
+                        if ( sel.follow ) {
+                                gui_pad_show_line( gui_pad_current_line() );
+                                sel.follow = 0;
+                        }
+                        gui_attron( A_REVERSE );
+                }
+                collapsed = group_is_collapsed( grp );
+
+                gui_attron( A_UNDERLINE );
+                add_to_linebuf( collapsed ? "[+] " : "[-] " );
+                if ( grp->flags & GROUP_F_OVERFLOW ) {
+                        add_to_linebuf( "Other, least recently active groups (%s%d connections)",
+                                        EST_MARK, GROUP_SIZE_EST( grp ));
+                } else if ( ( policy & POLICY_KEY ) && grp->gkey != NULL ) {
+                        add_key_banner( grp );
+                } else if ( policy & POLICY_IF ) {
                         add_to_linebuf( "Connections in interface %s\n", grp->grp_filter->ifname );
                 } else if ( policy & POLICY_CLOUD ) {
-                        add_to_linebuf("Related ( %d connections)", group_get_size( grp ));
+                        add_to_linebuf("Related ( %s%d connections)", EST_MARK, GROUP_SIZE_EST( grp ));
 
                 } else if ( (policy & (POLICY_REMOTE | POLICY_LOCAL ) ) != 0 ) {
                         conn_p = group_get_first_conn( grp );
@@ -464,18 +733,20 @@ static void gui_print_group( struct group *grp, int print_parent, int print_bann
                                 add_to_linebuf( " port %d ", connection_get_port( conn_p, 
                                                         policy & POLICY_LOCAL ));
 
-                        add_to_linebuf( " (%d connections)", group_get_size( grp) );
+                        add_to_linebuf( " (%s%d connections)", EST_MARK, GROUP_SIZE_EST( grp ));
                 } else  if ( policy & POLICY_STATE ) {
                         add_to_linebuf( "Connections on state %s\n", 
                                         conn_state_to_str( grp->grp_filter->state ));
-                        add_to_linebuf( " (%d connections)", group_get_size( grp) );
+                        add_to_linebuf( " (%s%d connections)", EST_MARK, GROUP_SIZE_EST( grp ));
                 } else {
 
-                        add_to_linebuf( "+   Group: %d connections", group_get_size( grp ));
+                        add_to_linebuf( "+   Group: %s%d connections", EST_MARK, GROUP_SIZE_EST( grp ));
                 }
 
                 write_linebuf();
-                attroff( A_UNDERLINE);
+                gui_attroff( A_UNDERLINE | A_REVERSE );
+                if ( collapsed ) 
+                        return;
         }
         conn_p = group_get_parent( grp );
         if ( conn_p && print_parent ) 
@@ -542,6 +813,14 @@ int main_input( struct stat_context *ctx, int key )
                         TRACE( "Switching grouping to state " );
                         switch_grouping( ctx, POLICY_STATE );
                         break;
+                case 'K' :
+                        if ( ctx->gkey != NULL ) {
+                                TRACE( "Switching grouping to key %s", ctx->gkey->spec );
+                                switch_grouping( ctx, gkey_plan_policy( ctx->gkey ));
+                        } else {
+                                rv = 0;
+                        }
+                        break;
                 case 'T' :
                         TRACE("Toggling fuzzy timestamps");
                         gui_toggle_operation(UI_FUZZY_TIMESTAMPS);
@@ -552,6 +831,35 @@ int main_input( struct stat_context *ctx, int key )
                         gui_toggle_operation(UI_SHOW_ROUTE);
                         break;
 #endif /* ENABLE_ROUTES */
+                case KEY_UP :
+                case 'k' :
+                        if ( sel.index > 0 ) {
+                                sel.index--;
+                                sel.grp = NULL;
+                        }
+                        sel.follow = 1;
+                        break;
+                case KEY_DOWN :
+                case 'j' :
+                        if ( sel.index < sel.count - 1 ) {
+                                sel.index++;
+                                sel.grp = NULL;
+                        }
+                        sel.follow = 1;
+                        break;
+                case ' ' :
+                case '\n' :
+                case KEY_ENTER :
+                        TRACE( "Toggling collapse of group %d", sel.index );
+                        sel.toggle = 1;
+                        sel.follow = 1;
+                        break;
+                case KEY_NPAGE :
+                        gui_pad_scroll( gui_pad_page_size() );
+                        break;
+                case KEY_PPAGE :
+                        gui_pad_scroll( -gui_pad_page_size() );
+                        break;
                 default :
                         WARN( "Unkown key pressed %c (%d), ignoring\n",(char)key,key );
                         rv = 0;
@@ -562,10 +870,10 @@ int main_input( struct stat_context *ctx, int key )
 
 void main_print_help() 
 {
-        attron( A_UNDERLINE );
+        gui_attron( A_UNDERLINE );
         add_to_linebuf("\tMain view commands:");
         write_linebuf();
-        attroff( A_UNDERLINE );
+        gui_attroff( A_UNDERLINE );
         add_to_linebuf(" l  ");
         write_linebuf_partial_attr( A_BOLD);
         add_to_linebuf(" Toggle display of listening \"connections\"");
@@ -603,6 +911,25 @@ void main_print_help()
         write_linebuf_partial_attr( A_BOLD);
         add_to_linebuf(" group by connection state");
         write_linebuf();
+        add_to_linebuf(" K");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" group by the key given with --group (e.g. \"lport,raddr\")");
+        write_linebuf();
+        write_linebuf();
+        add_to_linebuf("  Commands for browsing the groups");
+        write_linebuf();
+        add_to_linebuf(" Up/Down");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" select group  ");
+        write_linebuf_partial();
+        add_to_linebuf("Space");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" collapse/expand selected group");
+        write_linebuf();
+        add_to_linebuf(" PgUp/PgDn");
+        write_linebuf_partial_attr( A_BOLD);
+        add_to_linebuf(" scroll the view");
+        write_linebuf();
 }
 
 
@@ -638,6 +965,7 @@ static void do_print_stat_pids( struct stat_context *ctx )
 {
         struct pidinfo *info_p;
 
+        gui_pad_begin();
         info_p = ctx->pinfo;
         while ( info_p != NULL ) {
                 if ( group_get_size( info_p->grp ) > 0 ) {
@@ -647,6 +975,7 @@ static void do_print_stat_pids( struct stat_context *ctx )
                 }
                 info_p = info_p->next;
         }
+        gui_pad_end();
 }
 #endif /* ENABLE_FOLLOW_PID */
 /** 
@@ -659,13 +988,27 @@ static void do_print_stat_pids( struct stat_context *ctx )
 static void do_print_stat( struct stat_context *ctx )
 {
         struct group *grp;
+        int show_listen = OPERATION_ENABLED( ctx, OP_SHOW_LISTEN );
+
+        /* Find out if the selected group is still there */
+        sel.present = 0;
+        glist_foreach_group( ctx->listen_groups, grp ) {
+                if ( grp == sel.grp && group_has_banner( grp, show_listen, 1 ) )
+                        sel.present = 1;
+        }
+        glist_foreach_group( ctx->out_groups, grp ) {
+                if ( grp == sel.grp && group_has_banner( grp, 1, 1 ) )
+                        sel.present = 1;
+        }
+        sel.next = 0;
 
+        gui_pad_begin();
         if ( OPERATION_ENABLED( ctx, OP_SHOW_LISTEN) ||
                         glist_get_size_nonempty( ctx->listen_groups ) > 0 ) {
 
                 gui_print_in_banner( ctx );
                 glist_foreach_group( ctx->listen_groups, grp ) {
-                        gui_print_group( grp, OPERATION_ENABLED(ctx, OP_SHOW_LISTEN),1 );
+                        gui_print_group( grp, show_listen, 1 );
                 }
         }
 
@@ -674,6 +1017,13 @@ static void do_print_stat( struct stat_context *ctx )
         glist_foreach_group( ctx->out_groups, grp ) {
                 gui_print_group( grp,1,1 );
         }
+        gui_pad_end();
+
+        sel.count = sel.next;
+        if ( sel.index >= sel.count ) 
+                sel.index = sel.count > 0 ? sel.count - 1 : 0;
+        /* Toggle is only honored if the selected group was printed */
+        sel.toggle = 0;
 }
 
 /** 
@@ -689,6 +1039,10 @@ static void do_print_stat( struct stat_context *ctx )
  */
 int main_update( struct stat_context *ctx )
 {
+        long start = connection_now_usecs();
+
+        sample_rate = SAMPLING( ctx ) ? ctx->sample_rate : 1;
+        check_render_gen();
 
 #ifdef ENABLE_FOLLOW_PID
         if ( OPERATION_ENABLED(ctx, OP_FOLLOW_PID) )
@@ -697,5 +1051,16 @@ int main_update( struct stat_context *ctx )
 #endif /* ENABLE_FOLLOW_PID */
                 do_print_stat( ctx );
 
+        render_usecs = connection_now_usecs() - start;
         return 0;
 }
+
+/**
+ * Get the time spent formatting the main view on last update.
+ * @ingroup mview
+ * @return The time in microseconds.
+ */
+long main_render_usecs( void )
+{
+        return render_usecs;
+}
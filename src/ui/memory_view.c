@@ -0,0 +1,419 @@
+/**
+ * @file memory_view.c
+ * @brief Implementation for the memory view.
+ *
+ * The memory view shows the groups holding most socket memory, followed by
+ * the connections holding most. The memory used by the sockets is only
+ * collected while the view is active (unless collection was requested from
+ * command line).
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ncurses.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_VIEW
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "arena.h"
+#include "scouts.h"
+#include "printout_curses.h"
+#include "ui.h"
+
+#ifdef ENABLE_SOCK_MEM
+/**
+ * Maximum number of groups and connections listed.
+ */
+#define MEMORY_VIEW_MAX_ROWS 100
+
+/**
+ * Set if the collection was started by the view, the collection is stopped
+ * when the view is left.
+ */
+static int started_here;
+
+/**
+ * Groups holding memory, collected on every update.
+ */
+static struct {
+        struct group **grps; /**< The groups */
+        int count; /**< Number of groups collected */
+        int size; /**< Number of slots on grps */
+} groups;
+
+/**
+ * Connections holding memory, collected on every update.
+ */
+static struct {
+        struct tcp_connection **conns; /**< The connections */
+        int count; /**< Number of connections collected */
+        int size; /**< Number of slots on conns */
+} found;
+
+/**
+ * @defgroup mview Memory view functions
+ */
+
+/** 
+ * @brief Initialize the memory view.
+ *
+ * The collection of socket memory is started if it is not running.
+ * 
+ * @ingroup mview
+ * @param ctx Pointer to global context
+ * 
+ * @return 0 on success, -1 if the memory can not be collected.
+ */
+int init_memory_view( struct stat_context *ctx )
+{
+        TRACE("Initializing memory view\n");
+        if ( gui_get_current_view() == MEMORY_VIEW ) 
+                return 0;
+
+        if ( ctx->smem == NULL ) 
+                ctx->smem = sock_mem_init();
+        if ( ctx->smem == NULL ) {
+                ui_show_message( LOCATION_BANNER, 
+                                "Socket memory not available (sock_diag failed)" );
+                return -1;
+        }
+        if ( ! OPERATION_ENABLED( ctx, OP_SOCK_MEM )) {
+                OPERATION_ENABLE( ctx, OP_SOCK_MEM );
+                started_here = 1;
+        }
+        gui_set_current_view( MEMORY_VIEW );
+        return 0;
+}
+
+/** 
+ * @brief Deinitialize the memory view.
+ *
+ * The collected groups and connections are dropped. If the collection
+ * was started by the view, it is stopped.
+ * 
+ * @ingroup mview
+ * @param ctx Pointer to global context
+ */
+void deinit_memory_view( struct stat_context *ctx )
+{
+        if ( started_here ) {
+                OPERATION_DISABLE( ctx, OP_SOCK_MEM );
+                sock_mem_clear( ctx );
+                started_here = 0;
+        }
+        /* The groups and connections were allocated from the scratch arena */
+        groups.grps = NULL;
+        groups.size = 0;
+        groups.count = 0;
+        found.conns = NULL;
+        found.size = 0;
+        found.count = 0;
+}
+
+/**
+ * @brief Format amount of memory.
+ *
+ * @param buf Buffer for the string.
+ * @param buflen Length of the buffer.
+ * @param bytes The amount of memory in bytes.
+ * @return Pointer to @a buf.
+ */
+static char *format_bytes( char *buf, int buflen, uint64_t bytes )
+{
+        if ( bytes < 10 * 1024 ) 
+                snprintf( buf, buflen, "%lu", (unsigned long)bytes );
+        else if ( bytes < 10 * 1024 * 1024 ) 
+                snprintf( buf, buflen, "%luK", (unsigned long)( bytes / 1024 ));
+        else 
+                snprintf( buf, buflen, "%luM", (unsigned long)( bytes / ( 1024 * 1024 )));
+        return buf;
+}
+
+/**
+ * @brief Add group to the collected groups if it holds memory.
+ *
+ * @param grp The group.
+ * @param scratch Arena for the collected groups.
+ */
+static void collect_group( struct group *grp, struct arena *scratch )
+{
+        if ( grp->mem_held == 0 ) 
+                return;
+        if ( groups.count == groups.size ) {
+                groups.size = groups.size ? groups.size * 2 : 64;
+                groups.grps = arena_grow( scratch, groups.grps, 
+                                groups.count * sizeof( *groups.grps ),
+                                groups.size * sizeof( *groups.grps ));
+        }
+        groups.grps[groups.count++] = grp;
+}
+
+/**
+ * @brief Add connection to the found connections if it holds memory.
+ *
+ * @param conn_p The connection.
+ * @param data Arena for the collected connections.
+ */
+static void collect_connection( struct tcp_connection *conn_p, void *data )
+{
+        if ( conn_p->mem == NULL || conn_p->mem->held == 0 ) 
+                return;
+
+        if ( found.count == found.size ) {
+                found.size = found.size ? found.size * 2 : 64;
+                found.conns = arena_grow( data, found.conns, 
+                                found.count * sizeof( *found.conns ),
+                                found.size * sizeof( *found.conns ));
+        }
+        found.conns[found.count++] = conn_p;
+}
+
+/**
+ * Compare the groups by memory held, most first.
+ */
+static int compare_group_mem( const void *a, const void *b )
+{
+        const struct group *ga = *(struct group * const *)a;
+        const struct group *gb = *(struct group * const *)b;
+
+        if ( ga->mem_held > gb->mem_held ) 
+                return -1;
+        return ga->mem_held < gb->mem_held;
+}
+
+/**
+ * Compare the connections by memory held, most first.
+ */
+static int compare_conn_mem( const void *a, const void *b )
+{
+        const struct tcp_connection *ca = *(struct tcp_connection * const *)a;
+        const struct tcp_connection *cb = *(struct tcp_connection * const *)b;
+
+        if ( ca->mem->held > cb->mem->held ) 
+                return -1;
+        return ca->mem->held < cb->mem->held;
+}
+
+/**
+ * @brief Print description for the group.
+ *
+ * @param ctx Pointer to the global context.
+ * @param grp The group.
+ */
+static void print_group_name( struct stat_context *ctx, struct group *grp )
+{
+        struct tcp_connection *conn_p;
+        uint16_t policy;
+
+        policy = group_get_policy( grp );
+        conn_p = group_get_first_conn( grp );
+        if ( grp->flags & GROUP_F_OVERFLOW ) {
+                add_to_linebuf( "Other" );
+        } else if ( grp->parent != NULL ) {
+                add_to_linebuf( "Incoming to port %hu", 
+                                connection_get_port( grp->parent, 1 ));
+        } else if ( policy & POLICY_STATE ) {
+                add_to_linebuf( "On state %s", 
+                                conn_state_to_str( grp->grp_filter->state ));
+        } else if ( ( policy & POLICY_IF ) && grp->grp_filter->ifname ) {
+                add_to_linebuf( "Interface %s", grp->grp_filter->ifname );
+        } else if ( conn_p != NULL && ( policy & POLICY_REMOTE )) {
+                add_to_linebuf( "To %s", ( policy & POLICY_ADDR ) ? 
+                                conn_p->metadata.raddr_string : "*" );
+                if ( policy & POLICY_PORT ) 
+                        add_to_linebuf( ":%hu", connection_get_port( conn_p, 0 ));
+        } else {
+                add_to_linebuf( "Group of %s%d", SAMPLE_MARK( ctx ), 
+                                SAMPLE_ESTIMATE( ctx, group_get_size( grp )));
+        }
+}
+
+/**
+ * @brief Print the groups holding most memory.
+ *
+ * @param ctx Pointer to the global context.
+ */
+static void print_groups( struct stat_context *ctx )
+{
+#ifdef ENABLE_FOLLOW_PID
+        struct pidinfo *info_p;
+#endif /* ENABLE_FOLLOW_PID */
+        struct group *grp;
+        char buf[20];
+        int i;
+
+        groups.grps = NULL;
+        groups.count = 0;
+        groups.size = 0;
+#ifdef ENABLE_FOLLOW_PID
+        for ( info_p = ctx->pinfo; info_p != NULL; info_p = info_p->next ) 
+                collect_group( info_p->grp, ctx->scratch );
+#endif /* ENABLE_FOLLOW_PID */
+        glist_foreach_group( ctx->listen_groups, grp ) 
+                collect_group( grp, ctx->scratch );
+        glist_foreach_group( ctx->out_groups, grp ) 
+                collect_group( grp, ctx->scratch );
+        qsort( groups.grps, groups.count, sizeof( *groups.grps ), 
+                        compare_group_mem );
+
+        gui_attron( A_REVERSE );
+        add_to_linebuf( "\t\tSocket memory held by groups (%d), most first ",
+                        groups.count );
+        if ( SAMPLING( ctx )) 
+                add_to_linebuf( "(estimated from 1/%d) ", ctx->sample_rate );
+        write_linebuf();
+        gui_attroff( A_REVERSE );
+
+        for ( i = 0; i < groups.count && i < MEMORY_VIEW_MAX_ROWS; i++ ) {
+                grp = groups.grps[i];
+                add_to_linebuf( "%10s  ", format_bytes( buf, sizeof( buf ), 
+                                        SAMPLE_ESTIMATE( ctx, grp->mem_held )));
+                write_linebuf_partial_attr( A_BOLD );
+                print_group_name( ctx, grp );
+                add_to_linebuf( " (%s%d connections)", SAMPLE_MARK( ctx ),
+                                SAMPLE_ESTIMATE( ctx, group_get_size( grp )));
+                write_linebuf();
+        }
+}
+
+/**
+ * @brief Print the connections holding most memory.
+ *
+ * @param ctx Pointer to the global context.
+ */
+static void print_connections( struct stat_context *ctx )
+{
+        struct tcp_connection *conn_p;
+        char held[20], rmem[20], wmem[20], fwd[20];
+        int i;
+
+        found.conns = NULL;
+        found.count = 0;
+        found.size = 0;
+        chash_walk( ctx->chash, collect_connection, ctx->scratch );
+        qsort( found.conns, found.count, sizeof( *found.conns ), 
+                        compare_conn_mem );
+
+        gui_attron( A_REVERSE );
+        add_to_linebuf( "\t\tSocket memory held by connections (%s%d), most first ",
+                        SAMPLE_MARK( ctx ), SAMPLE_ESTIMATE( ctx, found.count ));
+        write_linebuf();
+        gui_attroff( A_REVERSE );
+
+        gui_attron( A_UNDERLINE );
+        add_to_linebuf( "%8s %8s %8s %8s %6s  %40s       %40s", "Held", "Recv", 
+                        "Send", "Fwd", "Drops", "Local address", "Remote address" );
+        write_linebuf();
+        gui_attroff( A_UNDERLINE );
+
+        for ( i = 0; i < found.count && i < MEMORY_VIEW_MAX_ROWS; i++ ) {
+                conn_p = found.conns[i];
+                add_to_linebuf( "%8s %8s %8s %8s %6u  %40.40s:%-5hu %40.40s:%-5hu", 
+                                format_bytes( held, sizeof( held ), conn_p->mem->held ),
+                                format_bytes( rmem, sizeof( rmem ), conn_p->mem->rmem_alloc ),
+                                format_bytes( wmem, sizeof( wmem ), conn_p->mem->wmem_queued ),
+                                format_bytes( fwd, sizeof( fwd ), conn_p->mem->fwd_alloc ),
+                                conn_p->mem->drops,
+                                conn_p->metadata.laddr_string,
+                                connection_get_port( conn_p, 1 ), 
+                                conn_p->metadata.raddr_string,
+                                connection_get_port( conn_p, 0 ));
+                write_linebuf();
+        }
+        if ( found.count > MEMORY_VIEW_MAX_ROWS ) {
+                add_to_linebuf( "  ... %d more", found.count - MEMORY_VIEW_MAX_ROWS );
+                write_linebuf();
+        }
+}
+
+/** 
+ * @brief Update the UI with the memory view.
+ *
+ * @ingroup mview
+ * @param ctx Pointer to the global context.
+ * 
+ * @return 0.
+ */
+int memory_update( struct stat_context *ctx )
+{
+        struct arena *scratch = ctx->scratch;
+        char used[20], peak[20], cap[20];
+
+        gui_pad_begin();
+        add_to_linebuf( "Scratch memory for update round: %s used on last round, %s peak, %s reserved",
+                        format_bytes( used, sizeof( used ), scratch->last_used ),
+                        format_bytes( peak, sizeof( peak ), scratch->high_water ),
+                        format_bytes( cap, sizeof( cap ), scratch->capacity ));
+        write_linebuf();
+        write_linebuf();
+        print_groups( ctx );
+        write_linebuf();
+        print_connections( ctx );
+        gui_pad_end();
+
+        return 0;
+}
+
+/** 
+ * @brief Handle the commands for memory view.
+ *
+ * @ingroup mview
+ * @param ctx Pointer to the global context
+ * @param key The key pressed by user.
+ * 
+ * @return 0 if the key did not match any command, 1 if it did.
+ */
+int memory_input( _UNUSED struct stat_context *ctx, int key )
+{
+        int rv = 1;
+
+        switch ( key ) {
+                case KEY_NPAGE :
+                        gui_pad_scroll( gui_pad_page_size() );
+                        break;
+                case KEY_PPAGE :
+                        gui_pad_scroll( -gui_pad_page_size() );
+                        break;
+                default :
+                        rv = 0;
+                        break;
+        }
+        return rv;
+}
+#endif /* ENABLE_SOCK_MEM */
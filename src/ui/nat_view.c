@@ -0,0 +1,249 @@
+/**
+ * @file nat_view.c
+ * @brief Implementation for the NAT view.
+ *
+ * The NAT view lists the connections whose remote address is translated,
+ * with the real remote end found from the connection tracking table. Reading
+ * the table is started when the view is entered for the first time (unless
+ * it was started from command line) and kept running after that.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ncurses.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_VIEW
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "arena.h"
+#include "scouts.h"
+#include "printout_curses.h"
+#include "ui.h"
+
+#ifdef ENABLE_CONNTRACK
+/**
+ * Maximum number of connections listed.
+ */
+#define NAT_VIEW_MAX_ROWS 500
+
+/**
+ * Translated connections, collected on every update.
+ */
+static struct {
+        struct tcp_connection **conns; /**< The connections */
+        int count; /**< Number of connections collected */
+        int size; /**< Number of slots on conns */
+} found;
+
+/**
+ * @defgroup nview NAT view functions
+ */
+
+/** 
+ * @brief Initialize the NAT view.
+ *
+ * Reading the connection tracking table is started if it is not running.
+ * 
+ * @ingroup nview
+ * @param ctx Pointer to global context
+ * 
+ * @return 0 on success, -1 if the table is not available.
+ */
+int init_nat_view( struct stat_context *ctx )
+{
+        TRACE("Initializing NAT view\n");
+        if ( gui_get_current_view() == NAT_VIEW ) 
+                return 0;
+
+        if ( ctx->ct == NULL ) {
+                ctx->ct = ct_table_init( ctx );
+                if ( ctx->ct == NULL ) {
+                        ui_show_message( LOCATION_BANNER, 
+                                        "Connection tracking table not available (needs CAP_NET_ADMIN)" );
+                        return -1;
+                }
+                OPERATION_ENABLE( ctx, OP_CONNTRACK );
+        }
+        gui_set_current_view( NAT_VIEW );
+        return 0;
+}
+
+/** 
+ * @brief Deinitialize the NAT view.
+ *
+ * The collected connections are dropped, the table is still read.
+ * 
+ * @ingroup nview
+ * @param ctx Pointer to global context
+ */
+void deinit_nat_view( _UNUSED struct stat_context *ctx )
+{
+        /* The connections were allocated from the scratch arena */
+        found.conns = NULL;
+        found.size = 0;
+        found.count = 0;
+}
+
+/**
+ * Callback collecting the translated connections, @a data is the arena for
+ * the collected connections.
+ */
+static void collect_translated( struct tcp_connection *conn_p, void *data )
+{
+        if ( conn_p->nat == NULL ) 
+                return;
+        if ( found.count == found.size ) {
+                found.size = found.size ? found.size * 2 : 64;
+                found.conns = arena_grow( data, found.conns, 
+                                found.count * sizeof( *found.conns ),
+                                found.size * sizeof( *found.conns ));
+        }
+        found.conns[found.count++] = conn_p;
+}
+
+/**
+ * Compare the connections by the real peer, then by the remote address on
+ * socket.
+ */
+static int compare_peer( const void *a, const void *b )
+{
+        const struct tcp_connection *ca = *(struct tcp_connection * const *)a;
+        const struct tcp_connection *cb = *(struct tcp_connection * const *)b;
+        int rv;
+
+        rv = strcmp( ca->nat->peer_string, cb->nat->peer_string );
+        if ( rv == 0 ) 
+                rv = memcmp( &ca->key, &cb->key, sizeof( ca->key ));
+        return rv;
+}
+
+/** 
+ * @brief Update the UI with the NAT view.
+ *
+ * @ingroup nview
+ * @param ctx Pointer to the global context.
+ * 
+ * @return 0.
+ */
+int nat_update( struct stat_context *ctx )
+{
+        struct ct_table *ct = ctx->ct;
+        struct tcp_connection *conn_p;
+        char local[ADDRSTR_BUFLEN + 8], remote[ADDRSTR_BUFLEN + 8];
+        char peer[INET6_ADDRSTRLEN + 8];
+        int i;
+
+        found.conns = NULL;
+        found.count = 0;
+        found.size = 0;
+        chash_walk( ctx->chash, collect_translated, ctx->scratch );
+        qsort( found.conns, found.count, sizeof( *found.conns ), compare_peer );
+
+        gui_pad_begin();
+        gui_attron( A_REVERSE );
+        add_to_linebuf( "\t\tConntrack from %s, %d translated tuples, %s%d connections ",
+                        ct_source_name( ct ), ct->entries.count, SAMPLE_MARK( ctx ),
+                        SAMPLE_ESTIMATE( ctx, found.count ));
+        if ( ct->source == CT_SOURCE_NETLINK ) 
+                add_to_linebuf( "(%lu events, %lu resyncs) ", ct->events, ct->resyncs );
+        write_linebuf();
+        gui_attroff( A_REVERSE );
+
+        gui_attron( A_UNDERLINE );
+        add_to_linebuf( "%-30s %-30s %4s %-30s %s", "Local address", 
+                        "Remote address (socket)", "NAT", "Real peer", "State" );
+        write_linebuf();
+        gui_attroff( A_UNDERLINE );
+
+        for ( i = 0; i < found.count && i < NAT_VIEW_MAX_ROWS; i++ ) {
+                conn_p = found.conns[i];
+                snprintf( local, sizeof( local ), "%s:%hu", 
+                                conn_p->metadata.laddr_string, 
+                                connection_get_port( conn_p, 1 ));
+                snprintf( remote, sizeof( remote ), "%s:%hu", 
+                                conn_p->metadata.raddr_string, 
+                                connection_get_port( conn_p, 0 ));
+                snprintf( peer, sizeof( peer ), "%s:%hu", conn_p->nat->peer_string,
+                                ntohs( ss_get_port( &conn_p->nat->peer )));
+                add_to_linebuf( "%-30s %-30s %4s ", local, remote, 
+                                conn_p->nat->kind == NAT_DST ? "DNAT" : "SNAT" );
+                write_linebuf_partial();
+                add_to_linebuf( "%-30s", peer );
+                write_linebuf_partial_attr( A_BOLD );
+                add_to_linebuf( " %s", conn_state_to_str( conn_p->state ));
+                write_linebuf();
+        }
+        if ( found.count > NAT_VIEW_MAX_ROWS ) {
+                add_to_linebuf( "  ... %d more", found.count - NAT_VIEW_MAX_ROWS );
+                write_linebuf();
+        }
+        gui_pad_end();
+
+        return 0;
+}
+
+/** 
+ * @brief Handle the commands for NAT view.
+ *
+ * @ingroup nview
+ * @param ctx Pointer to the global context
+ * @param key The key pressed by user.
+ * 
+ * @return 0 if the key did not match any command, 1 if it did.
+ */
+int nat_input( _UNUSED struct stat_context *ctx, int key )
+{
+        int rv = 1;
+
+        switch ( key ) {
+                case KEY_NPAGE :
+                        gui_pad_scroll( gui_pad_page_size() );
+                        break;
+                case KEY_PPAGE :
+                        gui_pad_scroll( -gui_pad_page_size() );
+                        break;
+                default :
+                        rv = 0;
+                        break;
+        }
+        return rv;
+}
+#endif /* ENABLE_CONNTRACK */
@@ -0,0 +1,234 @@
+/**
+ * @file ports_view.c
+ * @brief Implementation for the ephemeral ports view.
+ *
+ * The ports view lists the (local address, remote address, remote port)
+ * tuples using most local ephemeral ports, with the utilisation of the
+ * available port range. The port monitor is started when the view is
+ * entered for the first time (unless it was started from command line) and
+ * kept running after that.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <ncurses.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_VIEW
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "arena.h"
+#include "scouts.h"
+#include "portmon.h"
+#include "printout_curses.h"
+#include "ui.h"
+
+#ifdef ENABLE_PORT_MONITOR
+/**
+ * Maximum number of tuples listed.
+ */
+#define PORTS_VIEW_MAX_ROWS 200
+
+/**
+ * Entries on the port monitor, collected on every update.
+ */
+static struct {
+        struct port_entry **entries; /**< The entries */
+        int count; /**< Number of entries collected */
+        int size; /**< Number of slots on entries */
+} found;
+
+/**
+ * @defgroup pview Ports view functions
+ */
+
+/** 
+ * @brief Initialize the ports view.
+ *
+ * The port monitor is started if it is not running, the connections already
+ * known are counted.
+ * 
+ * @ingroup pview
+ * @param ctx Pointer to global context
+ * 
+ * @return 0 on success, -1 if the port range is not available.
+ */
+int init_ports_view( struct stat_context *ctx )
+{
+        TRACE("Initializing ports view\n");
+        if ( gui_get_current_view() == PORTS_VIEW ) 
+                return 0;
+
+        if ( ctx->ports == NULL ) {
+                ctx->ports = portmon_init( PORTMON_DEFAULT_ALERT, ctx->sample_rate );
+                if ( ctx->ports == NULL ) {
+                        ui_show_message( LOCATION_BANNER, 
+                                        "Ephemeral port range not available" );
+                        return -1;
+                }
+                portmon_add_all( ctx->ports, ctx->chash );
+        }
+        gui_set_current_view( PORTS_VIEW );
+        return 0;
+}
+
+/** 
+ * @brief Deinitialize the ports view.
+ *
+ * The collected entries are dropped, the monitor is left running.
+ * 
+ * @ingroup pview
+ * @param ctx Pointer to global context
+ */
+void deinit_ports_view( _UNUSED struct stat_context *ctx )
+{
+        /* The entries were allocated from the scratch arena */
+        found.entries = NULL;
+        found.size = 0;
+        found.count = 0;
+}
+
+/**
+ * Compare the entries by the number of ports in use, most first.
+ */
+static int compare_count( const void *a, const void *b )
+{
+        const struct port_entry *ea = *(struct port_entry * const *)a;
+        const struct port_entry *eb = *(struct port_entry * const *)b;
+
+        return eb->count - ea->count;
+}
+
+/** 
+ * @brief Update the UI with the ports view.
+ *
+ * @ingroup pview
+ * @param ctx Pointer to the global context.
+ * 
+ * @return 0.
+ */
+int ports_update( struct stat_context *ctx )
+{
+        struct port_monitor *pmon = ctx->ports;
+        struct port_entry *entry;
+        struct hash_link *link;
+        char buf[2 * INET6_ADDRSTRLEN + 16];
+        unsigned int chain;
+        int i, usage;
+
+        found.entries = NULL;
+        found.count = 0;
+        found.size = 0;
+        for ( chain = 0; chain < pmon->index.size; chain++ ) {
+                for ( link = pmon->index.chains[chain]; link != NULL; link = link->next ) {
+                        entry = HASH_ENTRY( link, struct port_entry, link );
+                        if ( found.count == found.size ) {
+                                found.size = found.size ? found.size * 2 : 64;
+                                found.entries = arena_grow( ctx->scratch, found.entries, 
+                                                found.count * sizeof( *found.entries ),
+                                                found.size * sizeof( *found.entries ));
+                        }
+                        found.entries[found.count++] = entry;
+                }
+        }
+        qsort( found.entries, found.count, sizeof( *found.entries ), compare_count );
+
+        gui_pad_begin();
+        gui_attron( A_REVERSE );
+        add_to_linebuf( "\t\tEphemeral ports %d-%d, %d available, alert at %d%% ",
+                        pmon->low, pmon->high, pmon->available, pmon->alert_pct );
+        if ( pmon->scale > 1 ) 
+                add_to_linebuf( "(estimated from 1/%d) ", pmon->scale );
+        write_linebuf();
+        gui_attroff( A_REVERSE );
+
+        gui_attron( A_UNDERLINE );
+        add_to_linebuf( "%6s %7s %7s  %s", "Usage", "In use", "Peak", 
+                        "Local address -> Remote address" );
+        write_linebuf();
+        gui_attroff( A_UNDERLINE );
+
+        for ( i = 0; i < found.count && i < PORTS_VIEW_MAX_ROWS; i++ ) {
+                entry = found.entries[i];
+                usage = portmon_usage( pmon, entry );
+                add_to_linebuf( "%5d%% %7d %7d  %s", usage, 
+                                PORTMON_ESTIMATE( pmon, entry->count ), 
+                                PORTMON_ESTIMATE( pmon, entry->peak ),
+                                portmon_format( entry, buf, sizeof( buf )));
+                if ( entry->alerted ) 
+                        write_linebuf_partial_attr( A_BOLD );
+                write_linebuf();
+        }
+        if ( found.count > PORTS_VIEW_MAX_ROWS ) {
+                add_to_linebuf( "  ... %d more", found.count - PORTS_VIEW_MAX_ROWS );
+                write_linebuf();
+        }
+        gui_pad_end();
+
+        return 0;
+}
+
+/** 
+ * @brief Handle the commands for ports view.
+ *
+ * @ingroup pview
+ * @param ctx Pointer to the global context
+ * @param key The key pressed by user.
+ * 
+ * @return 0 if the key did not match any command, 1 if it did.
+ */
+int ports_input( _UNUSED struct stat_context *ctx, int key )
+{
+        int rv = 1;
+
+        switch ( key ) {
+                case KEY_NPAGE :
+                        gui_pad_scroll( gui_pad_page_size() );
+                        break;
+                case KEY_PPAGE :
+                        gui_pad_scroll( -gui_pad_page_size() );
+                        break;
+                default :
+                        rv = 0;
+                        break;
+        }
+        return rv;
+}
+#endif /* ENABLE_PORT_MONITOR */
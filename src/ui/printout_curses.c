@@ -74,6 +74,13 @@ struct gui_curses_context {
         char row_buf[GUI_MAX_ROW_LEN];
         enum gui_view view; /**< Currently active view */
         ui_flags_t flags;
+        WINDOW *win; /**< Window the linebuf is written to */
+        WINDOW *pad; /**< Pad holding the scrollable part of the view */
+        int pad_rows; /**< Number of rows allocated for the pad */
+        int pad_top; /**< Screen row where the pad is shown from */
+        int pad_lines; /**< Number of lines written to the pad on this round */
+        int pad_scroll; /**< First line of the pad shown on screen */
+        int pad_used; /**< Non-zero if pad was written on this round */
 };
 
 /**
@@ -105,6 +112,8 @@ void reset_ctx( void )
         gui_ctx.current_row = 0;
         gui_ctx.current_column = 0;
         gui_ctx.more_lines = 0;
+        gui_ctx.win = stdscr;
+        gui_ctx.pad_used = 0;
 }
 
 /** 
@@ -213,6 +222,64 @@ void gui_clear_statusbar()
  *
  */
 
+/**
+ * Check if there is room for writing the current line.
+ * When writing to the screen, the last row is reserved for statusbar and
+ * <code>--MORE--</code>. When writing to the pad, the pad is grown as needed,
+ * hence there is always room.
+ *
+ * @ingroup linebuf_api
+ * @return non-zero if the line can be written, 0 if not.
+ */
+static int linebuf_has_room( void )
+{
+        int rows;
+
+        if ( gui_ctx.win != gui_ctx.pad ) 
+                return gui_ctx.current_row < gui_ctx.rows-1;
+
+        if ( gui_ctx.current_row >= gui_ctx.pad_rows - 1 ) {
+                rows = gui_ctx.pad_rows * 2;
+                if ( wresize( gui_ctx.pad, rows, gui_ctx.columns ) == ERR ) {
+                        WARN( "Unable to grow pad to %d rows\n", rows );
+                        return 0;
+                }
+                TRACE( "Pad grown to %d rows\n", rows );
+                gui_ctx.pad_rows = rows;
+        }
+        return 1;
+}
+
+/**
+ * Turn on attributes for the text written with linebuf API.
+ * @ingroup linebuf_api
+ * @param attr Attributes to turn on.
+ */
+void gui_attron( int attr )
+{
+        wattron( gui_ctx.win, attr );
+}
+
+/**
+ * Turn off attributes for the text written with linebuf API.
+ * @ingroup linebuf_api
+ * @param attr Attributes to turn off.
+ */
+void gui_attroff( int attr )
+{
+        wattroff( gui_ctx.win, attr );
+}
+
+/**
+ * Set the attributes for the text written with linebuf API.
+ * @ingroup linebuf_api
+ * @param attr Attributes to set.
+ */
+void gui_attrset( int attr )
+{
+        wattrset( gui_ctx.win, attr );
+}
+
 /**
  * Append the contents of linebuffer to the window and move to next line. 
  * This function must be called when the final contents of a line are to be
@@ -234,7 +301,7 @@ int write_linebuf( void )
 {
         int rv = 0;
 
-        if ( gui_ctx.current_row == gui_ctx.rows-1 ) {
+        if ( ! linebuf_has_room() ) {
                 gui_ctx.more_lines++;
                 /* Last line */
                 attron( A_BOLD );
@@ -242,9 +309,9 @@ int write_linebuf( void )
                 attroff( A_BOLD );
                 rv = -1;
         } else {
-                mvprintw( gui_ctx.current_row, gui_ctx.current_column,
-                                gui_ctx.row_buf );
-                printw( "\n" );
+                mvwprintw( gui_ctx.win, gui_ctx.current_row, 
+                                gui_ctx.current_column, "%s", gui_ctx.row_buf );
+                wprintw( gui_ctx.win, "\n" );
                 gui_ctx.current_row++;
                 gui_ctx.current_column = 0;
         }
@@ -270,7 +337,7 @@ int write_linebuf_partial( void )
         int rv = 0;
         int len;
 
-        if ( gui_ctx.current_row == gui_ctx.rows-1 ) {
+        if ( ! linebuf_has_room() ) {
                 /* no more lines, don't write anything,
                  * the finall call to write_linebuf()
                  * will handle this
@@ -278,8 +345,8 @@ int write_linebuf_partial( void )
                 rv = -1;
         } else {
                 len = strlen( gui_ctx.row_buf );
-                mvprintw( gui_ctx.current_row, gui_ctx.current_column,
-                                gui_ctx.row_buf );
+                mvwprintw( gui_ctx.win, gui_ctx.current_row, 
+                                gui_ctx.current_column, "%s", gui_ctx.row_buf );
                 gui_ctx.current_column += len;
         }
         gui_ctx.row_buf[0] = '\0';
@@ -306,7 +373,7 @@ int write_linebuf_partial_attr( int attr )
         int rv = 0;
         int len;
 
-        if ( gui_ctx.current_row == gui_ctx.rows-1 ) {
+        if ( ! linebuf_has_room() ) {
                 /* no more lines, don't write anything,
                  * the finall call to write_linebuf()
                  * will handle this
@@ -315,10 +382,10 @@ int write_linebuf_partial_attr( int attr )
         } else {
                 len = strlen( gui_ctx.row_buf );
                 
-                attron( attr );
-                mvprintw( gui_ctx.current_row, gui_ctx.current_column,
-                                gui_ctx.row_buf );
-                attroff( attr );
+                wattron( gui_ctx.win, attr );
+                mvwprintw( gui_ctx.win, gui_ctx.current_row, 
+                                gui_ctx.current_column, "%s", gui_ctx.row_buf );
+                wattroff( gui_ctx.win, attr );
                 gui_ctx.current_column += len;
         }
         gui_ctx.row_buf[0] = '\0';
@@ -360,6 +427,45 @@ int add_to_linebuf( const char *fmt, ... )
         return rv;
 }
 
+/**
+ * @brief Add preformatted string to line buffer.
+ * Same as add_to_linebuf() with "%s" format, without the cost of formatting.
+ *
+ * @ingroup linebuf_api
+ *
+ * @param str The string to add.
+ *
+ * @return 0 if all data was added to line buffer, -1 if there was no room for
+ * more.
+ */
+int add_str_to_linebuf( const char *str )
+{
+        size_t len, room, slen;
+
+        len = strlen( gui_ctx.row_buf );
+        if ( len + gui_ctx.current_column >= (size_t)gui_ctx.columns ) 
+                return -1;
+
+        room = gui_ctx.columns - ( len + gui_ctx.current_column );
+        slen = strlen( str );
+        if ( slen >= room ) 
+                slen = room - 1;
+        memcpy( &(gui_ctx.row_buf[len]), str, slen );
+        gui_ctx.row_buf[len + slen] = '\0';
+
+        return 0;
+}
+
+/**
+ * Get the contents of line buffer not yet written to the window.
+ * @ingroup linebuf_api
+ * @return Pointer to the line buffer, valid until next write.
+ */
+const char *get_linebuf( void )
+{
+        return gui_ctx.row_buf;
+}
+
 /**
  * @defgroup gui_c Functions for graphical user interface using ncurses
  * library.
@@ -405,9 +511,145 @@ int gui_init( struct stat_context *ctx )
  */
 void gui_deinit( void )
 {
+        if ( gui_ctx.pad ) {
+                delwin( gui_ctx.pad );
+                gui_ctx.pad = NULL;
+        }
         endwin();
 }
 
+/**
+ * @defgroup gui_pad Scrollable part of the view
+ *
+ * The part of the view which can grow past the screen (i.e. the connection
+ * groups) is written to a ncurses pad. Everything written with the linebuf
+ * API between gui_pad_begin() and gui_pad_end() goes to the pad. The pad is
+ * shown below the lines written before gui_pad_begin(), starting from the
+ * current scroll position.
+ */
+
+/**
+ * Start writing to the pad.
+ * The pad is cleared and all subsequent writes with linebuf API will go to
+ * the pad until gui_pad_end() is called.
+ * @ingroup gui_pad
+ */
+void gui_pad_begin( void )
+{
+        if ( gui_ctx.pad != NULL && getmaxx( gui_ctx.pad ) != gui_ctx.columns ) {
+                /* Screen size changed */
+                delwin( gui_ctx.pad );
+                gui_ctx.pad = NULL;
+        }
+        if ( gui_ctx.pad == NULL ) {
+                gui_ctx.pad_rows = gui_ctx.rows * 2;
+                gui_ctx.pad = newpad( gui_ctx.pad_rows, gui_ctx.columns );
+                if ( gui_ctx.pad == NULL ) {
+                        WARN( "Unable to create pad\n" );
+                        return;
+                }
+        }
+        werase( gui_ctx.pad );
+        gui_ctx.pad_top = gui_ctx.current_row;
+        gui_ctx.current_row = 0;
+        gui_ctx.current_column = 0;
+        gui_ctx.win = gui_ctx.pad;
+}
+
+/**
+ * Stop writing to the pad, subsequent writes go to the screen.
+ * @ingroup gui_pad
+ */
+void gui_pad_end( void )
+{
+        if ( gui_ctx.win != gui_ctx.pad || gui_ctx.pad == NULL )
+                return;
+
+        gui_ctx.pad_lines = gui_ctx.current_row;
+        gui_ctx.current_row = gui_ctx.pad_top;
+        gui_ctx.current_column = 0;
+        gui_ctx.win = stdscr;
+        gui_ctx.pad_used = 1;
+}
+
+/**
+ * Get the line on the pad which will be written next.
+ * @ingroup gui_pad
+ * @return Number of lines written to the pad so far.
+ */
+int gui_pad_current_line( void )
+{
+        return gui_ctx.current_row;
+}
+
+/**
+ * Get the number of pad lines that fit on the screen.
+ * @ingroup gui_pad
+ * @return number of visible pad lines.
+ */
+int gui_pad_page_size( void )
+{
+        int size = gui_ctx.rows - 1 - gui_ctx.pad_top;
+
+        return size > 1 ? size : 1;
+}
+
+/**
+ * Scroll the pad by given number of lines.
+ * @ingroup gui_pad
+ * @param lines Number of lines to scroll, negative values scroll up.
+ */
+void gui_pad_scroll( int lines )
+{
+        gui_ctx.pad_scroll += lines;
+        if ( gui_ctx.pad_scroll < 0 )
+                gui_ctx.pad_scroll = 0;
+}
+
+/**
+ * Scroll the pad so that given line is visible.
+ * @ingroup gui_pad
+ * @param line Line on the pad which should be visible.
+ */
+void gui_pad_show_line( int line )
+{
+        int page = gui_pad_page_size();
+
+        if ( line < gui_ctx.pad_scroll ) 
+                gui_ctx.pad_scroll = line;
+        else if ( line >= gui_ctx.pad_scroll + page )
+                gui_ctx.pad_scroll = line - page + 1;
+}
+
+/**
+ * Copy the visible part of the pad to the virtual screen.
+ * If there are lines below the visible part, <code>--MORE--</code> is written
+ * to the last line.
+ * @ingroup gui_pad
+ */
+static void pad_draw( void )
+{
+        int page = gui_pad_page_size();
+        int below;
+
+        if ( gui_ctx.pad_scroll > gui_ctx.pad_lines - page ) 
+                gui_ctx.pad_scroll = gui_ctx.pad_lines > page ? 
+                        gui_ctx.pad_lines - page : 0;
+
+        below = gui_ctx.pad_lines - (gui_ctx.pad_scroll + page);
+        if ( below > 0 ) {
+                attron( A_BOLD );
+                mvprintw( gui_ctx.rows-1, 0, "--MORE (%d)--", below );
+                attroff( A_BOLD );
+        }
+        wnoutrefresh( stdscr );
+        if ( gui_ctx.pad_top < gui_ctx.rows - 1 ) 
+                pnoutrefresh( gui_ctx.pad, gui_ctx.pad_scroll, 0, 
+                                gui_ctx.pad_top, 0, 
+                                gui_ctx.rows - 2, gui_ctx.columns - 1 );
+        doupdate();
+}
+
 /** 
  * @brief Update the screen with latest printed info. 
  * All other GUI functions will draw the information on virtual screen, only
@@ -421,6 +663,10 @@ void gui_draw( void )
 {
 
         clrtobot();
+        if ( gui_ctx.pad_used ) {
+                pad_draw();
+                return;
+        }
         refresh();
        // clear(); /* Get ready for next update round */
 }
@@ -42,13 +42,31 @@
 enum gui_view {
         MAIN_VIEW, 
         ENDPOINT_VIEW,
-        HELP_VIEW
+        HELP_VIEW,
+        STATE_VIEW,
+        MEMORY_VIEW,
+        PORTS_VIEW,
+        LB_VIEW,
+        NAT_VIEW
 };
 /* the linebuf API */
 int write_linebuf( void );
 int write_linebuf_partial( void );
 int write_linebuf_partial_attr( int attr );
 int add_to_linebuf( const char *fmt, ... );
+int add_str_to_linebuf( const char *str );
+const char *get_linebuf( void );
+void gui_attron( int attr );
+void gui_attroff( int attr );
+void gui_attrset( int attr );
+
+/* The scrollable pad */
+void gui_pad_begin( void );
+void gui_pad_end( void );
+int gui_pad_current_line( void );
+int gui_pad_page_size( void );
+void gui_pad_scroll( int lines );
+void gui_pad_show_line( int line );
 
 /* GENERIC GUI CONTEXT ACCESSORS */
 /* FLAGS for GUI features which can be controlled by users */
@@ -95,15 +113,20 @@ void gui_print_in_banner( struct stat_context *ctx );
 void gui_print_out_banner( struct stat_context *ctx );
 void gui_print_pid_banner( struct pidinfo *info_p );
 void gui_print_if_banners( struct stat_context *ctx );
+#ifdef ENABLE_SNMP_STATS
+void gui_print_snmp_banners( struct stat_context *ctx );
+#endif /* ENABLE_SNMP_STATS */
 #ifdef DEBUG
 void gui_print_dbg_banner( struct stat_context *ctx );
 #endif /* DEBUG */
 
 /* MAIN VIEW  */
 int main_update( struct stat_context *ctx );
+long main_render_usecs( void );
 int init_main_view( struct stat_context *ctx );
 int main_input( struct stat_context *ctx, int key );
 void main_print_help();
+char *conn_state_to_str( enum tcp_state state );
 
 /* ENDPOINT VIEW */
 int endpoint_input( struct stat_context *ctx, int key );
@@ -115,6 +138,43 @@ void deinit_endpoint_view( struct stat_context *ctx );
 int init_help_view( struct stat_context *ctx );
 int help_update( struct stat_context *ctx );
 
+/* STATE VIEW */
+int init_state_view( struct stat_context *ctx );
+void deinit_state_view( struct stat_context *ctx );
+int state_update( struct stat_context *ctx );
+int state_input( struct stat_context *ctx, int key );
+void state_print_help();
+
+#ifdef ENABLE_SOCK_MEM
+/* MEMORY VIEW */
+int init_memory_view( struct stat_context *ctx );
+void deinit_memory_view( struct stat_context *ctx );
+int memory_update( struct stat_context *ctx );
+int memory_input( struct stat_context *ctx, int key );
+#endif /* ENABLE_SOCK_MEM */
+
+#ifdef ENABLE_PORT_MONITOR
+/* PORTS VIEW */
+int init_ports_view( struct stat_context *ctx );
+void deinit_ports_view( struct stat_context *ctx );
+int ports_update( struct stat_context *ctx );
+int ports_input( struct stat_context *ctx, int key );
+#endif /* ENABLE_PORT_MONITOR */
+
+/* BACKEND VIEW */
+int init_lb_view( struct stat_context *ctx );
+void deinit_lb_view( struct stat_context *ctx );
+int lb_update( struct stat_context *ctx );
+int lb_input( struct stat_context *ctx, int key );
+
+#ifdef ENABLE_CONNTRACK
+/* NAT VIEW */
+int init_nat_view( struct stat_context *ctx );
+void deinit_nat_view( struct stat_context *ctx );
+int nat_update( struct stat_context *ctx );
+int nat_input( struct stat_context *ctx, int key );
+#endif /* ENABLE_CONNTRACK */
+
 #define GUI_MAX_ROW_LEN 200
 
 /* Start using "wide" formating after this limit of columns is in use */
@@ -122,4 +182,7 @@ int help_update( struct stat_context *ctx );
 #define GUI_COLUMN_WIDEST_LIMIT 150
 #define GUI_COLUMN_RT_WIDE_LIMIT 130
 
+/* Groups with more connections than this are collapsed by default */
+#define GUI_GROUP_COLLAPSE_LIMIT 10
+
 #endif /* _PRINTOUT_CURSES_H_ */
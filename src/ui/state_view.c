@@ -0,0 +1,420 @@
+/**
+ * @file state_view.c
+ * @brief Implementation for the state view.
+ *
+ * The state view lists the connections on chosen state, those which have
+ * been on the state longest first. Below the list, the distributions of the
+ * handshake durations and of the time spent on the closing states are shown
+ * for every group that has any recorded.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ncurses.h>
+
+#define DBG_MODULE_NAME DBG_MODULE_VIEW
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "arena.h"
+#include "scouts.h"
+#include "printout_curses.h"
+
+/**
+ * Maximum number of connections listed.
+ */
+#define STATE_VIEW_MAX_CONNS 200
+
+/**
+ * States which can be selected for the view.
+ */
+static enum tcp_state view_states[] = {
+        TCP_SYN_SENT,
+        TCP_SYN_RECV,
+        TCP_FIN_WAIT1,
+        TCP_FIN_WAIT2,
+        TCP_CLOSE_WAIT,
+        TCP_LAST_ACK,
+        TCP_CLOSING,
+        TCP_TIME_WAIT,
+        TCP_ESTABLISHED
+};
+
+/**
+ * Number of states on view_states.
+ */
+#define NROF_VIEW_STATES ( sizeof( view_states ) / sizeof( view_states[0] ))
+
+/**
+ * Index of the selected state on view_states.
+ */
+static unsigned int selected;
+
+/**
+ * Connections on the selected state, collected on every update.
+ */
+static struct {
+        struct tcp_connection **conns; /**< The connections */
+        int count; /**< Number of connections collected */
+        int size; /**< Number of slots on conns */
+} found;
+
+/**
+ * @defgroup sview State view functions
+ */
+
+/** 
+ * @brief Initialize the state view.
+ * 
+ * @ingroup sview
+ * @param ctx Pointer to global context
+ * 
+ * @return  0.
+ */
+int init_state_view( _UNUSED struct stat_context *ctx )
+{
+        TRACE("Initializing state view\n");
+        if ( gui_get_current_view() == STATE_VIEW ) 
+                return 0;
+
+        gui_set_current_view( STATE_VIEW );
+        return 0;
+}
+
+/** 
+ * @brief Deinitialize the state view.
+ *
+ * The collected connections are dropped.
+ * 
+ * @ingroup sview
+ * @param ctx Pointer to global context
+ */
+void deinit_state_view( _UNUSED struct stat_context *ctx )
+{
+        /* The connections were allocated from the scratch arena */
+        found.conns = NULL;
+        found.size = 0;
+        found.count = 0;
+}
+
+/**
+ * @brief Format duration given in milliseconds.
+ *
+ * @param buf Buffer for the string.
+ * @param buflen Length of the buffer.
+ * @param msecs The duration.
+ * @return Pointer to @a buf.
+ */
+static char *format_msecs( char *buf, int buflen, uint64_t msecs )
+{
+        unsigned long secs = msecs / 1000;
+
+        if ( msecs < 1000 ) 
+                snprintf( buf, buflen, "%lums", (unsigned long)msecs );
+        else if ( secs < 60 ) 
+                snprintf( buf, buflen, "%lu.%lus", secs, 
+                                (unsigned long)( msecs % 1000 ) / 100 );
+        else if ( secs < 3600 ) 
+                snprintf( buf, buflen, "%lum%02lus", secs / 60, secs % 60 );
+        else
+                snprintf( buf, buflen, "%luh%02lum", secs / 3600, 
+                                ( secs / 60 ) % 60 );
+        return buf;
+}
+
+/**
+ * @brief Add connection to the found connections if it is on the selected
+ * state.
+ *
+ * @param conn_p The connection.
+ * @param data Arena for the collected connections.
+ */
+static void collect_connection( struct tcp_connection *conn_p, void *data )
+{
+        if ( conn_p->state != view_states[selected] ) 
+                return;
+
+        if ( found.count == found.size ) {
+                found.size = found.size ? found.size * 2 : 64;
+                found.conns = arena_grow( data, found.conns, 
+                                found.count * sizeof( *found.conns ),
+                                found.size * sizeof( *found.conns ));
+        }
+        found.conns[found.count++] = conn_p;
+}
+
+/**
+ * Compare the connections by the time they entered their state.
+ */
+static int compare_state_since( const void *a, const void *b )
+{
+        const struct tcp_connection *ca = *(struct tcp_connection * const *)a;
+        const struct tcp_connection *cb = *(struct tcp_connection * const *)b;
+
+        if ( ca->metadata.state_since < cb->metadata.state_since ) 
+                return -1;
+        return ca->metadata.state_since > cb->metadata.state_since;
+}
+
+/**
+ * @brief Print the oldest connections on the selected state.
+ *
+ * @param ctx Pointer to the global context.
+ */
+static void print_oldest( struct stat_context *ctx )
+{
+        struct tcp_connection *conn_p;
+        uint64_t now = connection_time_ms();
+        char buf[20];
+        int i;
+
+        found.conns = NULL;
+        found.count = 0;
+        found.size = 0;
+        chash_walk( ctx->chash, collect_connection, ctx->scratch );
+        qsort( found.conns, found.count, sizeof( *found.conns ), 
+                        compare_state_since );
+
+        gui_attron( A_REVERSE );
+        add_to_linebuf( "\t\tConnections on state %s (%s%d), longest first ",
+                        conn_state_to_str( view_states[selected] ), SAMPLE_MARK( ctx ),
+                        SAMPLE_ESTIMATE( ctx, found.count ));
+        write_linebuf();
+        gui_attroff( A_REVERSE );
+
+        gui_attron( A_UNDERLINE );
+        add_to_linebuf( "%10s  %40s       %40s", "On state", "Local address", 
+                        "Remote address" );
+        write_linebuf();
+        gui_attroff( A_UNDERLINE );
+
+        for ( i = 0; i < found.count && i < STATE_VIEW_MAX_CONNS; i++ ) {
+                conn_p = found.conns[i];
+                format_msecs( buf, sizeof( buf ), 
+                                now > conn_p->metadata.state_since ? 
+                                now - conn_p->metadata.state_since : 0 );
+                add_to_linebuf( "%10s  %40.40s:%-5hu %40.40s:%-5hu", buf, 
+                                conn_p->metadata.laddr_string,
+                                connection_get_port( conn_p, 1 ), 
+                                conn_p->metadata.raddr_string,
+                                connection_get_port( conn_p, 0 ));
+                write_linebuf();
+        }
+        if ( found.count > STATE_VIEW_MAX_CONNS ) {
+                add_to_linebuf( "  ... %d more", found.count - STATE_VIEW_MAX_CONNS );
+                write_linebuf();
+        }
+}
+
+/**
+ * @brief Print the distribution of recorded durations.
+ *
+ * @param ctx Pointer to the global context.
+ * @param grp The group.
+ * @param kind Which durations to print.
+ * @param name Name for the durations.
+ */
+static void print_distribution( struct stat_context *ctx, struct group *grp, 
+                enum state_hist_kind kind, const char *name )
+{
+        static const int pcts[] = { 50, 90, 99 };
+        uint64_t bound;
+        char buf[20];
+        unsigned int i;
+
+        add_to_linebuf( " %s: %s%u", name, SAMPLE_MARK( ctx ), 
+                        SAMPLE_ESTIMATE( ctx, grp->hist->count[kind] ));
+        if ( grp->hist->count[kind] == 0 ) 
+                return;
+        for ( i = 0; i < sizeof( pcts ) / sizeof( pcts[0] ); i++ ) {
+                bound = group_duration_percentile( grp, kind, pcts[i] );
+                if ( bound == UINT64_MAX ) 
+                        add_to_linebuf( " p%d>=%s", pcts[i], format_msecs( buf, 
+                                        sizeof( buf ), 
+                                        1ULL << ( STATE_HIST_BUCKETS - 2 )));
+                else 
+                        add_to_linebuf( " p%d<%s", pcts[i], format_msecs( buf, 
+                                        sizeof( buf ), bound ));
+        }
+}
+
+/**
+ * @brief Print the durations recorded for groups on list.
+ *
+ * @param ctx Pointer to the global context.
+ * @param list The group list.
+ * @param incoming non-zero if the groups are for incoming connections.
+ */
+static void print_group_durations( struct stat_context *ctx, struct glist *list, 
+                int incoming )
+{
+        struct tcp_connection *conn_p;
+        struct group *grp;
+        uint16_t policy;
+
+        glist_foreach_group( list, grp ) {
+                if ( grp->hist == NULL ) 
+                        continue;
+
+                policy = group_get_policy( grp );
+                conn_p = group_get_first_conn( grp );
+                if ( conn_p == NULL ) 
+                        conn_p = group_get_parent( grp );
+                if ( grp->flags & GROUP_F_OVERFLOW ) {
+                        add_to_linebuf( "  Other" );
+                } else if ( incoming && conn_p != NULL ) {
+                        add_to_linebuf( "  Incoming to port %-5hu", 
+                                        connection_get_port( conn_p, 1 ));
+                } else if ( policy & POLICY_STATE ) {
+                        add_to_linebuf( "  On state %s", 
+                                        conn_state_to_str( grp->grp_filter->state ));
+                } else if ( ( policy & POLICY_IF ) && grp->grp_filter->ifname ) {
+                        add_to_linebuf( "  Interface %s", grp->grp_filter->ifname );
+                } else if ( conn_p != NULL && ( policy & POLICY_REMOTE )) {
+                        add_to_linebuf( "  To %s", ( policy & POLICY_ADDR ) ? 
+                                        conn_p->metadata.raddr_string : "*" );
+                        if ( policy & POLICY_PORT ) 
+                                add_to_linebuf( ":%hu", connection_get_port( conn_p, 0 ));
+                } else {
+                        add_to_linebuf( "  Group of %s%d", SAMPLE_MARK( ctx ),
+                                        SAMPLE_ESTIMATE( ctx, group_get_size( grp )));
+                }
+                add_to_linebuf( "\t" );
+                print_distribution( ctx, grp, HIST_HANDSHAKE, "handshakes" );
+                add_to_linebuf( ", " );
+                print_distribution( ctx, grp, HIST_CLOSING, "closing" );
+                write_linebuf();
+        }
+}
+
+/** 
+ * @brief Update the UI with the state view.
+ *
+ * @ingroup sview
+ * @param ctx Pointer to the global context.
+ * 
+ * @return 0.
+ */
+int state_update( struct stat_context *ctx )
+{
+#ifdef ENABLE_FOLLOW_PID
+        struct pidinfo *info_p;
+#endif /* ENABLE_FOLLOW_PID */
+
+        gui_pad_begin();
+        print_oldest( ctx );
+
+        write_linebuf();
+        gui_attron( A_REVERSE );
+        add_to_linebuf( "\t\tHandshake and closing state durations by group " );
+        write_linebuf();
+        gui_attroff( A_REVERSE );
+#ifdef ENABLE_FOLLOW_PID
+        if ( OPERATION_ENABLED( ctx, OP_FOLLOW_PID )) {
+                for ( info_p = ctx->pinfo; info_p != NULL; info_p = info_p->next ) {
+                        if ( info_p->grp->hist == NULL ) 
+                                continue;
+                        add_to_linebuf( "  %s (%d)\t", info_p->progname, info_p->pid );
+                        print_distribution( ctx, info_p->grp, HIST_HANDSHAKE, "handshakes" );
+                        add_to_linebuf( ", " );
+                        print_distribution( ctx, info_p->grp, HIST_CLOSING, "closing" );
+                        write_linebuf();
+                }
+                gui_pad_end();
+                return 0;
+        }
+#endif /* ENABLE_FOLLOW_PID */
+        print_group_durations( ctx, ctx->listen_groups, 1 );
+        print_group_durations( ctx, ctx->out_groups, 0 );
+        gui_pad_end();
+
+        return 0;
+}
+
+/** 
+ * @brief Handle the commands for state view.
+ *
+ * @ingroup sview
+ * @param ctx Pointer to the global context
+ * @param key The key pressed by user.
+ * 
+ * @return 0 if the key did not match any command, 1 if it did.
+ */
+int state_input( _UNUSED struct stat_context *ctx, int key )
+{
+        int rv = 1;
+
+        switch ( key ) {
+                case 's' :
+                        TRACE( "Selecting next state\n" );
+                        selected = ( selected + 1 ) % NROF_VIEW_STATES;
+                        gui_pad_show_line( 0 );
+                        break;
+                case 'S' :
+                        TRACE( "Selecting previous state\n" );
+                        selected = ( selected + NROF_VIEW_STATES - 1 ) % NROF_VIEW_STATES;
+                        gui_pad_show_line( 0 );
+                        break;
+                case KEY_NPAGE :
+                        gui_pad_scroll( gui_pad_page_size() );
+                        break;
+                case KEY_PPAGE :
+                        gui_pad_scroll( -gui_pad_page_size() );
+                        break;
+                default :
+                        rv = 0;
+                        break;
+        }
+        return rv;
+}
+
+/**
+ * @brief Print the help for state view commands.
+ * @ingroup sview
+ */
+void state_print_help()
+{
+        gui_attron( A_UNDERLINE );
+        add_to_linebuf("\tState view commands:");
+        write_linebuf();
+        gui_attroff( A_UNDERLINE );
+        add_to_linebuf(" s S");
+        write_linebuf_partial_attr( A_BOLD );
+        add_to_linebuf(" Select next / previous state");
+        write_linebuf();
+}
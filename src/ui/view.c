@@ -113,6 +113,10 @@ void ui_update_view( struct stat_context *ctx )
         if( OPERATION_ENABLED(ctx, OP_IFSTATS) )
                 gui_print_if_banners( ctx );
 #endif /* ENABLE_IFSTATS */
+#ifdef ENABLE_SNMP_STATS
+        if( OPERATION_ENABLED(ctx, OP_SNMP_STATS) && ctx->snmp != NULL )
+                gui_print_snmp_banners( ctx );
+#endif /* ENABLE_SNMP_STATS */
 #ifdef DEBUG
         gui_print_dbg_banner( ctx );
 #endif /* DEBUG */
@@ -133,6 +137,27 @@ void ui_update_view( struct stat_context *ctx )
                 case HELP_VIEW :
                         help_update( ctx );
                         break;
+                case STATE_VIEW :
+                        state_update( ctx );
+                        break;
+#ifdef ENABLE_SOCK_MEM
+                case MEMORY_VIEW :
+                        memory_update( ctx );
+                        break;
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_PORT_MONITOR
+                case PORTS_VIEW :
+                        ports_update( ctx );
+                        break;
+#endif /* ENABLE_PORT_MONITOR */
+                case LB_VIEW :
+                        lb_update( ctx );
+                        break;
+#ifdef ENABLE_CONNTRACK
+                case NAT_VIEW :
+                        nat_update( ctx );
+                        break;
+#endif /* ENABLE_CONNTRACK */
                 default :
                         main_update( ctx );
                         break;
@@ -141,6 +166,35 @@ void ui_update_view( struct stat_context *ctx )
 }
 
 extern void do_exit( struct stat_context *ctx, char *exit_msg, int success);
+
+/**
+ * @brief Deinitialize the view which is being left.
+ *
+ * @param ctx Pointer to the global context.
+ * @param view The view being left.
+ */
+static void leave_view( struct stat_context *ctx, enum gui_view view )
+{
+        if ( view == ENDPOINT_VIEW )
+                deinit_endpoint_view( ctx );
+        if ( view == STATE_VIEW )
+                deinit_state_view( ctx );
+#ifdef ENABLE_SOCK_MEM
+        if ( view == MEMORY_VIEW )
+                deinit_memory_view( ctx );
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_PORT_MONITOR
+        if ( view == PORTS_VIEW )
+                deinit_ports_view( ctx );
+#endif /* ENABLE_PORT_MONITOR */
+        if ( view == LB_VIEW )
+                deinit_lb_view( ctx );
+#ifdef ENABLE_CONNTRACK
+        if ( view == NAT_VIEW )
+                deinit_nat_view( ctx );
+#endif /* ENABLE_CONNTRACK */
+}
+
 /** 
  * @brief Handle user commands.
  * Input loop waits for key presses from user and acts on them. When GUI is
@@ -190,23 +244,69 @@ void ui_input_loop( struct stat_context *ctx )
                         TRACE( "Toggling interface stat diffs" );
                         gui_toggle_operation(UI_IFSTAT_DIFFS);
                         break;
+#ifdef ENABLE_SNMP_STATS
+                case 'C' :
+                        TRACE( "Toggling kernel TCP counters\n" );
+                        if ( ctx->snmp != NULL )
+                                OPERATION_TOGGLE( ctx, OP_SNMP_STATS );
+                        break;
+#endif /* ENABLE_SNMP_STATS */
                 case 'E' :
                         TRACE("Enabling endpoint view\n");
-                        if ( view != ENDPOINT_VIEW ) 
+                        if ( view != ENDPOINT_VIEW ) {
+                                leave_view( ctx, view );
                                 init_endpoint_view( ctx );
+                        }
+                        break;
+                case 'O' :
+                        TRACE("Enabling state view\n");
+                        if ( view != STATE_VIEW ) {
+                                leave_view( ctx, view );
+                                init_state_view( ctx );
+                        }
+                        break;
+#ifdef ENABLE_SOCK_MEM
+                case 'B' :
+                        TRACE("Enabling memory view\n");
+                        if ( view != MEMORY_VIEW ) {
+                                leave_view( ctx, view );
+                                init_memory_view( ctx );
+                        }
+                        break;
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_PORT_MONITOR
+                case 'U' :
+                        TRACE("Enabling ports view\n");
+                        if ( view != PORTS_VIEW ) {
+                                leave_view( ctx, view );
+                                init_ports_view( ctx );
+                        }
                         break;
+#endif /* ENABLE_PORT_MONITOR */
+                case 'D' :
+                        TRACE("Enabling backend view\n");
+                        if ( view != LB_VIEW ) {
+                                leave_view( ctx, view );
+                                init_lb_view( ctx );
+                        }
+                        break;
+#ifdef ENABLE_CONNTRACK
+                case 'X' :
+                        TRACE("Enabling NAT view\n");
+                        if ( view != NAT_VIEW ) {
+                                leave_view( ctx, view );
+                                init_nat_view( ctx );
+                        }
+                        break;
+#endif /* ENABLE_CONNTRACK */
                 case 'M' :
                         if ( view != MAIN_VIEW ) {
-                                if ( view == ENDPOINT_VIEW )
-                                        deinit_endpoint_view( ctx );
-
+                                leave_view( ctx, view );
                                 init_main_view( ctx );
                         }
                         break;
                 case 'H' :
-                        if ( view == ENDPOINT_VIEW )
-                                deinit_endpoint_view( ctx );
-
+                        leave_view( ctx, view );
                         init_help_view( ctx );
                         break;
                 default :
@@ -215,6 +315,22 @@ void ui_input_loop( struct stat_context *ctx )
                                 main_input( ctx, key );
                         } else if ( view == ENDPOINT_VIEW ) {
                                 endpoint_input( ctx, key );
+                        } else if ( view == STATE_VIEW ) {
+                                state_input( ctx, key );
+#ifdef ENABLE_SOCK_MEM
+                        } else if ( view == MEMORY_VIEW ) {
+                                memory_input( ctx, key );
+#endif /* ENABLE_SOCK_MEM */
+#ifdef ENABLE_PORT_MONITOR
+                        } else if ( view == PORTS_VIEW ) {
+                                ports_input( ctx, key );
+#endif /* ENABLE_PORT_MONITOR */
+                        } else if ( view == LB_VIEW ) {
+                                lb_input( ctx, key );
+#ifdef ENABLE_CONNTRACK
+                        } else if ( view == NAT_VIEW ) {
+                                nat_input( ctx, key );
+#endif /* ENABLE_CONNTRACK */
                         } 
                         break;
         }
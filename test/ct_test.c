@@ -0,0 +1,340 @@
+/**
+ * @file ct_test.c
+ * @brief Test for the real peers from the connection tracking table.
+ *
+ * The test runs in its own user and network namespace, where the process
+ * has CAP_NET_ADMIN without privileges outside, so ctnetlink should be
+ * used. A connection is opened on loopback and grouped by the real peer,
+ * then a translated conntrack entry is created for it: the connection
+ * should get the real peer from the event and be grouped again. When the
+ * connection is closed it should no longer be counted. The test is skipped
+ * if the namespaces or ctnetlink are not available.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "groupkey.h"
+#include "libtcpstat.h"
+#include "scouts.h"
+#include "test.h"
+
+/**
+ * The real peer given to the connection.
+ */
+#define REAL_PEER "127.0.0.2"
+/**
+ * The real port given to the connection.
+ */
+#define REAL_PORT 8080
+/**
+ * Timeout for the created conntrack entry (seconds).
+ */
+#define ENTRY_TIMEOUT 60
+
+/**
+ * Write string to file.
+ * @return 0 on success, -1 on error.
+ */
+static int write_file( const char *path, const char *str )
+{
+        int fd, rv = 0;
+
+        fd = open( path, O_WRONLY );
+        if ( fd < 0 ) 
+                return -1;
+        if ( write( fd, str, strlen( str )) != (ssize_t)strlen( str )) 
+                rv = -1;
+        close( fd );
+        return rv;
+}
+
+/**
+ * Move to new user and network namespace as root and bring loopback up.
+ * @return 0 on success, -1 on error.
+ */
+static int enter_namespace( void )
+{
+        char map[64];
+        uid_t uid = getuid();
+        gid_t gid = getgid();
+        struct ifreq ifr;
+        int fd, rv;
+
+        if ( unshare( CLONE_NEWUSER | CLONE_NEWNET ) != 0 ) 
+                return -1;
+        snprintf( map, sizeof( map ), "0 %u 1", (unsigned)uid );
+        if ( write_file( "/proc/self/uid_map", map ) != 0 ) 
+                return -1;
+        /* Fails on older kernels, where it is not needed */
+        write_file( "/proc/self/setgroups", "deny" );
+        snprintf( map, sizeof( map ), "0 %u 1", (unsigned)gid );
+        if ( write_file( "/proc/self/gid_map", map ) != 0 ) 
+                return -1;
+
+        fd = socket( AF_INET, SOCK_DGRAM, 0 );
+        if ( fd < 0 ) 
+                return -1;
+        memset( &ifr, 0, sizeof( ifr ));
+        strcpy( ifr.ifr_name, "lo" );
+        rv = ioctl( fd, SIOCGIFFLAGS, &ifr );
+        if ( rv == 0 ) {
+                ifr.ifr_flags |= IFF_UP;
+                rv = ioctl( fd, SIOCSIFFLAGS, &ifr );
+        }
+        close( fd );
+        return rv;
+}
+
+/**
+ * Add attribute to netlink message.
+ * @return Pointer to the attribute.
+ */
+static struct nlattr *add_attr( struct nlmsghdr *nlh, int type, const void *data, 
+                int len )
+{
+        struct nlattr *attr = (struct nlattr *)( (char *)nlh + 
+                        NLMSG_ALIGN( nlh->nlmsg_len ));
+
+        attr->nla_type = type;
+        attr->nla_len = NLA_HDRLEN + len;
+        if ( data != NULL ) 
+                memcpy( (char *)attr + NLA_HDRLEN, data, len );
+        nlh->nlmsg_len = NLMSG_ALIGN( nlh->nlmsg_len ) + NLA_ALIGN( attr->nla_len );
+        return attr;
+}
+
+/**
+ * Close nested attribute opened with add_attr().
+ */
+static void end_nest( struct nlmsghdr *nlh, struct nlattr *nest )
+{
+        nest->nla_type |= NLA_F_NESTED;
+        nest->nla_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+}
+
+/**
+ * Add TCP tuple to conntrack message.
+ */
+static void add_tuple( struct nlmsghdr *nlh, int type, struct sockaddr_in *src,
+                struct sockaddr_in *dst )
+{
+        struct nlattr *tuple, *nest;
+        uint8_t proto = IPPROTO_TCP;
+
+        tuple = add_attr( nlh, type, NULL, 0 );
+        nest = add_attr( nlh, CTA_TUPLE_IP, NULL, 0 );
+        add_attr( nlh, CTA_IP_V4_SRC, &src->sin_addr, 4 );
+        add_attr( nlh, CTA_IP_V4_DST, &dst->sin_addr, 4 );
+        end_nest( nlh, nest );
+        nest = add_attr( nlh, CTA_TUPLE_PROTO, NULL, 0 );
+        add_attr( nlh, CTA_PROTO_NUM, &proto, 1 );
+        add_attr( nlh, CTA_PROTO_SRC_PORT, &src->sin_port, 2 );
+        add_attr( nlh, CTA_PROTO_DST_PORT, &dst->sin_port, 2 );
+        end_nest( nlh, nest );
+        end_nest( nlh, tuple );
+}
+
+/**
+ * Create conntrack entry for connection from @a local to @a remote, whose
+ * replies come from @a real (as if the destination was translated).
+ * @return 0 on success, -1 on error.
+ */
+static int create_entry( struct sockaddr_in *local, struct sockaddr_in *remote,
+                struct sockaddr_in *real )
+{
+        char buf[1024];
+        struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+        struct nfgenmsg *nfg;
+        struct sockaddr_nl addr;
+        uint32_t timeout = htonl( ENTRY_TIMEOUT );
+        ssize_t len;
+        int fd, rv = -1;
+
+        fd = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER );
+        if ( fd < 0 ) 
+                return -1;
+        memset( &addr, 0, sizeof( addr ));
+        addr.nl_family = AF_NETLINK;
+
+        memset( buf, 0, sizeof( buf ));
+        nlh->nlmsg_len = NLMSG_LENGTH( sizeof( *nfg ));
+        nlh->nlmsg_type = ( NFNL_SUBSYS_CTNETLINK << 8 ) | IPCTNL_MSG_CT_NEW;
+        nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK;
+        nlh->nlmsg_seq = 1;
+        nfg = NLMSG_DATA( nlh );
+        nfg->nfgen_family = AF_INET;
+        nfg->version = NFNETLINK_V0;
+        add_tuple( nlh, CTA_TUPLE_ORIG, local, remote );
+        add_tuple( nlh, CTA_TUPLE_REPLY, real, local );
+        add_attr( nlh, CTA_TIMEOUT, &timeout, sizeof( timeout ));
+
+        if ( sendto( fd, buf, nlh->nlmsg_len, 0, (struct sockaddr *)&addr,
+                                sizeof( addr )) < 0 ) {
+                close( fd );
+                return -1;
+        }
+        len = recv( fd, buf, sizeof( buf ), 0 );
+        if ( len >= (ssize_t)NLMSG_LENGTH( sizeof( struct nlmsgerr )) &&
+                        nlh->nlmsg_type == NLMSG_ERROR ) {
+                rv = ((struct nlmsgerr *)NLMSG_DATA( nlh ))->error == 0 ? 0 : -1;
+                if ( rv != 0 ) 
+                        fprintf( stderr, "create conntrack entry: %s\n", strerror( 
+                                        -((struct nlmsgerr *)NLMSG_DATA( nlh ))->error ));
+        }
+        close( fd );
+        return rv;
+}
+
+/**
+ * Open connection on loopback.
+ * @param local Address of the client end is set here.
+ * @param remote Address of the server end is set here.
+ * @param fds The client, listening and accepted sockets are set here.
+ * @return 0 on success, -1 on error.
+ */
+static int open_connection( struct sockaddr_in *local, struct sockaddr_in *remote,
+                int *fds )
+{
+        socklen_t alen = sizeof( *remote );
+
+        fds[1] = socket( AF_INET, SOCK_STREAM, 0 );
+        memset( remote, 0, sizeof( *remote ));
+        remote->sin_family = AF_INET;
+        remote->sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        if ( fds[1] < 0 || bind( fds[1], (struct sockaddr *)remote, alen ) != 0 ||
+                        listen( fds[1], 1 ) != 0 ||
+                        getsockname( fds[1], (struct sockaddr *)remote, &alen ) != 0 ) 
+                return -1;
+        fds[0] = socket( AF_INET, SOCK_STREAM, 0 );
+        if ( fds[0] < 0 || connect( fds[0], (struct sockaddr *)remote, alen ) != 0 ||
+                        getsockname( fds[0], (struct sockaddr *)local, &alen ) != 0 ) 
+                return -1;
+        fds[2] = accept( fds[1], NULL, NULL );
+        return fds[2] < 0 ? -1 : 0;
+}
+
+/**
+ * Run one update round.
+ */
+static void tick( struct stat_context *ctx )
+{
+        CHECK( tcpstat_tick( ctx ) == 0 );
+        tcpstat_tick_done( ctx );
+}
+
+int main( void )
+{
+        struct stat_context *ctx;
+        struct sockaddr_in local, remote, real;
+        struct sockaddr_storage lss, rss;
+        struct tcp_connection *conn_p;
+        struct group *grp;
+        struct linger lin = { 1, 0 };
+        int fds[3], i;
+
+        if ( enter_namespace() != 0 ) 
+                SKIP( "user and network namespaces not available" );
+        if ( open_connection( &local, &remote, fds ) != 0 ) {
+                perror( "connect" );
+                return 1;
+        }
+        memset( &real, 0, sizeof( real ));
+        real.sin_family = AF_INET;
+        inet_pton( AF_INET, REAL_PEER, &real.sin_addr );
+        real.sin_port = htons( REAL_PORT );
+
+        ctx = tcpstat_init();
+        ctx->collected_stats = STAT_V4_ONLY;
+        ctx->gkey = gkey_plan_parse( "peer" );
+        ctx->common_policy = gkey_plan_policy( ctx->gkey );
+        if ( tcpstat_start( ctx ) != 0 ) 
+                SKIP( "interfaces not available" );
+        if ( ctx->ct == NULL || ctx->ct->source != CT_SOURCE_NETLINK ) 
+                SKIP( "ctnetlink not available" );
+
+        tick( ctx );
+        memset( &lss, 0, sizeof( lss ));
+        memset( &rss, 0, sizeof( rss ));
+        memcpy( &lss, &local, sizeof( local ));
+        memcpy( &rss, &remote, sizeof( remote ));
+        conn_p = chash_get( ctx->chash, &lss, &rss );
+        CHECK( conn_p != NULL && conn_p->nat == NULL && conn_p->group != NULL );
+        if ( conn_p == NULL ) 
+                return TEST_RESULT();
+        grp = conn_p->group;
+
+        if ( create_entry( &local, &remote, &real ) != 0 ) 
+                SKIP( "conntrack entries can not be created" );
+        tick( ctx );
+        CHECK( conn_p->nat != NULL && conn_p->nat->kind == NAT_DST );
+        CHECK( conn_p->nat != NULL && 
+                        strcmp( conn_p->nat->peer_string, REAL_PEER ) == 0 );
+        CHECK( ctx->ct->annotated == 1 );
+        /* Grouped again by the real peer */
+        CHECK( conn_p->group != NULL && conn_p->group != grp );
+        CHECK( conn_p->group != NULL && 
+                        gkey_index_find( ctx->gkeys, conn_p ) == conn_p->group );
+
+        /* Reset, the socket is gone at once */
+        setsockopt( fds[0], SOL_SOCKET, SO_LINGER, &lin, sizeof( lin ));
+        close( fds[0] );
+        for ( i = 0; i < 2; i++ ) 
+                tick( ctx );
+        CHECK( chash_get( ctx->chash, &lss, &rss ) == NULL );
+        CHECK( ctx->ct->annotated == 0 );
+
+        close( fds[1] );
+        close( fds[2] );
+        tcpstat_deinit( ctx );
+        return TEST_RESULT();
+}
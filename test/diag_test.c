@@ -0,0 +1,169 @@
+/**
+ * @file diag_test.c
+ * @brief Test for the closed connection events from sock_diag.
+ *
+ * A connection is opened and closed on loopback between two update rounds,
+ * both ends should be seen on the destroy events with the time they were
+ * seen set. The test is skipped if the events can not be subscribed, e.g.
+ * when the kernel requires CAP_NET_ADMIN for it.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "libtcpstat.h"
+#include "scouts.h"
+#include "test.h"
+
+/**
+ * Time to wait for the connection to close on loopback.
+ */
+#define CLOSE_WAIT_USECS 100000
+
+/**
+ * What was seen of the short-lived connection.
+ */
+struct seen {
+        in_port_t port; /**< Port of the listener (network byte order) */
+        int found; /**< Number of ends of the connection seen */
+        uint64_t state_since; /**< Time the last end was put to its state */
+};
+
+/**
+ * Look for the ends of the connection on the new connections.
+ */
+static void on_new( enum tcpstat_event ev _UNUSED, struct tcp_connection *conn_p,
+                const char *msg _UNUSED, void *arg )
+{
+        struct seen *seen = arg;
+
+        if ( ss_get_port( &conn_p->laddr ) != seen->port &&
+                        ss_get_port( &conn_p->raddr ) != seen->port ) 
+                return;
+        seen->found++;
+        seen->state_since = conn_p->metadata.state_since;
+}
+
+/**
+ * Open connection to the listener and close it.
+ *
+ * @param lfd The listening socket.
+ * @param addr Address of the listener.
+ * @return 0 on success, -1 on error.
+ */
+static int open_and_close( int lfd, struct sockaddr_in *addr )
+{
+        int cfd, afd;
+
+        cfd = socket( AF_INET, SOCK_STREAM, 0 );
+        if ( cfd < 0 || connect( cfd, (struct sockaddr *)addr, sizeof( *addr )) != 0 ) {
+                perror( "connect" );
+                return -1;
+        }
+        afd = accept( lfd, NULL, NULL );
+        if ( afd < 0 ) {
+                perror( "accept" );
+                close( cfd );
+                return -1;
+        }
+        /* Client end goes to TIME_WAIT, the full socket is destroyed. The
+         * server end is destroyed once the last ACK arrives. */
+        close( cfd );
+        close( afd );
+        usleep( CLOSE_WAIT_USECS );
+        return 0;
+}
+
+int main( void )
+{
+        struct stat_context *ctx;
+        struct sockaddr_in addr;
+        socklen_t alen = sizeof( addr );
+        struct seen seen;
+        uint64_t before, after;
+        int lfd;
+
+        memset( &seen, 0, sizeof( seen ));
+        ctx = tcpstat_init();
+        ctx->collected_stats = STAT_V4_ONLY;
+        OPERATION_ENABLE( ctx, OP_DIAG_EVENTS );
+        tcpstat_subscribe( ctx, TCPSTAT_EV_NEW, on_new, &seen );
+        if ( tcpstat_start( ctx ) != 0 ) 
+                SKIP( "interfaces not available" );
+        if ( ctx->diag == NULL ) 
+                SKIP( "destroy events not available" );
+
+        lfd = socket( AF_INET, SOCK_STREAM, 0 );
+        memset( &addr, 0, sizeof( addr ));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        if ( lfd < 0 || bind( lfd, (struct sockaddr *)&addr, sizeof( addr )) != 0 ||
+                        listen( lfd, 1 ) != 0 ||
+                        getsockname( lfd, (struct sockaddr *)&addr, &alen ) != 0 ) {
+                perror( "listen" );
+                return 1;
+        }
+        seen.port = addr.sin_port;
+
+        CHECK( tcpstat_tick( ctx ) == 0 );
+        tcpstat_tick_done( ctx );
+        /* The listener was seen on the first round */
+        seen.found = 0;
+
+        before = connection_time_ms();
+        if ( open_and_close( lfd, &addr ) != 0 ) 
+                return 1;
+        CHECK( tcpstat_tick( ctx ) == 0 );
+        after = connection_time_ms();
+
+        /* Only seen on the event, not on the poll */
+        CHECK( seen.found == 2 );
+        CHECK( ctx->diag->round_shortlived >= 2 );
+        CHECK( seen.state_since >= before && seen.state_since <= after );
+        tcpstat_tick_done( ctx );
+
+        close( lfd );
+        tcpstat_deinit( ctx );
+        return TEST_RESULT();
+}
@@ -0,0 +1,199 @@
+/**
+ * @file filtexpr_bench.c
+ * @brief Benchmark for matching connections with filter expressions.
+ *
+ * The same selection is done with the filter chain the --ignore-rport and
+ * --ignore-raddr options build and with one compiled filter expression,
+ * the time to match one connection is printed for both.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "filtexpr.h"
+
+/**
+ * Number of connections matched on each run.
+ */
+#define BENCH_CONNS 4096
+/**
+ * Number of runs, the fastest one is reported.
+ */
+#define BENCH_RUNS 7
+/**
+ * Number of times the connections are matched on one run.
+ */
+#define BENCH_LOOPS 50
+
+static struct tcp_connection conns[BENCH_CONNS];
+
+/**
+ * Well known ports the remote ports are mostly drawn from.
+ */
+static const int well_known[] = { 22, 25, 53, 80, 110, 143, 443, 993, 8080, 
+        8443, 3306, 5432 };
+
+/**
+ * Number of the well known ports.
+ */
+#define NR_WELL_KNOWN ( sizeof( well_known ) / sizeof( well_known[0] ))
+
+/**
+ * Build the filter chain the options would build.
+ * @param ports The remote ports to ignore.
+ * @param nr_ports Number of ports.
+ * @param addr Remote address to ignore, NULL if none.
+ * @return The filter list.
+ */
+static struct filter_list *option_chain( const int *ports, int nr_ports, 
+                const char *addr )
+{
+        struct filter_list *list = filtlist_init( FIRST_MATCH );
+        struct sockaddr_storage ss;
+        struct filter *filt;
+        int i;
+
+        for ( i = 0; i < nr_ports; i++ ) {
+                memset( &ss, 0, sizeof( ss ));
+                ss.ss_family = AF_INET;
+                ss_set_port( &ss, htons( ports[i] ));
+                filt = filter_init( POLICY_REMOTE | POLICY_PORT, FILTERACT_IGNORE, 1 );
+                filter_set_raddr( filt, &ss );
+                filtlist_add( list, filt, ADD_LAST );
+        }
+        if ( addr != NULL ) {
+                memset( &ss, 0, sizeof( ss ));
+                ss.ss_family = AF_INET;
+                inet_pton( AF_INET, addr, ss_get_addr( &ss ));
+                filt = filter_init( POLICY_REMOTE | POLICY_ADDR, FILTERACT_IGNORE, 1 );
+                filter_set_raddr( filt, &ss );
+                filtlist_add( list, filt, ADD_LAST );
+        }
+        return list;
+}
+
+/**
+ * Time matching all connections against the list.
+ * @param list The filter list.
+ * @param matches Number of connections matched is set here.
+ * @return Time to match one connection on the fastest run (ns).
+ */
+static double time_list( struct filter_list *list, int *matches )
+{
+        long start, best = -1, t;
+        int run, loop, i;
+
+        for ( run = 0; run < BENCH_RUNS; run++ ) {
+                start = connection_now_usecs();
+                for ( loop = 0; loop < BENCH_LOOPS; loop++ ) {
+                        *matches = 0;
+                        for ( i = 0; i < BENCH_CONNS; i++ ) 
+                                *matches += filtlist_match( list, &conns[i] ) != NULL;
+                }
+                t = connection_now_usecs() - start;
+                if ( best < 0 || t < best ) 
+                        best = t;
+        }
+        return best * 1000.0 / ( BENCH_CONNS * BENCH_LOOPS );
+}
+
+/**
+ * Compare the option chain with the expression.
+ * @param name Name for the comparison.
+ * @param chain The filter chain.
+ * @param spec The expression selecting the same connections.
+ * @return 0 if both select the same connections, 1 if not.
+ */
+static int compare( const char *name, struct filter_list *chain, const char *spec )
+{
+        struct filter_list *list;
+        struct filter *filt;
+        char err[128];
+        double t_chain, t_expr;
+        int m_chain, m_expr;
+
+        filt = filter_from_expr( spec, FILTERACT_IGNORE, err, sizeof( err ));
+        if ( filt == NULL ) {
+                fprintf( stderr, "\"%s\": %s\n", spec, err );
+                return 1;
+        }
+        list = filtlist_init( FIRST_MATCH );
+        filtlist_add( list, filt, ADD_LAST );
+
+        t_chain = time_list( chain, &m_chain );
+        t_expr = time_list( list, &m_expr );
+        printf( "%-20s chain %6.1f ns, expression %6.1f ns (%d instructions), "
+                        "%d/%d matched\n", name, t_chain, t_expr, filt->expr->len, 
+                        m_expr, BENCH_CONNS );
+        filtlist_deinit( list );
+        filtlist_deinit( chain );
+        return m_chain == m_expr ? 0 : 1;
+}
+
+int main( void )
+{
+        static const int two[] = { 443, 8443 };
+        static const int eight[] = { 22, 25, 53, 80, 110, 143, 993, 3306 };
+        struct sockaddr_in *sin;
+        int i, rv = 0;
+
+        srand( 3 );
+        for ( i = 0; i < BENCH_CONNS; i++ ) {
+                conns[i].state = TCP_ESTABLISHED;
+                sin = (struct sockaddr_in *)&conns[i].laddr;
+                sin->sin_family = AF_INET;
+                sin->sin_addr.s_addr = htonl( 0x0a000001 );
+                sin->sin_port = htons( 30000 + rand() % 30000 );
+                sin = (struct sockaddr_in *)&conns[i].raddr;
+                sin->sin_family = AF_INET;
+                sin->sin_addr.s_addr = htonl( 0x0a010200 + rand() % 8 );
+                sin->sin_port = htons( rand() % 4 ? well_known[rand() % NR_WELL_KNOWN] :
+                                rand() % 65536 );
+        }
+
+        rv |= compare( "2 ports + 1 addr", option_chain( two, 2, "10.1.2.3" ),
+                        "rport in {443,8443} or raddr 10.1.2.3" );
+        rv |= compare( "8 ports", option_chain( eight, 8, NULL ),
+                        "rport in {22,25,53,80,110,143,993,3306}" );
+        rv |= compare( "12 ports", option_chain( well_known, NR_WELL_KNOWN, NULL ),
+                        "rport in {22,25,53,80,110,143,443,993,8080,8443,3306,5432}" );
+        return rv;
+}
@@ -0,0 +1,230 @@
+/**
+ * @file filtexpr_test.c
+ * @brief Tests for the compiled filter expressions.
+ *
+ * Each expression on the table is compiled and evaluated for a fixed set of
+ * connections, the matches are compared with the expected ones. The table
+ * also tells the expected length of the code and the number of negated
+ * tests on it, to check that the negations are pushed down to the tests and
+ * the tests of the same kind are merged. No jump on the code should land on
+ * another jump.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "filtexpr.h"
+#include "test.h"
+
+/**
+ * Connection the expressions are evaluated for.
+ */
+struct conn_spec {
+        int family; /**< Address family */
+        const char *laddr; /**< Local address */
+        in_port_t lport; /**< Local port */
+        const char *raddr; /**< Remote address */
+        in_port_t rport; /**< Remote port */
+        enum tcp_state state; /**< State */
+        const char *ifname; /**< Interface */
+};
+
+static const struct conn_spec conns[] = {
+        { AF_INET, "10.0.0.1", 40000, "10.1.2.3", 443, TCP_ESTABLISHED, "eth0" },
+        { AF_INET, "10.0.0.1", 40001, "192.168.1.5", 8443, TCP_SYN_SENT, "eth1" },
+        { AF_INET, "10.0.0.1", 22, "10.9.9.9", 50000, TCP_ESTABLISHED, "eth0" },
+        { AF_INET, "10.0.0.1", 40002, "10.1.2.3", 1500, TCP_TIME_WAIT, "eth1" },
+        { AF_INET6, "::1", 80, "::1", 60000, TCP_ESTABLISHED, "lo" },
+        { AF_INET, "127.0.0.1", 40003, "127.0.0.1", 80, TCP_CLOSE_WAIT, "lo" },
+};
+
+/**
+ * Number of the connections.
+ */
+#define NR_CONNS ( sizeof( conns ) / sizeof( conns[0] ))
+
+/**
+ * Expression with the expected results.
+ */
+struct expr_case {
+        const char *spec; /**< The expression */
+        int len; /**< Number of instructions, -1 if not checked */
+        int negs; /**< Number of negated tests, -1 if not checked */
+        const char *match; /**< '1' for each connection matching */
+};
+
+static const struct expr_case cases[] = {
+        /* Plain tests */
+        { "rport 443", 1, 0, "100000" },
+        { "port 80", 3, 0, "000011" },
+        { "laddr 10.0.0.0/8 and af inet", 3, 0, "111100" },
+        { "state syn_sent", 1, 0, "010000" },
+        { "if lo", 1, 0, "000011" },
+        /* Negations are pushed down to the tests */
+        { "not not lport 22", 1, 0, "001000" },
+        { "not raddr 10.0.0.0/8", 1, 1, "010011" },
+        { "not (rport 443 or state established)", 3, 0, "010101" },
+        { "not (raddr 10.0.0.0/8 and rport 443)", 3, 1, "011111" },
+        { "not (if eth0 or af inet6)", 3, 2, "010101" },
+        /* Tests of the same kind are merged */
+        { "rport 443 or rport 8443 or rport 1000-2000", 1, 0, "110100" },
+        { "state established or state listen or state time_wait", 1, 0, "101110" },
+        { "rport in {443,8443} and rport 8000-9000", 1, 0, "010000" },
+        { "rport 443 or not rport 443", 1, 0, "111111" },
+        { "rport 443 and rport 80", 1, 0, "000000" },
+        /* Jumps landing on jumps are threaded */
+        { "(rport 443 and state established) or (rport 1500 and state time_wait) or if lo",
+                9, 0, "100111" },
+        { "(rport 443 or rport 80) and (if eth0 or if lo) and af inet", 7, 0, "100001" },
+        { "rport in {443,8443} and state established and not raddr 10.0.0.0/8 and if eth1",
+                -1, -1, "000000" },
+        { "rport in {443,8443} and not raddr 10.0.0.0/8 or lport 22", -1, -1, "011000" },
+};
+
+/**
+ * Expressions which should not compile.
+ */
+static const char *invalid[] = {
+        "",
+        "rport",
+        "rport in {443,",
+        "rport 70000",
+        "rport 5-3",
+        "raddr 10.0.0.0/33",
+        "state bogus",
+        "(rport 1",
+        "rport 1 rport 2",
+        "not",
+};
+
+/**
+ * Set the connection from the specification.
+ */
+static void make_connection( const struct conn_spec *spec, struct tcp_connection *conn_p )
+{
+        memset( conn_p, 0, sizeof( *conn_p ));
+        conn_p->laddr.ss_family = spec->family;
+        conn_p->raddr.ss_family = spec->family;
+        if ( spec->family == AF_INET ) {
+                inet_pton( AF_INET, spec->laddr, ss_get_addr( &conn_p->laddr ));
+                inet_pton( AF_INET, spec->raddr, ss_get_addr( &conn_p->raddr ));
+        } else {
+                inet_pton( AF_INET6, spec->laddr, ss_get_addr6( &conn_p->laddr ));
+                inet_pton( AF_INET6, spec->raddr, ss_get_addr6( &conn_p->raddr ));
+        }
+        ss_set_port( &conn_p->laddr, htons( spec->lport ));
+        ss_set_port( &conn_p->raddr, htons( spec->rport ));
+        conn_p->state = spec->state;
+        conn_p->metadata.ifname = spec->ifname;
+}
+
+/**
+ * Check that no jump lands on another jump.
+ * @return non-zero if the jumps are threaded.
+ */
+static int jumps_threaded( const struct fexpr *expr )
+{
+        int i, target;
+
+        for ( i = 0; i < expr->len; i++ ) {
+                if ( expr->code[i].op != FOP_JT && expr->code[i].op != FOP_JF ) 
+                        continue;
+                target = i + 1 + expr->code[i].a;
+                if ( target > expr->len ) 
+                        return 0;
+                if ( target < expr->len && ( expr->code[target].op == FOP_JT ||
+                                        expr->code[target].op == FOP_JF )) 
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * Compile and evaluate one expression.
+ */
+static void run_case( const struct expr_case *c, struct tcp_connection *tconns )
+{
+        struct fexpr *expr;
+        char err[128];
+        unsigned int i;
+        int negs = 0, matched;
+
+        expr = fexpr_compile( c->spec, err, sizeof( err ));
+        if ( expr == NULL ) {
+                fprintf( stderr, "\"%s\": %s\n", c->spec, err );
+                CHECK( expr != NULL );
+                return;
+        }
+        for ( i = 0; i < (unsigned int)expr->len; i++ ) 
+                negs += expr->code[i].neg;
+        if ( c->len >= 0 && expr->len != c->len ) 
+                fprintf( stderr, "\"%s\": %d instructions\n", c->spec, expr->len );
+        CHECK( c->len < 0 || expr->len == c->len );
+        if ( c->negs >= 0 && negs != c->negs ) 
+                fprintf( stderr, "\"%s\": %d negated tests\n", c->spec, negs );
+        CHECK( c->negs < 0 || negs == c->negs );
+        CHECK( jumps_threaded( expr ));
+        for ( i = 0; i < NR_CONNS; i++ ) {
+                matched = fexpr_eval( expr, &tconns[i] ) ? '1' : '0';
+                if ( matched != c->match[i] ) 
+                        fprintf( stderr, "\"%s\": connection %u\n", c->spec, i );
+                CHECK( matched == c->match[i] );
+        }
+        fexpr_deinit( expr );
+}
+
+int main( void )
+{
+        struct tcp_connection tconns[NR_CONNS];
+        char err[128];
+        unsigned int i;
+
+        for ( i = 0; i < NR_CONNS; i++ ) 
+                make_connection( &conns[i], &tconns[i] );
+        for ( i = 0; i < sizeof( cases ) / sizeof( cases[0] ); i++ ) 
+                run_case( &cases[i], tconns );
+        for ( i = 0; i < sizeof( invalid ) / sizeof( invalid[0] ); i++ ) {
+                if ( fexpr_compile( invalid[i], err, sizeof( err )) != NULL ) 
+                        fprintf( stderr, "\"%s\" compiled\n", invalid[i] );
+                CHECK( fexpr_compile( invalid[i], err, sizeof( err )) == NULL );
+        }
+        return TEST_RESULT();
+}
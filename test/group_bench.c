@@ -0,0 +1,124 @@
+/**
+ * @file group_bench.c
+ * @brief Benchmark for purging groups whose connections have closed.
+ *
+ * Every other outgoing group loses its only connection and the groups are
+ * purged at once, as happens when a large batch of short connections ends
+ * between two rounds. The number of groups can be given as argument.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "defs.h"
+#include "debug.h"
+#include "connection.h"
+#include "stat.h"
+#include "libtcpstat.h"
+
+/**
+ * Default number of groups, half of them die.
+ */
+#define DEFAULT_GROUPS 200000
+
+/**
+ * Create a group with one connection to its own remote address.
+ * @param ctx Pointer to the global context.
+ * @param i Number of the group.
+ * @return The connection.
+ */
+static struct tcp_connection *add_group( struct stat_context *ctx, int i )
+{
+        struct sockaddr_storage laddr, raddr;
+        struct sockaddr_in *sin;
+        struct tcp_connection *conn_p;
+        struct group *grp;
+
+        memset( &laddr, 0, sizeof( laddr ));
+        memset( &raddr, 0, sizeof( raddr ));
+        sin = (struct sockaddr_in *)&laddr;
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl( 0x0a000001 );
+        sin->sin_port = htons( 40000 );
+        sin = (struct sockaddr_in *)&raddr;
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl( 0x0b000000 + i );
+        sin->sin_port = htons( 443 );
+
+        conn_p = connection_init( &laddr, &raddr, TCP_ESTABLISHED );
+        chash_put( ctx->chash, conn_p );
+        grp = group_init();
+        group_add_connection( grp, conn_p );
+        glist_add( ctx->out_groups, grp );
+        return conn_p;
+}
+
+int main( int argc, char **argv )
+{
+        struct stat_context *ctx;
+        struct tcp_connection *conn_p;
+        long start, purge, reclaim;
+        int groups = DEFAULT_GROUPS, i, reclaimed;
+
+        if ( argc > 1 ) 
+                groups = atoi( argv[1] );
+        if ( groups < 2 ) {
+                fprintf( stderr, "Usage: %s [groups]\n", argv[0] );
+                return 1;
+        }
+
+        ctx = tcpstat_init();
+        for ( i = 0; i < groups; i++ ) {
+                conn_p = add_group( ctx, i );
+                /* Connections not updated on the round are closed */
+                if ( i % 2 == 0 ) 
+                        metadata_clear_flags( conn_p->metadata );
+        }
+
+        start = connection_now_usecs();
+        purge_closed_connections( ctx, groups / 2 );
+        purge = connection_now_usecs() - start;
+        start = connection_now_usecs();
+        reclaimed = glist_reclaim( ctx->out_groups );
+        reclaim = connection_now_usecs() - start;
+
+        printf( "%d groups, %d dying: purge %.1f ms, reclaim %.1f ms\n", groups,
+                        reclaimed, purge / 1000.0, reclaim / 1000.0 );
+        tcpstat_deinit( ctx );
+        return reclaimed == groups / 2 ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file test.h
+ * @brief Helpers for the tests.
+ *
+ * Each test is a program which exits with 0 when all checks pass, 1 when
+ * some check failed and TEST_SKIPPED when the test can not be run here
+ * (e.g. missing capabilities). The tests are run with <code>make test</code>.
+ *
+ * Copyright (c) 2006 - 2009, J. Taimisto
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     - Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer.
+ *     - Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials
+ *       provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @author Jukka Taimisto <jtaimisto@gmail.com>
+ */
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Exit status of a test which could not be run.
+ */
+#define TEST_SKIPPED 77
+
+/**
+ * Number of failed checks.
+ */
+static int test_failures;
+
+/**
+ * Check that condition holds, report the failure if not.
+ */
+#define CHECK( cond ) do { \
+        if ( !( cond )) { \
+                fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                                __LINE__, #cond ); \
+                test_failures++; \
+        } \
+} while ( 0 )
+
+/**
+ * Skip the test, telling why.
+ */
+#define SKIP( why ) do { \
+        printf( "%s: skipped, %s\n", __FILE__, why ); \
+        exit( TEST_SKIPPED ); \
+} while ( 0 )
+
+/**
+ * Exit status for the test.
+ */
+#define TEST_RESULT() ( test_failures > 0 ? 1 : 0 )
+
+#endif /* _TEST_H_ */